@@ -1,6 +1,6 @@
 TEMPLATE = app
 TARGET = orbitcoin-qt
-VERSION = 1.6.1.0
+VERSION = 1.6.1.1
 INCLUDEPATH += src src/json src/qt
 QT += core gui network
 DEFINES += QT_GUI BOOST_THREAD_USE_LIB BOOST_SPIRIT_THREADSAFE
@@ -188,6 +188,7 @@ HEADERS += src/qt/gui.h \
     src/init.h \
     src/irc.h \
     src/mruset.h \
+    src/prevector.h \
     src/json/json_spirit_writer_template.h \
     src/json/json_spirit_writer.h \
     src/json/json_spirit_value.h \
@@ -214,6 +215,8 @@ HEADERS += src/qt/gui.h \
     src/qt/walletmodel.h \
     src/qt/walletmodeltransaction.h \
     src/rpc.h \
+    src/stratum.h \
+    src/muhash.h \
     src/qt/overviewpage.h \
     src/qt/csvmodelwriter.h \
     src/crypter.h \
@@ -289,6 +292,8 @@ SOURCES += src/qt/orbitcoin.cpp src/qt/gui.cpp \
     src/rpcwallet.cpp \
     src/rpcblockchain.cpp \
     src/rpcrawtransaction.cpp \
+    src/stratum.cpp \
+    src/muhash.cpp \
     src/qt/overviewpage.cpp \
     src/qt/csvmodelwriter.cpp \
     src/crypter.cpp \
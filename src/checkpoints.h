@@ -49,7 +49,7 @@ namespace Checkpoints
     int GetTotalBlocksEstimate();
 
     // Returns last CBlockIndex* in mapBlockIndex that is a checkpoint
-    CBlockIndex* GetLastCheckpoint(const std::map<uint256, CBlockIndex*>& mapBlockIndex);
+    CBlockIndex* GetLastCheckpoint(const BlockMap &mapBlockIndex);
 
     // Returns last checkpoint timestamp
     int GetLastCheckpointTime();
@@ -583,3 +583,120 @@ bool CAddrDB::Read(CAddrMan& addr)
     return(true);
 }
 
+
+
+//
+// CMemPoolDB
+//
+
+/* Version of the file format, incremented on incompatible changes */
+static const int MEMPOOL_DUMP_VERSION = 1;
+
+CMemPoolDB::CMemPoolDB()
+{
+    pathMemPool = GetDataDir() / "mempool.dat";
+}
+
+bool CMemPoolDB::Write(const std::vector<CTransaction> &vtx)
+{
+    // Generate random temporary filename
+    unsigned short randv = 0;
+    RAND_bytes((unsigned char *)&randv, sizeof(randv));
+    std::string tmpfn = strprintf("mempool.dat.%04x", randv);
+
+    // serialize network magic, format version and transactions, then append csum
+    CDataStream ssMemPool(SER_DISK, CLIENT_VERSION);
+    ssMemPool << FLATDATA(pchMessageStart);
+    ssMemPool << MEMPOOL_DUMP_VERSION;
+    ssMemPool << vtx;
+    uint256 hash = Hash(ssMemPool.begin(), ssMemPool.end());
+    ssMemPool << hash;
+
+    boost::filesystem::path pathTmp = GetDataDir() / tmpfn;
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if(!fileout)
+      return(error("CMemPoolDB::Write() : fopen(%s) failed", pathTmp.string().c_str()));
+
+    // no temporary file is left behind on failure
+    boost::system::error_code ec;
+    try {
+        fileout << ssMemPool;
+    }
+    catch(const std::exception &) {
+        fileout.fclose();
+        boost::filesystem::remove(pathTmp, ec);
+        return(error("CMemPoolDB::Write() : I/O error"));
+    }
+    fflush(fileout);
+    if(FileCommit(fileout)) {
+        fileout.fclose();
+        boost::filesystem::remove(pathTmp, ec);
+        return(error("CMemPoolDB::Write() : FileCommit() failed"));
+    }
+    fileout.fclose();
+
+    // replace existing mempool.dat, if any, with new mempool.dat.XXXX
+    if(!RenameOver(pathTmp, pathMemPool)) {
+        boost::filesystem::remove(pathTmp, ec);
+        return(error("CMemPoolDB::Write() : RenameOver() failed"));
+    }
+
+    return(true);
+}
+
+bool CMemPoolDB::Read(std::vector<CTransaction> &vtx)
+{
+    FILE *file = fopen(pathMemPool.string().c_str(), "rb");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if(!filein)
+      return(error("CMemPoolDB::Read() : fopen(%s) failed", pathMemPool.string().c_str()));
+
+    int fileSize = GetFilesize(filein);
+    int dataSize = fileSize - sizeof(uint256);
+    if(dataSize < (int)(sizeof(pchMessageStart) + sizeof(MEMPOOL_DUMP_VERSION)))
+      return(error("CMemPoolDB::Read() : file too short"));
+    vector<unsigned char> vchData;
+    vchData.resize(dataSize);
+    uint256 hashIn;
+
+    try {
+        filein.read((char *)&vchData[0], dataSize);
+        filein >> hashIn;
+    }
+    catch(const std::exception &) {
+        return(error("CMemPoolDB::Read() : I/O error"));
+    }
+    filein.fclose();
+
+    CDataStream ssMemPool(vchData, SER_DISK, CLIENT_VERSION);
+
+    uint256 hashTmp = Hash(ssMemPool.begin(), ssMemPool.end());
+    if(hashIn != hashTmp)
+      return(error("CMemPoolDB::Read() : checksum mismatch"));
+
+    unsigned char pchMsgTmp[4];
+    int nVersion;
+    try {
+        ssMemPool >> FLATDATA(pchMsgTmp);
+        ssMemPool >> nVersion;
+    }
+    catch(const std::exception &) {
+        return(error("CMemPoolDB::Read() #2 : I/O error"));
+    }
+
+    if(memcmp(pchMsgTmp, pchMessageStart, sizeof(pchMsgTmp)))
+      return(error("CMemPoolDB::Read() : invalid network magic number"));
+
+    if(nVersion != MEMPOOL_DUMP_VERSION)
+      return(error("CMemPoolDB::Read() : unsupported version %d", nVersion));
+
+    try {
+        ssMemPool >> vtx;
+    }
+    catch(const std::exception &) {
+        return(error("CMemPoolDB::Read() #3 : I/O error"));
+    }
+
+    return(true);
+}
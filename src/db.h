@@ -323,4 +323,15 @@ public:
     bool Read(CAddrMan& addr);
 };
 
+/** Access to the saved transaction memory pool (mempool.dat) */
+class CMemPoolDB
+{
+private:
+    boost::filesystem::path pathMemPool;
+public:
+    CMemPoolDB();
+    bool Write(const std::vector<CTransaction> &vtx);
+    bool Read(std::vector<CTransaction> &vtx);
+};
+
 #endif /* DB_H */
@@ -11,6 +11,7 @@
 #include "util.h"
 #include "ui_interface.h"
 #include "checkpoints.h"
+#include "stratum.h"
 
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
@@ -70,8 +71,6 @@ void StartShutdown()
 #endif
 }
 
-static CCoinsViewDB *pcoinsdbview;
-
 void Shutdown(void* parg)
 {
     static CCriticalSection cs_Shutdown;
@@ -97,11 +96,13 @@ void Shutdown(void* parg)
         nTransactionsUpdated++;
         bitdb.Flush(false);
         StopNode();
+        DumpMemPool();
         {
             LOCK(cs_main);
             if(pwalletMain) pwalletMain->SetBestChain(CBlockLocator(pindexBest));
-            if(pblocktree)  pblocktree->Flush();
-            if(pcoinsTip)   pcoinsTip->Flush();
+            if(pcoinsTip)   CommitChainState(true);
+            /* Scans of the coin database see fShutdown and stop */
+            if(pcoinsdbview) pcoinsdbview->WaitForScans();
             delete pcoinsTip;
             pcoinsTip = NULL;
             delete pcoinsdbview;
@@ -258,7 +259,14 @@ std::string HelpMessage()
         "  -datadir=<dir>         " + _("Specify data directory") + "\n" +
         "  -wallet=<dir>          " + _("Specify wallet file (within data directory)") + "\n" +
         "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n" +
+        "  -commitinterval=<n>    " + _("Commit the block chain state to disk every <n> seconds during the initial download (default: 30)") + "\n" +
         "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n" +
+        "  -maxmempool=<n>        " + _("Keep the transaction memory pool below <n> megabytes (default: 100)") + "\n" +
+        "  -limitancestorcount=<n> " + _("Reject transactions with more than <n> unconfirmed ancestors (default: 25)") + "\n" +
+        "  -limitancestorsize=<n>  " + _("Reject transactions whose unconfirmed ancestors with them exceed <n> kilobytes (default: 101)") + "\n" +
+        "  -limitdescendantcount=<n> " + _("Reject transactions which would give an unconfirmed ancestor more than <n> descendants (default: 25)") + "\n" +
+        "  -limitdescendantsize=<n> " + _("Reject transactions which would make the descendants of an unconfirmed ancestor exceed <n> kilobytes (default: 101)") + "\n" +
+        "  -persistmempool        " + _("Save the transaction memory pool on shutdown and load it on startup (default: 1)") + "\n" +
         "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n" +
         "  -proxy=<ip:port>       " + _("Connect through socks proxy") + "\n" +
         "  -socks=<n>             " + _("Select the version of socks proxy to use (4-5, default: 5)") + "\n" +
@@ -311,6 +319,10 @@ std::string HelpMessage()
         "  -rpcport=<port>        " + _("Listen for JSON-RPC connections on <port> (default: 15299 or testnet: 25299)") + "\n" +
         "  -rpcallowip=<ip>       " + _("Allow JSON-RPC connections from specified IP address") + "\n" +
         "  -rpcconnect=<ip>       " + _("Send commands to node running on <ip> (default: 127.0.0.1)") + "\n" +
+        "  -stratum               " + _("Accept Stratum mining connections (default: 0)") + "\n" +
+        "  -stratumport=<port>    " + _("Listen for Stratum connections on <port> (default: 15300 or testnet: 25300)") + "\n" +
+        "  -stratumallowip=<ip>   " + _("Allow Stratum connections from specified IP address") + "\n" +
+        "  -stratumdifficulty=<n> " + _("Share difficulty of Stratum miners (default: 16)") + "\n" +
         "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n" +
         "  -walletnotify=<cmd>    " + _("Execute command when a wallet transaction changes (%s in cmd is replaced by TxID)") + "\n" +
         "  -upgradewallet         " + _("Upgrade wallet to latest format") + "\n" +
@@ -320,6 +332,10 @@ std::string HelpMessage()
         "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 2500, 0 = all)") + "\n" +
         "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n" +
         "  -reindex               " + _("Rebuild block chain index from existing block chain files") + "\n" +
+        "  -txindex               " + _("Maintain a full transaction index (default: 0)") + "\n" +
+        "  -prune=<n>             " + _("Delete old blocks to keep the block files below <n> MiB, implies -txindex (default: 0 = off)") + "\n" +
+        "  -compressblocks        " + _("Store new blocks compressed and convert old block files in the background (default: 0)") + "\n" +
+        "  -addressindex          " + _("Maintain an index of the history and unspent outputs of every address (default: 0)") + "\n" +
 
         "\n" + _("Block creation options:") + "\n" +
         "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n" +
@@ -481,6 +497,10 @@ bool AppInit2()
         SoftSetBoolArg("-rescan", true);
     }
 
+    /* The stake kernels of coins in pruned blocks are located through the transaction index */
+    if(GetArg("-prune", 0) > 0)
+      SoftSetBoolArg("-txindex", true);
+
     // ********************************************************* Step 3: parameter-to-internal-flags
 
     fDebug = GetBoolArg("-debug");
@@ -537,6 +557,37 @@ bool AppInit2()
             return InitError(strprintf(_("Invalid amount for -mininput=<amount>: '%s'"), mapArgs["-mininput"].c_str()));
     }
 
+    /* Old block files are deleted beyond this limit; the blocks pruned aren't served to peers */
+    if(GetArg("-prune", 0) > 0) {
+        if(GetArg("-prune", 0) < (int64)MIN_PRUNE_TARGET)
+          return(InitError(strprintf(_("-prune is below the minimum of %" PRI64u " MiB"), MIN_PRUNE_TARGET)));
+        if(!GetBoolArg("-txindex", false))
+          return(InitError(_("-prune requires -txindex")));
+        if(GetBoolArg("-rescan"))
+          return(InitError(_("Rescans are not possible in pruned mode, a full resynchronisation is required")));
+        fPruneMode = true;
+        nPruneTarget = (uint64)GetArg("-prune", 0) * 1024 * 1024;
+        nLocalServices &= ~NODE_NETWORK;
+    }
+
+    /* Blocks connected during the initial download are made durable in groups */
+    nCommitInterval = std::max((int64)0, GetArg("-commitinterval", DEFAULT_COMMIT_INTERVAL));
+
+    /* Block and undo records are stored compressed with zlib */
+    fCompressBlocks = GetBoolArg("-compressblocks", false);
+
+    /* Transactions of the lowest fee rate are evicted beyond this limit */
+    int64 nMaxMemPool = std::max((int64)1, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE));
+    uint64 nMaxMemPoolUsage =
+      (uint64)std::min(nMaxMemPool, std::numeric_limits<int64>::max() / 1000000) * 1000000;
+    mempool.nMaxUsage = (size_t)std::min(nMaxMemPoolUsage, (uint64)std::numeric_limits<size_t>::max());
+
+    /* Chains of unconfirmed transactions are limited in length and size */
+    mempool.nLimitAncestors = (uint)std::max((int64)1, GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT));
+    mempool.nLimitAncestorSize = (uint64)std::max((int64)1, GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT)) * 1000;
+    mempool.nLimitDescendants = (uint)std::max((int64)1, GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT));
+    mempool.nLimitDescendantSize = (uint64)std::max((int64)1, GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT)) * 1000;
+
     /* Inputs below this limit in value don't participate in staking */
     if(mapArgs.count("-stakeminvalue")) {
         if(!ParseMoney(mapArgs["-stakeminvalue"], nStakeMinValue))
@@ -813,6 +864,11 @@ bool AppInit2()
         pblocktree = new CBlockTreeDB();
         pcoinsdbview = new CCoinsViewDB();
         pcoinsTip = new CCoinsViewCache(*pcoinsdbview);
+        /* The transaction and address indices are rebuilt as requested */
+        fTxIndex = GetBoolArg("-txindex", false);
+        pblocktree->WriteFlag("txindex", fTxIndex);
+        fAddressIndex = GetBoolArg("-addressindex", false);
+        pblocktree->WriteFlag("addressindex", fAddressIndex);
         /* Proceed to reindexing */
         uiInterface.InitMessage(_("Reindexing the block chain..."));
         int nFile = 0;
@@ -840,8 +896,29 @@ bool AppInit2()
         return(false);
     }
 
+    /* The block tree has the transaction index either complete or none at all */
+    if(fTxIndex != GetBoolArg("-txindex", false))
+      return(InitError(_("You need to rebuild the block chain index using -reindex to change -txindex")));
+    if(fAddressIndex != GetBoolArg("-addressindex", false))
+      return(InitError(_("You need to rebuild the block chain index using -reindex to change -addressindex")));
+
     printf(" block index %15" PRI64d "ms\n", GetTimeMillis() - nStart);
 
+    /* Coins DBs of earlier versions have no statistics of the UTXO set maintained */
+    if(!pcoinsdbview->HaveStats()) {
+        nStart = GetTimeMillis();
+        uiInterface.InitMessage(_("Calculating the UTXO set statistics..."));
+        printf("Calculating the UTXO set statistics...\n");
+        if(!pcoinsdbview->InitStats()) {
+            if(fRequestShutdown) {
+                printf("Shutting down...\n");
+                return(false);
+            }
+            return(InitError(_("Error calculating the UTXO set statistics")));
+        }
+        printf(" UTXO stats  %15" PRI64d "ms\n", GetTimeMillis() - nStart);
+    }
+
     if (GetBoolArg("-printblockindex") || GetBoolArg("-printblocktree"))
     {
         PrintBlockTree();
@@ -852,7 +929,7 @@ bool AppInit2()
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -947,6 +1024,9 @@ bool AppInit2()
     }
     if (pindexBest != pindexRescan && pindexBest && pindexRescan && pindexBest->nHeight > pindexRescan->nHeight)
     {
+        /* The blocks to scan are gone and -reindex cannot bring them back */
+        if (!HaveBlockData(pindexRescan))
+            return InitError(_("The wallet is behind the pruned blocks, a full resynchronisation is required"));
         uiInterface.InitMessage(_("Rescanning..."));
         printf("Rescanning last %i blocks (from block %i)...\n", pindexBest->nHeight - pindexRescan->nHeight, pindexRescan->nHeight);
         nStart = GetTimeMillis();
@@ -1006,6 +1086,12 @@ bool AppInit2()
     if (fServer)
         NewThread(ThreadRPCServer, NULL);
 
+    if(GetBoolArg("-stratum", false))
+      NewThread(ThreadStratumServer, NULL);
+
+    if(fCompressBlocks)
+      NewThread(ThreadBlockFileCompressor, NULL);
+
     // ********************************************************* Step 12: finished
 
     uiInterface.InitMessage(_("Done loading"));
@@ -1017,6 +1103,10 @@ bool AppInit2()
      // Add wallet transactions that aren't already in a block to mapTransactions
     pwalletMain->ReacceptWalletTransactions();
 
+    /* Restore the memory pool saved at shutdown */
+    if(GetBoolArg("-persistmempool", true))
+      NewThread(ThreadMemPool, NULL);
+
 #if !defined(QT_GUI)
     // Loop until process is exit()ed from shutdown() function,
     // called from ThreadRPCServer thread when a "stop" command is received.
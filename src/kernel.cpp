@@ -6,6 +6,7 @@
 
 #include "kernel.h"
 #include "db.h"
+#include "txdb.h"
 
 using namespace std;
 
@@ -110,7 +111,7 @@ static bool SelectBlockFromCandidates(vector<pair<int64, uint256> >& vSortedByTi
             continue;
         // compute the selection hash by hashing its proof-hash and the
         // previous proof-of-stake modifier
-        uint256 hashProof = pindex->IsProofOfStake()? pindex->hashProofOfStake : pindex->GetBlockHash();
+        uint256 hashProof = pindex->IsProofOfStake()? pindex->GetStake().hashProofOfStake : pindex->GetBlockHash();
         CDataStream ss(SER_GETHASH, 0);
         ss << hashProof << nStakeModifierPrev;
         uint256 hashSelection = Hash(ss.begin(), ss.end());
@@ -414,6 +415,51 @@ bool CheckStakeKernelHash(uint nBits, const CBlock& blockFrom, uint nTxPrevOffse
     return(true);
 }
 
+bool ReadKernelInput(const uint256 &hashTx, const CCoins &coins, CTransaction &txPrev,
+  CBlock &blockFrom, uint &nTxPos) {
+
+    CBlockIndex *pindex = FindBlockByHeight(coins.nHeight);
+    if(!pindex)
+      return(false);
+
+    if(pindex->nStatus & BLOCK_HAVE_DATA) {
+
+        /* The header and the transaction are read directly with the transaction index */
+        if(ReadIndexedTransaction(hashTx, txPrev, blockFrom, nTxPos))
+          return(true);
+
+        // Read block and scan it to find txPrev
+        if(!blockFrom.ReadFromDisk(pindex))
+          return(false);
+
+        nTxPos = GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(blockFrom.vtx.size());
+        BOOST_FOREACH(const CTransaction &tx, blockFrom.vtx) {
+            if(tx.GetHash() == hashTx) {
+                txPrev = tx;
+                return(true);
+            }
+            nTxPos += tx.GetSize();
+        }
+
+        return(false);
+    }
+
+    /* Pruned; the transaction index keeps the offset and the coins keep
+     * everything else the kernel depends on */
+    CDiskTxPos postx;
+    if(!fTxIndex || !pblocktree->ReadTxIndex(hashTx, postx))
+      return(false);
+
+    blockFrom = pindex->GetBlockHeader();
+    nTxPos = postx.nTxOffset;
+    txPrev.SetNull();
+    txPrev.nVersion = coins.nVersion;
+    txPrev.nTime = coins.nTime;
+    txPrev.vout = coins.vout;
+
+    return(true);
+}
+
 // Check kernel hash target and coinstake signature
 bool CheckProofOfStake(const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake,
   uint256& targetProofOfStake, bool& fCritical, bool fMiner) {
@@ -436,21 +482,8 @@ bool CheckProofOfStake(const CTransaction& tx, unsigned int nBits, uint256& hash
         return(false);
     }
 
-    CBlockIndex* pindex = FindBlockByHeight(coins.nHeight);
-
-    // Read block and scan it to find txPrev
     CBlock block;
-    if (block.ReadFromDisk(pindex)) {
-        nTxPos = GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(block.vtx.size());
-        BOOST_FOREACH(const CTransaction &tx, block.vtx) {
-            if (tx.GetHash() == txin.prevout.hash) {
-                txPrev = tx;
-                break;
-            }
-            nTxPos += tx.GetSerializeSize(SER_DISK, CLIENT_VERSION);
-        }
-    }
-    else {
+    if(!ReadKernelInput(txin.prevout.hash, coins, txPrev, block, nTxPos)) {
        /* May happen if the block isn't in the main chain yet */
         fCritical = false;
         if(fDebug) return(error("CheckProofOfStake() : cannot load a block requested"));
@@ -493,7 +526,7 @@ unsigned int GetStakeModifierChecksum(const CBlockIndex* pindex)
     CDataStream ss(SER_GETHASH, 0);
     if (pindex->pprev)
         ss << pindex->pprev->nStakeModifierChecksum;
-    ss << pindex->nFlags << pindex->hashProofOfStake << pindex->nStakeModifier;
+    ss << pindex->nFlags << pindex->GetStake().hashProofOfStake << pindex->nStakeModifier;
     uint256 hashChecksum = Hash(ss.begin(), ss.end());
     hashChecksum >>= (256 - 32);
     return hashChecksum.Get64();
@@ -37,6 +37,12 @@ bool CheckStakeKernelHash(uint nBits, const CBlock& blockFrom, uint nTxPrevOffse
 bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64& nStakeModifier,
   int64& nStakeModifierTime, int& nStakeModifierHeight, bool fPrintProofOfStake = false);
 
+/* Locates the transaction of a stake kernel input, the header of its block and
+ * its offset within the block; the transaction is rebuilt from the coins if the
+ * block data has been pruned */
+bool ReadKernelInput(const uint256 &hashTx, const CCoins &coins, CTransaction &txPrev,
+  CBlock &blockFrom, uint &nTxPos);
+
 // Check kernel hash target and coinstake signature
 // Sets hashProofOfStake and targetProofOfStake on success return
 bool CheckProofOfStake(const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake, uint256& targetProofOfStake, bool& fCritical, bool fMiner=false);
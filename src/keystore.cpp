@@ -19,13 +19,30 @@ bool CBasicKeyStore::AddKey(const CKey& key)
 {
     bool fCompressed = false;
     CSecret secret = key.GetSecret(fCompressed);
+    CPubKey vchPubKey = key.GetPubKey();
+    CKeyID keyID = vchPubKey.GetID();
     {
         LOCK(cs_KeyStore);
-        mapKeys[key.GetPubKey().GetID()] = make_pair(secret, fCompressed);
+        mapKeys[keyID] = make_pair(secret, fCompressed);
+        mapPubKeys[keyID] = vchPubKey;
     }
     return true;
 }
 
+bool CBasicKeyStore::GetPubKey(const CKeyID &address, CPubKey &vchPubKeyOut) const
+{
+    {
+        LOCK(cs_KeyStore);
+        PubKeyMap::const_iterator mi = mapPubKeys.find(address);
+        if (mi != mapPubKeys.end())
+        {
+            vchPubKeyOut = (*mi).second;
+            return true;
+        }
+    }
+    return false;
+}
+
 bool CBasicKeyStore::AddCScript(const CScript& redeemScript)
 {
     {
@@ -155,7 +172,7 @@ bool CCryptoKeyStore::AddKey(const CKey& key)
         if (!EncryptSecret(vMasterKey, key.GetSecret(fCompressed), vchPubKey.GetHash(), vchCryptedSecret))
             return false;
 
-        if (!AddCryptedKey(key.GetPubKey(), vchCryptedSecret))
+        if (!AddCryptedKey(vchPubKey, vchCryptedSecret))
             return false;
     }
     return true;
@@ -204,7 +221,7 @@ bool CCryptoKeyStore::GetPubKey(const CKeyID &address, CPubKey& vchPubKeyOut) co
     {
         LOCK(cs_KeyStore);
         if (!IsCrypted())
-            return CKeyStore::GetPubKey(address, vchPubKeyOut);
+            return CBasicKeyStore::GetPubKey(address, vchPubKeyOut);
 
         CryptedKeyMap::const_iterator mi = mapCryptedKeys.find(address);
         if (mi != mapCryptedKeys.end())
@@ -226,18 +243,19 @@ bool CCryptoKeyStore::EncryptKeys(CKeyingMaterial& vMasterKeyIn)
         fUseCrypto = true;
         BOOST_FOREACH(KeyMap::value_type& mKey, mapKeys)
         {
-            CKey key;
-            if (!key.SetSecret(mKey.second.first, mKey.second.second))
+            // The public key is cached, no need to derive it again
+            PubKeyMap::const_iterator mi = mapPubKeys.find(mKey.first);
+            if (mi == mapPubKeys.end())
                 return false;
-            const CPubKey vchPubKey = key.GetPubKey();
+            const CPubKey &vchPubKey = (*mi).second;
             std::vector<unsigned char> vchCryptedSecret;
-            bool fCompressed;
-            if (!EncryptSecret(vMasterKeyIn, key.GetSecret(fCompressed), vchPubKey.GetHash(), vchCryptedSecret))
+            if (!EncryptSecret(vMasterKeyIn, mKey.second.first, vchPubKey.GetHash(), vchCryptedSecret))
                 return false;
             if (!AddCryptedKey(vchPubKey, vchCryptedSecret))
                 return false;
         }
         mapKeys.clear();
+        mapPubKeys.clear();
     }
     return true;
 }
@@ -66,14 +66,17 @@ public:
 };
 
 typedef std::map<CKeyID, std::pair<CSecret, bool> > KeyMap;
+typedef std::map<CKeyID, CPubKey> PubKeyMap;
 typedef std::map<CScriptID, CScript > ScriptMap;
 typedef std::set<CScript> WatchOnlySet;
 
-/** Basic key store, that keeps keys in an address->secret map */
+/** Basic key store, that keeps keys in an address->secret map
+ * and their public keys in a side map to avoid EC math on lookups */
 class CBasicKeyStore : public CKeyStore
 {
 protected:
     KeyMap mapKeys;
+    PubKeyMap mapPubKeys;
     ScriptMap mapScripts;
     WatchOnlySet setWatchOnly;
 
@@ -115,6 +118,7 @@ public:
         }
         return false;
     }
+    bool GetPubKey(const CKeyID &address, CPubKey& vchPubKeyOut) const;
     virtual bool AddCScript(const CScript& redeemScript);
     virtual bool HaveCScript(const CScriptID &hash) const;
     virtual bool GetCScript(const CScriptID &hash, CScript& redeemScriptOut) const;
@@ -149,6 +153,16 @@ protected:
 
     bool Unlock(const CKeyingMaterial& vMasterKeyIn);
 
+    // copies the master key out for batch encryption, fails if locked
+    bool GetMasterKey(CKeyingMaterial& vMasterKeyOut) const
+    {
+        LOCK(cs_KeyStore);
+        if (!IsCrypted() || vMasterKey.empty())
+            return false;
+        vMasterKeyOut = vMasterKey;
+        return true;
+    }
+
 public:
     CCryptoKeyStore() : fUseCrypto(false)
     {
@@ -139,6 +139,21 @@ public:
     leveldb::Iterator *NewIterator() {
         return pdb->NewIterator(iteroptions);
     }
+
+    // iterators over a snapshot see the same state of the database
+    leveldb::Iterator *NewIterator(const leveldb::Snapshot *psnapshot) {
+        leveldb::ReadOptions snapoptions = iteroptions;
+        snapoptions.snapshot = psnapshot;
+        return pdb->NewIterator(snapoptions);
+    }
+
+    const leveldb::Snapshot *GetSnapshot() {
+        return pdb->GetSnapshot();
+    }
+
+    void ReleaseSnapshot(const leveldb::Snapshot *psnapshot) {
+        pdb->ReleaseSnapshot(psnapshot);
+    }
 };
 
 #endif /* LEVELDB_H */
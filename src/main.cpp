@@ -15,6 +15,15 @@
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 
+#include <zlib.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 
 using namespace std;
 using namespace boost;
@@ -31,9 +40,19 @@ CCriticalSection cs_main;
 CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+BlockMap mapBlockIndex;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 
+/* Transaction index maintained in the block tree DB */
+bool fTxIndex = false;
+/* Address index maintained in the block tree DB */
+bool fAddressIndex = false;
+/* Old block and undo files are deleted to keep their size below the target in bytes */
+bool fPruneMode = false;
+uint64 nPruneTarget = 0;
+/* New block and undo records are compressed, old block files converted in the background */
+bool fCompressBlocks = false;
+
 CBigNum bnProofOfWorkLimit(~uint256(0) >> 20); // 0.000244140625 PoW difficulty is the lowest possible
 CBigNum bnProofOfStakeLimit(~uint256(0) >> 20); // the same for PoS
 uint256 nPoWBase = uint256("0x00000000ffff0000000000000000000000000000000000000000000000000000"); // difficulty-1 target
@@ -72,6 +91,10 @@ uint256 nBestInvalidTrust = 0;
 
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
+/* Best chain changes are signalled to the RPC long polling */
+static boost::mutex csBlockChange;
+static boost::condition_variable cvBlockChange;
+static uint256 hashBlockChange = 0;
 int64 nTimeBestReceived = 0;
 set<CBlockIndex*, CBlockIndexTrustComparator> setBlockIndexValid; // may contain all CBlockIndex*'s that have validness >=BLOCK_VALID_TRANSACTIONS, and must contain those who aren't failed
 
@@ -82,7 +105,7 @@ multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
 set<pair<COutPoint, unsigned int> > setStakeSeenOrphan;
 map<uint256, uint256> mapProofOfStake;
 
-map<uint256, CTransaction> mapOrphanTransactions;
+map<uint256, CTransactionRef> mapOrphanTransactions;
 map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
 
 // Constant stuff for coinbase transactions we create:
@@ -122,7 +145,7 @@ void UnregisterWallet(CWallet* pwalletIn)
 }
 
 // check whether the passed transaction is from us
-bool static IsFromMe(CTransaction& tx)
+bool static IsFromMe(const CTransaction& tx)
 {
     BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
         if (pwallet->IsFromMe(tx))
@@ -151,6 +174,9 @@ void SyncWithWallets(const uint256 &hash, const CTransaction& tx, const CBlock*
 {
     if (!fConnect)
     {
+        BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
+            pwallet->DisconnectTransaction(hash);
+
         // ppcoin: wallets need to refund inputs when disconnecting coinstake
         if (tx.IsCoinStake())
         {
@@ -211,8 +237,9 @@ bool CCoinsView::SetCoins(uint256 txid, const CCoins &coins) { return false; }
 bool CCoinsView::HaveCoins(uint256 txid) { return false; }
 CBlockIndex *CCoinsView::GetBestBlock() { return NULL; }
 bool CCoinsView::SetBestBlock(CBlockIndex *pindex) { return false; }
-bool CCoinsView::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) { return false; }
+bool CCoinsView::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex, const CCoinsStats &statsDelta) { return false; }
 bool CCoinsView::GetStats(CCoinsStats &stats) { return false; }
+bool CCoinsView::ScanStats(CCoinsStats &stats) { return false; }
 
 CCoinsViewBacked::CCoinsViewBacked(CCoinsView &viewIn) : base(&viewIn) { }
 bool CCoinsViewBacked::GetCoins(uint256 txid, CCoins &coins) { return base->GetCoins(txid, coins); }
@@ -222,8 +249,9 @@ CBlockIndex *CCoinsViewBacked::GetBestBlock() { return base->GetBestBlock(); }
 bool CCoinsViewBacked::SetBestBlock(CBlockIndex *pindex) { return base->SetBestBlock(pindex); }
 void CCoinsViewBacked::SetBackend(CCoinsView &viewIn) { base = &viewIn; }
 bool CCoinsViewBacked::GetStats(CCoinsStats &stats) { return base->GetStats(stats); }
+bool CCoinsViewBacked::ScanStats(CCoinsStats &stats) { return base->ScanStats(stats); }
 
-bool CCoinsViewBacked::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) { return base->BatchWrite(mapCoins, pindex); }
+bool CCoinsViewBacked::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex, const CCoinsStats &statsDelta) { return base->BatchWrite(mapCoins, pindex, statsDelta); }
 
 CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), pindexTip(NULL) { }
 
@@ -293,19 +321,38 @@ bool CCoinsViewCache::SetBestBlock(CBlockIndex *pindex) {
     return true;
 }
 
-bool CCoinsViewCache::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) {
+bool CCoinsViewCache::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex, const CCoinsStats &statsDeltaIn) {
     for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
         cacheCoins[it->first] = it->second;
     pindexTip = pindex;
+    statsDelta.Add(statsDeltaIn);
     return true;
 }
 
+/* The statistics of the base with the changes of this cache applied */
+bool CCoinsViewCache::GetStats(CCoinsStats &stats) {
+    if(!base->GetStats(stats))
+      return(false);
+
+    stats.Add(statsDelta);
+
+    CBlockIndex *pindex = GetBestBlock();
+    if(pindex) {
+        stats.nHeight = pindex->nHeight;
+        stats.hashBlock = pindex->GetBlockHash();
+    }
+
+    return(true);
+}
+
 bool CCoinsViewCache::Flush() {
     cacheCoinsReadOnly.clear(); // purge read-only cache
 
-    bool fOk = base->BatchWrite(cacheCoins, pindexTip);
-    if (fOk)
+    bool fOk = base->BatchWrite(cacheCoins, pindexTip, statsDelta);
+    if (fOk) {
         cacheCoins.clear();
+        statsDelta = CCoinsStats();
+    }
     return fOk;
 }
 
@@ -313,6 +360,79 @@ unsigned int CCoinsViewCache::GetCacheSize() {
     return cacheCoins.size();
 }
 
+/* Every output is hashed together with its outpoint and the metadata of its transaction */
+void static GetCoinsStatsElement(const uint256 &txid, uint n, const CCoins &coins, const CTxOut &out,
+  std::vector<uchar> &vch) {
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+
+    ss << txid;
+    ss << VARINT(n);
+    ss << VARINT(coins.nHeight * 2 + (coins.fCoinBase ? 1 : 0));
+    ss << VARINT(coins.nTime * 2 + (coins.fCoinStake ? 1 : 0));
+    ss << VARINT(coins.nBlockTime);
+    ss << coins.nVersion;
+    ss << out;
+
+    vch.assign(ss.begin(), ss.end());
+}
+
+bool CCoinsStats::IsCounted(const CCoins &coins) {
+    BOOST_FOREACH(const CTxOut &out, coins.vout) {
+        if(IsCounted(out))
+          return(true);
+    }
+    return(false);
+}
+
+void CCoinsStats::AddOutput(const uint256 &txid, uint n, const CCoins &coins, const CTxOut &out) {
+    std::vector<uchar> vch;
+
+    GetCoinsStatsElement(txid, n, coins, out, vch);
+    muhash.Insert(vch);
+    nTransactionOutputs++;
+    nTotalAmount += out.nValue;
+}
+
+void CCoinsStats::RemoveOutput(const uint256 &txid, uint n, const CCoins &coins, const CTxOut &out) {
+    std::vector<uchar> vch;
+
+    GetCoinsStatsElement(txid, n, coins, out, vch);
+    muhash.Remove(vch);
+    nTransactionOutputs--;
+    nTotalAmount -= out.nValue;
+}
+
+void CCoinsStats::AddCoins(const uint256 &txid, const CCoins &coins) {
+    uint i;
+
+    for(i = 0; i < coins.vout.size(); i++) {
+        if(IsCounted(coins.vout[i]))
+          AddOutput(txid, i, coins, coins.vout[i]);
+    }
+    if(IsCounted(coins))
+      nTransactions++;
+}
+
+void CCoinsStats::RemoveCoins(const uint256 &txid, const CCoins &coins) {
+    uint i;
+
+    for(i = 0; i < coins.vout.size(); i++) {
+        if(IsCounted(coins.vout[i]))
+          RemoveOutput(txid, i, coins, coins.vout[i]);
+    }
+    if(IsCounted(coins))
+      nTransactions--;
+}
+
+void CCoinsStats::Add(const CCoinsStats &stats) {
+    nTransactions += stats.nTransactions;
+    nPrunedTransactions += stats.nPrunedTransactions;
+    nTransactionOutputs += stats.nTransactionOutputs;
+    nSerializedSize += stats.nSerializedSize;
+    nTotalAmount += stats.nTotalAmount;
+    muhash *= stats.muhash;
+}
+
 /** CCoinsView that brings transactions from a memorypool into view.
     It does not check for spendings by memory pool transactions. */
 CCoinsViewMemPool::CCoinsViewMemPool(CCoinsView &baseIn, CTxMemPool &mempoolIn) : CCoinsViewBacked(baseIn), mempool(mempoolIn) { }
@@ -340,8 +460,9 @@ CBlockTreeDB *pblocktree = NULL;
 // mapOrphanTransactions
 //
 
-bool AddOrphanTx(const CTransaction& tx)
+bool AddOrphanTx(const CTransactionRef& ptx)
 {
+    const CTransaction& tx = *ptx;
     uint256 hash = tx.GetHash();
     if (mapOrphanTransactions.count(hash))
         return false;
@@ -354,7 +475,7 @@ bool AddOrphanTx(const CTransaction& tx)
     // 10,000 orphans, each of which is at most 5,000 bytes big is
     // at most 500 megabytes of orphans:
 
-    size_t nSize = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
+    size_t nSize = tx.GetSize();
 
     if (nSize > 5000)
     {
@@ -363,7 +484,7 @@ bool AddOrphanTx(const CTransaction& tx)
         return false;
     }
 
-    mapOrphanTransactions[hash] = tx;
+    mapOrphanTransactions[hash] = ptx;
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
         mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
 
@@ -377,7 +498,7 @@ void static EraseOrphanTx(uint256 hash)
 {
     if (!mapOrphanTransactions.count(hash))
         return;
-    const CTransaction& tx = mapOrphanTransactions[hash];
+    const CTransaction& tx = *mapOrphanTransactions[hash];
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
     {
         mapOrphanTransactionsByPrev[txin.prevout.hash].erase(hash);
@@ -394,7 +515,7 @@ unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
     {
         // Evict a random orphan:
         uint256 randomhash = GetRandHash();
-        map<uint256, CTransaction>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
+        map<uint256, CTransactionRef>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
         if (it == mapOrphanTransactions.end())
             it = mapOrphanTransactions.begin();
         EraseOrphanTx(it->first);
@@ -566,7 +687,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     }
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -584,7 +705,7 @@ bool CTransaction::CheckTransaction() const
     if (vout.empty())
         return DoS(10, error("CTransaction::CheckTransaction() : vout empty"));
     // Size limits
-    if (::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION) > MAX_BLOCK_SIZE)
+    if (GetSize() > MAX_BLOCK_SIZE)
         return DoS(100, error("CTransaction::CheckTransaction() : size limits failed"));
 
     // Check for negative or overflow output values
@@ -684,6 +805,18 @@ void CTxMemPool::pruneSpent(const uint256 &hashTx, CCoins &coins)
 }
 
 bool CTxMemPool::accept(CTransaction &tx, bool fCheckInputs, bool* pfMissingInputs)
+{
+    return accept(tx, CTransactionRef(), fCheckInputs, pfMissingInputs);
+}
+
+bool CTxMemPool::accept(const CTransactionRef &ptx, bool fCheckInputs, bool *pfMissingInputs)
+{
+    return accept(*ptx, ptx, fCheckInputs, pfMissingInputs);
+}
+
+/* Either a transaction to copy into the pool or a shared reference to it */
+bool CTxMemPool::accept(const CTransaction &tx, CTransactionRef ptx, bool fCheckInputs,
+  bool *pfMissingInputs)
 {
     if (pfMissingInputs)
         *pfMissingInputs = false;
@@ -716,7 +849,7 @@ bool CTxMemPool::accept(CTransaction &tx, bool fCheckInputs, bool* pfMissingInpu
     }
 
     // Check for conflicts with in-memory transactions
-    CTransaction* ptxOld = NULL;
+    const CTransaction* ptxOld = NULL;
     for (unsigned int i = 0; i < tx.vin.size(); i++)
     {
         COutPoint outpoint = tx.vin[i].prevout;
@@ -743,6 +876,9 @@ bool CTxMemPool::accept(CTransaction &tx, bool fCheckInputs, bool* pfMissingInpu
         }
     }
 
+    /* Calculated from the inputs at entry unless checked here */
+    int64 nFees = -1;
+
     if (fCheckInputs)
     {
         CCoinsViewCache &view = *pcoinsTip;
@@ -771,8 +907,8 @@ bool CTxMemPool::accept(CTransaction &tx, bool fCheckInputs, bool* pfMissingInpu
         // you should add code here to check that the transaction does a
         // reasonable number of ECDSA signature verifications.
 
-        int64 nFees = tx.GetValueIn(view)-tx.GetValueOut();
-        unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        nFees = tx.GetValueIn(view)-tx.GetValueOut();
+        unsigned int nSize = tx.GetSize();
 
         // Don't accept it if it can't get into a block
         // The default setting is to allow free transactions
@@ -781,6 +917,16 @@ bool CTxMemPool::accept(CTransaction &tx, bool fCheckInputs, bool* pfMissingInpu
           return(error("CTxMemPool::accept() : not enough fees for tx %s, %" PRI64d " < %" PRI64d,
             hash.ToString().c_str(), nFees, txMinFee));
 
+        /* More once the pool has been full recently */
+        int64 nPoolMinFee = GetMinFeeRate() * nSize / 1000;
+        if(nFees < nPoolMinFee)
+          return(error("CTxMemPool::accept() : memory pool full, fee for tx %s %" PRI64d " < %" PRI64d,
+            hash.ToString().c_str(), nFees, nPoolMinFee));
+
+        /* Long chains of unconfirmed transactions are expensive to track and mine */
+        if(!CheckChainLimits(tx, nSize))
+          return(error("CTxMemPool::accept() : chain limits exceeded by tx %s",
+            hash.ToString().substr(0,10).c_str()));
 
         // Continuously rate-limit free transactions
         // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
@@ -823,7 +969,18 @@ bool CTxMemPool::accept(CTransaction &tx, bool fCheckInputs, bool* pfMissingInpu
             printf("CTxMemPool::accept() : replacing tx %s with new version\n", ptxOld->GetHash().ToString().c_str());
             remove(*ptxOld);
         }
-        addUnchecked(hash, tx);
+        if (!ptx || !ptx->IsFrozen())
+        {
+            CTransaction* ptxNew = new CTransaction(tx);
+            ptxNew->Freeze();
+            ptx.reset(ptxNew);
+        }
+        addUnchecked(hash, ptx, nFees);
+
+        TrimToSize(nMaxUsage);
+        if(!mapTx.count(hash))
+          return(error("CTxMemPool::accept() : memory pool full, tx %s evicted",
+            hash.ToString().substr(0,10).c_str()));
     }
 
     ///// are we sure this is ok when loading transactions or restoring block txes
@@ -842,31 +999,329 @@ bool CTransaction::AcceptToMemoryPool(bool fCheckInputs, bool* pfMissingInputs)
     return mempool.accept(*this, fCheckInputs, pfMissingInputs);
 }
 
-bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
+/* Heap memory taken by an allocation of the given size, including
+ * the allocator overhead of a 64-bit system */
+static inline size_t MallocUsage(size_t nAlloc)
+{
+    if(!nAlloc) return(0);
+    return(((nAlloc + 31) >> 4) << 4);
+}
+
+/* Estimates the memory taken by a pool transaction with its map and index nodes */
+static size_t MemPoolUsage(const CTransaction &tx, uint nParents)
+{
+    /* Red-black tree nodes add the colour and three pointers to their values */
+    const size_t nNodeOverhead = 4 * sizeof(void *);
+    size_t nUsage = MallocUsage(sizeof(std::pair<const uint256, CTxMemPoolEntry>) + nNodeOverhead);
+
+    /* The shared transaction itself with its reference counter */
+    nUsage += MallocUsage(sizeof(CTransaction)) + MallocUsage(3 * sizeof(void *));
+    nUsage += MallocUsage(tx.vin.capacity() * sizeof(CTxIn));
+    BOOST_FOREACH(const CTxIn &txin, tx.vin)
+      nUsage += MallocUsage(txin.scriptSig.allocated_memory());
+    nUsage += MallocUsage(tx.vout.capacity() * sizeof(CTxOut));
+    BOOST_FOREACH(const CTxOut &txout, tx.vout)
+      nUsage += MallocUsage(txout.scriptPubKey.allocated_memory());
+    if(tx.strTxComment.capacity() > 15)
+      nUsage += MallocUsage(tx.strTxComment.capacity() + 1);
+
+    nUsage += tx.vin.size() * MallocUsage(sizeof(std::pair<const COutPoint, CInPoint>) + nNodeOverhead);
+    nUsage += 2 * MallocUsage(sizeof(std::pair<double, uint256>) + nNodeOverhead);
+    nUsage += 2 * nParents * MallocUsage(sizeof(uint256) + nNodeOverhead);
+
+    return(nUsage);
+}
+
+/* Values the inputs of a pool transaction, either outputs of other pool transactions
+ * or confirmed coins; only the latter contribute to priority */
+void CTxMemPool::CalculateInputs(CTxMemPoolEntry &entry)
+{
+    const CTransaction &tx = *entry.ptx;
+    int64 nValueIn = 0;
+    entry.fInputsKnown = true;
+    entry.dPriority = 0;
+    entry.nValueInChain = 0;
+    BOOST_FOREACH(const CTxIn &txin, tx.vin) {
+        std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.find(txin.prevout.hash);
+        if(it != mapTx.end()) {
+            const CTransaction &txPrev = *it->second.ptx;
+            if(txin.prevout.n < txPrev.vout.size())
+              nValueIn += txPrev.vout[txin.prevout.n].nValue;
+            else
+              entry.fInputsKnown = false;
+            continue;
+        }
+        CCoins coins;
+        if(pcoinsTip && pcoinsTip->GetCoins(txin.prevout.hash, coins) &&
+          coins.IsAvailable(txin.prevout.n)) {
+            int64 nValue = coins.vout[txin.prevout.n].nValue;
+            nValueIn += nValue;
+            entry.nValueInChain += nValue;
+            entry.dPriority += (double)nValue * (entry.nHeight - coins.nHeight);
+        } else {
+            entry.fInputsKnown = false;
+        }
+    }
+    entry.dPriority /= entry.nSize;
+    entry.nFee = 0;
+    if(entry.fInputsKnown && (nValueIn > tx.GetValueOut()))
+      entry.nFee = nValueIn - tx.GetValueOut();
+}
+
+/* Walks the in-pool ancestors of a new transaction and verifies neither its
+ * ancestor package nor the descendant package of any ancestor grows too large */
+bool CTxMemPool::CheckChainLimits(const CTransaction &tx, uint nSize)
+{
+    LOCK(cs);
+    std::set<uint256> setAncestors;
+    std::vector<uint256> vQueue;
+    BOOST_FOREACH(const CTxIn &txin, tx.vin)
+      if(mapTx.count(txin.prevout.hash))
+        vQueue.push_back(txin.prevout.hash);
+
+    uint64 nSizeWithAncestors = nSize;
+    while(!vQueue.empty()) {
+        uint256 hashAncestor = vQueue.back();
+        vQueue.pop_back();
+        if(!setAncestors.insert(hashAncestor).second)
+          continue;
+        const CTxMemPoolEntry &ancestor = mapTx[hashAncestor];
+
+        if((setAncestors.size() + 1) > nLimitAncestors)
+          return(error("CTxMemPool::CheckChainLimits() : too many unconfirmed ancestors [limit: %u]",
+            nLimitAncestors));
+        nSizeWithAncestors += ancestor.nSize;
+        if(nSizeWithAncestors > nLimitAncestorSize)
+          return(error("CTxMemPool::CheckChainLimits() : exceeds ancestor size limit [limit: %" PRI64u "]",
+            nLimitAncestorSize));
+        if((ancestor.nCountWithDescendants + 1) > nLimitDescendants)
+          return(error("CTxMemPool::CheckChainLimits() : too many descendants for tx %s [limit: %u]",
+            hashAncestor.ToString().substr(0,10).c_str(), nLimitDescendants));
+        if((ancestor.nSizeWithDescendants + nSize) > nLimitDescendantSize)
+          return(error("CTxMemPool::CheckChainLimits() : exceeds descendant size limit for tx %s [limit: %" PRI64u "]",
+            hashAncestor.ToString().substr(0,10).c_str(), nLimitDescendantSize));
+
+        BOOST_FOREACH(const uint256 &hashParent, ancestor.setParents)
+          vQueue.push_back(hashParent);
+    }
+
+    return(true);
+}
+
+/* Either the fee known to the caller or a negative value to calculate it here */
+bool CTxMemPool::addUnchecked(const uint256& hash, const CTransactionRef &ptx, int64 nFee)
 {
     // Add to memory pool without checking anything.  Don't call this directly,
     // call CTxMemPool::accept to properly check the transaction first.
     {
-        mapTx[hash] = tx;
+        LOCK(cs);
+        const CTransaction &tx = *ptx;
+        CTxMemPoolEntry entry;
+        entry.ptx = ptx;
+        entry.nSize = tx.GetSize();
+        entry.nHeight = nBestHeight;
+        CalculateInputs(entry);
+        if(nFee >= 0) {
+            entry.nFee = nFee;
+            entry.fInputsKnown = true;
+        }
+        BOOST_FOREACH(const CTxIn &txin, tx.vin)
+          if(mapTx.count(txin.prevout.hash))
+            entry.setParents.insert(txin.prevout.hash);
+
+        entry.nUsage = MemPoolUsage(tx, entry.setParents.size());
+
+        CTxMemPoolEntry &entryNew = mapTx[hash];
+        entryNew = entry;
+        nTotalTxSize += entryNew.nSize;
+        nDynamicUsage += entryNew.nUsage;
+        BOOST_FOREACH(const uint256 &hashParent, entryNew.setParents)
+          mapTx[hashParent].setChildren.insert(hash);
+
+        /* Pool transactions may spend this one already if it has been
+         * resurrected after them while reorganising */
+        for(std::map<COutPoint, CInPoint>::iterator it = mapNextTx.lower_bound(COutPoint(hash, 0));
+          (it != mapNextTx.end()) && (it->first.hash == hash); it++) {
+            uint256 hashChild = it->second.ptx->GetHash();
+            entryNew.setChildren.insert(hashChild);
+            mapTx[hashChild].setParents.insert(hash);
+        }
+
+        std::set<uint256> setAncestors;
+        queryAncestors(hash, setAncestors);
+
+        if(entryNew.setChildren.empty()) {
+            /* The usual case of a new leaf joins the packages of its ancestors */
+            entryNew.nCountWithAncestors = 1 + setAncestors.size();
+            entryNew.nSizeWithAncestors = entryNew.nSize;
+            entryNew.nFeesWithAncestors = entryNew.nFee;
+            BOOST_FOREACH(const uint256 &hashAncestor, setAncestors) {
+                CTxMemPoolEntry &ancestor = mapTx[hashAncestor];
+                entryNew.nSizeWithAncestors += ancestor.nSize;
+                entryNew.nFeesWithAncestors += ancestor.nFee;
+                ancestor.nCountWithDescendants++;
+                ancestor.nSizeWithDescendants += entryNew.nSize;
+                ancestor.nFeesWithDescendants += entryNew.nFee;
+                UpdateDescendantScore(hashAncestor, ancestor);
+            }
+            setAncestorFeeRate.insert(std::make_pair(entryNew.GetAncestorFeeRate(), hash));
+            entryNew.nCountWithDescendants = 1;
+            entryNew.nSizeWithDescendants = entryNew.nSize;
+            entryNew.nFeesWithDescendants = entryNew.nFee;
+            UpdateDescendantScore(hash, entryNew);
+        } else {
+            /* A resurrected parent links packages together and may complete the inputs
+             * of its children; recalculate everything affected, which happens while
+             * reorganising only */
+            BOOST_FOREACH(const uint256 &hashChild, entryNew.setChildren) {
+                CTxMemPoolEntry &child = mapTx[hashChild];
+                if(!child.fInputsKnown)
+                  CalculateInputs(child);
+            }
+            std::set<uint256> setUpdate;
+            queryDescendants(hash, setUpdate);
+            setUpdate.insert(hash);
+            std::set<uint256> setUpdateDescendants(setAncestors);
+            BOOST_FOREACH(const uint256 &hashUpdate, setUpdate) {
+                UpdateAncestorTotals(hashUpdate);
+                setUpdateDescendants.insert(hashUpdate);
+                queryAncestors(hashUpdate, setUpdateDescendants);
+            }
+            BOOST_FOREACH(const uint256 &hashUpdate, setUpdateDescendants)
+              UpdateDescendantTotals(hashUpdate);
+        }
+
         for (unsigned int i = 0; i < tx.vin.size(); i++)
-            mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+            mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
         nTransactionsUpdated++;
     }
     return true;
 }
 
+/* Adds all in-pool ancestors of a transaction to the set */
+void CTxMemPool::queryAncestors(const uint256 &hash, std::set<uint256> &setAncestors)
+{
+    LOCK(cs);
+    std::vector<uint256> vQueue(1, hash);
+    while(!vQueue.empty()) {
+        std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.find(vQueue.back());
+        vQueue.pop_back();
+        if(it == mapTx.end()) continue;
+        BOOST_FOREACH(const uint256 &hashParent, it->second.setParents)
+          if(setAncestors.insert(hashParent).second)
+            vQueue.push_back(hashParent);
+    }
+}
+
+/* Adds all in-pool descendants of a transaction to the set */
+void CTxMemPool::queryDescendants(const uint256 &hash, std::set<uint256> &setDescendants)
+{
+    std::vector<uint256> vQueue(1, hash);
+    while(!vQueue.empty()) {
+        std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.find(vQueue.back());
+        vQueue.pop_back();
+        if(it == mapTx.end()) continue;
+        BOOST_FOREACH(const uint256 &hashChild, it->second.setChildren)
+          if(setDescendants.insert(hashChild).second)
+            vQueue.push_back(hashChild);
+    }
+}
+
+/* Recalculates the package totals of a transaction with all its ancestors
+ * and its position in the fee rate index */
+void CTxMemPool::UpdateAncestorTotals(const uint256 &hash)
+{
+    CTxMemPoolEntry &entry = mapTx[hash];
+    if(entry.nSizeWithAncestors)
+      setAncestorFeeRate.erase(std::make_pair(entry.GetAncestorFeeRate(), hash));
+
+    std::set<uint256> setAncestors;
+    queryAncestors(hash, setAncestors);
+    entry.nCountWithAncestors = 1;
+    entry.nSizeWithAncestors = entry.nSize;
+    entry.nFeesWithAncestors = entry.nFee;
+    BOOST_FOREACH(const uint256 &hashAncestor, setAncestors) {
+        const CTxMemPoolEntry &ancestor = mapTx[hashAncestor];
+        entry.nCountWithAncestors++;
+        entry.nSizeWithAncestors += ancestor.nSize;
+        entry.nFeesWithAncestors += ancestor.nFee;
+    }
+
+    setAncestorFeeRate.insert(std::make_pair(entry.GetAncestorFeeRate(), hash));
+}
+
+/* Recalculates the package totals of a transaction with all its descendants */
+void CTxMemPool::UpdateDescendantTotals(const uint256 &hash)
+{
+    CTxMemPoolEntry &entry = mapTx[hash];
+
+    std::set<uint256> setDescendants;
+    queryDescendants(hash, setDescendants);
+    entry.nCountWithDescendants = 1;
+    entry.nSizeWithDescendants = entry.nSize;
+    entry.nFeesWithDescendants = entry.nFee;
+    BOOST_FOREACH(const uint256 &hashDescendant, setDescendants) {
+        const CTxMemPoolEntry &descendant = mapTx[hashDescendant];
+        entry.nCountWithDescendants++;
+        entry.nSizeWithDescendants += descendant.nSize;
+        entry.nFeesWithDescendants += descendant.nFee;
+    }
+    UpdateDescendantScore(hash, entry);
+}
+
+/* Moves a transaction to its current position in the eviction index */
+void CTxMemPool::UpdateDescendantScore(const uint256 &hash, CTxMemPoolEntry &entry)
+{
+    setDescendantScore.erase(std::make_pair(entry.dDescendantScore, hash));
+    entry.dDescendantScore = entry.GetDescendantScore();
+    setDescendantScore.insert(std::make_pair(entry.dDescendantScore, hash));
+}
 
-bool CTxMemPool::remove(CTransaction &tx)
+bool CTxMemPool::remove(const CTransaction &tx)
 {
     // Remove transaction from memory pool
     {
         LOCK(cs);
         uint256 hash = tx.GetHash();
-        if (mapTx.count(hash))
+        std::map<uint256, CTxMemPoolEntry>::iterator it = mapTx.find(hash);
+        if (it != mapTx.end())
         {
+            const CTxMemPoolEntry &entry = it->second;
+
+            /* Ancestors lose this descendant, while descendants stay in the pool
+             * without this ancestor; transactions leave the pool either as leaves
+             * or as roots, so the links between the others are kept */
+            std::set<uint256> setAncestors;
+            queryAncestors(hash, setAncestors);
+            BOOST_FOREACH(const uint256 &hashAncestor, setAncestors) {
+                CTxMemPoolEntry &ancestor = mapTx[hashAncestor];
+                ancestor.nCountWithDescendants--;
+                ancestor.nSizeWithDescendants -= entry.nSize;
+                ancestor.nFeesWithDescendants -= entry.nFee;
+                UpdateDescendantScore(hashAncestor, ancestor);
+            }
+            std::set<uint256> setDescendants;
+            queryDescendants(hash, setDescendants);
+            BOOST_FOREACH(const uint256 &hashDescendant, setDescendants) {
+                CTxMemPoolEntry &descendant = mapTx[hashDescendant];
+                setAncestorFeeRate.erase(std::make_pair(descendant.GetAncestorFeeRate(), hashDescendant));
+                descendant.nCountWithAncestors--;
+                descendant.nSizeWithAncestors -= entry.nSize;
+                descendant.nFeesWithAncestors -= entry.nFee;
+                setAncestorFeeRate.insert(std::make_pair(descendant.GetAncestorFeeRate(), hashDescendant));
+            }
+            BOOST_FOREACH(const uint256 &hashChild, entry.setChildren)
+              mapTx[hashChild].setParents.erase(hash);
+            BOOST_FOREACH(const uint256 &hashParent, entry.setParents)
+              mapTx[hashParent].setChildren.erase(hash);
+
+            setAncestorFeeRate.erase(std::make_pair(entry.GetAncestorFeeRate(), hash));
+            setDescendantScore.erase(std::make_pair(entry.dDescendantScore, hash));
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
-            mapTx.erase(hash);
+            nTotalTxSize -= entry.nSize;
+            nDynamicUsage -= entry.nUsage;
+            mapTx.erase(it);
             nTransactionsUpdated++;
         }
     }
@@ -878,19 +1333,164 @@ void CTxMemPool::clear()
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    setAncestorFeeRate.clear();
+    setDescendantScore.clear();
+    nTotalTxSize = 0;
+    nDynamicUsage = 0;
+    nRollingMinFeeRate = 0;
     ++nTransactionsUpdated;
 }
 
+/* Evicts the transactions of the lowest descendant scores with everything depending on them
+ * until the pool fits into the limit and raises the minimum fee rate above theirs */
+void CTxMemPool::TrimToSize(size_t nLimit)
+{
+    LOCK(cs);
+    uint nEvicted = 0;
+    while((nDynamicUsage > nLimit) && !setDescendantScore.empty()) {
+        double dFeeRate = setDescendantScore.begin()->first;
+        uint256 hash = setDescendantScore.begin()->second;
+
+        /* Leaves go first, so every removal keeps the totals of the rest intact */
+        std::set<uint256> setDescendants;
+        queryDescendants(hash, setDescendants);
+        std::vector<std::pair<uint, uint256> > vRemove;
+        BOOST_FOREACH(const uint256 &hashDescendant, setDescendants)
+          vRemove.push_back(std::make_pair(mapTx[hashDescendant].nCountWithAncestors, hashDescendant));
+        vRemove.push_back(std::make_pair(mapTx[hash].nCountWithAncestors, hash));
+        std::sort(vRemove.rbegin(), vRemove.rend());
+        for(uint i = 0; i < vRemove.size(); i++) {
+            CTransactionRef ptx = get(vRemove[i].second);
+            if(ptx) remove(*ptx);
+        }
+        nEvicted += vRemove.size();
+
+        int64 nFeeRate = (int64)dFeeRate + MIN_RELAY_TX_FEE;
+        if(nFeeRate > nRollingMinFeeRate)
+          nRollingMinFeeRate = nFeeRate;
+        nLastRollingFeeUpdate = GetTime();
+    }
+
+    if(nEvicted)
+      printf("CTxMemPool::TrimToSize() : evicted %u transactions, minimum fee rate %" PRI64d "\n",
+        nEvicted, nRollingMinFeeRate);
+}
+
+/* The fee rate per kilobyte required to enter the pool after evictions;
+ * halves every 12 hours or faster while the pool is well below its limit */
+int64 CTxMemPool::GetMinFeeRate()
+{
+    LOCK(cs);
+    if(!nRollingMinFeeRate)
+      return(0);
+
+    int64 nNow = GetTime();
+    if(nNow > (nLastRollingFeeUpdate + 10)) {
+        double dHalfLife = 12 * 60 * 60;
+        if(nDynamicUsage < (nMaxUsage / 4))
+          dHalfLife /= 4;
+        else if(nDynamicUsage < (nMaxUsage / 2))
+          dHalfLife /= 2;
+        nRollingMinFeeRate = (int64)((double)nRollingMinFeeRate /
+          pow(2.0, (double)(nNow - nLastRollingFeeUpdate) / dHalfLife));
+        nLastRollingFeeUpdate = nNow;
+        if(nRollingMinFeeRate < (MIN_RELAY_TX_FEE / 2))
+          nRollingMinFeeRate = 0;
+    }
+
+    return(nRollingMinFeeRate);
+}
+
 void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
 {
     vtxid.clear();
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTransaction>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+    for (map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
         vtxid.push_back((*mi).first);
 }
 
+/* Set once the saved memory pool has been loaded,
+ * so an incomplete pool never replaces it; guarded by mempool.cs */
+static bool fMemPoolLoaded = false;
+
+void DumpMemPool()
+{
+    int64 nStart = GetTimeMillis();
+
+    /* Parents are saved ahead of their children */
+    std::vector<std::pair<uint, const CTxMemPoolEntry *> > vEntries;
+    std::vector<CTransaction> vtx;
+    {
+        LOCK(mempool.cs);
+        if(!fMemPoolLoaded)
+          return;
+        vEntries.reserve(mempool.mapTx.size());
+        for(std::map<uint256, CTxMemPoolEntry>::const_iterator it = mempool.mapTx.begin();
+          it != mempool.mapTx.end(); it++)
+          vEntries.push_back(std::make_pair(it->second.nCountWithAncestors, &it->second));
+        std::sort(vEntries.begin(), vEntries.end());
+        vtx.reserve(vEntries.size());
+        for(uint i = 0; i < vEntries.size(); i++)
+          vtx.push_back(*vEntries[i].second->ptx);
+    }
+
+    CMemPoolDB mpdb;
+    if(mpdb.Write(vtx))
+      printf("Flushed %" PRIszu " transactions to mempool.dat  %" PRI64d "ms\n",
+        vtx.size(), GetTimeMillis() - nStart);
+}
+
+/* Loads and revalidates the saved memory pool in the background,
+ * then saves it periodically */
+void ThreadMemPool(void *parg)
+{
+    // Make this thread recognisable as the memory pool thread
+    RenameThread("orb-mempool");
+
+    vnThreadsRunning[THREAD_MEMPOOL]++;
+
+    try {
+        std::vector<CTransaction> vtx;
+        CMemPoolDB mpdb;
+        int64 nStart = GetTimeMillis();
+        uint nAccepted = 0;
+
+        if(mpdb.Read(vtx)) {
+            /* One transaction at a time not to hold up block processing and RPC */
+            for(uint i = 0; (i < vtx.size()) && !fShutdown; i++) {
+                LOCK(cs_main);
+                if(mempool.accept(vtx[i], true, NULL))
+                  nAccepted++;
+            }
+            printf("Loaded %u of %" PRIszu " transactions from mempool.dat  %" PRI64d "ms\n",
+              nAccepted, vtx.size(), GetTimeMillis() - nStart);
+        } else {
+            printf("Invalid or missing mempool.dat; starting with an empty memory pool\n");
+        }
+        if(!fShutdown) {
+            LOCK(mempool.cs);
+            fMemPoolLoaded = true;
+        }
+
+        while(!fShutdown) {
+            vnThreadsRunning[THREAD_MEMPOOL]--;
+            for(uint i = 0; (i < 900) && !fShutdown; i++)
+              MilliSleep(1000);
+            vnThreadsRunning[THREAD_MEMPOOL]++;
+            if(!fShutdown)
+              DumpMemPool();
+        }
+    }
+    catch(std::exception &e) {
+        PrintException(&e, "ThreadMemPool()");
+    }
+
+    vnThreadsRunning[THREAD_MEMPOOL]--;
+    printf("ThreadMemPool exited\n");
+}
+
 /* Returns a transaction depth in the main chain or
  *  0 = in the memory pool, not yet in the main chain
  * -1 = failed transaction */
@@ -901,7 +1501,7 @@ int CMerkleTx::GetDepthInMainChain(CBlockIndex* &pindexRet) const {
       return(fTxMempool ? 0 : -1);
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if(mi == mapBlockIndex.end())
       return(fTxMempool ? 0 : -1);
 
@@ -977,6 +1577,17 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
             }
         }
 
+        /* A single positioned read with the transaction index */
+        if(fTxIndex) {
+            CBlock header;
+            uint nTxOffset;
+            if(ReadIndexedTransaction(hash, txOut, header, nTxOffset)) {
+                hashBlock = header.GetHash();
+                return(true);
+            }
+            return(false);
+        }
+
         if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
             int nHeight = -1;
             {
@@ -1007,6 +1618,35 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
 }
 
 
+bool ReadIndexedTransaction(const uint256 &hash, CTransaction &tx, CBlock &header, uint &nTxOffset) {
+    CDiskTxPos postx;
+
+    if(!fTxIndex || !pblocktree->ReadTxIndex(hash, postx))
+      return(false);
+
+    CBlockFileView view;
+    if(!GetBlockFileView(postx, false, view))
+      return(error("ReadIndexedTransaction() : GetBlockFileView() failed for %s", postx.ToString().c_str()));
+
+    try {
+        CMemoryReader reader(view.pbegin, view.pend, SER_DISK | SER_BLOCKHEADERONLY, CLIENT_VERSION);
+        reader >> header;
+        reader.nType &= ~SER_BLOCKHEADERONLY;
+        reader.Seek(postx.nTxOffset);
+        reader >> tx;
+    } catch(std::exception &e) {
+        return(error("ReadIndexedTransaction() : deserialise or I/O error at %s", postx.ToString().c_str()));
+    }
+
+    if(tx.GetHash() != hash)
+      return(error("ReadIndexedTransaction() : transaction %s hash mismatch", hash.ToString().c_str()));
+
+    nTxOffset = postx.nTxOffset;
+
+    return(true);
+}
+
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // CBlock and CBlockIndex
@@ -1030,6 +1670,17 @@ CBlockIndex* FindBlockByHeight(int nHeight)
     return pblockindex;
 }
 
+/* Returns true if no block of the main chain from pindexStart on has been pruned */
+bool HaveBlockData(const CBlockIndex *pindexStart) {
+    const CBlockIndex *pindex;
+
+    for(pindex = pindexStart; pindex; pindex = pindex->pnext)
+      if(!(pindex->nStatus & BLOCK_HAVE_DATA))
+        return(false);
+
+    return(true);
+}
+
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
 {
     if (!fReadTransactions)
@@ -1392,6 +2043,28 @@ void static InvalidBlockFound(CBlockIndex *pindex) {
         ConnectBestBlock(); // reorganise away from the failed block
 }
 
+/* Waits until the best chain moves away from the block given, a shutdown
+ * or a timeout; returns true if the best chain has changed */
+bool WaitForBestChain(const uint256 &hashWatched, int nTimeoutMillis)
+{
+    boost::system_time timeout = boost::get_system_time() + boost::posix_time::milliseconds(nTimeoutMillis);
+
+    /* Nothing has been signalled yet since startup */
+    {
+        LOCK(cs_main);
+        boost::lock_guard<boost::mutex> lock(csBlockChange);
+        if(hashBlockChange == 0)
+          hashBlockChange = hashBestChain;
+    }
+
+    boost::unique_lock<boost::mutex> lock(csBlockChange);
+    while((hashBlockChange == hashWatched) && !fShutdown) {
+        if(!cvBlockChange.timed_wait(lock, timeout))
+          break;
+    }
+    return(hashBlockChange != hashWatched);
+}
+
 bool ConnectBestBlock() {
     do {
         CBlockIndex *pindexNewBest;
@@ -1479,6 +2152,8 @@ unsigned int CTransaction::GetP2SHSigOpCount(CCoinsViewCache& inputs) const
 
 bool CTransaction::UpdateCoins(CCoinsViewCache &inputs, CTxUndo &txundo, int nHeight, unsigned int nTimeStamp, const uint256 &txhash) const
 {
+    CCoinsStats &stats = inputs.GetStatsDelta();
+
     // mark inputs spent
     if (!IsCoinBase()) {
         BOOST_FOREACH(const CTxIn &txin, vin) {
@@ -1489,11 +2164,20 @@ bool CTransaction::UpdateCoins(CCoinsViewCache &inputs, CTxUndo &txundo, int nHe
             if (!coins.Spend(txin.prevout, undo))
                 return error("UpdateCoins() : cannot spend input");
             txundo.vprevout.push_back(undo);
+
+            /* The metadata is still there even if the spend has pruned it */
+            if(CCoinsStats::IsCounted(undo.txout)) {
+                stats.RemoveOutput(txin.prevout.hash, txin.prevout.n, coins, undo.txout);
+                if(!CCoinsStats::IsCounted(coins))
+                  stats.nTransactions--;
+            }
         }
     }
 
-    // add outputs
-    if (!inputs.SetCoins(txhash, CCoins(*this, nHeight, nTimeStamp)))
+    // add outputs; BIP30 checks guarantee nothing counted is overwritten
+    CCoins coinsNew(*this, nHeight, nTimeStamp);
+    stats.AddCoins(txhash, coinsNew);
+    if (!inputs.SetCoins(txhash, coinsNew))
         return error("UpdateCoins() : cannot update output");
 
     return true;
@@ -1590,12 +2274,13 @@ bool CTransaction::CheckInputs(CCoinsViewCache &inputs, enum CheckSig_mode csmod
         // still computed and checked, and any change will be caught at the next checkpoint.
         if (csmode == CS_ALWAYS || 
             (csmode == CS_AFTER_CHECKPOINT && inputs.GetBestBlock()->nHeight >= Checkpoints::GetTotalBlocksEstimate())) {
+            CSigHashCache sighashcache(*this);
             for (unsigned int i = 0; i < vin.size(); i++) {
                 const COutPoint &prevout = vin[i].prevout;
                 const CCoins &coins = inputs.GetCoins(prevout.hash);
 
                 /* ECDSA signature verification */
-                if(!VerifySignature(coins, *this, i, flags, 0)) {
+                if(!VerifySignature(coins, *this, i, flags, 0, &sighashcache)) {
 
                     return(DoS(100, error("CheckInputs() : transaction %s signature verification failed",
                       GetHash().ToString().substr(0,10).c_str())));
@@ -1616,6 +2301,7 @@ bool CTransaction::ClientCheckInputs() const {
       return(false);
 
     LOCK(mempool.cs);
+    CSigHashCache sighashcache(*this);
     int64 nValueIn = 0;
     for(unsigned int i = 0; i < vin.size(); i++) {
 
@@ -1625,7 +2311,7 @@ bool CTransaction::ClientCheckInputs() const {
         if(!mempool.exists(prevout.hash))
           return(false);
 
-        CTransaction& txPrev = mempool.lookup(prevout.hash);
+        const CTransaction& txPrev = mempool.lookup(prevout.hash);
 
         /* A subtransaction index check */
         if(prevout.n >= txPrev.vout.size())
@@ -1638,7 +2324,7 @@ bool CTransaction::ClientCheckInputs() const {
 
         /* ECDSA signature verification */
         if(!VerifySignature(CCoins(txPrev, -1, -1), *this, i,
-          SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC | SCRIPT_VERIFY_DERSIG, 0))
+          SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC | SCRIPT_VERIFY_DERSIG, 0, &sighashcache))
           return error("ClientCheckInputs() : transaction %s signature verificaton failed",
             GetHash().ToString().substr(0,10).c_str());
 
@@ -1653,6 +2339,39 @@ bool CTransaction::ClientCheckInputs() const {
     return(true);
 }
 
+/* Restores a spent output from its undo record along with the metadata
+ * of its transaction if pruned and accounts for it in the statistics */
+bool ApplyTxInUndo(const CTxInUndo &undo, CCoinsViewCache &view, const COutPoint &out) {
+    CCoins coins;
+    view.GetCoins(out.hash, coins); // this can fail if the prevout was already entirely spent
+    bool fCounted = CCoinsStats::IsCounted(coins);
+    if (coins.IsPruned()) {
+        if (undo.nHeight == 0)
+            return error("ApplyTxInUndo() : undo data doesn't contain tx metadata? database corrupted");
+        coins.fCoinBase = undo.fCoinBase;
+        coins.fCoinStake = undo.fCoinStake;
+        coins.nHeight = undo.nHeight;
+        coins.nTime = undo.nTime;
+        coins.nBlockTime = undo.nBlockTime;
+        coins.nVersion = undo.nVersion;
+    } else {
+        if (undo.nHeight != 0)
+            return error("ApplyTxInUndo() : undo data contains unneeded tx metadata? database corrupted");
+    }
+    if (coins.IsAvailable(out.n))
+        return error("ApplyTxInUndo() : prevout output not spent? database corrupted");
+    if (coins.vout.size() < out.n+1)
+        coins.vout.resize(out.n+1);
+    coins.vout[out.n] = undo.txout;
+    if(CCoinsStats::IsCounted(undo.txout)) {
+        CCoinsStats &stats = view.GetStatsDelta();
+        stats.AddOutput(out.hash, out.n, coins, undo.txout);
+        if(!fCounted)
+          stats.nTransactions++;
+    }
+    return(view.SetCoins(out.hash, coins));
+}
+
 bool CBlock::DisconnectBlock(CBlockIndex *pindex, CCoinsViewCache &view) {
     int i;
     uint j;
@@ -1666,15 +2385,18 @@ bool CBlock::DisconnectBlock(CBlockIndex *pindex, CCoinsViewCache &view) {
         CDiskBlockPos pos = pindex->GetUndoPos();
         if (pos.IsNull())
             return error("DisconnectBlock() : no undo data available");
-        FILE *file = OpenUndoFile(pos, true);
-        if (file == NULL)
+        CBlockFileView undoView;
+        if (!GetBlockFileView(pos, true, undoView))
             return error("DisconnectBlock() : undo file not available");
-        CAutoFile fileUndo(file, SER_DISK, CLIENT_VERSION);
-        fileUndo >> blockUndo;
+        CMemoryReader readerUndo(undoView.pbegin, undoView.pend, SER_DISK, CLIENT_VERSION);
+        readerUndo >> blockUndo;
     }
 
     assert(blockUndo.vtxundo.size() + 1 == vtx.size());
 
+    std::vector<std::pair<CAddressIndexKey, int64> > vAddressHistory;
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vAddressUnspent;
+
     // undo transactions in reverse order
     for(i = vtx.size() - 1; i >= 0; i--) {
         const CTransaction &tx = vtx[i];
@@ -1694,8 +2416,22 @@ bool CBlock::DisconnectBlock(CBlockIndex *pindex, CCoinsViewCache &view) {
             return error("DisconnectBlock() : added transaction mismatch? database corrupted");
 
         // remove outputs
+        view.GetStatsDelta().RemoveCoins(hash, outs);
         outs = CCoins();
 
+        if(fAddressIndex) {
+            for(j = 0; j < tx.vout.size(); j++) {
+                const CTxOut &out = tx.vout[j];
+                if(out.IsEmpty())
+                  continue;
+                uint160 hashScript = GetAddressIndexHash(out.scriptPubKey);
+                vAddressHistory.push_back(std::make_pair(
+                  CAddressIndexKey(hashScript, pindex->nHeight, hash, j, false), out.nValue));
+                vAddressUnspent.push_back(std::make_pair(CAddressUnspentKey(hashScript, hash, j),
+                  CAddressUnspentValue()));
+            }
+        }
+
         // restore inputs
         if (i > 0) { // not coinbases
             const CTxUndo &txundo = blockUndo.vtxundo[i-1];
@@ -1703,28 +2439,16 @@ bool CBlock::DisconnectBlock(CBlockIndex *pindex, CCoinsViewCache &view) {
             for(j = tx.vin.size(); j-- > 0;) {
                 const COutPoint &out = tx.vin[j].prevout;
                 const CTxInUndo &undo = txundo.vprevout[j];
-                CCoins coins;
-                view.GetCoins(out.hash, coins); // this can fail if the prevout was already entirely spent
-                if (coins.IsPruned()) {
-                    if (undo.nHeight == 0)
-                        return error("DisconnectBlock() : undo data doesn't contain tx metadata? database corrupted");
-                    coins.fCoinBase = undo.fCoinBase;
-                    coins.fCoinStake = undo.fCoinStake;
-                    coins.nHeight = undo.nHeight;
-                    coins.nTime = undo.nTime;
-                    coins.nBlockTime = undo.nBlockTime;
-                    coins.nVersion = undo.nVersion;
-                } else {
-                    if (undo.nHeight != 0)
-                        return error("DisconnectBlock() : undo data contains unneeded tx metadata? database corrupted");
+                if(!ApplyTxInUndo(undo, view, out))
+                  return(error("DisconnectBlock() : cannot restore coin inputs"));
+
+                if(fAddressIndex) {
+                    uint160 hashScript = GetAddressIndexHash(undo.txout.scriptPubKey);
+                    vAddressHistory.push_back(std::make_pair(
+                      CAddressIndexKey(hashScript, pindex->nHeight, hash, j, true), -undo.txout.nValue));
+                    vAddressUnspent.push_back(std::make_pair(CAddressUnspentKey(hashScript, out.hash, out.n),
+                      CAddressUnspentValue(undo.txout.nValue, undo.txout.scriptPubKey, view.GetCoins(out.hash).nHeight)));
                 }
-                if (coins.IsAvailable(out.n))
-                    return error("DisconnectBlock() : prevout output not spent? database corrupted");
-                if (coins.vout.size() < out.n+1)
-                    coins.vout.resize(out.n+1);
-                coins.vout[out.n] = undo.txout;
-                if (!view.SetCoins(out.hash, coins))
-                    return error("DisconnectBlock() : cannot restore coin inputs");
             }
         }
 
@@ -1732,6 +2456,9 @@ bool CBlock::DisconnectBlock(CBlockIndex *pindex, CCoinsViewCache &view) {
         SyncWithWallets(vtx[i].GetHash(), vtx[i], this, false, false);
     }
 
+    if(fAddressIndex && !pblocktree->EraseAddressIndex(vAddressHistory, vAddressUnspent))
+      return(error("DisconnectBlock() : EraseAddressIndex failed"));
+
     /* Synchronise with the coins DB */
     if(!view.SetBestBlock(pindex->pprev))
       return(error("DisconnectBlock() : block %s final synchronisation failed",
@@ -1741,10 +2468,11 @@ bool CBlock::DisconnectBlock(CBlockIndex *pindex, CCoinsViewCache &view) {
 }
 
 bool FindUndoPos(int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
+void static PruneBlockFiles();
 
 bool CBlock::ConnectBlock(CBlockIndex* pindex, CCoinsViewCache &view) {
     uint flags = SCRIPT_VERIFY_P2SH;
-    uint i;
+    uint i, j;
 
     /* Make sure the block index and coins DB are synchronised;
      * no need to work around the genesis block and its transactions if any
@@ -1787,6 +2515,15 @@ bool CBlock::ConnectBlock(CBlockIndex* pindex, CCoinsViewCache &view) {
 
     CBlockUndo blockundo;
 
+    /* Transactions follow the 80 byte header and their number */
+    std::vector<std::pair<uint256, CDiskTxPos> > vPos;
+    CDiskTxPos pos(pindex->GetBlockPos(), 80 + GetSizeOfCompactSize(vtx.size()));
+    if(fTxIndex)
+      vPos.reserve(vtx.size());
+
+    std::vector<std::pair<CAddressIndexKey, int64> > vAddressHistory;
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vAddressUnspent;
+
     int64 nFees = 0, nValueIn = 0, nValueOut = 0, nActualStakeReward = 0;
     unsigned int nSigOps = 0;
     for(i = 0; i < vtx.size(); i++) {
@@ -1795,6 +2532,11 @@ bool CBlock::ConnectBlock(CBlockIndex* pindex, CCoinsViewCache &view) {
         if (nSigOps > MAX_BLOCK_SIGOPS)
             return DoS(100, error("ConnectBlock() : too many sigops"));
 
+        if(fTxIndex) {
+            vPos.push_back(std::make_pair(GetTxHash(i), pos));
+            pos.nTxOffset += tx.GetSize();
+        }
+
         if(tx.IsCoinBase()) nValueOut += tx.GetValueOut();
         else {
 
@@ -1834,6 +2576,32 @@ bool CBlock::ConnectBlock(CBlockIndex* pindex, CCoinsViewCache &view) {
         if(IsProofOfStake() && tx.IsCoinBase())
             continue;
 
+        /* The outputs spent must be indexed before they're gone from the view */
+        if(fAddressIndex) {
+            const uint256 &hash = GetTxHash(i);
+            if(!tx.IsCoinBase()) {
+                for(j = 0; j < tx.vin.size(); j++) {
+                    const COutPoint &outpoint = tx.vin[j].prevout;
+                    const CTxOut &prevout = view.GetCoins(outpoint.hash).vout[outpoint.n];
+                    uint160 hashScript = GetAddressIndexHash(prevout.scriptPubKey);
+                    vAddressHistory.push_back(std::make_pair(
+                      CAddressIndexKey(hashScript, pindex->nHeight, hash, j, true), -prevout.nValue));
+                    vAddressUnspent.push_back(std::make_pair(
+                      CAddressUnspentKey(hashScript, outpoint.hash, outpoint.n), CAddressUnspentValue()));
+                }
+            }
+            for(j = 0; j < tx.vout.size(); j++) {
+                const CTxOut &out = tx.vout[j];
+                if(out.IsEmpty())
+                  continue;
+                uint160 hashScript = GetAddressIndexHash(out.scriptPubKey);
+                vAddressHistory.push_back(std::make_pair(
+                  CAddressIndexKey(hashScript, pindex->nHeight, hash, j, false), out.nValue));
+                vAddressUnspent.push_back(std::make_pair(CAddressUnspentKey(hashScript, hash, j),
+                  CAddressUnspentValue(out.nValue, out.scriptPubKey, pindex->nHeight)));
+            }
+        }
+
         CTxUndo txundo;
         if (!tx.UpdateCoins(view, txundo, pindex->nHeight, pindex->nTime, GetTxHash(i)))
             return error("ConnectBlock() : UpdateInputs failed");
@@ -1861,10 +2629,11 @@ bool CBlock::ConnectBlock(CBlockIndex* pindex, CCoinsViewCache &view) {
     {
         if (pindex->GetUndoPos().IsNull()) {
             CDiskBlockPos pos;
-            if (!FindUndoPos(pindex->nFile, pos, ::GetSerializeSize(blockundo, SER_DISK, CLIENT_VERSION) + 8))
+            CBlockRecord record(blockundo);
+            if (!FindUndoPos(pindex->nFile, pos, record.GetDiskSize()))
                 return error("ConnectBlock() : FindUndoPos failed");
-            if (!blockundo.WriteToDisk(pos))
-                return error("ConnectBlock() : CBlockUndo::WriteToDisk failed");
+            if (!WriteBlockRecord(pos, true, record))
+                return error("ConnectBlock() : WriteBlockRecord() failed");
 
             // update nUndoPos in block index
             pindex->nUndoPos = pos.nPos;
@@ -1878,6 +2647,12 @@ bool CBlock::ConnectBlock(CBlockIndex* pindex, CCoinsViewCache &view) {
             return error("ConnectBlock() : WriteBlockIndex failed");
     }
 
+    if(fTxIndex && !pblocktree->WriteTxIndex(vPos))
+      return(error("ConnectBlock() : WriteTxIndex failed"));
+
+    if(fAddressIndex && !pblocktree->WriteAddressIndex(vAddressHistory, vAddressUnspent))
+      return(error("ConnectBlock() : WriteAddressIndex failed"));
+
     /* Synchronise with the coins DB */
     if(!view.SetBestBlock(pindex))
       return(error("ConnectBlock() : block %s final synchronisation failed",
@@ -1899,7 +2674,7 @@ bool SetBestChain(CBlockIndex* pindexNew)
     if (pindexGenesisBlock == NULL && pindexNew->GetBlockHash() == (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet))
     {
         view.SetBestBlock(pindexNew);
-        if (!view.Flush())
+        if (!CommitChainState(true))
             return false;
         pindexGenesisBlock = pindexNew;
         pindexBest = pindexNew;
@@ -1983,9 +2758,8 @@ bool SetBestChain(CBlockIndex* pindexNew)
 
     // Make sure it's successfully written to disk before changing memory structure
     bool fIsInitialDownload = IsInitialBlockDownload();
-    if (!fIsInitialDownload || view.GetCacheSize()>5000)
-        if (!view.Flush())
-            return false;
+    if (!CommitChainState(false))
+        return false;
 
     // At this point, all changes have been done to the database.
     // Proceed by updating the memory structures.
@@ -2024,6 +2798,12 @@ bool SetBestChain(CBlockIndex* pindexNew)
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
 
+    {
+        boost::lock_guard<boost::mutex> lock(csBlockChange);
+        hashBlockChange = hashBestChain;
+    }
+    cvBlockChange.notify_all();
+
     uint256 nBestBlockTrust = pindexBest->nHeight != 0 ? (pindexBest->nChainTrust - pindexBest->pprev->nChainTrust) : pindexBest->nChainTrust;
 
     printf("SetBestChain: new best=%s  height=%d  trust=%s blocktrust=%s  tx=%lu  date=%s\n",
@@ -2125,6 +2905,55 @@ bool CBlock::GetCoinAge(uint64 *pCoinAge, uint64 *pCoinAgeFails) const {
     return(true);
 }
 
+/* Block index entries and their stake details are never freed,
+ * so they are allocated from slabs of this many objects */
+static const uint BLOCK_INDEX_SLAB = 4096;
+
+template<typename T> T *SlabNew() {
+    static T *pslab = NULL;
+    static uint nUsed = BLOCK_INDEX_SLAB;
+
+    if(nUsed == BLOCK_INDEX_SLAB) {
+        pslab = new T[BLOCK_INDEX_SLAB];
+        nUsed = 0;
+    }
+
+    return(&pslab[nUsed++]);
+}
+
+const CBlockIndexStake &CBlockIndex::GetStake() const {
+    static const CBlockIndexStake stakeNull;
+
+    if(pstake) return(*pstake);
+    if(!IsProofOfStake() || !phashBlock) return(stakeNull);
+
+    /* The stake modifier and its checksum are computed from these,
+     * so a block index database which can't provide them is fatal */
+    CDiskBlockIndex diskindex;
+    if(!pblocktree->ReadBlockIndex(*phashBlock, diskindex)) {
+        string strError = strprintf("CBlockIndex::GetStake() : failed to read block index entry %s",
+          phashBlock->ToString().c_str());
+        printf("*** %s\n", strError.c_str());
+        strMiscWarning = _("Error: the block index database is corrupt, a full resynchronisation is required");
+        uiInterface.ThreadSafeMessageBox(strMiscWarning, "Orbitcoin", CClientUIInterface::OK | CClientUIInterface::ICON_ERROR | CClientUIInterface::MODAL);
+        StartShutdown();
+        throw(std::runtime_error(strError));
+    }
+    pstake = SlabNew<CBlockIndexStake>();
+    pstake->prevoutStake = diskindex.prevoutStake;
+    pstake->nStakeTime = diskindex.nStakeTime;
+    pstake->hashProofOfStake = diskindex.hashProofOfStake;
+
+    return(*pstake);
+}
+
+void CBlockIndex::SetStake(const COutPoint &prevoutStake, uint nStakeTime, const uint256 &hashProofOfStake) {
+    if(!pstake) pstake = SlabNew<CBlockIndexStake>();
+    pstake->prevoutStake = prevoutStake;
+    pstake->nStakeTime = nStakeTime;
+    pstake->hashProofOfStake = hashProofOfStake;
+}
+
 bool CBlock::AddToBlockIndex(const CDiskBlockPos &pos)
 {
     // Check for duplicate
@@ -2133,12 +2962,11 @@ bool CBlock::AddToBlockIndex(const CDiskBlockPos &pos)
         return error("AddToBlockIndex() : %s already exists", hash.ToString().substr(0,20).c_str());
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(*this);
-    if (!pindexNew)
-        return error("AddToBlockIndex() : new CBlockIndex failed");
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    CBlockIndex* pindexNew = SlabNew<CBlockIndex>();
+    *pindexNew = CBlockIndex(*this);
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
@@ -2161,7 +2989,7 @@ bool CBlock::AddToBlockIndex(const CDiskBlockPos &pos)
     {
         if (!mapProofOfStake.count(hash))
             return error("AddToBlockIndex() : hashProofOfStake not found in map");
-        pindexNew->hashProofOfStake = mapProofOfStake[hash];
+        pindexNew->SetStake(vtx[1].vin[0].prevout, vtx[1].nTime, mapProofOfStake[hash]);
     }
 
     // Compute stake modifier
@@ -2197,6 +3025,63 @@ bool CBlock::AddToBlockIndex(const CDiskBlockPos &pos)
     return true;
 }
 
+/* Block and undo files appended to since the last commit */
+static CCriticalSection cs_DirtyBlockFiles;
+static std::set<std::pair<int, bool> > setDirtyBlockFiles;
+int64 nCommitInterval = DEFAULT_COMMIT_INTERVAL;
+static int64 nLastCommitTime = 0;
+
+void MarkBlockFileDirty(int nFile, bool fUndo) {
+    LOCK(cs_DirtyBlockFiles);
+    setDirtyBlockFiles.insert(std::make_pair(nFile, fUndo));
+}
+
+/* A group commit with a single ordered barrier per store replaces the syncs
+ * of every block: the block and undo files go first, the block index next
+ * and the coins with their best block last, so the coins never refer to data
+ * which may be lost in a crash; the coin cache is bounded as before */
+bool CommitChainState(bool fForce) {
+    std::set<std::pair<int, bool> > setDirty;
+    int64 nNow = GetTime();
+
+    if(!fForce && IsInitialBlockDownload() && (pcoinsTip->GetCacheSize() <= 5000) &&
+      ((nNow - nLastCommitTime) < nCommitInterval))
+      return(true);
+
+    {
+        LOCK(cs_DirtyBlockFiles);
+        setDirty.swap(setDirtyBlockFiles);
+    }
+    /* Opened for writing as _commit() on Windows requires write access */
+    for(std::set<std::pair<int, bool> >::const_iterator it = setDirty.begin(); it != setDirty.end(); it++) {
+        CDiskBlockPos pos(it->first, 0);
+        FILE *file = it->second ? OpenUndoFile(pos, false) : OpenBlockFile(pos, false);
+        if(!file || FileCommit(file)) {
+            if(file) fclose(file);
+            /* The files not committed remain dirty for the next attempt */
+            {
+                LOCK(cs_DirtyBlockFiles);
+                setDirtyBlockFiles.insert(it, setDirty.end());
+            }
+            return(error("CommitChainState() : FileCommit() failed on %s file %i",
+              it->second ? "undo" : "block", it->first));
+        }
+        fclose(file);
+    }
+
+    if(!pblocktree->Sync())
+      return(error("CommitChainState() : failed to sync the block index"));
+
+    if(!pcoinsTip->Flush())
+      return(error("CommitChainState() : failed to write the coins"));
+
+    nLastCommitTime = nNow;
+
+    PruneBlockFiles();
+
+    return(true);
+}
+
 bool FindBlockPos(CDiskBlockPos &pos, unsigned int nAddSize, unsigned int nHeight,
   uint64 nTime, bool fKnown = false) {
     bool fUpdatedLast = false;
@@ -2215,22 +3100,19 @@ bool FindBlockPos(CDiskBlockPos &pos, unsigned int nAddSize, unsigned int nHeigh
             printf("Leaving block file %i: %s\n",
               nLastBlockFile, infoLastBlockFile.ToString().c_str());
             /* Flush the last block file to disk */
+            UnmapBlockFile(nLastBlockFile);
             CDiskBlockPos posOld(nLastBlockFile, 0);
             FILE *fileOld = OpenBlockFile(posOld);
             if(fileOld) {
                 FileTruncate(fileOld, infoLastBlockFile.nSize);
-                fflush(fileOld);
-                if(FileCommit(fileOld))
-                  return(error("FindBlockPos() : FileCommit() on block file failed"));
                 fclose(fileOld);
+                MarkBlockFileDirty(nLastBlockFile, false);
             } else return(error("FindBlockPos() : OpenBlockFile() on block file failed"));
             fileOld = OpenUndoFile(posOld);
             if(fileOld) {
                 FileTruncate(fileOld, infoLastBlockFile.nUndoSize);
-                fflush(fileOld);
-                if(FileCommit(fileOld))
-                  return(error("FindBlockPos() : FileCommit() on undo file failed"));
                 fclose(fileOld);
+                MarkBlockFileDirty(nLastBlockFile, true);
             } else return(error("FindBlockPos() : OpenBlockFile() on undo file failed"));
             nLastBlockFile++;
             infoLastBlockFile.SetNull();
@@ -2302,25 +3184,94 @@ bool FindUndoPos(int nFile, CDiskBlockPos &pos, unsigned int nAddSize)
     return true;
 }
 
-bool CBlock::CheckBlock() const {
+/* Deletes the oldest block and undo files while their total size is above
+ * the pruning target; must follow a flush of the coins DB as the blocks
+ * pruned cannot be connected again */
+void static PruneBlockFiles() {
+    uint64 nUsage = 0;
+    int nFile;
 
-    if(fReindex) {
-        /* Merkle root verification */
-        if(hashMerkleRoot != BuildMerkleTree()) return(false);
-        return(true);
-    }
+    if(!fPruneMode || (nBestHeight <= MIN_BLOCKS_TO_KEEP))
+      return;
 
-    uint nAdjTime = GetAdjustedTime();
+    LOCK(cs_LastBlockFile);
 
-    // These are checks that are independent of context
-    // that can be verified before saving an orphan block.
+    std::vector<CBlockFileInfo> vinfo(nLastBlockFile + 1);
+    for(nFile = 0; nFile < nLastBlockFile; nFile++) {
+        pblocktree->ReadBlockFileInfo(nFile, vinfo[nFile]);
+        nUsage += vinfo[nFile].nSize + vinfo[nFile].nUndoSize;
+    }
+    vinfo[nLastBlockFile] = infoLastBlockFile;
+    nUsage += infoLastBlockFile.nSize + infoLastBlockFile.nUndoSize;
 
-    // Size limits
-    if (vtx.empty() || vtx.size() > MAX_BLOCK_SIZE || ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION) > MAX_BLOCK_SIZE)
-        return DoS(100, error("CheckBlock() : size limits failed"));
+    if(nUsage <= nPruneTarget)
+      return;
 
-    // First transaction must be coinbase, the rest must not be
-    if (vtx.empty() || !vtx[0].IsCoinBase())
+    /* The last block file is never pruned as it's being written to */
+    std::set<int> setFilesToPrune;
+    uint nHeightLimit = nBestHeight - MIN_BLOCKS_TO_KEEP;
+    for(nFile = 0; (nFile < nLastBlockFile) && (nUsage > nPruneTarget); nFile++) {
+        if(!vinfo[nFile].nSize || (vinfo[nFile].nHeightLast > nHeightLimit))
+          continue;
+        nUsage -= vinfo[nFile].nSize + vinfo[nFile].nUndoSize;
+        setFilesToPrune.insert(nFile);
+    }
+
+    if(setFilesToPrune.empty())
+      return;
+
+    /* The block index goes first, so the data is never referenced once deleted */
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*) &item, mapBlockIndex) {
+        CBlockIndex *pindex = item.second;
+        if((pindex->nStatus & (BLOCK_HAVE_DATA | BLOCK_HAVE_UNDO)) && setFilesToPrune.count(pindex->nFile)) {
+            pindex->nStatus &= ~(BLOCK_HAVE_DATA | BLOCK_HAVE_UNDO);
+            pindex->nFile = 0;
+            pindex->nDataPos = 0;
+            pindex->nUndoPos = 0;
+            pblocktree->WriteBlockIndex(CDiskBlockIndex(pindex));
+        }
+    }
+
+    /* Durable before any file is deleted */
+    pblocktree->Sync();
+
+    BOOST_FOREACH(int nFilePruned, setFilesToPrune) {
+        CBlockFileInfo info;
+        pblocktree->WriteBlockFileInfo(nFilePruned, info);
+        boost::system::error_code ec;
+        UnmapBlockFile(nFilePruned);
+        {
+            /* Not to be recreated by a commit */
+            LOCK(cs_DirtyBlockFiles);
+            setDirtyBlockFiles.erase(std::make_pair(nFilePruned, false));
+            setDirtyBlockFiles.erase(std::make_pair(nFilePruned, true));
+        }
+        boost::filesystem::remove(GetDataDir() / "blocks" / strprintf("blk%05u.dat", nFilePruned), ec);
+        boost::filesystem::remove(GetDataDir() / "blocks" / strprintf("rev%05u.dat", nFilePruned), ec);
+        printf("Pruned block file %i: %s\n", nFilePruned, vinfo[nFilePruned].ToString().c_str());
+    }
+    pblocktree->Flush();
+}
+
+bool CBlock::CheckBlock() const {
+
+    if(fReindex) {
+        /* Merkle root verification */
+        if(hashMerkleRoot != BuildMerkleTree()) return(false);
+        return(true);
+    }
+
+    uint nAdjTime = GetAdjustedTime();
+
+    // These are checks that are independent of context
+    // that can be verified before saving an orphan block.
+
+    // Size limits
+    if (vtx.empty() || vtx.size() > MAX_BLOCK_SIZE || ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION) > MAX_BLOCK_SIZE)
+        return DoS(100, error("CheckBlock() : size limits failed"));
+
+    // First transaction must be coinbase, the rest must not be
+    if (vtx.empty() || !vtx[0].IsCoinBase())
         return DoS(100, error("CheckBlock() : first tx is not coinbase"));
     for (unsigned int i = 1; i < vtx.size(); i++)
         if (vtx[i].IsCoinBase())
@@ -2410,7 +3361,7 @@ bool CBlock::AcceptBlock(CDiskBlockPos *dbp) {
         return error("AcceptBlock() : block already in mapBlockIndex");
 
     // Get prev block index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
     if (mi == mapBlockIndex.end())
         return DoS(10, error("AcceptBlock() : prev block not found"));
     CBlockIndex* pindexPrev = (*mi).second;
@@ -2418,9 +3369,9 @@ bool CBlock::AcceptBlock(CDiskBlockPos *dbp) {
 
     if(fReindex && (dbp != NULL)) {
         /* Skip all remaining checks and actions, add the block to the index */
-        uint nBlockSize = ::GetSerializeSize(*this, SER_DISK, CLIENT_VERSION);
+        uint nRecordSize = GetBlockRecordSize(*dbp, false);
         CDiskBlockPos blockPos = *dbp;
-        if(!FindBlockPos(blockPos, nBlockSize + 8, nHeight, nTime, 1))
+        if(!nRecordSize || !FindBlockPos(blockPos, nRecordSize, nHeight, nTime, 1))
           return(error("AcceptBlock() : FindBlockPos() failed while reindexing"));
         if(!AddToBlockIndex(blockPos))
           return(error("AcceptBlock() : AddToBlockIndex() failed while reindexing"));
@@ -2524,16 +3475,16 @@ bool CBlock::AcceptBlock(CDiskBlockPos *dbp) {
     }
 
     // Write block to history file
-    unsigned int nBlockSize = ::GetSerializeSize(*this, SER_DISK, CLIENT_VERSION);
-    if (!CheckDiskSpace(::GetSerializeSize(*this, SER_DISK, CLIENT_VERSION)))
+    CBlockRecord record(*this);
+    if (!CheckDiskSpace(record.GetDiskSize()))
         return error("AcceptBlock() : out of disk space");
     CDiskBlockPos blockPos;
     {
-        if (!FindBlockPos(blockPos, nBlockSize+8, nHeight, nTime))
+        if (!FindBlockPos(blockPos, record.GetDiskSize(), nHeight, nTime))
             return error("AcceptBlock() : FindBlockPos failed");
     }
-    if (!WriteToDisk(blockPos))
-        return error("AcceptBlock() : WriteToDisk failed");
+    if (!WriteBlockRecord(blockPos, false, record))
+        return error("AcceptBlock() : WriteBlockRecord() failed");
     if (!AddToBlockIndex(blockPos))
         return error("AcceptBlock() : AddToBlockIndex failed");
 
@@ -2740,7 +3691,7 @@ uint256 CBlockIndex::GetBlockTrust() const {
 }
 
 
-bool ProcessBlock(CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp) {
+bool ProcessBlock(CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp, bool fChecked) {
     uint256 hash = pblock->GetHash();
 
     /* Duplicate block check */
@@ -2768,8 +3719,9 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp) {
         }
     }
 
-    /* Basic block integrity checks including PoW target and signature verification */
-    if(!pblock->CheckBlock())
+    /* Basic block integrity checks including PoW target and signature verification
+     * unless done by the caller already */
+    if(!fChecked && !pblock->CheckBlock())
       return(error("ProcessBlock() : CheckBlock() FAILED"));
 
     if(pblock->IsProofOfStake()) { 
@@ -3092,6 +4044,535 @@ FILE* OpenDiskFile(const CDiskBlockPos &pos, const char *prefix, bool fReadOnly)
     return file;
 }
 
+/* Block and undo files are read through memory mappings which are cached
+ * in LRU order, so reading a block needs no system calls once mapped;
+ * fewer on 32-bit systems to save the address space */
+static const uint MAX_BLOCKFILE_MAPS = (sizeof(void *) > 4) ? 64 : 8;
+
+class CMappedBlockFile {
+public:
+    int nFile;
+    bool fUndo;
+    char *pdata;
+    size_t nSize;
+
+    CMappedBlockFile(int nFileIn, bool fUndoIn, char *pdataIn, size_t nSizeIn) :
+      nFile(nFileIn), fUndo(fUndoIn), pdata(pdataIn), nSize(nSizeIn) { }
+
+    ~CMappedBlockFile() {
+#ifndef WIN32
+        munmap(pdata, nSize);
+#endif
+    }
+};
+
+static CCriticalSection cs_BlockFileMaps;
+static std::list<boost::shared_ptr<CMappedBlockFile> > listBlockFileMaps;
+
+#ifndef WIN32
+/* Returns a mapping of the file covering at least nMinSize bytes */
+static boost::shared_ptr<CMappedBlockFile> MapBlockFile(int nFile, bool fUndo, uint64 nMinSize) {
+    std::list<boost::shared_ptr<CMappedBlockFile> >::iterator it;
+    boost::shared_ptr<CMappedBlockFile> pmap;
+
+    LOCK(cs_BlockFileMaps);
+
+    for(it = listBlockFileMaps.begin(); it != listBlockFileMaps.end(); it++) {
+        if(((*it)->nFile == nFile) && ((*it)->fUndo == fUndo)) {
+            if((*it)->nSize >= nMinSize) {
+                listBlockFileMaps.splice(listBlockFileMaps.begin(), listBlockFileMaps, it);
+                return(listBlockFileMaps.front());
+            }
+            /* The file has grown since mapped */
+            listBlockFileMaps.erase(it);
+            break;
+        }
+    }
+
+    boost::filesystem::path path = GetDataDir() / "blocks" / strprintf("%s%05u.dat", fUndo ? "rev" : "blk", nFile);
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if(fd < 0) {
+        printf("Unable to open file %s\n", path.string().c_str());
+        return(pmap);
+    }
+    struct stat st;
+    if(fstat(fd, &st) || ((uint64)st.st_size < nMinSize) || !st.st_size) {
+        close(fd);
+        return(pmap);
+    }
+    void *pdata = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(pdata == MAP_FAILED) {
+        printf("Unable to map file %s\n", path.string().c_str());
+        return(pmap);
+    }
+
+    pmap.reset(new CMappedBlockFile(nFile, fUndo, (char *)pdata, st.st_size));
+    listBlockFileMaps.push_front(pmap);
+    if(listBlockFileMaps.size() > MAX_BLOCKFILE_MAPS)
+      listBlockFileMaps.pop_back();
+
+    return(pmap);
+}
+#endif
+
+void UnmapBlockFile(int nFile) {
+    std::list<boost::shared_ptr<CMappedBlockFile> >::iterator it;
+
+    LOCK(cs_BlockFileMaps);
+
+    for(it = listBlockFileMaps.begin(); it != listBlockFileMaps.end();) {
+        if((*it)->nFile == nFile) it = listBlockFileMaps.erase(it);
+        else it++;
+    }
+}
+
+/* Locates the raw payload of a record and returns its size word */
+static bool GetBlockFileRecord(const CDiskBlockPos &pos, bool fUndo, CBlockFileView &view, uint &nSizeWord) {
+    uint nSize;
+
+    /* Every record is preceded by the network magic and its size */
+    if(pos.IsNull() || (pos.nPos < 8))
+      return(false);
+
+#ifndef WIN32
+    view.pmap = MapBlockFile(pos.nFile, fUndo, pos.nPos);
+    if(!view.pmap)
+      return(false);
+    const char *pheader = view.pmap->pdata + pos.nPos - 8;
+    if(memcmp(pheader, pchMessageStart, 4))
+      return(error("GetBlockFileView() : no record at %s", pos.ToString().c_str()));
+    memcpy(&nSizeWord, pheader + 4, 4);
+    nSize = nSizeWord & ~BLOCK_RECORD_COMPRESSED;
+    if(((uint64)pos.nPos + nSize) > view.pmap->nSize) {
+        /* The record has been written after the file was mapped */
+        view.pmap = MapBlockFile(pos.nFile, fUndo, (uint64)pos.nPos + nSize);
+        if(!view.pmap)
+          return(error("GetBlockFileView() : truncated record at %s", pos.ToString().c_str()));
+    }
+    view.pbegin = view.pmap->pdata + pos.nPos;
+    view.pend = view.pbegin + nSize;
+#else
+    CAutoFile filein(OpenDiskFile(CDiskBlockPos(pos.nFile, pos.nPos - 8), fUndo ? "rev" : "blk", true),
+      SER_DISK, CLIENT_VERSION);
+    if(filein.IsNull())
+      return(false);
+    try {
+        uchar pchMagic[4];
+        filein >> FLATDATA(pchMagic) >> nSizeWord;
+        if(memcmp(pchMagic, pchMessageStart, 4))
+          return(error("GetBlockFileView() : no record at %s", pos.ToString().c_str()));
+        nSize = nSizeWord & ~BLOCK_RECORD_COMPRESSED;
+        view.vData.resize(nSize);
+        if(nSize) filein.read(&view.vData[0], nSize);
+    } catch(std::exception &e) {
+        return(error("GetBlockFileView() : I/O error at %s", pos.ToString().c_str()));
+    }
+    view.pbegin = nSize ? &view.vData[0] : NULL;
+    view.pend = view.pbegin + nSize;
+#endif
+
+    return(true);
+}
+
+/* Limit on the uncompressed size of a record to reject corrupt ones */
+static const uint MAX_BLOCK_RECORD_SIZE = 8 * MAX_BLOCK_SIZE;
+
+/* Restores a compressed record payload */
+static bool InflateBlockRecord(const char *pbegin, const char *pend, std::vector<char> &vOut) {
+    uint nSize;
+
+    if((pend - pbegin) < 4)
+      return(false);
+    memcpy(&nSize, pbegin, 4);
+    if(nSize > MAX_BLOCK_RECORD_SIZE)
+      return(false);
+
+    vOut.resize(nSize);
+    uLongf nOutSize = nSize;
+    if(!nSize || (uncompress((Bytef *)&vOut[0], &nOutSize, (const Bytef *)pbegin + 4, pend - pbegin - 4) != Z_OK) ||
+      (nOutSize != nSize))
+      return(false);
+
+    return(true);
+}
+
+bool GetBlockFileView(const CDiskBlockPos &pos, bool fUndo, CBlockFileView &view) {
+    uint nSizeWord;
+
+    if(!GetBlockFileRecord(pos, fUndo, view, nSizeWord))
+      return(false);
+
+    if(nSizeWord & BLOCK_RECORD_COMPRESSED) {
+        std::vector<char> vData;
+        if(!InflateBlockRecord(view.pbegin, view.pend, vData))
+          return(error("GetBlockFileView() : corrupt compressed record at %s", pos.ToString().c_str()));
+        view.vData.swap(vData);
+        view.pmap.reset();
+        view.pbegin = &view.vData[0];
+        view.pend = view.pbegin + view.vData.size();
+    }
+
+    return(true);
+}
+
+uint GetBlockRecordSize(const CDiskBlockPos &pos, bool fUndo) {
+    CBlockFileView view;
+    uint nSizeWord;
+
+    if(!GetBlockFileRecord(pos, fUndo, view, nSizeWord))
+      return(0);
+
+    return((nSizeWord & ~BLOCK_RECORD_COMPRESSED) + 8);
+}
+
+void CBlockRecord::Set(const char *pbegin, const char *pend, bool fCompress) {
+    uint nSize = pend - pbegin;
+
+    fCompressed = false;
+
+    if(fCompress && nSize) {
+        uLongf nOutSize = compressBound(nSize);
+        vData.resize(nOutSize + 4);
+        memcpy(&vData[0], &nSize, 4);
+        if((compress2((Bytef *)&vData[4], &nOutSize, (const Bytef *)pbegin, nSize, Z_DEFAULT_COMPRESSION) == Z_OK) &&
+          ((nOutSize + 4) < nSize)) {
+            vData.resize(nOutSize + 4);
+            fCompressed = true;
+            return;
+        }
+    }
+
+    /* Stored as is */
+    vData.assign(pbegin, pend);
+}
+
+bool WriteBlockRecord(CDiskBlockPos &pos, bool fUndo, const CBlockRecord &record) {
+    const char *pszType = fUndo ? "undo" : "block";
+
+    /* Open history file to append */
+    CAutoFile fileout = CAutoFile(fUndo ? OpenUndoFile(pos) : OpenBlockFile(pos), SER_DISK, CLIENT_VERSION);
+    if(!fileout)
+      return(error("WriteBlockRecord() : failed to open the %s file", pszType));
+
+    /* Write index header */
+    uint nSizeWord = record.GetSizeWord();
+    fileout << FLATDATA(pchMessageStart) << nSizeWord;
+
+    /* Write the payload */
+    long fileOutPos = ftell(fileout);
+    if(fileOutPos < 0)
+      return(error("WriteBlockRecord() : ftell() failed on the %s file", pszType));
+    pos.nPos = (uint)fileOutPos;
+    if(!record.vData.empty())
+      fileout.write(&record.vData[0], record.vData.size());
+
+    /* Flush stdio buffers, synced to disk by the next commit */
+    fflush(fileout);
+    MarkBlockFileDirty(pos.nFile, fUndo);
+
+    return(true);
+}
+
+/* The background converter rewrites completed block files with compressed records
+ * into temporary files, commits the new positions to the block tree DB along with
+ * a marker of the file pending and renames the temporary files over the old ones */
+
+/* Block files this deep in the chain are converted */
+static const int BLOCK_COMPRESS_DEPTH = MIN_BLOCKS_TO_KEEP;
+
+class CCompressEntry {
+public:
+    CBlockIndex *pindex;
+    uint nStatus;
+    uint nDataPos;
+    uint nUndoPos;
+    bool fMainChain;
+    uint nNewDataPos;
+    uint nNewUndoPos;
+};
+
+static bool CompareCompressEntryData(const CCompressEntry *a, const CCompressEntry *b) {
+    return(a->nDataPos < b->nDataPos);
+}
+
+static bool CompareCompressEntryUndo(const CCompressEntry *a, const CCompressEntry *b) {
+    return(a->nUndoPos < b->nUndoPos);
+}
+
+static boost::filesystem::path GetBlockFileTempPath(int nFile, bool fUndo) {
+    return(GetDataDir() / "blocks" / strprintf("%s%05u.dat.tmp", fUndo ? "rev" : "blk", nFile));
+}
+
+/* Copies the records into a new file compressing them as it goes;
+ * returns false on errors or shutdown */
+static bool CopyBlockFileRecords(int nFile, bool fUndo, std::vector<CCompressEntry *> &vEntries,
+  uint &nNewSize, bool &fChanged) {
+    boost::filesystem::path pathTemp = GetBlockFileTempPath(nFile, fUndo);
+
+    CAutoFile fileout(fopen(pathTemp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if(!fileout)
+      return(error("CompressBlockFile() : failed to create %s", pathTemp.string().c_str()));
+
+    std::sort(vEntries.begin(), vEntries.end(), fUndo ? CompareCompressEntryUndo : CompareCompressEntryData);
+
+    nNewSize = 0;
+    try {
+        BOOST_FOREACH(CCompressEntry *pentry, vEntries) {
+            if(fShutdown)
+              return(false);
+
+            CBlockFileView view;
+            CBlockRecord record;
+            uint nSizeWord;
+            CDiskBlockPos pos(nFile, fUndo ? pentry->nUndoPos : pentry->nDataPos);
+            if(!GetBlockFileRecord(pos, fUndo, view, nSizeWord))
+              return(error("CompressBlockFile() : failed to read the record at %s", pos.ToString().c_str()));
+
+            if(nSizeWord & BLOCK_RECORD_COMPRESSED) {
+                record.vData.assign(view.pbegin, view.pend);
+                record.fCompressed = true;
+            } else {
+                record.Set(view.pbegin, view.pend, true);
+                if(record.fCompressed)
+                  fChanged = true;
+            }
+
+            if(fUndo)
+              pentry->nNewUndoPos = nNewSize + 8;
+            else
+              pentry->nNewDataPos = nNewSize + 8;
+            if(pos.nPos != (nNewSize + 8))
+              fChanged = true;
+
+            nSizeWord = record.GetSizeWord();
+            fileout << FLATDATA(pchMessageStart) << nSizeWord;
+            fileout.write(&record.vData[0], record.vData.size());
+            nNewSize += record.GetDiskSize();
+        }
+    } catch(std::exception &e) {
+        return(error("CompressBlockFile() : I/O error while writing %s", pathTemp.string().c_str()));
+    }
+
+    fflush(fileout);
+    if(FileCommit(fileout))
+      return(error("CompressBlockFile() : FileCommit() failed on %s", pathTemp.string().c_str()));
+
+    return(true);
+}
+
+/* Locates the transactions indexed within the blocks to be moved */
+static bool GetMovedTransactions(int nFile, const std::vector<CCompressEntry *> &vEntries,
+  std::vector<std::pair<uint256, CDiskTxPos> > &vPos) {
+    uint i;
+
+    BOOST_FOREACH(const CCompressEntry *pentry, vEntries) {
+        if(fShutdown)
+          return(false);
+        if(!(pentry->nStatus & BLOCK_HAVE_DATA))
+          continue;
+
+        CBlock block;
+        if(!block.ReadFromDisk(CDiskBlockPos(nFile, pentry->nDataPos)))
+          return(false);
+        block.BuildMerkleTree();
+        for(i = 0; i < block.vtx.size(); i++) {
+            const uint256 &hash = block.GetTxHash(i);
+            CDiskTxPos postx;
+            if(pblocktree->ReadTxIndex(hash, postx) && (postx.nFile == nFile) &&
+              (postx.nPos == pentry->nDataPos))
+              vPos.push_back(std::make_pair(hash,
+                CDiskTxPos(CDiskBlockPos(nFile, pentry->nNewDataPos), postx.nTxOffset)));
+        }
+    }
+
+    return(true);
+}
+
+bool CompressBlockFile(int nFile) {
+    std::vector<CCompressEntry> vEntries;
+    std::vector<CCompressEntry *> vData, vUndo;
+    std::vector<std::pair<uint256, CDiskTxPos> > vPos;
+    CBlockFileInfo info;
+    uint nNewSize = 0, nNewUndoSize = 0;
+    bool fChanged = false;
+    int64 nStart = GetTimeMillis();
+
+    /* A snapshot of the blocks stored */
+    {
+        LOCK2(cs_main, cs_LastBlockFile);
+        if((nFile >= nLastBlockFile) || !pblocktree->ReadBlockFileInfo(nFile, info) || !info.nSize)
+          return(false);
+        BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*) &item, mapBlockIndex) {
+            CBlockIndex *pindex = item.second;
+            if((pindex->nFile != nFile) || !(pindex->nStatus & BLOCK_HAVE_MASK))
+              continue;
+            CCompressEntry entry;
+            entry.pindex = pindex;
+            entry.nStatus = pindex->nStatus;
+            entry.nDataPos = pindex->nDataPos;
+            entry.nUndoPos = pindex->nUndoPos;
+            entry.fMainChain = pindex->IsInMainChain();
+            entry.nNewDataPos = entry.nNewUndoPos = 0;
+            vEntries.push_back(entry);
+        }
+    }
+
+    if(filesystem::space(GetDataDir()).available < (nMinDiskSpace + info.nSize + info.nUndoSize))
+      return(false);
+
+    BOOST_FOREACH(CCompressEntry &entry, vEntries) {
+        if(entry.nStatus & BLOCK_HAVE_DATA)
+          vData.push_back(&entry);
+        if(entry.nStatus & BLOCK_HAVE_UNDO)
+          vUndo.push_back(&entry);
+    }
+
+    boost::system::error_code ec;
+    if(!CopyBlockFileRecords(nFile, false, vData, nNewSize, fChanged) ||
+      !CopyBlockFileRecords(nFile, true, vUndo, nNewUndoSize, fChanged) ||
+      (fChanged && fTxIndex && !GetMovedTransactions(nFile, vData, vPos))) {
+        boost::filesystem::remove(GetBlockFileTempPath(nFile, false), ec);
+        boost::filesystem::remove(GetBlockFileTempPath(nFile, true), ec);
+        return(false);
+    }
+
+    if(!fChanged) {
+        boost::filesystem::remove(GetBlockFileTempPath(nFile, false), ec);
+        boost::filesystem::remove(GetBlockFileTempPath(nFile, true), ec);
+        return(pblocktree->WriteBlockFileCompressed(nFile));
+    }
+
+    {
+        LOCK2(cs_main, cs_LastBlockFile);
+
+        /* Nothing may have been added, removed or connected in the meantime */
+        CBlockFileInfo infoNow;
+        bool fValid = (nFile < nLastBlockFile) && pblocktree->ReadBlockFileInfo(nFile, infoNow) &&
+          (infoNow.nSize == info.nSize) && (infoNow.nUndoSize == info.nUndoSize) &&
+          (infoNow.nBlocks == info.nBlocks);
+        BOOST_FOREACH(const CCompressEntry &entry, vEntries) {
+            if(!fValid)
+              break;
+            const CBlockIndex *pindex = entry.pindex;
+            fValid = (pindex->nFile == nFile) && (pindex->nStatus == entry.nStatus) &&
+              (pindex->nDataPos == entry.nDataPos) && (pindex->nUndoPos == entry.nUndoPos) &&
+              (pindex->IsInMainChain() == entry.fMainChain);
+        }
+        if(!fValid) {
+            boost::filesystem::remove(GetBlockFileTempPath(nFile, false), ec);
+            boost::filesystem::remove(GetBlockFileTempPath(nFile, true), ec);
+            printf("CompressBlockFile() : block file %i changed while converted, retrying later\n", nFile);
+            return(false);
+        }
+
+        std::vector<CBlockIndex *> vIndex;
+        BOOST_FOREACH(CCompressEntry &entry, vEntries) {
+            if(entry.nStatus & BLOCK_HAVE_DATA)
+              entry.pindex->nDataPos = entry.nNewDataPos;
+            if(entry.nStatus & BLOCK_HAVE_UNDO)
+              entry.pindex->nUndoPos = entry.nNewUndoPos;
+            vIndex.push_back(entry.pindex);
+        }
+        infoNow.nSize = nNewSize;
+        infoNow.nUndoSize = nNewUndoSize;
+
+        if(!pblocktree->WriteCompressedBlockFile(nFile, infoNow, vIndex, vPos)) {
+            BOOST_FOREACH(CCompressEntry &entry, vEntries) {
+                entry.pindex->nDataPos = entry.nDataPos;
+                entry.pindex->nUndoPos = entry.nUndoPos;
+            }
+            boost::filesystem::remove(GetBlockFileTempPath(nFile, false), ec);
+            boost::filesystem::remove(GetBlockFileTempPath(nFile, true), ec);
+            return(error("CompressBlockFile() : failed to write the block index of file %i", nFile));
+        }
+
+        /* No mapping of the old files may be made while they're replaced */
+        {
+            LOCK(cs_BlockFileMaps);
+            if(!RenameOver(GetBlockFileTempPath(nFile, false),
+                GetDataDir() / "blocks" / strprintf("blk%05u.dat", nFile)) ||
+              !RenameOver(GetBlockFileTempPath(nFile, true),
+                GetDataDir() / "blocks" / strprintf("rev%05u.dat", nFile))) {
+                UnmapBlockFile(nFile);
+                return(error("CompressBlockFile() : failed to replace block file %i, restart to recover", nFile));
+            }
+            UnmapBlockFile(nFile);
+        }
+        /* The renames must be durable before the pending record is gone */
+        if(DirectoryCommit(GetDataDir() / "blocks"))
+          return(error("CompressBlockFile() : DirectoryCommit() failed on block file %i", nFile));
+        pblocktree->EraseBlockFileCompressPending();
+    }
+
+    printf("Compressed block file %i: %u + %u bytes to %u + %u bytes  %" PRI64d "ms\n",
+      nFile, info.nSize, info.nUndoSize, nNewSize, nNewUndoSize, GetTimeMillis() - nStart);
+
+    return(true);
+}
+
+/* Completes or rolls back a conversion interrupted by a crash */
+static void RecoverBlockFileCompression() {
+    boost::system::error_code ec;
+    int nFile;
+
+    if(pblocktree->ReadBlockFileCompressPending(nFile)) {
+        /* The new positions have been committed, the new files must take over */
+        if(boost::filesystem::exists(GetBlockFileTempPath(nFile, false)))
+          RenameOver(GetBlockFileTempPath(nFile, false), GetDataDir() / "blocks" / strprintf("blk%05u.dat", nFile));
+        if(boost::filesystem::exists(GetBlockFileTempPath(nFile, true)))
+          RenameOver(GetBlockFileTempPath(nFile, true), GetDataDir() / "blocks" / strprintf("rev%05u.dat", nFile));
+        if(!DirectoryCommit(GetDataDir() / "blocks"))
+          pblocktree->EraseBlockFileCompressPending();
+        printf("Completed the conversion of block file %i\n", nFile);
+    }
+
+    /* Leftovers of a conversion not committed */
+    boost::filesystem::directory_iterator it(GetDataDir() / "blocks", ec), itEnd;
+    for(; !ec && (it != itEnd); it.increment(ec)) {
+        if(it->path().extension() == ".tmp")
+          boost::filesystem::remove(it->path(), ec);
+    }
+}
+
+void ThreadBlockFileCompressor(void *parg) {
+    int nFile;
+
+    RenameThread("orb-blockcompress");
+
+    vnThreadsRunning[THREAD_BLOCKCOMPRESS]++;
+
+    try {
+        while(!fShutdown) {
+            for(nFile = 0; !fShutdown; nFile++) {
+                CBlockFileInfo info;
+                {
+                    LOCK(cs_LastBlockFile);
+                    if(nFile >= nLastBlockFile)
+                      break;
+                    if(!pblocktree->ReadBlockFileInfo(nFile, info))
+                      continue;
+                }
+                if(IsInitialBlockDownload() || !info.nSize ||
+                  ((int)info.nHeightLast > (nBestHeight - BLOCK_COMPRESS_DEPTH)) ||
+                  pblocktree->IsBlockFileCompressed(nFile))
+                  continue;
+                CompressBlockFile(nFile);
+            }
+
+            vnThreadsRunning[THREAD_BLOCKCOMPRESS]--;
+            for(uint i = 0; (i < 600) && !fShutdown; i++)
+              MilliSleep(1000);
+            vnThreadsRunning[THREAD_BLOCKCOMPRESS]++;
+        }
+    }
+    catch(std::exception &e) {
+        PrintExceptionContinue(&e, "ThreadBlockFileCompressor()");
+    }
+
+    vnThreadsRunning[THREAD_BLOCKCOMPRESS]--;
+}
+
 FILE* OpenBlockFile(const CDiskBlockPos &pos, bool fReadOnly) {
     return OpenDiskFile(pos, "blk", fReadOnly);
 }
@@ -3106,14 +4587,12 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("InsertBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = SlabNew<CBlockIndex>();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
@@ -3147,6 +4626,8 @@ void InitTestnet() {
 
 bool static LoadBlockIndexDB()
 {
+    RecoverBlockFileCompression();
+
     if (!pblocktree->LoadBlockIndexGuts())
         return false;
 
@@ -3162,27 +4643,47 @@ bool static LoadBlockIndexDB()
         vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
     }
     sort(vSortedByHeight.begin(), vSortedByHeight.end());
+    vector<CBlockIndex *> vUpgrade;
     BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
     {
         CBlockIndex* pindex = item.second;
-        pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
+        /* Chain trust and stake modifier checksums are stored with the index;
+         * calculate them for the entries written by older versions */
+        if(!(pindex->nStatus & BLOCK_HAVE_TRUST)) {
+            pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
+            pindex->nStakeModifierChecksum = GetStakeModifierChecksum(pindex);
+            vUpgrade.push_back(pindex);
+        }
         pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
         if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS && !(pindex->nStatus & BLOCK_FAILED_MASK))
             setBlockIndexValid.insert(pindex);
 
-        // Calculate stake modifier checksum
-        pindex->nStakeModifierChecksum = GetStakeModifierChecksum(pindex);
         if(!CheckStakeModifierCheckpoints(pindex->nHeight, pindex->nStakeModifierChecksum))
           return(error("LoadBlockIndexDB() : failed stake modifier checkpoint height=%d, " \
             "modifier=0x%016" PRI64x, pindex->nHeight, pindex->nStakeModifier));
     }
 
+    /* Store the calculated values to load faster next time */
+    if(!vUpgrade.empty()) {
+        printf("LoadBlockIndexDB(): storing chain trust of %" PRIszu " block index entries\n", vUpgrade.size());
+        if(!pblocktree->WriteBlockIndex(vUpgrade))
+          return(error("LoadBlockIndexDB() : failed to store the chain trust"));
+    }
+
     // Load block file info
     pblocktree->ReadLastBlockFile(nLastBlockFile);
     printf("LoadBlockIndexDB(): last block file = %i\n", nLastBlockFile);
     if (pblocktree->ReadBlockFileInfo(nLastBlockFile, infoLastBlockFile))
         printf("LoadBlockIndexDB(): last block file: %s\n", infoLastBlockFile.ToString().c_str());
 
+    /* The transaction index is a property of the block tree */
+    fTxIndex = false;
+    pblocktree->ReadFlag("txindex", fTxIndex);
+    printf("LoadBlockIndexDB(): transaction index %s\n", fTxIndex ? "enabled" : "disabled");
+    fAddressIndex = false;
+    pblocktree->ReadFlag("addressindex", fAddressIndex);
+    printf("LoadBlockIndexDB(): address index %s\n", fAddressIndex ? "enabled" : "disabled");
+
     // Load hashBestChain pointer to end of best chain
     pindexBest = pcoinsTip->GetBestBlock();
     if (pindexBest == NULL)
@@ -3229,6 +4730,15 @@ bool static LoadBlockIndexDB()
     {
         if (fRequestShutdown || pindex->nHeight < nBestHeight-nCheckDepth)
             break;
+        /* The stored chain trust and stake modifier checksum must match */
+        uint256 nChainTrust = pindex->pprev->nChainTrust + pindex->GetBlockTrust();
+        if ((pindex->nChainTrust != nChainTrust) ||
+          (pindex->nStakeModifierChecksum != GetStakeModifierChecksum(pindex)))
+            return error("LoadBlockIndexDB() : *** inconsistent chain trust or stake modifier checksum at %d, hash=%s",
+              pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
+        /* Nothing to verify past the pruned blocks */
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+            break;
         CBlock block;
         if (!block.ReadFromDisk(pindex))
             return error("LoadBlockIndexDB() : block.ReadFromDisk failed");
@@ -3355,12 +4865,18 @@ bool LoadBlockIndex(bool fAllowNew) {
         if(!fTestNet) assert(block.GetHash() == hashGenesisBlock);
         else assert(block.GetHash() == hashGenesisBlockTestNet);
 
+        /* A new block tree gets the transaction and address indices as requested */
+        fTxIndex = GetBoolArg("-txindex", false);
+        fAddressIndex = GetBoolArg("-addressindex", false);
+        if(!pblocktree->WriteFlag("txindex", fTxIndex) || !pblocktree->WriteFlag("addressindex", fAddressIndex))
+          return(error("LoadBlockIndex() : failed to write the index flags"));
+
         // Start new block file
-        unsigned int nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+        CBlockRecord record(block);
         CDiskBlockPos blockPos;
-        if (!FindBlockPos(blockPos, nBlockSize+8, 0, block.nTime))
+        if (!FindBlockPos(blockPos, record.GetDiskSize(), 0, block.nTime))
             return error("AcceptBlock() : FindBlockPos failed");
-        if (!block.WriteToDisk(blockPos))
+        if (!WriteBlockRecord(blockPos, false, record))
             return error("LoadBlockIndex() : writing genesis block to disk failed");
         if (!block.AddToBlockIndex(blockPos))
             return error("LoadBlockIndex() : genesis block not accepted");
@@ -3392,7 +4908,7 @@ void PrintBlockTree()
 {
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -3459,14 +4975,14 @@ void PrintBlockTree()
 bool ReadBlockFromDisk(CBlock &block, const CDiskBlockPos &pos) {
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if(filein.IsNull())
-      return(error("ReadBlockFromDisk() : OpenBlockFile() failed for %s", pos.ToString().c_str()));
+    CBlockFileView view;
+    if(!GetBlockFileView(pos, false, view))
+      return(error("ReadBlockFromDisk() : GetBlockFileView() failed for %s", pos.ToString().c_str()));
 
     // Read block
     try {
-        filein >> block;
+        CMemoryReader reader(view.pbegin, view.pend, SER_DISK, CLIENT_VERSION);
+        reader >> block;
     } catch(const std::exception& e) {
         return(error("ReadBlockFromDisk(): deserialise or I/O error at %s", pos.ToString().c_str()));
     }
@@ -3474,25 +4990,185 @@ bool ReadBlockFromDisk(CBlock &block, const CDiskBlockPos &pos) {
     return(true);
 }
 
-bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp) {
-    int64 nStart = GetTimeMillis();
+/* The block import used by -reindex, -loadblock and bootstrap.dat is a pipeline:
+ * a reader thread locates the blocks in the file and passes their raw data on,
+ * a pool of check threads deserialises them and runs the context free checks,
+ * the calling thread connects them in the order they appear in the file */
+
+/* Limits on the blocks held between the reader and the connect stage */
+static const uint MAX_IMPORT_BLOCKS = 1024;
+static const uint MAX_IMPORT_BYTES  = 64 * 1024 * 1024;
+
+enum {
+    IMPORT_PENDING = 0,
+    IMPORT_VALID,
+    IMPORT_BAD_DATA,
+    IMPORT_BAD_BLOCK
+};
+
+class CImportBlock {
+public:
+    uint64 nSeq;
+    CDiskBlockPos pos;
+    std::vector<char> vData;
+    bool fCompressed;
+    CBlock block;
+    int nState;
+
+    CImportBlock() : nSeq(0), fCompressed(false), nState(IMPORT_PENDING) { }
+};
+
+class CBlockImporter {
+private:
+    boost::mutex mutex;
+    boost::condition_variable condReader;
+    boost::condition_variable condCheck;
+    boost::condition_variable condConnect;
+    std::deque<CImportBlock *> queueCheck;
+    std::map<uint64, CImportBlock *> mapChecked;
+    uint64 nSeqRead;
+    uint64 nSeqConnect;
+    uint64 nBytesQueued;
+    bool fReadDone;
+    bool fAbort;
+
+public:
+    /* Statistics */
+    uint64 nBytesRead;
+    int64 nReaderWait;
+    int64 nConnectWait;
+
+    CBlockImporter() : nSeqRead(0), nSeqConnect(0), nBytesQueued(0), fReadDone(false),
+      fAbort(false), nBytesRead(0), nReaderWait(0), nConnectWait(0) { }
+
+    ~CBlockImporter() {
+        BOOST_FOREACH(CImportBlock *pitem, queueCheck)
+          delete(pitem);
+        for(std::map<uint64, CImportBlock *>::iterator it = mapChecked.begin(); it != mapChecked.end(); it++)
+          delete(it->second);
+    }
+
+    /* Reader: queues a block for the checks, waits while the pipeline is full;
+     * returns false if the import has been aborted */
+    bool Push(CImportBlock *pitem) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        int64 nStart = GetTimeMillis();
+        while(!fAbort && (nSeqRead != nSeqConnect) && (((nSeqRead - nSeqConnect) >= MAX_IMPORT_BLOCKS) ||
+          ((nBytesQueued + pitem->vData.size()) > MAX_IMPORT_BYTES)))
+          condReader.wait(lock);
+        nReaderWait += GetTimeMillis() - nStart;
+        if(fAbort) {
+            delete(pitem);
+            return(false);
+        }
+        pitem->nSeq = nSeqRead++;
+        nBytesQueued += pitem->vData.size();
+        nBytesRead += pitem->vData.size();
+        queueCheck.push_back(pitem);
+        condCheck.notify_one();
+        return(true);
+    }
+
+    /* Reader: no more blocks to come */
+    void ReadDone() {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fReadDone = true;
+        condCheck.notify_all();
+        condConnect.notify_all();
+    }
+
+    /* Check threads: the next block to check or NULL when finished */
+    CImportBlock *PopCheck() {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while(!fAbort && !fReadDone && queueCheck.empty())
+          condCheck.wait(lock);
+        if(fAbort || queueCheck.empty())
+          return(NULL);
+        CImportBlock *pitem = queueCheck.front();
+        queueCheck.pop_front();
+        return(pitem);
+    }
+
+    /* Check threads: the block is ready to connect */
+    void Checked(CImportBlock *pitem) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        mapChecked.insert(std::make_pair(pitem->nSeq, pitem));
+        if(pitem->nSeq == nSeqConnect)
+          condConnect.notify_one();
+    }
+
+    /* Connect stage: the next block in the file order or NULL when finished;
+     * the caller takes over the block */
+    CImportBlock *PopChecked() {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        std::map<uint64, CImportBlock *>::iterator it = mapChecked.end();
+        int64 nStart = GetTimeMillis();
+        while(!fAbort && ((it = mapChecked.find(nSeqConnect)) == mapChecked.end()) &&
+          !(fReadDone && (nSeqConnect == nSeqRead)))
+          condConnect.wait(lock);
+        nConnectWait += GetTimeMillis() - nStart;
+        if(fAbort || (it == mapChecked.end()))
+          return(NULL);
+        CImportBlock *pitem = it->second;
+        mapChecked.erase(it);
+        nSeqConnect++;
+        nBytesQueued -= pitem->vData.size();
+        condReader.notify_one();
+        return(pitem);
+    }
+
+    /* Stops all stages */
+    void Abort() {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fAbort = true;
+        condReader.notify_all();
+        condCheck.notify_all();
+        condConnect.notify_all();
+    }
+
+    void GetQueueSizes(uint &nCheck, uint &nConnect) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nCheck = queueCheck.size();
+        nConnect = mapChecked.size();
+    }
+};
+
+bool ParseBlockRecordSize(uint nSizeWord, uint &nSize, bool &fCompressed) {
+
+    fCompressed = (nSizeWord & BLOCK_RECORD_COMPRESSED) != 0;
+    nSize = nSizeWord & ~BLOCK_RECORD_COMPRESSED;
+
+    /* A block header or a size prefix with some payload */
+    return((nSize >= (fCompressed ? 5 : 80)) && (nSize <= MAX_BLOCK_SIZE));
+}
 
-    // Map of disk positions for blocks with unknown parent (only used for reindex)
-    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
+void DecodeBlockRecord(std::vector<char> &vData, bool fCompressed, CBlock &block) {
+
+    if(fCompressed) {
+        std::vector<char> vInflated;
+        if(!InflateBlockRecord(&vData[0], &vData[0] + vData.size(), vInflated))
+          throw(std::runtime_error("corrupt compressed block"));
+        vData.swap(vInflated);
+    }
+    CDataStream ssBlock(vData, SER_DISK, CLIENT_VERSION);
+    ssBlock >> block;
+}
+
+/* Locates the blocks in the file and passes them to the check threads */
+static void ThreadImportReader(CBlockImporter *pimport, CBufferedFile *pblkdat, const CDiskBlockPos *dbp) {
+    CBufferedFile &blkdat = *pblkdat;
+
+    RenameThread("orb-importread");
 
-    uint nLoaded = 0;
     try {
-        // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
-        CBufferedFile blkdat(fileIn, 2 * MAX_BLOCK_SIZE, MAX_BLOCK_SIZE + 8,
-          SER_DISK, CLIENT_VERSION);
         uint64 nRewind = blkdat.GetPos();
 
         while(!blkdat.eof()) {
-            boost::this_thread::interruption_point();
             blkdat.SetPos(nRewind);
             nRewind++; // start one byte further next time, in case of failure
             blkdat.SetLimit(); // remove former limit
             uint nSize = 0;
+            bool fCompressed = false;
             try {
                 // locate a header
                 uchar buf[4];
@@ -3503,90 +5179,216 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp) {
                   continue;
                 // read size
                 blkdat >> nSize;
-                if((nSize < 80) || (nSize > MAX_BLOCK_SIZE))
+                if(!ParseBlockRecordSize(nSize, nSize, fCompressed))
                   continue;
             } catch(const std::exception &) {
                 // no valid block header found; don't complain
                 break;
             }
+
+            /* Read the raw block data in parts as the buffer
+             * cannot hold a block of the maximum size with rewind */
+            CImportBlock *pitem = new CImportBlock();
             try {
-                // read block
                 uint64 nBlockPos = blkdat.GetPos();
-                if(dbp)
-                  dbp->nPos = nBlockPos;
+                if(dbp) pitem->pos = CDiskBlockPos(dbp->nFile, nBlockPos);
+                pitem->fCompressed = fCompressed;
                 blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                CBlock block;
-                blkdat >> block;
+                pitem->vData.resize(nSize);
+                uint nRead, nPart;
+                for(nRead = 0; nRead < nSize; nRead += nPart) {
+                    nPart = std::min(nSize - nRead, (uint)65536);
+                    blkdat.read(&pitem->vData[nRead], nPart);
+                }
                 nRewind = blkdat.GetPos();
+            } catch(const std::exception &) {
+                printf("LoadExternalBlockFile() : I/O error caught while reading blocks\n");
+                delete(pitem);
+                continue;
+            }
+            if(!pimport->Push(pitem))
+              break;
+        }
+    } catch(std::exception &e) {
+        PrintExceptionContinue(&e, "ThreadImportReader()");
+    } catch(...) {
+        PrintExceptionContinue(NULL, "ThreadImportReader()");
+    }
 
-                uint256 hash = block.GetHash();
-
-                /* Genesis block requires special processing */
-                if(hash == (fTestNet ? hashGenesisBlockTestNet : hashGenesisBlock)) {
-                    if(!fReindex) continue; /* already in the index if bootstrapping */
-                    block.BuildMerkleTree();
-                    block.print();
-                    uint nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
-                    CDiskBlockPos blockPos;
-                    if(dbp != NULL) blockPos = *dbp;
-                    else break;
-                    if(!FindBlockPos(blockPos, nBlockSize + 8, 0, block.nTime, 1)) {
-                        printf("FindBlockPos() failed on the genesis block\n");
-                        break;
-                    }
-                    if(!block.AddToBlockIndex(blockPos)) {
-                        printf("AddToBlockIndex() failed on the genesis block\n");
-                        break;
-                    }
-                    Checkpoints::WriteSyncCheckpoint(fTestNet ? hashGenesisBlockTestNet : hashGenesisBlock);
-                    nLoaded = 1;
-                    continue;
-                }
+    pimport->ReadDone();
+}
 
-                // detect out of order blocks, and store them for later
-                if(mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
-                    printf("LoadExternalBlockFile() : out of order block %s, parent %s not known\n",
-                      hash.ToString().c_str(), block.hashPrevBlock.ToString().c_str());
-                    if(dbp)
-                      mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
-                    continue;
-                }
+/* Deserialises the blocks and runs the checks which need no chain context */
+static void ThreadImportCheck(CBlockImporter *pimport) {
+    CImportBlock *pitem;
 
-                // process in case the block isn't known yet
-                if((mapBlockIndex.count(hash) == 0) ||
-                  ((mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0)) {
-                    if(ProcessBlock(NULL, &block, dbp))
-                      nLoaded++;
-                    else
-                      break;
+    RenameThread("orb-importcheck");
+
+    while((pitem = pimport->PopCheck())) {
+        try {
+            DecodeBlockRecord(pitem->vData, pitem->fCompressed, pitem->block);
+            /* Cache the block hash for the connect stage */
+            pitem->block.GetHash();
+            pitem->nState = pitem->block.CheckBlock() ? IMPORT_VALID : IMPORT_BAD_BLOCK;
+        } catch(std::exception &e) {
+            pitem->nState = IMPORT_BAD_DATA;
+        }
+        pimport->Checked(pitem);
+    }
+}
+
+/* Map of disk positions for blocks with unknown parent (only used for reindex) */
+static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
+
+/* Connects a block of the import pipeline; returns false to stop the import */
+static bool ImportBlock(CImportBlock &item, bool fPos, uint &nLoaded) {
+    CBlock &block = item.block;
+    CDiskBlockPos *dbp = fPos ? &item.pos : NULL;
+
+    if(item.nState == IMPORT_BAD_DATA) {
+        printf("LoadExternalBlockFile() : deserialise error caught while loading blocks\n");
+        return(true);
+    }
+
+    uint256 hash = block.GetHash();
+
+    /* Genesis block requires special processing */
+    if(hash == (fTestNet ? hashGenesisBlockTestNet : hashGenesisBlock)) {
+        if(!fReindex) return(true); /* already in the index if bootstrapping */
+        block.BuildMerkleTree();
+        block.print();
+        CDiskBlockPos blockPos;
+        if(dbp != NULL) blockPos = *dbp;
+        else return(false);
+        uint nRecordSize = GetBlockRecordSize(blockPos, false);
+        if(!nRecordSize || !FindBlockPos(blockPos, nRecordSize, 0, block.nTime, 1)) {
+            printf("FindBlockPos() failed on the genesis block\n");
+            return(false);
+        }
+        if(!block.AddToBlockIndex(blockPos)) {
+            printf("AddToBlockIndex() failed on the genesis block\n");
+            return(false);
+        }
+        Checkpoints::WriteSyncCheckpoint(fTestNet ? hashGenesisBlockTestNet : hashGenesisBlock);
+        nLoaded = 1;
+        return(true);
+    }
+
+    // detect out of order blocks, and store them for later
+    if(mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
+        printf("LoadExternalBlockFile() : out of order block %s, parent %s not known\n",
+          hash.ToString().c_str(), block.hashPrevBlock.ToString().c_str());
+        if(dbp)
+          mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
+        return(true);
+    }
+
+    // process in case the block isn't known yet
+    if((mapBlockIndex.count(hash) == 0) ||
+      ((mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0)) {
+        if(item.nState != IMPORT_VALID) {
+            printf("LoadExternalBlockFile() : block %s CheckBlock() FAILED\n", hash.ToString().c_str());
+            return(false);
+        }
+        if(ProcessBlock(NULL, &block, dbp, true))
+          nLoaded++;
+        else
+          return(false);
+    }
+
+    // Recursively process earlier encountered successors of this block
+    deque<uint256> queue;
+    queue.push_back(hash);
+    while(!queue.empty()) {
+        uint256 head = queue.front();
+        queue.pop_front();
+        std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
+        while(range.first != range.second) {
+            std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
+            CBlock blockChild;
+            if(ReadBlockFromDisk(blockChild, it->second)) {
+                printf("LoadExternalBlockFile() : processing out of order child %s of %s\n",
+                  blockChild.GetHash().ToString().c_str(), head.ToString().c_str());
+                if(ProcessBlock(NULL, &blockChild, &it->second)) {
+                    nLoaded++;
+                    queue.push_back(blockChild.GetHash());
                 }
+            }
+            range.first++;
+            mapBlocksUnknownParent.erase(it);
+        }
+    }
 
-                // Recursively process earlier encountered successors of this block
-                deque<uint256> queue;
-                queue.push_back(hash);
-                while(!queue.empty()) {
-                    uint256 head = queue.front();
-                    queue.pop_front();
-                    std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
-                    while(range.first != range.second) {
-                        std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
-                        if(ReadBlockFromDisk(block, it->second)) {
-                            printf("LoadExternalBlockFile() : processing out of order child %s of %s\n",
-                              block.GetHash().ToString().c_str(), head.ToString().c_str());
-                            if(ProcessBlock(NULL, &block, &it->second)) {
-                                nLoaded++;
-                                queue.push_back(block.GetHash());
-                            }
-                        }
-                        range.first++;
-                        mapBlocksUnknownParent.erase(it);
-                    }
+    return(true);
+}
+
+bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp) {
+    int64 nStart = GetTimeMillis(), nLastProgress = nStart;
+    uint nLoaded = 0, nBlocks = 0, nThreads = 0, nCheck, nConnect, i;
+
+    try {
+        // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
+        CBufferedFile blkdat(fileIn, 2 * MAX_BLOCK_SIZE, MAX_BLOCK_SIZE + 8,
+          SER_DISK, CLIENT_VERSION);
+        CBlockImporter import;
+        boost::thread_group importThreads;
+
+        /* One core is left to the reader and the connect stage */
+        uint nMaxThreads = std::max(GetNumCores() - 1, 1);
+        try {
+            for(i = 0; i < nMaxThreads; i++) {
+                importThreads.create_thread(boost::bind(&ThreadImportCheck, &import));
+                nThreads++;
+            }
+        } catch(boost::thread_resource_error &e) {
+            printf("LoadExternalBlockFile() : %u of %u check threads started\n", nThreads, nMaxThreads);
+        }
+        try {
+            if(!nThreads) throw(boost::thread_resource_error());
+            importThreads.create_thread(boost::bind(&ThreadImportReader, &import, &blkdat, dbp));
+        } catch(boost::thread_resource_error &e) {
+            printf("LoadExternalBlockFile() : failed to start the import threads\n");
+            import.Abort();
+            importThreads.join_all();
+            return(false);
+        }
+
+        CImportBlock *pitem;
+        while((pitem = import.PopChecked())) {
+            bool fContinue = !fShutdown;
+            if(fContinue) {
+                try {
+                    boost::this_thread::interruption_point();
+                    fContinue = ImportBlock(*pitem, dbp != NULL, nLoaded);
+                } catch(boost::thread_interrupted &) {
+                    import.Abort();
+                    importThreads.join_all();
+                    delete(pitem);
+                    throw;
+                } catch(std::exception &e) {
+                    printf("LoadExternalBlockFile() : deserialise or I/O error caught while loading blocks\n");
                 }
-            } catch(std::exception &e) {
-                printf("LoadExternalBlockFile() : deserialise or I/O error caught while loading blocks\n");
+            }
+            delete(pitem);
+            if(!fContinue) break;
+            nBlocks++;
+
+            if((GetTimeMillis() - nLastProgress) >= 10000) {
+                nLastProgress = GetTimeMillis();
+                import.GetQueueSizes(nCheck, nConnect);
+                printf("LoadExternalBlockFile() : %u blocks imported, %u loaded, %u queued for checks, " \
+                  "%u queued for connection, %.2f MiB/s\n", nBlocks, nLoaded, nCheck, nConnect,
+                  (double)import.nBytesRead / 1048576.0 / ((nLastProgress - nStart) / 1000.0));
             }
         }
+
+        /* Stops the reader and the check threads on early exit */
+        import.Abort();
+        importThreads.join_all();
+
+        printf("LoadExternalBlockFile() : %u check threads, %.2f MiB read, " \
+          "reader waited %" PRI64d "ms, connect stage waited %" PRI64d "ms\n",
+          nThreads, (double)import.nBytesRead / 1048576.0, import.nReaderWait, import.nConnectWait);
     } catch(std::runtime_error &e) {
         printf("LoadExternalBlockFile() : system error caught while loading blocks\n");
         return(false);
@@ -3998,12 +5800,17 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             if (inv.type == MSG_BLOCK)
             {
                 // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
                 {
+                    /* Pruned blocks aren't served */
                     CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    pfrom->PushMessage("block", block);
+                    if(!(mi->second->nStatus & BLOCK_HAVE_DATA)) {
+                        printf("getdata for pruned block %s from peer %s ignored\n",
+                          inv.hash.ToString().substr(0,20).c_str(), pfrom->addr.ToString().c_str());
+                    } else if(block.ReadFromDisk((*mi).second)) {
+                        pfrom->PushMessage("block", block);
+                    }
                 }
             }
             else if (inv.IsKnownType())
@@ -4012,21 +5819,16 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CTransactionRef>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushMessage(inv.GetCommand(), *(*mi).second);
                         pushed = true;
                     }
                 }
                 if (!pushed && inv.type == MSG_TX) {
                     LOCK(mempool.cs);
-                    if (mempool.exists(inv.hash)) {
-                        CTransaction tx = mempool.lookup(inv.hash);
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << tx;
-                        pfrom->PushMessage("tx", ss);
-                    }
+                    if (mempool.exists(inv.hash))
+                        pfrom->PushMessage("tx", mempool.lookup(inv.hash));
                 }
             }
 
@@ -4079,6 +5881,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 break;
             }
 
+            /* No inventory the peer would never get */
+            if(!(pindex->nStatus & BLOCK_HAVE_DATA)) {
+                printf("getblocks stopping at pruned block height %d for peer %s\n",
+                  pindex->nHeight, pfrom->addr.ToString().c_str());
+                break;
+            }
+
             pfrom->PushInventory(CInv(MSG_BLOCK, pindex->GetBlockHash()));
 
             if(pindex->pnext) pindex = pindex->pnext;
@@ -4136,7 +5945,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -4166,18 +5975,20 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     {
         vector<uint256> vWorkQueue;
         vector<uint256> vEraseQueue;
-        CDataStream vMsg(vRecv);
-        CTransaction tx;
-        vRecv >> tx;
+        // Read once and shared by the memory pool, the orphan pool and relay
+        CTransaction* ptxNew = new CTransaction();
+        CTransactionRef ptx(ptxNew);
+        vRecv >> *ptxNew;
+        const CTransaction& tx = *ptx;
 
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
         bool fMissingInputs = false;
-        if (tx.AcceptToMemoryPool(true, &fMissingInputs))
+        if (mempool.accept(ptx, true, &fMissingInputs))
         {
             SyncWithWallets(inv.hash, tx, NULL, true);
-            RelayTransaction(tx, inv.hash);
+            RelayTransaction(ptx, inv.hash);
             mapAlreadyAskedFor.erase(inv);
             vWorkQueue.push_back(inv.hash);
             vEraseQueue.push_back(inv.hash);
@@ -4191,14 +6002,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                      ++mi)
                 {
                     const uint256& orphanTxHash = *mi;
-                    CTransaction& orphanTx = mapOrphanTransactions[orphanTxHash];
+                    CTransactionRef ptxOrphan = mapOrphanTransactions[orphanTxHash];
                     bool fMissingInputs2 = false;
 
-                    if (orphanTx.AcceptToMemoryPool(true, &fMissingInputs2))
+                    if (mempool.accept(ptxOrphan, true, &fMissingInputs2))
                     {
                         printf("   accepted orphan tx %s\n", orphanTxHash.ToString().substr(0,10).c_str());
                         SyncWithWallets(inv.hash, tx, NULL, true);
-                        RelayTransaction(orphanTx, orphanTxHash);
+                        RelayTransaction(ptxOrphan, orphanTxHash);
                         mapAlreadyAskedFor.erase(CInv(MSG_TX, orphanTxHash));
                         vWorkQueue.push_back(orphanTxHash);
                         vEraseQueue.push_back(orphanTxHash);
@@ -4217,7 +6028,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         }
         else if (fMissingInputs)
         {
-            AddOrphanTx(tx);
+            AddOrphanTx(ptx);
 
             // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
             unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
@@ -10,11 +10,15 @@
 #include "sync.h"
 #include "net.h"
 #include "script.h"
+#include "muhash.h"
 
 #include "neoscrypt.h"
 
 #include <list>
 
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+
 class CWallet;
 class CBlock;
 class CBlockIndex;
@@ -46,7 +50,21 @@ static const unsigned int MAX_TX_COMMENT_LEN = 140;
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
+/* Pruning never goes below two full block files, in MiB */
+static const uint64 MIN_PRUNE_TARGET = 2 * MAX_BLOCKFILE_SIZE / 1024 / 1024;
+/* Blocks this deep or less are never pruned to allow reorganisations */
+static const int MIN_BLOCKS_TO_KEEP = 2880;
+/* Default seconds between commits of the chain state during the initial block download */
+static const int64 DEFAULT_COMMIT_INTERVAL = 30;
 static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
+/* Default memory limit of the transaction pool in megabytes */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 100;
+/* Default limits of unconfirmed transaction chains in the pool,
+ * in transactions and kilobytes of a package */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
 
 static const uint BLOCK_LIMITER_TIME_OLD = 90;
 static const uint BLOCK_LIMITER_TIME_NEW = 240;
@@ -100,7 +118,19 @@ inline int64 FutureDrift(int64 nTime) { return nTime + 15 * 60; } // max. 15 min
 
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+/* Block hashes are distributed uniformly, so their lower 64 bits
+ * make a good hash table key */
+struct BlockHasher {
+    size_t operator()(const uint256 &hash) const { return((size_t)hash.Get64()); }
+};
+typedef boost::unordered_map<uint256, CBlockIndex *, BlockHasher> BlockMap;
+extern BlockMap mapBlockIndex;
+extern bool fTxIndex;
+extern bool fAddressIndex;
+extern bool fPruneMode;
+extern uint64 nPruneTarget;
+extern bool fCompressBlocks;
+extern int64 nCommitInterval;
 extern std::set<CBlockIndex*, CBlockIndexTrustComparator> setBlockIndexValid;
 extern std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
 extern CBlockIndex* pindexGenesisBlock;
@@ -149,13 +179,14 @@ void InitTestnet();
 void RegisterWallet(CWallet* pwalletIn);
 void UnregisterWallet(CWallet* pwalletIn);
 void SyncWithWallets(const uint256 &hash, const CTransaction& tx, const CBlock* pblock = NULL, bool fUpdate = false, bool fConnect = true);
-bool ProcessBlock(CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp = NULL);
+bool ProcessBlock(CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp = NULL, bool fChecked = false);
 bool CheckDiskSpace(uint64 nAdditionalBytes=0);
 FILE* OpenBlockFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
+bool HaveBlockData(const CBlockIndex *pindexStart);
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp = NULL);
@@ -170,14 +201,20 @@ int GetNumBlocksOfPeers();
 bool IsInitialBlockDownload();
 std::string GetWarnings(std::string strFor);
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock, bool fAllowSlow);
+/* Reads a confirmed transaction and the header of its block using the transaction index */
+bool ReadIndexedTransaction(const uint256 &hash, CTransaction &tx, CBlock &header, uint &nTxOffset);
 bool SetBestChain(CBlockIndex* pindexNew);
 bool ConnectBestBlock();
+bool WaitForBestChain(const uint256 &hashWatched, int nTimeoutMillis);
 CBlockIndex * InsertBlockIndex(uint256 hash);
 uint256 WantedByOrphan(const CBlock* pblockOrphan);
 const CBlockIndex *GetPrevBlockIndex(const CBlockIndex *pindex, uint nRange, bool fProofOfStake);
 void StakeMiner0(CWallet *pwallet);
 void StakeMiner1(CWallet *pwallet);
 void ResendWalletTransactions(bool fForce=false);
+void DumpMemPool();
+void ThreadMemPool(void *parg);
+void ThreadBlockFileCompressor(void *parg);
 
 bool GetWalletFile(CWallet* pwallet, std::string &strWalletFileOut);
 
@@ -215,16 +252,232 @@ struct CDiskBlockPos {
     }
 };
 
+class CMappedBlockFile;
+
+/* A block or undo record read from its file, usually a view into
+ * a cached memory mapping which is kept alive while referenced */
+class CBlockFileView {
+public:
+    const char *pbegin;
+    const char *pend;
+    boost::shared_ptr<CMappedBlockFile> pmap;
+    /* Copy of the record if not mapped */
+    std::vector<char> vData;
+
+    CBlockFileView() : pbegin(NULL), pend(NULL) { }
+};
+
+/* Locates the record at the position in a block (blk) or undo (rev) file */
+bool GetBlockFileView(const CDiskBlockPos &pos, bool fUndo, CBlockFileView &view);
+/* Drops the cached mappings of a block and undo file pair */
+void UnmapBlockFile(int nFile);
+
+/* The high bit of the record size marks a payload compressed with zlib
+ * and prefixed with its uncompressed size; such records may follow
+ * the plain ones in any file and are read back transparently */
+static const uint BLOCK_RECORD_COMPRESSED = 0x80000000;
+
+/* A block or undo record prepared for writing */
+class CBlockRecord {
+public:
+    std::vector<char> vData;
+    bool fCompressed;
+
+    CBlockRecord() : fCompressed(false) { }
+
+    /* Compressed with -compressblocks unless it doesn't shrink */
+    template<typename T> explicit CBlockRecord(const T &obj) : fCompressed(false) {
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss << obj;
+        Set(&ss[0], &ss[0] + ss.size(), fCompressBlocks);
+    }
+
+    void Set(const char *pbegin, const char *pend, bool fCompress);
+
+    uint GetSizeWord() const { return((uint)vData.size() | (fCompressed ? BLOCK_RECORD_COMPRESSED : 0)); }
+    /* Including the magic and size */
+    uint GetDiskSize() const { return((uint)vData.size() + 8); }
+};
+
+/* Block and undo data appended to a file is durable after the next commit */
+void MarkBlockFileDirty(int nFile, bool fUndo);
+/* Commits the block and undo data, the block index and the coins in order,
+ * at intervals during the initial block download unless forced */
+bool CommitChainState(bool fForce);
+
+/* Appends the record at the position located for it and sets the position of its payload */
+bool WriteBlockRecord(CDiskBlockPos &pos, bool fUndo, const CBlockRecord &record);
+/* Size of the record on disk including the magic and size, zero if there is none */
+uint GetBlockRecordSize(const CDiskBlockPos &pos, bool fUndo);
+/* Splits the size word of a record found while importing a block file;
+ * returns false if the size is out of range for a block */
+bool ParseBlockRecordSize(uint nSizeWord, uint &nSize, bool &fCompressed);
+/* Deserialises a block record payload read while importing, inflating it
+ * first if compressed; throws on corrupt data */
+void DecodeBlockRecord(std::vector<char> &vData, bool fCompressed, CBlock &block);
+/* Rewrites a completed block file and its undo file with compressed records */
+bool CompressBlockFile(int nFile);
+
+/* Position of a transaction within a block on disk */
+struct CDiskTxPos : public CDiskBlockPos {
+    /* From the beginning of the block */
+    uint nTxOffset;
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(*(CDiskBlockPos *)this);
+        READWRITE(VARINT(nTxOffset));
+    )
+
+    CDiskTxPos() {
+        SetNull();
+    }
+
+    CDiskTxPos(const CDiskBlockPos &blockIn, uint nTxOffsetIn) : CDiskBlockPos(blockIn.nFile, blockIn.nPos) {
+        nTxOffset = nTxOffsetIn;
+    }
+
+    void SetNull() {
+        CDiskBlockPos::SetNull();
+        nTxOffset = 0;
+    }
+};
+
+/* Funding or spending of a script by a transaction in the address index;
+ * the height is stored big endian to keep the history of a script in order */
+struct CAddressIndexKey {
+    uint160 hashScript;
+    int nHeight;
+    uint256 txid;
+    /* Output or input number */
+    uint nIndex;
+    bool fSpending;
+
+    CAddressIndexKey() {
+        SetNull();
+    }
+
+    CAddressIndexKey(const uint160 &hashScriptIn, int nHeightIn, const uint256 &txidIn,
+      uint nIndexIn, bool fSpendingIn) {
+        hashScript = hashScriptIn;
+        nHeight = nHeightIn;
+        txid = txidIn;
+        nIndex = nIndexIn;
+        fSpending = fSpendingIn;
+    }
+
+    void SetNull() {
+        hashScript = 0;
+        nHeight = 0;
+        txid = 0;
+        nIndex = 0;
+        fSpending = false;
+    }
+
+    uint GetSerializeSize(int nType, int nVersion) const {
+        return(20 + 4 + 32 + 4 + 1);
+    }
+
+    template<typename Stream> void Serialize(Stream &s, int nType, int nVersion) const {
+        uchar pchHeight[4] = { (uchar)(nHeight >> 24), (uchar)(nHeight >> 16),
+          (uchar)(nHeight >> 8), (uchar)nHeight };
+        s << hashScript;
+        s.write((const char *) pchHeight, 4);
+        s << txid << nIndex << fSpending;
+    }
+
+    template<typename Stream> void Unserialize(Stream &s, int nType, int nVersion) {
+        uchar pchHeight[4];
+        s >> hashScript;
+        s.read((char *) pchHeight, 4);
+        nHeight = (pchHeight[0] << 24) | (pchHeight[1] << 16) | (pchHeight[2] << 8) | pchHeight[3];
+        s >> txid >> nIndex >> fSpending;
+    }
+};
+
+/* Unspent output of a script in the address index */
+struct CAddressUnspentKey {
+    uint160 hashScript;
+    uint256 txid;
+    uint nIndex;
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(hashScript);
+        READWRITE(txid);
+        READWRITE(nIndex);
+    )
+
+    CAddressUnspentKey() {
+        hashScript = 0;
+        txid = 0;
+        nIndex = 0;
+    }
+
+    CAddressUnspentKey(const uint160 &hashScriptIn, const uint256 &txidIn, uint nIndexIn) {
+        hashScript = hashScriptIn;
+        txid = txidIn;
+        nIndex = nIndexIn;
+    }
+};
+
+/* A null value erases the unspent output from the index */
+struct CAddressUnspentValue {
+    int64 nValue;
+    CScript scriptPubKey;
+    int nHeight;
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(nValue);
+        READWRITE(scriptPubKey);
+        READWRITE(nHeight);
+    )
+
+    CAddressUnspentValue() {
+        SetNull();
+    }
+
+    CAddressUnspentValue(int64 nValueIn, const CScript &scriptPubKeyIn, int nHeightIn) {
+        nValue = nValueIn;
+        scriptPubKey = scriptPubKeyIn;
+        nHeight = nHeightIn;
+    }
+
+    void SetNull() {
+        nValue = -1;
+        scriptPubKey.clear();
+        nHeight = 0;
+    }
+
+    bool IsNull() const { return(nValue == -1); }
+};
+
+/* Scripts are indexed by the key or script hash of their address, so pay-to-pubkey
+ * outputs of coin bases and coin stakes are found along with pay-to-pubkey-hash ones */
+inline uint160 GetAddressIndexHash(const CTxDestination &dest) {
+    if(const CKeyID *pkeyID = boost::get<CKeyID>(&dest))
+      return(*pkeyID);
+    if(const CScriptID *pscriptID = boost::get<CScriptID>(&dest))
+      return(*pscriptID);
+    return(0);
+}
+
+/* Scripts of no address are indexed by their own hash */
+inline uint160 GetAddressIndexHash(const CScript &script) {
+    CTxDestination dest;
+    if(ExtractDestination(script, dest))
+      return(GetAddressIndexHash(dest));
+    return(Hash160(script.begin(), script.end()));
+}
+
 
 /** An inpoint - a combination of a transaction and an index n into its vin */
 class CInPoint
 {
 public:
-    CTransaction* ptx;
+    const CTransaction* ptx;
     unsigned int n;
 
     CInPoint() { SetNull(); }
-    CInPoint(CTransaction* ptxIn, unsigned int nIn) { ptx = ptxIn; n = nIn; }
+    CInPoint(const CTransaction* ptxIn, unsigned int nIn) { ptx = ptxIn; n = nIn; }
     void SetNull() { ptx = NULL; n = (unsigned int) -1; }
     bool IsNull() const { return (ptx == NULL && n == (unsigned int) -1); }
 };
@@ -475,6 +728,13 @@ public:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
 
+private:
+    /* Hash and serialised size of a frozen transaction */
+    bool fFrozen;
+    uint256 hashCached;
+    uint nSizeCached;
+
+public:
     CTransaction()
     {
         SetNull();
@@ -489,6 +749,8 @@ public:
       READWRITE(nLockTime);
       if(this->nVersion > 1)
         READWRITE(strTxComment);
+      if(fRead)
+        const_cast<CTransaction *>(this)->Freeze();
     )
 
     void SetNull()
@@ -500,6 +762,29 @@ public:
         nLockTime = 0;
         nDoS = 0;  // Denial-of-service prevention
         strTxComment.clear();
+        fFrozen = false;
+    }
+
+    /* A transaction read from a stream or stored in the memory pool is frozen:
+     * its hash and size are computed once and returned from then on.
+     * Transactions under construction are hashed anew on every call;
+     * a frozen one must be thawed before any of its fields are modified */
+    void Freeze()
+    {
+        fFrozen = false;
+        hashCached = SerializeHash(*this);
+        nSizeCached = ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION);
+        fFrozen = true;
+    }
+
+    void Thaw()
+    {
+        fFrozen = false;
+    }
+
+    bool IsFrozen() const
+    {
+        return(fFrozen);
     }
 
     bool IsNull() const
@@ -509,9 +794,17 @@ public:
 
     uint256 GetHash() const
     {
+        if(fFrozen) return(hashCached);
         return SerializeHash(*this);
     }
 
+    /* Serialised size, the same for the network and disk formats */
+    uint GetSize() const
+    {
+        if(fFrozen) return(nSizeCached);
+        return(::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION));
+    }
+
     bool IsFinal(int nBlockHeight=0, int64 nBlockTime=0) const
     {
         // Time based nLockTime implemented in 0.1.6
@@ -802,35 +1095,6 @@ public:
     IMPLEMENT_SERIALIZE(
         READWRITE(vtxundo);
     )
-
-    bool WriteToDisk(CDiskBlockPos &pos)
-    {
-        // Open history file to append
-        CAutoFile fileout = CAutoFile(OpenUndoFile(pos), SER_DISK, CLIENT_VERSION);
-        if(!fileout)
-          return(error("CBlockUndo::WriteToDisk() : OpenUndoFile() failed"));
-
-        // Write index header
-        unsigned int nSize = fileout.GetSerializeSize(*this);
-        fileout << FLATDATA(pchMessageStart) << nSize;
-
-        // Write undo data
-        long fileOutPos = ftell(fileout);
-        if(fileOutPos < 0)
-          return(error("CBlockUndo::WriteToDisk() : ftell() failed"));
-        pos.nPos = (unsigned int)fileOutPos;
-        fileout << *this;
-
-        // Flush stdio buffers and commit to disk before returning
-        fflush(fileout);
-        if(!IsInitialBlockDownload()) {
-            if(FileCommit(fileout))
-              return(error("CBlockUndo::WriteToDisk() : FileCommit() failed"));
-        }
-
-        return(true);
-    }
-
 };
 
 /** pruned version of CTransaction: only retains metadata and unspent transaction outputs
@@ -1393,7 +1657,7 @@ public:
         /* Prevents a crash if called on a block header alone */
         if(vtx.size()) {
             /* Serialised CScript */
-            std::vector<uchar>::const_iterator scriptsig = vtx[0].vin[0].scriptSig.begin();
+            CScript::const_iterator scriptsig = vtx[0].vin[0].scriptSig.begin();
             uchar i, scount = scriptsig[0];
             /* Optimise: nTime is 4 bytes always,
              * nHeight must be less for a long time;
@@ -1509,48 +1773,19 @@ public:
         return hash;
     }
 
-    bool WriteToDisk(CDiskBlockPos &pos)
-    {
-        // Open history file to append
-        CAutoFile fileout = CAutoFile(OpenBlockFile(pos), SER_DISK, CLIENT_VERSION);
-        if(!fileout)
-          return(error("CBlock::WriteToDisk() : OpenBlockFile() failed"));
-
-        // Write index header
-        unsigned int nSize = fileout.GetSerializeSize(*this);
-        fileout << FLATDATA(pchMessageStart) << nSize;
-
-        // Write block
-        long fileOutPos = ftell(fileout);
-        if(fileOutPos < 0)
-          return(error("CBlock::WriteToDisk() : ftell() failed"));
-        pos.nPos = (unsigned int)fileOutPos;
-        fileout << *this;
-
-        // Flush stdio buffers and commit to disk before returning
-        fflush(fileout);
-        if(!IsInitialBlockDownload() || !((nBestHeight + 1) % 100)) {
-            if(FileCommit(fileout))
-              return(error("CBlock::WriteToDisk() : FileCommit() failed"));
-        }
-
-        return(true);
-    }
-
     bool ReadFromDisk(const CDiskBlockPos &pos, bool fReadTransactions = true)
     {
         SetNull();
 
-        // Open history file to read
-        CAutoFile filein = CAutoFile(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-        if(!filein)
-          return(error("CBlock::ReadFromDisk() : OpenBlockFile() failed"));
-        if(!fReadTransactions)
-          filein.nType |= SER_BLOCKHEADERONLY;
+        CBlockFileView view;
+        if(!GetBlockFileView(pos, false, view))
+          return(error("CBlock::ReadFromDisk() : GetBlockFileView() failed"));
+        CMemoryReader reader(view.pbegin, view.pend,
+          SER_DISK | (fReadTransactions ? 0 : SER_BLOCKHEADERONLY), CLIENT_VERSION);
 
         // Read block
         try {
-            filein >> *this;
+            reader >> *this;
         }
         catch(std::exception &e) {
             return(error("CBlock::ReadFromDisk() : I/O error"));
@@ -1695,7 +1930,31 @@ enum BlockStatus {
 
     BLOCK_FAILED_VALID       =   32, // stage after last reached validness failed
     BLOCK_FAILED_CHILD       =   64, // descends from failed block
-    BLOCK_FAILED_MASK        =   96
+    BLOCK_FAILED_MASK        =   96,
+
+    BLOCK_HAVE_TRUST         =  128  // chain trust and stake modifier checksum loaded with the index
+};
+
+/** Proof-of-stake details of a block index entry. Rarely needed, so they are
+ * not kept in memory for the entries loaded from the disk until requested */
+class CBlockIndexStake
+{
+public:
+    // Predecessor of coinstake transaction
+    COutPoint prevoutStake;
+
+    // Timestamp of coinstake transaction
+    unsigned int nStakeTime;
+
+    // Kernel hash
+    uint256 hashProofOfStake;
+
+    CBlockIndexStake()
+    {
+        prevoutStake.SetNull();
+        nStakeTime = 0;
+        hashProofOfStake = 0;
+    }
 };
 
 /** The block chain is a tree shaped structure starting with the
@@ -1717,6 +1976,9 @@ public:
     // (memory only) pointer to the index of the *active* successor of this block
     CBlockIndex* pnext;
 
+    // (memory only) proof-of-stake details if loaded, see GetStake()
+    mutable CBlockIndexStake* pstake;
+
     // height of the entry in the chain. The genesis block has height 0
     int nHeight;
 
@@ -1729,7 +1991,7 @@ public:
     // Byte offset within rev?????.dat where this block's undo data is stored
     unsigned int nUndoPos;
 
-    // (memory only) Trust score of block chain up to and including this block
+    // Trust score of block chain up to and including this block
     uint256 nChainTrust;
 
     // Number of transactions in this block.
@@ -1741,12 +2003,6 @@ public:
     // Verification status of this block. See enum BlockStatus for detailed info
     unsigned int nStatus;
 
-    // Coins amount created by this block
-    int64 nMint;
-
-    // Total coins created in this block chain up to and including this block
-    int64 nMoneySupply;
-
     // Block flags
     unsigned int nFlags;
     enum
@@ -1759,21 +2015,18 @@ public:
         BLOCK_STAKE_MODIFIER = (1 << 2),
     };
 
+    // Coins amount created by this block
+    int64 nMint;
+
+    // Total coins created in this block chain up to and including this block
+    int64 nMoneySupply;
+
     // Hash modifier for proof-of-stake kernel
     uint64 nStakeModifier;
 
-    // Checksum of index in-memory only
+    // Checksum of the stake modifiers up to and including this block
     unsigned int nStakeModifierChecksum;
 
-    // Predecessor of coinstake transaction
-    COutPoint prevoutStake;
-
-    // Timestamp of coinstake transaction
-    unsigned int nStakeTime;
-
-    // Kernel hash
-    uint256 hashProofOfStake;
-
     // Block header
     int nVersion;
     uint256 hashMerkleRoot;
@@ -1786,6 +2039,7 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pstake = NULL;
         nHeight = 0;
         nFile = 0;
         nDataPos = 0;
@@ -1799,9 +2053,6 @@ public:
         nFlags = 0;
         nStakeModifier = 0;
         nStakeModifierChecksum = 0;
-        hashProofOfStake = 0;
-        prevoutStake.SetNull();
-        nStakeTime = 0;
 
         nVersion       = 0;
         hashMerkleRoot = 0;
@@ -1815,6 +2066,7 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pstake = NULL;
         nHeight = 0;
         nFile = 0;
         nDataPos = 0;
@@ -1828,18 +2080,8 @@ public:
         nFlags = 0;
         nStakeModifier = 0;
         nStakeModifierChecksum = 0;
-        hashProofOfStake = 0;
         if (block.IsProofOfStake())
-        {
             SetProofOfStake();
-            prevoutStake = block.vtx[1].vin[0].prevout;
-            nStakeTime = block.vtx[1].nTime;
-        }
-        else
-        {
-            prevoutStake.SetNull();
-            nStakeTime = 0;
-        }
 
         nVersion       = block.nVersion;
         hashMerkleRoot = block.hashMerkleRoot;
@@ -2010,6 +2252,11 @@ public:
             nFlags |= BLOCK_STAKE_MODIFIER;
     }
 
+    /* Proof-of-stake details, read from the block tree DB on first use
+     * for the entries loaded at startup; requires cs_main */
+    const CBlockIndexStake &GetStake() const;
+    void SetStake(const COutPoint &prevoutStake, unsigned int nStakeTime, const uint256 &hashProofOfStake);
+
     std::string ToString() const
     {
         return(strprintf("CBlockIndex(nprev=%p, pnext=%p nHeight=%d, nMint=%s, nMoneySupply=%s, " \
@@ -2018,7 +2265,8 @@ public:
           pprev, pnext, nHeight, FormatMoney(nMint).c_str(), FormatMoney(nMoneySupply).c_str(),
           GeneratedStakeModifier() ? "MOD" : "-", GetStakeEntropyBit(),
           IsProofOfStake()? "PoS" : "PoW", nStakeModifier, nStakeModifierChecksum,
-          hashProofOfStake.ToString().c_str(), prevoutStake.ToString().c_str(), nStakeTime,
+          GetStake().hashProofOfStake.ToString().c_str(), GetStake().prevoutStake.ToString().c_str(),
+          GetStake().nStakeTime,
           hashMerkleRoot.ToString().c_str(), GetBlockHash().ToString().c_str()));
     }
 
@@ -2046,14 +2294,26 @@ private:
     uint256 blockHash;
 public:
     uint256 hashPrev;
+    COutPoint prevoutStake;
+    unsigned int nStakeTime;
+    uint256 hashProofOfStake;
 
     CDiskBlockIndex() {
         hashPrev = 0;
         blockHash = 0;
+        prevoutStake.SetNull();
+        nStakeTime = 0;
+        hashProofOfStake = 0;
     }
 
     explicit CDiskBlockIndex(CBlockIndex* pindex) : CBlockIndex(*pindex) {
         hashPrev = (pprev ? pprev->GetBlockHash() : 0);
+        blockHash = (phashBlock ? *phashBlock : 0);
+        nStatus |= BLOCK_HAVE_TRUST;
+        const CBlockIndexStake &stake = pindex->GetStake();
+        prevoutStake = stake.prevoutStake;
+        nStakeTime = stake.nStakeTime;
+        hashProofOfStake = stake.hashProofOfStake;
     }
 
     IMPLEMENT_SERIALIZE
@@ -2095,6 +2355,22 @@ public:
         READWRITE(nTime);
         READWRITE(nBits);
         READWRITE(nNonce);
+
+        /* Derived values stored to avoid recalculation on every start;
+         * gated on the version of the record rather than on a status bit,
+         * as older versions keep the bit while rewriting records without them */
+        if (nVersion >= BLOCK_INDEX_TRUST_VERSION)
+        {
+            READWRITE(nChainTrust);
+            READWRITE(nStakeModifierChecksum);
+        }
+        if (fRead)
+        {
+            if (nVersion >= BLOCK_INDEX_TRUST_VERSION)
+                const_cast<CDiskBlockIndex*>(this)->nStatus |= BLOCK_HAVE_TRUST;
+            else
+                const_cast<CDiskBlockIndex*>(this)->nStatus &= ~BLOCK_HAVE_TRUST;
+        }
     )
 
     uint256 GetBlockHash() const {
@@ -2154,7 +2430,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -2205,7 +2481,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -2224,7 +2500,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -2240,7 +2516,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -2264,18 +2540,105 @@ public:
 
 
 
+/** A memory pool transaction with its fee, size and priority as of entry,
+ * its in-pool parents and children and the totals of the packages it forms
+ * with all its in-pool ancestors and with all its in-pool descendants */
+class CTxMemPoolEntry
+{
+public:
+    CTransactionRef ptx;
+    int64 nFee;             /* Zero while any input is unknown */
+    bool fInputsKnown;
+    uint nSize;
+    int nHeight;            /* Best chain height at entry */
+    double dPriority;       /* Priority at nHeight */
+    int64 nValueInChain;    /* Value of confirmed inputs, the rate priority grows at */
+    std::set<uint256> setParents;
+    std::set<uint256> setChildren;
+    uint nCountWithAncestors;
+    uint64 nSizeWithAncestors;
+    int64 nFeesWithAncestors;
+    uint nCountWithDescendants;
+    uint64 nSizeWithDescendants;
+    int64 nFeesWithDescendants;
+    double dDescendantScore; /* As indexed for eviction */
+    size_t nUsage;          /* Memory taken by the transaction and its pool records */
+
+    CTxMemPoolEntry() : nFee(0), fInputsKnown(false), nSize(0), nHeight(0), dPriority(0),
+      nValueInChain(0), nCountWithAncestors(0), nSizeWithAncestors(0), nFeesWithAncestors(0),
+      nCountWithDescendants(0), nSizeWithDescendants(0), nFeesWithDescendants(0),
+      dDescendantScore(0), nUsage(0) { }
+
+    /* Priority is sum(valuein * age) / txsize and grows with every block */
+    double GetPriority(int nCurHeight) const
+    {
+        return(dPriority + (double)nValueInChain * (nCurHeight - nHeight) / nSize);
+    }
+
+    /* Fee per kilobyte of the package with the ancestors */
+    double GetAncestorFeeRate() const
+    {
+        return((double)nFeesWithAncestors * 1000.0 / (double)nSizeWithAncestors);
+    }
+
+    /* Fee per kilobyte of either the transaction or the package with the descendants,
+     * whichever is higher, so parents paid for by their children are kept */
+    double GetDescendantScore() const
+    {
+        return(std::max((double)nFee * 1000.0 / (double)nSize,
+          (double)nFeesWithDescendants * 1000.0 / (double)nSizeWithDescendants));
+    }
+};
+
 class CTxMemPool
 {
+private:
+    bool accept(const CTransaction &tx, CTransactionRef ptx, bool fCheckInputs, bool *pfMissingInputs);
+    void CalculateInputs(CTxMemPoolEntry &entry);
+    void UpdateAncestorTotals(const uint256 &hash);
+    void UpdateDescendantTotals(const uint256 &hash);
+    void UpdateDescendantScore(const uint256 &hash, CTxMemPoolEntry &entry);
+    void queryDescendants(const uint256 &hash, std::set<uint256> &setDescendants);
+
+    /* Totals of the pool contents */
+    uint64 nTotalTxSize;
+    size_t nDynamicUsage;
+    /* Fee rate per kilobyte required after evictions, decaying over time */
+    int64 nRollingMinFeeRate;
+    int64 nLastRollingFeeUpdate;
+
 public:
     mutable CCriticalSection cs;
-    std::map<uint256, CTransaction> mapTx;
+    std::map<uint256, CTxMemPoolEntry> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
+    /* Transactions by the fee rate of their ancestor packages, ascending */
+    std::set<std::pair<double, uint256> > setAncestorFeeRate;
+    /* Transactions by their descendant scores, ascending, for eviction */
+    std::set<std::pair<double, uint256> > setDescendantScore;
+    /* Memory limit in bytes */
+    size_t nMaxUsage;
+    /* Limits of the ancestor and descendant packages of new transactions,
+     * in transactions and bytes */
+    uint nLimitAncestors;
+    uint64 nLimitAncestorSize;
+    uint nLimitDescendants;
+    uint64 nLimitDescendantSize;
+
+    CTxMemPool() : nTotalTxSize(0), nDynamicUsage(0), nRollingMinFeeRate(0),
+      nLastRollingFeeUpdate(0), nMaxUsage(DEFAULT_MAX_MEMPOOL_SIZE * 1000000),
+      nLimitAncestors(DEFAULT_ANCESTOR_LIMIT), nLimitAncestorSize(DEFAULT_ANCESTOR_SIZE_LIMIT * 1000),
+      nLimitDescendants(DEFAULT_DESCENDANT_LIMIT), nLimitDescendantSize(DEFAULT_DESCENDANT_SIZE_LIMIT * 1000) { }
 
     bool accept(CTransaction &tx, bool fCheckInputs, bool* pfMissingInputs);
-    bool addUnchecked(const uint256& hash, CTransaction &tx);
-    bool remove(CTransaction &tx);
+    bool accept(const CTransactionRef &ptx, bool fCheckInputs, bool *pfMissingInputs);
+    bool addUnchecked(const uint256& hash, const CTransactionRef &ptx, int64 nFee = -1);
+    bool remove(const CTransaction &tx);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
+    void queryAncestors(const uint256 &hash, std::set<uint256> &setAncestors);
+    bool CheckChainLimits(const CTransaction &tx, uint nSize);
+    void TrimToSize(size_t nLimit);
+    int64 GetMinFeeRate();
     void pruneSpent(const uint256& hash, CCoins &coins);
 
     unsigned long size()
@@ -2284,28 +2647,81 @@ public:
         return mapTx.size();
     }
 
+    uint64 GetTotalTxSize()
+    {
+        LOCK(cs);
+        return(nTotalTxSize);
+    }
+
+    size_t DynamicMemoryUsage()
+    {
+        LOCK(cs);
+        return(nDynamicUsage);
+    }
+
     bool exists(uint256 hash)
     {
         return (mapTx.count(hash) != 0);
     }
 
-    CTransaction& lookup(uint256 hash)
+    const CTransaction& lookup(uint256 hash)
+    {
+        return *mapTx.find(hash)->second.ptx;
+    }
+
+    /* Shared reference to a pool transaction or none */
+    CTransactionRef get(const uint256 &hash)
     {
-        return mapTx[hash];
+        std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.find(hash);
+        if(it == mapTx.end()) return(CTransactionRef());
+        return(it->second.ptx);
     }
 };
 
 extern CTxMemPool mempool;
 
+/* Statistics of the unspent transaction output set; the counters and the multiset hash
+ * are maintained incrementally as the chain state changes and may be combined as deltas,
+ * while the pruned transaction count and the serialised size are known to full scans only */
 struct CCoinsStats
 {
     int nHeight;
+    uint256 hashBlock;
     uint64 nTransactions;
     uint64 nPrunedTransactions;
     uint64 nTransactionOutputs;
     uint64 nSerializedSize;
+    int64 nTotalAmount;
+    CMuHash3072 muhash;
+
+    CCoinsStats() : nHeight(0), hashBlock(0), nTransactions(0), nPrunedTransactions(0), nTransactionOutputs(0),
+      nSerializedSize(0), nTotalAmount(0) {}
 
-    CCoinsStats() : nHeight(0), nTransactions(0), nPrunedTransactions(0), nTransactionOutputs(0), nSerializedSize(0) {}
+    IMPLEMENT_SERIALIZE(
+        READWRITE(hashBlock);
+        READWRITE(nTransactions);
+        READWRITE(nTransactionOutputs);
+        READWRITE(nTotalAmount);
+        READWRITE(muhash);
+    )
+
+    /* Empty outputs are dropped by CCoins::Cleanup() as if spent, so they don't count */
+    static bool IsCounted(const CTxOut &out) {
+        return(!out.IsNull() && !out.IsEmpty());
+    }
+
+    /* A transaction counts while any of its outputs does */
+    static bool IsCounted(const CCoins &coins);
+
+    void AddOutput(const uint256 &txid, uint n, const CCoins &coins, const CTxOut &out);
+    void RemoveOutput(const uint256 &txid, uint n, const CCoins &coins, const CTxOut &out);
+
+    /* All counted outputs of a transaction */
+    void AddCoins(const uint256 &txid, const CCoins &coins);
+    void RemoveCoins(const uint256 &txid, const CCoins &coins);
+
+    /* Merges a delta or a partial scan; the unsigned counters wrap around for removals */
+    void Add(const CCoinsStats &stats);
 };
 
 /** Abstract view on the open txout dataset. */
@@ -2329,11 +2745,16 @@ public:
     virtual bool SetBestBlock(CBlockIndex *pindex);
 
     // Do a bulk modification (multiple SetCoins + one SetBestBlock)
-    virtual bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    // along with the resulting change of the statistics
+    virtual bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex,
+      const CCoinsStats &statsDelta);
 
-    // Calculate statistics about the unspent transaction output set
+    // Retrieve the incrementally maintained statistics about the unspent transaction output set
     virtual bool GetStats(CCoinsStats &stats);
 
+    // Calculate statistics about the unspent transaction output set by a full scan
+    virtual bool ScanStats(CCoinsStats &stats);
+
     // As we use CCoinsViews polymorphically, have a virtual destructor
     virtual ~CCoinsView() {}
 };
@@ -2352,8 +2773,10 @@ public:
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
     void SetBackend(CCoinsView &viewIn);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex,
+      const CCoinsStats &statsDelta);
     bool GetStats(CCoinsStats &stats);
+    bool ScanStats(CCoinsStats &stats);
 };
 
 /** CCoinsView that adds a memory cache for transactions to another CCoinsView */
@@ -2363,6 +2786,7 @@ protected:
     CBlockIndex *pindexTip;
     std::map<uint256,CCoins> cacheCoins;
     std::map<uint256,CCoins> cacheCoinsReadOnly;
+    CCoinsStats statsDelta;
 
 public:
     CCoinsViewCache(CCoinsView &baseIn, bool fDummy = false);
@@ -2373,7 +2797,14 @@ public:
     CCoins &GetCoins(const uint256 txid);
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex,
+      const CCoinsStats &statsDelta);
+    bool GetStats(CCoinsStats &stats);
+
+    // Changes of the statistics not pushed to the base yet
+    CCoinsStats &GetStatsDelta() {
+        return(statsDelta);
+    }
 
     // Push the modifications applied to this cache to its base.
     // Failure to call this method before destruction will cause the changes to be forgotten.
@@ -2402,6 +2833,9 @@ public:
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
+/** Restore a spent output from its undo record while disconnecting a block */
+bool ApplyTxInUndo(const CTxInUndo &undo, CCoinsViewCache &view, const COutPoint &out);
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
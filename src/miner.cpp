@@ -21,58 +21,98 @@ string strMintWarning;
 
 extern unsigned int nMinerSleep;
 
-// Some explaining would be appreciated
-class COrphan
-{
-public:
-    CTransaction* ptx;
-    set<uint256> setDependsOn;
-    double dPriority;
-    double dFeePerKb;
+uint64 nLastBlockTx = 0;
+uint64 nLastBlockSize = 0;
+int64 nLastCoinStakeSearchInterval = 0;
 
-    COrphan(CTransaction* ptxIn)
-    {
-        ptx = ptxIn;
-        dPriority = dFeePerKb = 0;
+/* Appends a memory pool transaction package, parents ahead of children, to the block
+ * if it fits and every transaction in it passes; nothing is changed otherwise */
+static bool AddPackageToBlock(CBlock *pblock, CCoinsViewCache &view,
+  const vector<const CTxMemPoolEntry *> &vPackage, int nHeight, bool fProofOfStake,
+  uint nBlockMaxSize, uint64 &nBlockSize, int &nBlockSigOps, int64 &nFees) {
+    uint nAdjTime = GetAdjustedTime();
+    uint64 nPackageSize = nBlockSize;
+    int nPackageSigOps = nBlockSigOps;
+    int64 nPackageFees = 0;
+
+    // second layer cached modifications just for this package
+    CCoinsViewCache viewTemp(view, true);
+
+    BOOST_FOREACH(const CTxMemPoolEntry *pentry, vPackage) {
+        const CTransaction &tx = *pentry->ptx;
+
+        if(tx.IsCoinBase() || tx.IsCoinStake() || !tx.IsFinal())
+          return(false);
+
+        // Size limits
+        if((nPackageSize + pentry->nSize) >= nBlockMaxSize)
+          return(false);
+
+        // Legacy limits on sigOps:
+        uint nTxSigOps = tx.GetLegacySigOpCount();
+        if((nPackageSigOps + nTxSigOps) >= MAX_BLOCK_SIGOPS)
+          return(false);
+
+        // Timestamp limit
+        if((tx.nTime > nAdjTime) || (fProofOfStake && (tx.nTime > pblock->vtx[0].nTime)))
+          return(false);
+
+        /* Low priority transactions up to 500 bytes in size
+         * are free unless they get caught by the dust spam filter */
+        bool fAllowFree = (((nPackageSize + pentry->nSize) < 1500) ||
+          CTransaction::AllowFree(pentry->GetPriority(nHeight)));
+        int64 nMinFee = tx.GetMinFee(nPackageSize, fAllowFree, GMF_BLOCK);
+
+        /* Script verification has been passed already while accepting
+         * transactions to the memory pool */
+        if(!tx.CheckInputs(viewTemp, CS_ALWAYS, SCRIPT_VERIFY_NONE))
+          return(false);
+
+        int64 nTxFees = tx.GetValueIn(viewTemp) - tx.GetValueOut();
+        if(nTxFees < nMinFee)
+          return(false);
+
+        nTxSigOps += tx.GetP2SHSigOpCount(viewTemp);
+        if((nPackageSigOps + nTxSigOps) >= MAX_BLOCK_SIGOPS)
+          return(false);
+
+        /* Outputs of the package are available to its later transactions
+         * the same way CCoinsViewMemPool presents them */
+        viewTemp.SetCoins(tx.GetHash(), CCoins(tx, MEMPOOL_HEIGHT, -1));
+
+        nPackageSize += pentry->nSize;
+        nPackageSigOps += nTxSigOps;
+        nPackageFees += nTxFees;
     }
 
-    void print() const
-    {
-        printf("COrphan(hash=%s, dPriority=%.1f, dFeePerKb=%.1f)\n",
-               ptx->GetHash().ToString().substr(0,10).c_str(), dPriority, dFeePerKb);
-        BOOST_FOREACH(uint256 hash, setDependsOn)
-            printf("   setDependsOn %s\n", hash.ToString().substr(0,10).c_str());
-    }
-};
+    // push changes from the second layer cache to the first one
+    viewTemp.Flush();
 
+    BOOST_FOREACH(const CTxMemPoolEntry *pentry, vPackage) {
+        pblock->vtx.push_back(*pentry->ptx);
 
-uint64 nLastBlockTx = 0;
-uint64 nLastBlockSize = 0;
-int64 nLastCoinStakeSearchInterval = 0;
- 
-// We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, CTransaction*> TxPriority;
-class TxPriorityCompare
-{
-    bool byFee;
-public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) { }
-    bool operator()(const TxPriority& a, const TxPriority& b)
-    {
-        if (byFee)
-        {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
-        }
-        else
-        {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
-        }
+        if(fDebug && GetBoolArg("-printpriority"))
+          printf("priority %.1f feeperkb %.1f txid %s\n",
+            pentry->GetPriority(nHeight), (double)pentry->nFee * 1000.0 / pentry->nSize,
+            pentry->ptx->GetHash().ToString().c_str());
     }
-};
+
+    nBlockSize = nPackageSize;
+    nBlockSigOps = nPackageSigOps;
+    nFees += nPackageFees;
+
+    return(true);
+}
+
+/* The package selection stops once the block has less space left than this
+ * or after this many packages in a row haven't fit into the last of it */
+static const uint MIN_PACKAGE_SPACE = 1000;
+static const uint MAX_PACKAGE_FAILURES = 100;
+
+/* Orders package members by their number of ancestors, so parents come first */
+static bool CompareAncestorCount(const CTxMemPoolEntry *a, const CTxMemPoolEntry *b) {
+    return(a->nCountWithAncestors < b->nCountWithAncestors);
+}
 
 // CreateNewBlock: create new block (without proof-of-work/proof-of-stake)
 CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake, int64 *pStakeReward) {
@@ -135,191 +175,97 @@ CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake, int64 *pStakeReward
         LOCK2(cs_main, mempool.cs);
         CCoinsViewCache view(*pcoinsTip, true);
 
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
-        {
-            CTransaction& tx = (*mi).second;
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !tx.IsFinal())
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            int64 nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                // Read prev transaction
-                CCoins coins;
-                if (!view.GetCoins(txin.prevout.hash, coins))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        printf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                int64 nValueIn = coins.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = pindexPrev->nHeight - coins.nHeight;
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority /= nTxSize;
-
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
-
-            if (porphan)
-            {
-                porphan->dPriority = dPriority;
-                porphan->dFeePerKb = dFeePerKb;
-            }
-            else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
-        }
-
         // Collect transactions into block
         uint64 nBlockSize = 1000;
         uint64 nBlockTx = 0;
         int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty()) {
-            int64 nMinFee;
-            unsigned int nAdjTime = GetAdjustedTime();
-
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            double dFeePerKb = vecPriority.front().get<1>();
-            CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // second layer cached modifications just for this transaction
-            CCoinsViewCache viewTemp(view, true);
+        set<uint256> setIncluded;
+
+        /* High priority transactions without unconfirmed inputs go first regardless
+         * of the fees they pay. Priority grows with every block at a rate specific
+         * to each transaction, so it is evaluated from the pool entries here
+         * with no coin lookups */
+        if(nBlockPrioritySize > 0) {
+            vector<pair<double, const CTxMemPoolEntry *> > vecPriority;
+            for(map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapTx.begin();
+              mi != mempool.mapTx.end(); ++mi) {
+                const CTxMemPoolEntry &entry = (*mi).second;
+                if(!entry.setParents.empty())
+                  continue;
+                double dPriority = entry.GetPriority(pindexPrev->nHeight);
+                if(dPriority >= (COIN * 2880 / 250))
+                  vecPriority.push_back(make_pair(dPriority, &entry));
+            }
+            sort(vecPriority.rbegin(), vecPriority.rend());
+
+            for(uint i = 0; i < vecPriority.size(); i++) {
+                const CTxMemPoolEntry *pentry = vecPriority[i].second;
+                if((nBlockSize + pentry->nSize) >= nBlockPrioritySize)
+                  break;
+                vector<const CTxMemPoolEntry *> vPackage(1, pentry);
+                if(AddPackageToBlock(pblock, view, vPackage, pindexPrev->nHeight, fProofOfStake,
+                  nBlockMaxSize, nBlockSize, nBlockSigOps, nFees)) {
+                    setIncluded.insert(pentry->ptx->GetHash());
+                    nBlockTx++;
+                }
+            }
+        }
 
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
+        /* Prioritise by fee then, walking down the packages of transactions with
+         * their unconfirmed ancestors ordered by the package fee rate until
+         * the block is nearly full */
+        uint nFailures = 0;
+        for(set<pair<double, uint256> >::reverse_iterator it = mempool.setAncestorFeeRate.rbegin();
+          it != mempool.setAncestorFeeRate.rend(); ++it) {
+            if((nBlockSize + MIN_PACKAGE_SPACE) >= nBlockMaxSize)
+              break;
+            if((nBlockSize + 4 * MIN_PACKAGE_SPACE) >= nBlockMaxSize) {
+                if(++nFailures > MAX_PACKAGE_FAILURES)
+                  break;
+            }
 
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = tx.GetLegacySigOpCount();
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
+            const uint256 &hash = (*it).second;
+            if(setIncluded.count(hash))
+              continue;
+            const CTxMemPoolEntry &entry = mempool.mapTx[hash];
 
-            // Timestamp limit
-            if ((tx.nTime > nAdjTime) || (fProofOfStake && tx.nTime > pblock->vtx[0].nTime))
-                continue;
+            /* Packages are sorted, so the rest are free as well */
+            if((nBlockSize >= nBlockMinSize) && ((*it).first < nMinTxFee))
+              break;
 
-            /* Low priority transactions up to 500 bytes in size
-             * are free unless they get caught by the dust spam filter */
-            bool fAllowFree = ((nBlockSize + nTxSize < 1500) || CTransaction::AllowFree(dPriority));
-            nMinFee = tx.GetMinFee(nBlockSize, fAllowFree, GMF_BLOCK);
+            /* Neither a transaction too large by itself needs its ancestors looked up */
+            if((nBlockSize + entry.nSize) >= nBlockMaxSize)
+              continue;
 
-            // Skip free transactions if we're past the minimum block size:
-            if (fSortedByFee && (dFeePerKb < nMinTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritize by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || (dPriority < COIN * 2880 / 250)))
-            {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+            set<uint256> setAncestors;
+            mempool.queryAncestors(hash, setAncestors);
+            vector<const CTxMemPoolEntry *> vPackage(1, &entry);
+            uint64 nPackageSize = entry.nSize;
+            int64 nPackageFees = entry.nFee;
+            BOOST_FOREACH(const uint256 &hashAncestor, setAncestors) {
+                if(setIncluded.count(hashAncestor))
+                  continue;
+                const CTxMemPoolEntry &ancestor = mempool.mapTx[hashAncestor];
+                vPackage.push_back(&ancestor);
+                nPackageSize += ancestor.nSize;
+                nPackageFees += ancestor.nFee;
             }
 
-            /* Script verification has been passed already while accepting
-             * transactions to the memory pool */
-            if(!tx.CheckInputs(viewTemp, CS_ALWAYS, SCRIPT_VERIFY_NONE))
+            if((nBlockSize + nPackageSize) >= nBlockMaxSize)
               continue;
 
-            int64 nTxFees = tx.GetValueIn(viewTemp)-tx.GetValueOut();
-            if (nTxFees < nMinFee)
-                continue;
-
-            nTxSigOps += tx.GetP2SHSigOpCount(viewTemp);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-/*
- * We need to call UpdateCoins using actual block timestamp, so don't perform this here.
- *
-            CTxUndo txundo;
-            if (!tx.UpdateCoins(viewTemp, txundo, pindexPrev->nHeight+1, pblock->nTime))
-                continue;
-
-*/
-
-            // push changes from the second layer cache to the first one
-            viewTemp.Flush();
-            uint256 hash = tx.GetHash();
-
-            // Added
-            pblock->vtx.push_back(tx);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            if (fDebug && GetBoolArg("-printpriority"))
-            {
-                printf("priority %.1f feeperkb %.1f txid %s\n",
-                       dPriority, dFeePerKb, tx.GetHash().ToString().c_str());
-            }
+            // Skip free transactions if we're past the minimum block size:
+            if((((double)nPackageFees * 1000.0 / nPackageSize) < nMinTxFee) &&
+              ((nBlockSize + nPackageSize) >= nBlockMinSize))
+              continue;
 
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash))
-            {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
+            sort(vPackage.begin(), vPackage.end(), CompareAncestorCount);
+            if(AddPackageToBlock(pblock, view, vPackage, pindexPrev->nHeight, fProofOfStake,
+              nBlockMaxSize, nBlockSize, nBlockSigOps, nFees)) {
+                BOOST_FOREACH(const CTxMemPoolEntry *pentry, vPackage)
+                  setIncluded.insert(pentry->ptx->GetHash());
+                nBlockTx += vPackage.size();
+                nFailures = 0;
             }
         }
 
@@ -350,6 +296,53 @@ CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake, int64 *pStakeReward
 }
 
 
+/* The shared proof-of-work block template is rebuilt on a new best block, once this many
+ * memory pool updates have accumulated or once older than the caller accepts with any */
+static const uint TEMPLATE_TX_THRESHOLD = 100;
+
+static CCriticalSection cs_blocktemplate;
+static CBlock *pblockTemplate = NULL;
+static CBlockIndex *pindexTemplate = NULL;
+static uint nTemplateTxUpdated = 0;
+static int64 nTemplateTime = 0;
+static uint nTemplateLastId = 0;
+
+bool GetBlockTemplate(CWallet *pwallet, int64 nMaxAge, uint &nTemplateId,
+  CBlock *&pblock, CBlockIndex *&pindexPrev) {
+
+    LOCK2(cs_main, cs_blocktemplate);
+
+    uint nTxUpdated = nTransactionsUpdated;
+    if(!pblockTemplate || (pindexTemplate != pindexBest) ||
+      ((nTxUpdated != nTemplateTxUpdated) &&
+      (((GetTime() - nTemplateTime) > nMaxAge) ||
+      ((nTxUpdated - nTemplateTxUpdated) >= TEMPLATE_TX_THRESHOLD)))) {
+
+        // Store the pindexBest used before CreateNewBlock, to avoid races
+        CBlockIndex *pindexPrevNew = pindexBest;
+        CBlock *pblockNew = CreateNewBlock(pwallet, false);
+        if(!pblockNew)
+          return(false);
+
+        delete(pblockTemplate);
+        pblockTemplate = pblockNew;
+        pindexTemplate = pindexPrevNew;
+        nTemplateTxUpdated = nTxUpdated;
+        nTemplateTime = GetTime();
+        nTemplateLastId++;
+    }
+
+    pindexPrev = pindexTemplate;
+    if(nTemplateId == nTemplateLastId) {
+        pblock = NULL;
+    } else {
+        pblock = new CBlock(*pblockTemplate);
+        nTemplateId = nTemplateLastId;
+    }
+
+    return(true);
+}
+
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
     // Update nExtraNonce
@@ -369,6 +362,16 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
 }
 
 
+/* Sets the extra nonce of a block to the bytes given, so its place
+ * in the serialised coin base doesn't depend on the value */
+void SetExtraNonce(CBlock *pblock, CBlockIndex *pindexPrev, const std::vector<uchar> &vchExtraNonce) {
+    uint nHeight = pindexPrev->nHeight + 1; // Height first in coinbase required
+    pblock->vtx[0].vin[0].scriptSig = (CScript() << nHeight << vchExtraNonce) + COINBASE_FLAGS;
+    assert(pblock->vtx[0].vin[0].scriptSig.size() <= 100);
+
+    pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+}
+
 /* Prepares a block header for transmission using RPC getwork */
 void FormatDataBuffer(CBlock *pblock, uint *pdata) {
     uint i;
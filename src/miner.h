@@ -13,9 +13,17 @@
 /* Generate a new block, without valid proof-of-work */
 CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake=false, int64 *pStakeReward=NULL);
 
+/* Copies the proof-of-work block template shared by the RPC calls unless
+ * the caller has the current one by its identifier already */
+bool GetBlockTemplate(CWallet *pwallet, int64 nMaxAge, uint &nTemplateId,
+  CBlock *&pblock, CBlockIndex *&pindexPrev);
+
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 
+/* Sets a fixed width extranonce for the Stratum mining */
+void SetExtraNonce(CBlock *pblock, CBlockIndex *pindexPrev, const std::vector<uchar> &vchExtraNonce);
+
 /* Prepares a block header for transmission using RPC getwork */
 void FormatDataBuffer(CBlock *pblock, uint *pdata);
 
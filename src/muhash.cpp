@@ -0,0 +1,102 @@
+// Copyright (c) 2018 The Orbitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <openssl/sha.h>
+
+#include "muhash.h"
+#include "util.h"
+
+static CBigNum MakeModulus() {
+    CBigNum bn;
+
+    if(!BN_set_bit(bn.get(), 3072) || !BN_sub_word(bn.get(), 1103717))
+      throw(bignum_error("CMuHash3072 : failed to set the modulus"));
+
+    return(bn);
+}
+
+/* The largest 3072-bit safe prime */
+static const CBigNum &GetModulus() {
+    static const CBigNum bnModulus(MakeModulus());
+    return(bnModulus);
+}
+
+CMuHash3072::CMuHash3072() : bnNumerator(1), bnDenominator(1) { }
+
+/* The SHA-256 of the element is expanded in counter mode to 3072 bits */
+void CMuHash3072::ToNumber(const uchar *pch, size_t nSize, CBigNum &bn) {
+    uchar seed[SHA256_DIGEST_LENGTH], vch[BYTES];
+    uint i;
+
+    SHA256(pch ? pch : seed, nSize, seed);
+    for(i = 0; i < (BYTES / SHA256_DIGEST_LENGTH); i++) {
+        SHA256_CTX ctx;
+        uchar counter[4] = { (uchar)(i >> 24), (uchar)(i >> 16), (uchar)(i >> 8), (uchar)i };
+        SHA256_Init(&ctx);
+        SHA256_Update(&ctx, seed, sizeof(seed));
+        SHA256_Update(&ctx, counter, sizeof(counter));
+        SHA256_Final(&vch[i * SHA256_DIGEST_LENGTH], &ctx);
+    }
+
+    BN_bin2bn(vch, BYTES, bn.get());
+    if(BN_cmp(bn.cget(), GetModulus().cget()) >= 0) {
+        CAutoBN_CTX pctx;
+        if(!BN_mod(bn.get(), bn.cget(), GetModulus().cget(), pctx))
+          throw(bignum_error("CMuHash3072::ToNumber() : BN_mod() failed"));
+    }
+}
+
+void CMuHash3072::SetFixed(const std::vector<uchar> &vch, CBigNum &bn) {
+    BN_bin2bn(&vch[0], BYTES, bn.get());
+}
+
+std::vector<uchar> CMuHash3072::GetFixed(const CBigNum &bn) {
+    std::vector<uchar> vch(BYTES, 0);
+    uint nSize = BN_num_bytes(bn.cget());
+
+    BN_bn2bin(bn.cget(), &vch[BYTES - nSize]);
+
+    return(vch);
+}
+
+void CMuHash3072::Insert(const uchar *pch, size_t nSize) {
+    CAutoBN_CTX pctx;
+    CBigNum bn;
+
+    ToNumber(pch, nSize, bn);
+    if(!BN_mod_mul(bnNumerator.get(), bnNumerator.cget(), bn.cget(), GetModulus().cget(), pctx))
+      throw(bignum_error("CMuHash3072::Insert() : BN_mod_mul() failed"));
+}
+
+void CMuHash3072::Remove(const uchar *pch, size_t nSize) {
+    CAutoBN_CTX pctx;
+    CBigNum bn;
+
+    ToNumber(pch, nSize, bn);
+    if(!BN_mod_mul(bnDenominator.get(), bnDenominator.cget(), bn.cget(), GetModulus().cget(), pctx))
+      throw(bignum_error("CMuHash3072::Remove() : BN_mod_mul() failed"));
+}
+
+CMuHash3072 &CMuHash3072::operator*=(const CMuHash3072 &b) {
+    CAutoBN_CTX pctx;
+
+    if(!BN_mod_mul(bnNumerator.get(), bnNumerator.cget(), b.bnNumerator.cget(), GetModulus().cget(), pctx) ||
+      !BN_mod_mul(bnDenominator.get(), bnDenominator.cget(), b.bnDenominator.cget(), GetModulus().cget(), pctx))
+      throw(bignum_error("CMuHash3072::operator*= : BN_mod_mul() failed"));
+
+    return(*this);
+}
+
+uint256 CMuHash3072::Finalize() const {
+    CAutoBN_CTX pctx;
+    CBigNum bnInverse, bnResult;
+
+    if(!BN_mod_inverse(bnInverse.get(), bnDenominator.cget(), GetModulus().cget(), pctx) ||
+      !BN_mod_mul(bnResult.get(), bnNumerator.cget(), bnInverse.cget(), GetModulus().cget(), pctx))
+      throw(bignum_error("CMuHash3072::Finalize() : modular inversion failed"));
+
+    std::vector<uchar> vch = GetFixed(bnResult);
+
+    return(Hash(vch.begin(), vch.end()));
+}
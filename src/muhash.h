@@ -0,0 +1,70 @@
+// Copyright (c) 2018 The Orbitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef MUHASH_H
+#define MUHASH_H
+
+#include <vector>
+
+#include "bignum.h"
+#include "serialize.h"
+#include "uint256.h"
+
+/* A hash of a multiset of byte strings which doesn't depend on their order:
+ * every element is expanded to a number modulo the 3072-bit prime 2^3072 - 1103717
+ * and multiplied in, removals multiply a separate denominator to avoid
+ * an inversion per element; multisets combine by multiplication */
+class CMuHash3072 {
+private:
+    CBigNum bnNumerator;
+    CBigNum bnDenominator;
+
+    static const uint BYTES = 384;
+
+    static void ToNumber(const uchar *pch, size_t nSize, CBigNum &bn);
+    static void SetFixed(const std::vector<uchar> &vch, CBigNum &bn);
+    static std::vector<uchar> GetFixed(const CBigNum &bn);
+
+public:
+    CMuHash3072();
+
+    void Insert(const uchar *pch, size_t nSize);
+    void Remove(const uchar *pch, size_t nSize);
+
+    void Insert(const std::vector<uchar> &vch) {
+        Insert(vch.empty() ? NULL : &vch[0], vch.size());
+    }
+
+    void Remove(const std::vector<uchar> &vch) {
+        Remove(vch.empty() ? NULL : &vch[0], vch.size());
+    }
+
+    CMuHash3072 &operator*=(const CMuHash3072 &b);
+
+    /* Hash of the multiset in its canonical form */
+    uint256 Finalize() const;
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const {
+        return(2 * BYTES);
+    }
+
+    template<typename Stream>
+    void Serialize(Stream &s, int nType, int nVersion) const {
+        std::vector<uchar> vch = GetFixed(bnNumerator);
+        s.write((const char *)&vch[0], BYTES);
+        vch = GetFixed(bnDenominator);
+        s.write((const char *)&vch[0], BYTES);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream &s, int nType, int nVersion) {
+        std::vector<uchar> vch(BYTES);
+        s.read((char *)&vch[0], BYTES);
+        SetFixed(vch, bnNumerator);
+        s.read((char *)&vch[0], BYTES);
+        SetFixed(vch, bnDenominator);
+    }
+};
+
+#endif /* MUHASH_H */
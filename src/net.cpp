@@ -67,7 +67,7 @@ CAddrMan addrman;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CTransactionRef> mapRelay;
 deque<pair<int64, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 map<CInv, int64> mapAlreadyAskedFor;
@@ -2030,8 +2030,12 @@ bool StopNode()
     if (vnThreadsRunning[THREAD_DUMPADDRESS] > 0) printf("ThreadDumpAddresses still running\n");
     if(vnThreadsRunning[THREAD_STAKER0] > 0) printf("ThreadStakeMiner0 still running\n");
     if(vnThreadsRunning[THREAD_STAKER1] > 0) printf("ThreadStakeMiner1 still running\n");
+    if(vnThreadsRunning[THREAD_MEMPOOL] > 0) printf("ThreadMemPool still running\n");
+    if(vnThreadsRunning[THREAD_STRATUM] > 0) printf("ThreadStratumServer still running\n");
+    if(vnThreadsRunning[THREAD_BLOCKCOMPRESS] > 0) printf("ThreadBlockFileCompressor still running\n");
     while((vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0)
-      || (vnThreadsRunning[THREAD_RPCHANDLER] > 0)) MilliSleep(20);
+      || (vnThreadsRunning[THREAD_RPCHANDLER] > 0)
+      || (vnThreadsRunning[THREAD_BLOCKCOMPRESS] > 0)) MilliSleep(20);
     MilliSleep(50);
     DumpAddresses();
     return true;
@@ -2064,13 +2068,18 @@ instance_of_cnetcleanup;
 
 void RelayTransaction(const CTransaction& tx, const uint256& hash)
 {
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss.reserve(10000);
-    ss << tx;
-    RelayTransaction(tx, hash, ss);
+    // Share the memory pool copy if there is one
+    CTransactionRef ptx;
+    {
+        LOCK(mempool.cs);
+        ptx = mempool.get(hash);
+    }
+    if (!ptx)
+        ptx.reset(new CTransaction(tx));
+    RelayTransaction(ptx, hash);
 }
 
-void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataStream& ss)
+void RelayTransaction(const CTransactionRef& ptx, const uint256& hash)
 {
     CInv inv(MSG_TX, hash);
     {
@@ -2082,8 +2091,8 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        // Keep a reference to serialise on request
+        mapRelay.insert(std::make_pair(inv, ptx));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
 
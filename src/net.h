@@ -9,6 +9,7 @@
 #include <deque>
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <openssl/rand.h>
 
 #ifndef WIN32
@@ -23,8 +24,12 @@
 class CRequestTracker;
 class CNode;
 class CBlockIndex;
+class CTransaction;
 extern int nBestHeight;
 
+/* A transaction shared by the memory pool, the orphan pool and the relay cache */
+typedef boost::shared_ptr<const CTransaction> CTransactionRef;
+
 
 
 inline unsigned int ReceiveBufferSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
@@ -109,6 +114,9 @@ enum threadId
     THREAD_STAKER0,
     THREAD_STAKER1,
     THREAD_NTP,
+    THREAD_MEMPOOL,
+    THREAD_STRATUM,
+    THREAD_BLOCKCOMPRESS,
 
     THREAD_MAX
 };
@@ -127,7 +135,7 @@ extern CCriticalSection cs_vNodes;
 extern std::vector<std::string> vAddedNodes;
 extern CCriticalSection cs_vAddedNodes;
 
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CTransactionRef> mapRelay;
 extern std::deque<std::pair<int64, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern std::map<CInv, int64> mapAlreadyAskedFor;
@@ -683,8 +691,7 @@ inline void RelayInventory(const CInv& inv)
     }
 }
 
-class CTransaction;
 void RelayTransaction(const CTransaction& tx, const uint256& hash);
-void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataStream& ss);
+void RelayTransaction(const CTransactionRef& ptx, const uint256& hash);
 
 #endif /* NET_H */
@@ -0,0 +1,247 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef PREVECTOR_H
+#define PREVECTOR_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <iterator>
+#include <new>
+
+/* A vector of plain data which keeps up to N elements within the object itself
+ * and allocates on the heap only for larger sizes. The element type must be
+ * copyable with memcpy() as the contents are moved around as raw memory.
+ * Iterators are plain pointers and any change of the capacity invalidates them,
+ * including the transition between the inline and heap storage */
+#pragma pack(push, 1)
+template<unsigned int N, typename T> class prevector {
+public:
+    typedef uint32_t size_type;
+    typedef int32_t difference_type;
+    typedef T value_type;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T* iterator;
+    typedef const T* const_iterator;
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+private:
+    /* The size itself for inline storage, the size plus N + 1 for heap storage */
+    size_type _size;
+    union {
+        char direct[sizeof(T) * N];
+        struct {
+            char *indirect;
+            size_type capacity;
+        } heap;
+    } _union;
+
+    bool is_direct() const { return(_size <= N); }
+
+    T *direct_ptr(difference_type pos) { return(reinterpret_cast<T *>(_union.direct) + pos); }
+    const T *direct_ptr(difference_type pos) const { return(reinterpret_cast<const T *>(_union.direct) + pos); }
+    T *indirect_ptr(difference_type pos) { return(reinterpret_cast<T *>(_union.heap.indirect) + pos); }
+    const T *indirect_ptr(difference_type pos) const { return(reinterpret_cast<const T *>(_union.heap.indirect) + pos); }
+
+    T *item_ptr(difference_type pos) { return(is_direct() ? direct_ptr(pos) : indirect_ptr(pos)); }
+    const T *item_ptr(difference_type pos) const { return(is_direct() ? direct_ptr(pos) : indirect_ptr(pos)); }
+
+    void change_capacity(size_type new_capacity) {
+        if(new_capacity <= N) {
+            if(!is_direct()) {
+                /* Back to the inline storage */
+                char *indirect = _union.heap.indirect;
+                memcpy(_union.direct, indirect, size() * sizeof(T));
+                free(indirect);
+                _size -= N + 1;
+            }
+        } else {
+            if(!is_direct()) {
+                char *indirect = static_cast<char *>(realloc(_union.heap.indirect, new_capacity * sizeof(T)));
+                if(!indirect) throw(std::bad_alloc());
+                _union.heap.indirect = indirect;
+                _union.heap.capacity = new_capacity;
+            } else {
+                /* Out to the heap */
+                char *indirect = static_cast<char *>(malloc(new_capacity * sizeof(T)));
+                if(!indirect) throw(std::bad_alloc());
+                memcpy(indirect, _union.direct, size() * sizeof(T));
+                _union.heap.indirect = indirect;
+                _union.heap.capacity = new_capacity;
+                _size += N + 1;
+            }
+        }
+    }
+
+    /* Room for at least one more element with the usual growth */
+    void grow(size_type new_size) {
+        if(capacity() < new_size)
+          change_capacity(new_size + (new_size >> 1));
+    }
+
+public:
+    prevector() : _size(0) { }
+
+    explicit prevector(size_type n) : _size(0) {
+        resize(n);
+    }
+
+    template<typename InputIterator>
+    prevector(InputIterator first, InputIterator last) : _size(0) {
+        assign(first, last);
+    }
+
+    prevector(const prevector<N, T> &other) : _size(0) {
+        assign(other.begin(), other.end());
+    }
+
+    ~prevector() {
+        if(!is_direct()) free(_union.heap.indirect);
+    }
+
+    prevector &operator=(const prevector<N, T> &other) {
+        if(&other != this) assign(other.begin(), other.end());
+        return(*this);
+    }
+
+    size_type size() const { return(is_direct() ? _size : _size - N - 1); }
+    bool empty() const { return(!size()); }
+    size_t capacity() const { return(is_direct() ? N : _union.heap.capacity); }
+
+    /* Heap memory in use, zero while stored inline */
+    size_t allocated_memory() const { return(is_direct() ? 0 : _union.heap.capacity * sizeof(T)); }
+
+    iterator begin() { return(item_ptr(0)); }
+    const_iterator begin() const { return(item_ptr(0)); }
+    iterator end() { return(item_ptr(size())); }
+    const_iterator end() const { return(item_ptr(size())); }
+
+    reverse_iterator rbegin() { return(reverse_iterator(end())); }
+    const_reverse_iterator rbegin() const { return(const_reverse_iterator(end())); }
+    reverse_iterator rend() { return(reverse_iterator(begin())); }
+    const_reverse_iterator rend() const { return(const_reverse_iterator(begin())); }
+
+    T &operator[](size_type pos) { return(*item_ptr(pos)); }
+    const T &operator[](size_type pos) const { return(*item_ptr(pos)); }
+    T &front() { return(*item_ptr(0)); }
+    const T &front() const { return(*item_ptr(0)); }
+    T &back() { return(*item_ptr(size() - 1)); }
+    const T &back() const { return(*item_ptr(size() - 1)); }
+    T *data() { return(item_ptr(0)); }
+    const T *data() const { return(item_ptr(0)); }
+
+    template<typename InputIterator>
+    void assign(InputIterator first, InputIterator last) {
+        size_type n = std::distance(first, last);
+        _size -= size();
+        if(capacity() < n) change_capacity(n);
+        std::copy(first, last, item_ptr(0));
+        _size += n;
+    }
+
+    void reserve(size_type new_capacity) {
+        if(new_capacity > capacity()) change_capacity(new_capacity);
+    }
+
+    void shrink_to_fit() {
+        change_capacity(size());
+    }
+
+    /* New elements are zero filled */
+    void resize(size_type new_size) {
+        size_type cur_size = size();
+        if(new_size > cur_size) {
+            if(capacity() < new_size) change_capacity(new_size);
+            memset(item_ptr(cur_size), 0, (new_size - cur_size) * sizeof(T));
+            _size += new_size - cur_size;
+        } else {
+            _size -= cur_size - new_size;
+        }
+    }
+
+    void clear() {
+        resize(0);
+    }
+
+    iterator insert(iterator pos, const T &value) {
+        T tmp(value);
+        size_type p = pos - item_ptr(0);
+        grow(size() + 1);
+        T *ptr = item_ptr(p);
+        memmove(ptr + 1, ptr, (size() - p) * sizeof(T));
+        *ptr = tmp;
+        _size++;
+        return(ptr);
+    }
+
+    void insert(iterator pos, size_type count, const T &value) {
+        T tmp(value);
+        size_type p = pos - item_ptr(0);
+        if(capacity() < (size() + count)) change_capacity(size() + count);
+        T *ptr = item_ptr(p);
+        memmove(ptr + count, ptr, (size() - p) * sizeof(T));
+        std::fill(ptr, ptr + count, tmp);
+        _size += count;
+    }
+
+    /* The source range must not point into this vector, as with std::vector */
+    template<typename InputIterator>
+    void insert(iterator pos, InputIterator first, InputIterator last) {
+        size_type p = pos - item_ptr(0);
+        size_type count = std::distance(first, last);
+        if(capacity() < (size() + count)) change_capacity(size() + count);
+        T *ptr = item_ptr(p);
+        memmove(ptr + count, ptr, (size() - p) * sizeof(T));
+        std::copy(first, last, ptr);
+        _size += count;
+    }
+
+    iterator erase(iterator pos) {
+        return(erase(pos, pos + 1));
+    }
+
+    iterator erase(iterator first, iterator last) {
+        memmove(first, last, (end() - last) * sizeof(T));
+        _size -= last - first;
+        return(first);
+    }
+
+    void push_back(const T &value) {
+        T tmp(value);
+        grow(size() + 1);
+        *item_ptr(size()) = tmp;
+        _size++;
+    }
+
+    void pop_back() {
+        _size--;
+    }
+
+    void swap(prevector<N, T> &other) {
+        std::swap(_union, other._union);
+        std::swap(_size, other._size);
+    }
+
+    bool operator==(const prevector<N, T> &other) const {
+        return((size() == other.size()) && std::equal(begin(), end(), other.begin()));
+    }
+
+    bool operator!=(const prevector<N, T> &other) const {
+        return(!(*this == other));
+    }
+
+    bool operator<(const prevector<N, T> &other) const {
+        return(std::lexicographical_compare(begin(), end(), other.begin(), other.end()));
+    }
+};
+#pragma pack(pop)
+
+#endif /* PREVECTOR_H */
@@ -265,8 +265,8 @@ static const CRPCCommand vRPCCommands[] =
     { "listreceivedbyaddress",  &listreceivedbyaddress,  false,  false },
     { "listreceivedbyaccount",  &listreceivedbyaccount,  false,  false },
     { "backupwallet",           &backupwallet,           true,   false },
-    { "keypoolrefill",          &keypoolrefill,          true,   false },
-    { "keypoolreset",           &keypoolreset,           true,   false },
+    { "keypoolrefill",          &keypoolrefill,          true,   true },
+    { "keypoolreset",           &keypoolreset,           true,   true },
     { "walletpassphrase",       &walletpassphrase,       true,   false },
     { "walletpassphrasechange", &walletpassphrasechange, false,  false },
     { "walletlock",             &walletlock,             true,   false },
@@ -281,6 +281,7 @@ static const CRPCCommand vRPCCommands[] =
     { "createmultisig",         &createmultisig,         false,  false },
     { "addredeemscript",        &addredeemscript,        false,  false },
     { "getrawmempool",          &getrawmempool,          true,   false },
+    { "getmempoolinfo",         &getmempoolinfo,         true,   false },
     { "getblock",               &getblock,               false,  false },
     { "getblockbynumber",       &getblockbynumber,       false,  false },
     { "getblockhash",           &getblockhash,           false,  false },
@@ -293,7 +294,7 @@ static const CRPCCommand vRPCCommands[] =
     { "getwork",                &getwork,                true,   false },
     { "listaccounts",           &listaccounts,           false,  false },
     { "settxfee",               &settxfee,               false,  false },
-    { "getblocktemplate",       &getblocktemplate,       true,   false },
+    { "getblocktemplate",       &getblocktemplate,       true,   true  },
     { "submitblock",            &submitblock,            false,  false },
     { "listsinceblock",         &listsinceblock,         false,  false },
     { "checkwallet",            &checkwallet,            false,  true  },
@@ -312,8 +313,11 @@ static const CRPCCommand vRPCCommands[] =
     { "decodescript",           &decodescript,           false,  false },
     { "signrawtransaction",     &signrawtransaction,     false,  false },
     { "sendrawtransaction",     &sendrawtransaction,     false,  false },
-    { "gettxoutsetinfo",        &gettxoutsetinfo,        true,   false },
+    { "gettxoutsetinfo",        &gettxoutsetinfo,        true,   true },
     { "gettxout",               &gettxout,               true,   false },
+    { "getaddressbalance",      &getaddressbalance,      true,   false },
+    { "getaddressutxos",        &getaddressutxos,        true,   false },
+    { "getaddresshistory",      &getaddresshistory,      true,   false },
     { "makekeypair",            &makekeypair,            false,  true  },
     { "getnetworkhashps",       &getnetworkhashps,       true,   false },
     { "getstakegen",            &getstakegen,            true,   false },
@@ -1290,8 +1294,11 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "createrawtransaction"   && n > 1) ConvertTo<Object>(params[1]);
     if (strMethod == "signrawtransaction"     && n > 1) ConvertTo<Array>(params[1], true);
     if (strMethod == "signrawtransaction"     && n > 2) ConvertTo<Array>(params[2], true);
+    if (strMethod == "gettxoutsetinfo"        && n > 0) ConvertTo<bool>(params[0]);
     if (strMethod == "gettxout"               && n > 1) ConvertTo<boost::int64_t>(params[1]);
     if (strMethod == "gettxout"               && n > 2) ConvertTo<bool>(params[2]);
+    if (strMethod == "getaddresshistory"      && n > 1) ConvertTo<boost::int64_t>(params[1]);
+    if (strMethod == "getaddresshistory"      && n > 2) ConvertTo<boost::int64_t>(params[2]);
     if(strMethod == "keypoolrefill"           && n > 0) ConvertTo<boost::int64_t>(params[0]);
     if(strMethod == "keypoolreset"            && n > 0) ConvertTo<boost::int64_t>(params[0]);
 
@@ -4,6 +4,8 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "main.h"
+#include "txdb.h"
+#include "base58.h"
 #include "rpc.h"
 
 using namespace json_spirit;
@@ -114,7 +116,7 @@ Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPri
         result.push_back(Pair("nextblockhash", blockindex->pnext->GetBlockHash().GetHex()));
 
     result.push_back(Pair("flags", strprintf("%s%s", blockindex->IsProofOfStake()? "proof-of-stake" : "proof-of-work", blockindex->GeneratedStakeModifier()? " stake-modifier": "")));
-    result.push_back(Pair("proofhash", blockindex->IsProofOfStake()? blockindex->hashProofOfStake.GetHex() : block.GetHashPoW().GetHex()));
+    result.push_back(Pair("proofhash", blockindex->IsProofOfStake()? blockindex->GetStake().hashProofOfStake.GetHex() : block.GetHashPoW().GetHex()));
     result.push_back(Pair("entropybit", (int)blockindex->GetStakeEntropyBit()));
     result.push_back(Pair("modifier", strprintf("%016" PRI64x, blockindex->nStakeModifier)));
     result.push_back(Pair("modifierchecksum", strprintf("%08x", blockindex->nStakeModifierChecksum)));
@@ -213,6 +215,23 @@ Value getrawmempool(const Array& params, bool fHelp)
     return a;
 }
 
+Value getmempoolinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmempoolinfo\n"
+            "Returns details on the transaction memory pool.");
+
+    Object obj;
+    obj.push_back(Pair("size",          (boost::uint64_t)mempool.size()));
+    obj.push_back(Pair("bytes",         (boost::uint64_t)mempool.GetTotalTxSize()));
+    obj.push_back(Pair("usage",         (boost::uint64_t)mempool.DynamicMemoryUsage()));
+    obj.push_back(Pair("maxmempool",    (boost::uint64_t)mempool.nMaxUsage));
+    obj.push_back(Pair("mempoolminfee", ValueFromAmount(std::max(mempool.GetMinFeeRate(), MIN_RELAY_TX_FEE))));
+
+    return obj;
+}
+
 Value getblockhash(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -244,6 +263,8 @@ Value getblock(const Array& params, bool fHelp)
 
     CBlock block;
     CBlockIndex* pblockindex = mapBlockIndex[hash];
+    if(!(pblockindex->nStatus & BLOCK_HAVE_DATA))
+      throw(JSONRPCError(RPC_MISC_ERROR, "Block not available (pruned data)"));
     block.ReadFromDisk(pblockindex, true);
 
     return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
@@ -269,6 +290,8 @@ Value getblockbynumber(const Array& params, bool fHelp)
     uint256 hash = *pblockindex->phashBlock;
 
     pblockindex = mapBlockIndex[hash];
+    if(!(pblockindex->nStatus & BLOCK_HAVE_DATA))
+      throw(JSONRPCError(RPC_MISC_ERROR, "Block not available (pruned data)"));
     block.ReadFromDisk(pblockindex, true);
 
     return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
@@ -308,21 +331,70 @@ Value getcheckpoint(const Array& params, bool fHelp)
 
 Value gettxoutsetinfo(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "gettxoutsetinfo\n"
-            "Returns statistics about the unspent transaction output set.");
+            "gettxoutsetinfo [verify=false]\n"
+            "Returns statistics about the unspent transaction output set.\n"
+            "The counters and the order independent hash_serialized of the set are maintained\n"
+            "as the chain state changes; if [verify] is true, they are compared against\n"
+            "a full scan of the set which also reports prunedtx and bytes_serialized.");
+
+    bool fVerify = false;
+    if (params.size() > 0)
+        fVerify = params[0].get_bool();
+
+    CCoinsStats stats, statsScan;
+    uint i;
+
+    /* A few attempts as the scan may catch a newer chain state than the one committed */
+    for(i = 0; i < 3; i++) {
+        CCoinsViewDB *pcoinsdb = NULL;
+        {
+            LOCK(cs_main);
+            if(fShutdown || !pcoinsTip || !pcoinsdbview)
+              throw JSONRPCError(RPC_MISC_ERROR, "Shutting down");
+            if(fVerify && !CommitChainState(true))
+              throw JSONRPCError(RPC_DATABASE_ERROR, "Failed to commit the chain state");
+            if(!pcoinsTip->GetStats(stats))
+              throw JSONRPCError(RPC_DATABASE_ERROR, "Statistics of the unspent transaction output set unavailable");
+            if(fVerify) {
+                pcoinsdb = pcoinsdbview;
+                pcoinsdb->BeginScan();
+            }
+        }
 
-    Object ret;
+        if(!fVerify)
+          break;
+
+        bool fScanned = pcoinsdb->ScanStats(statsScan);
+        pcoinsdb->EndScan();
+        if(!fScanned)
+          throw JSONRPCError(RPC_DATABASE_ERROR, "Failed to scan the unspent transaction output set");
+
+        if(statsScan.hashBlock == stats.hashBlock)
+          break;
+    }
 
-    CCoinsStats stats;
-    if (pcoinsTip->GetStats(stats)) {
-        ret.push_back(Pair("bestblock", pcoinsTip->GetBestBlock()->GetBlockHash().GetHex()));
-        ret.push_back(Pair("availabletx", (boost::int64_t)stats.nTransactions));
-        ret.push_back(Pair("prunedtx", (boost::int64_t)stats.nPrunedTransactions));
-        ret.push_back(Pair("txouts", (boost::int64_t)stats.nTransactionOutputs));
-        ret.push_back(Pair("bytes_serialized", (boost::int64_t)stats.nSerializedSize));
+    if(fVerify && (statsScan.hashBlock != stats.hashBlock))
+      throw JSONRPCError(RPC_MISC_ERROR, "The chain state keeps changing, try again later");
+
+    Object ret;
+    ret.push_back(Pair("height", stats.nHeight));
+    ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
+    ret.push_back(Pair("availabletx", (boost::int64_t)stats.nTransactions));
+    ret.push_back(Pair("txouts", (boost::int64_t)stats.nTransactionOutputs));
+    ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
+    ret.push_back(Pair("hash_serialized", stats.muhash.Finalize().GetHex()));
+
+    if(fVerify) {
+        ret.push_back(Pair("prunedtx", (boost::int64_t)statsScan.nPrunedTransactions));
+        ret.push_back(Pair("bytes_serialized", (boost::int64_t)statsScan.nSerializedSize));
+        ret.push_back(Pair("verified", (statsScan.nTransactions == stats.nTransactions) &&
+          (statsScan.nTransactionOutputs == stats.nTransactionOutputs) &&
+          (statsScan.nTotalAmount == stats.nTotalAmount) &&
+          (statsScan.muhash.Finalize() == stats.muhash.Finalize())));
     }
+
     return ret;
 }
 
@@ -374,3 +446,117 @@ Value gettxout(const Array& params, bool fHelp)
 
     return ret;
 }
+
+/* Key or script hash of an address to look up in the address index */
+static uint160 GetAddressIndexParam(const Value &param) {
+
+    if(!fAddressIndex)
+      throw(JSONRPCError(RPC_MISC_ERROR, "Address index not enabled, restart with -addressindex -reindex"));
+
+    CCoinAddress address(param.get_str());
+    if(!address.IsValid())
+      throw(JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid Orbitcoin address"));
+
+    return(GetAddressIndexHash(address.Get()));
+}
+
+Value getaddressbalance(const Array& params, bool fHelp)
+{
+    if(fHelp || (params.size() != 1))
+      throw(runtime_error(
+        "getaddressbalance <address>\n"
+        "Returns the confirmed balance and the total amount received by <address>.\n"
+        "Requires -addressindex."));
+
+    uint160 hashScript = GetAddressIndexParam(params[0]);
+
+    std::vector<std::pair<CAddressIndexKey, int64> > vHistory;
+    if(!pblocktree->ReadAddressIndex(hashScript, vHistory))
+      throw(JSONRPCError(RPC_DATABASE_ERROR, "Unable to read the address index"));
+
+    int64 nBalance = 0, nReceived = 0;
+    std::vector<std::pair<CAddressIndexKey, int64> >::const_iterator it;
+    for(it = vHistory.begin(); it != vHistory.end(); it++) {
+        nBalance += it->second;
+        if(!it->first.fSpending)
+          nReceived += it->second;
+    }
+
+    Object result;
+    result.push_back(Pair("balance", ValueFromAmount(nBalance)));
+    result.push_back(Pair("received", ValueFromAmount(nReceived)));
+
+    return(result);
+}
+
+Value getaddressutxos(const Array& params, bool fHelp)
+{
+    if(fHelp || (params.size() != 1))
+      throw(runtime_error(
+        "getaddressutxos <address>\n"
+        "Returns the confirmed unspent outputs of <address>.\n"
+        "Requires -addressindex."));
+
+    uint160 hashScript = GetAddressIndexParam(params[0]);
+
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspent;
+    if(!pblocktree->ReadAddressUnspentIndex(hashScript, vUnspent))
+      throw(JSONRPCError(RPC_DATABASE_ERROR, "Unable to read the address index"));
+
+    Array result;
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it;
+    for(it = vUnspent.begin(); it != vUnspent.end(); it++) {
+        Object entry;
+        entry.push_back(Pair("txid", it->first.txid.GetHex()));
+        entry.push_back(Pair("vout", (int)it->first.nIndex));
+        entry.push_back(Pair("amount", ValueFromAmount(it->second.nValue)));
+        entry.push_back(Pair("scriptPubKey", HexStr(it->second.scriptPubKey.begin(), it->second.scriptPubKey.end())));
+        entry.push_back(Pair("height", it->second.nHeight));
+        entry.push_back(Pair("confirmations", nBestHeight - it->second.nHeight + 1));
+        result.push_back(entry);
+    }
+
+    return(result);
+}
+
+Value getaddresshistory(const Array& params, bool fHelp)
+{
+    if(fHelp || (params.size() < 1) || (params.size() > 3))
+      throw(runtime_error(
+        "getaddresshistory <address> [skip=0] [count=100]\n"
+        "Returns up to [count] confirmed credits and debits of <address> oldest first\n"
+        "skipping the first [skip] of them.\n"
+        "Requires -addressindex."));
+
+    uint160 hashScript = GetAddressIndexParam(params[0]);
+
+    int64 nSkip = 0, nCount = 100;
+    if(params.size() > 1)
+      nSkip = params[1].get_int64();
+    if(params.size() > 2)
+      nCount = params[2].get_int64();
+    if((nSkip < 0) || (nCount < 1) || (nCount > 10000))
+      throw(JSONRPCError(RPC_INVALID_PARAMETER, "Invalid skip or count"));
+
+    std::vector<std::pair<CAddressIndexKey, int64> > vHistory;
+    if(!pblocktree->ReadAddressIndex(hashScript, vHistory, (uint)nSkip, (uint)nCount))
+      throw(JSONRPCError(RPC_DATABASE_ERROR, "Unable to read the address index"));
+
+    Array result;
+    std::vector<std::pair<CAddressIndexKey, int64> >::const_iterator it;
+    for(it = vHistory.begin(); it != vHistory.end(); it++) {
+        Object entry;
+        entry.push_back(Pair("txid", it->first.txid.GetHex()));
+        entry.push_back(Pair(it->first.fSpending ? "vin" : "vout", (int)it->first.nIndex));
+        entry.push_back(Pair("amount", ValueFromAmount(it->second)));
+        entry.push_back(Pair("height", it->first.nHeight));
+        CBlockIndex *pindex = FindBlockByHeight(it->first.nHeight);
+        if(pindex) {
+            entry.push_back(Pair("blockhash", pindex->GetBlockHash().GetHex()));
+            entry.push_back(Pair("time", (boost::int64_t)pindex->GetBlockTime()));
+        }
+        result.push_back(entry);
+    }
+
+    return(result);
+}
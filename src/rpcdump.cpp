@@ -65,6 +65,9 @@ Value importprivkey(const Array& params, bool fHelp) {
     {
         LOCK2(cs_main, pwalletMain->cs_wallet);
 
+        if(fRescan && !HaveBlockData(pindexGenesisBlock))
+          throw(JSONRPCError(RPC_WALLET_ERROR, "Rescans are not possible in pruned mode, import with rescan=false"));
+
         pwalletMain->MarkDirty();
         pwalletMain->SetAddressBookName(vchAddress, strLabel);
 
@@ -145,6 +148,9 @@ Value importaddress(const Array &params, bool fHelp) {
     {
         LOCK2(cs_main, pwalletMain->cs_wallet);
 
+        if(fRescan && !HaveBlockData(pindexGenesisBlock))
+          throw(JSONRPCError(RPC_WALLET_ERROR, "Rescans are not possible in pruned mode, import with rescan=false"));
+
         if(::IsMine(*pwalletMain, script) == MINE_SPENDABLE)
           throw(JSONRPCError(RPC_WALLET_ERROR, "The private key is already in the wallet"));
 
@@ -202,6 +208,9 @@ Value importpubkey(const Array &params, bool fHelp) {
     {
         LOCK2(cs_main, pwalletMain->cs_wallet);
 
+        if(fRescan && !HaveBlockData(pindexGenesisBlock))
+          throw(JSONRPCError(RPC_WALLET_ERROR, "Rescans are not possible in pruned mode, import with rescan=false"));
+
         if(::IsMine(*pwalletMain, script) == MINE_SPENDABLE)
           throw(JSONRPCError(RPC_WALLET_ERROR, "The private key is already in the wallet"));
 
@@ -9,6 +9,8 @@
 #include "miner.h"
 #include "rpc.h"
 
+#include <boost/scoped_ptr.hpp>
+
 using namespace json_spirit;
 using namespace std;
 
@@ -98,22 +100,25 @@ Value getwork(const Array& params, bool fHelp) {
     if (IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Orbitcoin is downloading blocks...");
 
+    /* Serialised by cs_main as the call isn't unlocked */
     typedef map<uint256, pair<CBlock*, CScript> > mapNewBlock_t;
-    static mapNewBlock_t mapNewBlock;    // FIXME: thread safety
+    static mapNewBlock_t mapNewBlock;
     static vector<CBlock*> vNewBlock;
     static CReserveKey reservekey(pwalletMain);
 
     if (params.size() == 0)
     {
         // Update block
-        static unsigned int nTransactionsUpdatedLast;
+        static uint nTemplateId = 0;
         static CBlockIndex* pindexPrev;
-        static int64 nStart;
         static CBlock* pblock;
-        if (pindexPrev != pindexBest ||
-            (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60))
+        CBlock *pblockNew;
+        CBlockIndex *pindexPrevNew;
+        if(!GetBlockTemplate(pwalletMain, 60, nTemplateId, pblockNew, pindexPrevNew))
+          throw(JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory"));
+        if(pblockNew)
         {
-            if (pindexPrev != pindexBest)
+            if (pindexPrev != pindexPrevNew)
             {
                 // Deallocate old blocks since they're obsolete now
                 mapNewBlock.clear();
@@ -121,22 +126,8 @@ Value getwork(const Array& params, bool fHelp) {
                     delete pblock;
                 vNewBlock.clear();
             }
-
-            // Clear pindexPrev so future getworks make a new block, despite any failures from here on
-            pindexPrev = NULL;
-
-            // Store the pindexBest used before CreateNewBlock, to avoid races
-            nTransactionsUpdatedLast = nTransactionsUpdated;
-            CBlockIndex* pindexPrevNew = pindexBest;
-            nStart = GetTime();
-
-            // Create new block
-            pblock = CreateNewBlock(pwalletMain, false);
-            if (!pblock)
-                throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+            pblock = pblockNew;
             vNewBlock.push_back(pblock);
-
-            // Need to update only after we know CreateNewBlock succeeded
             pindexPrev = pindexPrevNew;
         }
 
@@ -233,12 +224,16 @@ Value getblocktemplate(const Array& params, bool fHelp) {
             "  \"sizelimit\" : limit of block size\n"
             "  \"bits\" : compressed target of next block\n"
             "  \"height\" : height of the next block\n"
+            "  \"longpollid\" : identifier to pass back for long polling\n"
+            "If [params] contain \"longpollid\", waits for the best block or transactions to change.\n"
             "See https://en.bitcoin.it/wiki/BIP_0022 for full specification.");
 
     std::string strMode = "template";
+    Value lpval = Value::null;
     if (params.size() > 0)
     {
         const Object& oparam = params[0].get_obj();
+        lpval = find_value(oparam, "longpollid");
         const Value& modeval = find_value(oparam, "mode");
         if (modeval.type() == str_type)
             strMode = modeval.get_str();
@@ -256,40 +251,38 @@ Value getblocktemplate(const Array& params, bool fHelp) {
     if (vNodes.empty())
         throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Orbitcoin is not connected!");
 
+    /* Long polling waits for the best chain to change or, once in a while,
+     * for the memory pool to be updated; the identifier is the previous
+     * block hash followed by the memory pool update counter */
+    if(lpval.type() == str_type) {
+        std::string strLongPollId = lpval.get_str();
+        uint256 hashWatched;
+        hashWatched.SetHex(strLongPollId.substr(0, 64));
+        uint nTxWatched = (strLongPollId.size() > 64) ? atoi(strLongPollId.substr(64)) : 0;
+
+        int nWait = 0;
+        while(!WaitForBestChain(hashWatched, 10000) && !fShutdown) {
+            nWait += 10;
+            if((nWait >= 60) && (nTransactionsUpdated != nTxWatched))
+              break;
+        }
+        if(fShutdown)
+          throw(JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Shutting down"));
+    }
+
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+
     if (IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Orbitcoin is downloading blocks...");
 
-    static CReserveKey reservekey(pwalletMain);
-
     // Update block
-    static unsigned int nTransactionsUpdatedLast;
-    static CBlockIndex* pindexPrev;
-    static int64 nStart;
-    static CBlock* pblock;
-    if (pindexPrev != pindexBest ||
-        (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 5))
-    {
-        // Clear pindexPrev so future calls make a new block, despite any failures from here on
-        pindexPrev = NULL;
-
-        // Store the pindexBest used before CreateNewBlock, to avoid races
-        nTransactionsUpdatedLast = nTransactionsUpdated;
-        CBlockIndex* pindexPrevNew = pindexBest;
-        nStart = GetTime();
-
-        // Create new block
-        if(pblock)
-        {
-            delete pblock;
-            pblock = NULL;
-        }
-        pblock = CreateNewBlock(pwalletMain, false);
-        if (!pblock)
-            throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
-
-        // Need to update only after we know CreateNewBlock succeeded
-        pindexPrev = pindexPrevNew;
-    }
+    uint nTxUpdated = nTransactionsUpdated;
+    uint nTemplateId = 0;
+    CBlock *pblockNew;
+    CBlockIndex *pindexPrev;
+    if(!GetBlockTemplate(pwalletMain, 5, nTemplateId, pblockNew, pindexPrev))
+      throw(JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory"));
+    boost::scoped_ptr<CBlock> pblock(pblockNew);
 
     // Update nTime
     pblock->UpdateTime(pindexPrev);
@@ -350,6 +343,7 @@ Value getblocktemplate(const Array& params, bool fHelp) {
     Object result;
     result.push_back(Pair("version", pblock->nVersion));
     result.push_back(Pair("previousblockhash", pblock->hashPrevBlock.GetHex()));
+    result.push_back(Pair("longpollid", pindexPrev->GetBlockHash().GetHex() + i64tostr(nTxUpdated)));
     result.push_back(Pair("transactions", transactions));
     result.push_back(Pair("coinbaseaux", aux));
     result.push_back(Pair("coinbasevalue", (boost::int64_t)pblock->vtx[0].vout[0].nValue));
@@ -660,6 +660,9 @@ Value movecmd(const Array& params, bool fHelp)
     if (!walletdb.TxnCommit())
         throw JSONRPCError(RPC_DATABASE_ERROR, "database error");
 
+    pwalletMain->AddAccountingEntry(debit);
+    pwalletMain->AddAccountingEntry(credit);
+
     return true;
 }
 
@@ -1164,8 +1167,7 @@ Value listtransactions(const Array& params, bool fHelp)
 
     Array ret;
 
-    std::list<CAccountingEntry> acentries;
-    CWallet::TxItems txOrdered = pwalletMain->OrderedTxItems(acentries, strAccount);
+    CWallet::TxItems& txOrdered = pwalletMain->wtxOrdered;
 
     // iterate backwards until we have nCount items to return:
     for (CWallet::TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
@@ -1279,12 +1281,13 @@ Value listsinceblock(const Array& params, bool fHelp)
 
     Array transactions;
 
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
+    // only the transactions above the block or not in the main chain are candidates
+    vector<const CWalletTx*> vwtx;
+    pwalletMain->GetTransactionsSince(pindex ? pindex->nHeight : -1, vwtx);
+    BOOST_FOREACH(const CWalletTx* pwtx, vwtx)
     {
-        CWalletTx tx = (*it).second;
-
-        if (depth == -1 || tx.GetDepthInMainChain() < depth)
-            ListTransactions(tx, "*", 0, true, transactions);
+        if (depth == -1 || pwtx->GetDepthInMainChain() < depth)
+            ListTransactions(*pwtx, "*", 0, true, transactions);
     }
 
     uint256 lastblock;
@@ -1362,7 +1365,7 @@ Value gettransaction(const Array& params, bool fHelp)
             else
             {
                 entry.push_back(Pair("blockhash", hashBlock.GetHex()));
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+                BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
                 if (mi != mapBlockIndex.end() && (*mi).second)
                 {
                     CBlockIndex* pindex = (*mi).second;
@@ -1401,7 +1404,8 @@ Value keypoolrefill(const Array &params, bool fHelp) {
     if(fHelp || (params.size() > 1))
       throw(runtime_error(
         "keypoolrefill [new-size]\n"
-        "Adds new reserved keys to the key pool up to its size."
+        "Adds new reserved keys to the key pool up to its size.\n"
+        "Keys are committed in batches, keypoolsize of getinfo reports the progress."
         + HelpRequiringPassphrase()));
 
     uint nSize = (uint)GetArg("-keypool", 100);
@@ -1429,7 +1433,8 @@ Value keypoolreset(const Array &params, bool fHelp) {
       throw(runtime_error(
         "keypoolreset [new-size]\n"
         "Removes any remaining keys from the key pool, labels them as used,\n"
-        "and adds new reserved keys to the key pool up to its size."
+        "and adds new reserved keys to the key pool up to its size.\n"
+        "Keys are committed in batches, keypoolsize of getinfo reports the progress."
         + HelpRequiringPassphrase()));
 
     uint nSize = (uint)GetArg("-keypool", 100);
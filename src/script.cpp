@@ -18,7 +18,7 @@ using namespace boost;
 #include "util.h"
 
 bool CheckSig(vector<uchar> vchSig, vector<uchar> vchPubKey, CScript scriptCode,
-  const CTransaction& txTo, uint nIn, int nHashType);
+  const CTransaction& txTo, uint nIn, int nHashType, CSigHashCache *psighashcache = NULL);
 
 typedef vector<uchar> valtype;
 static const valtype vchFalse(0);
@@ -382,7 +382,7 @@ bool static CheckSignatureEncoding(const valtype &vchSig, uint flags) {
 }
 
 bool EvalScript(vector<vector<uchar> > &stack, const CScript &script, const CTransaction &txTo,
-  uint nIn, uint flags, int nHashType) {
+  uint nIn, uint flags, int nHashType, CSigHashCache *psighashcache) {
     CAutoBN_CTX pctx;
     CScript::const_iterator pc = script.begin();
     CScript::const_iterator pend = script.end();
@@ -1062,7 +1062,7 @@ bool EvalScript(vector<vector<uchar> > &stack, const CScript &script, const CTra
                       (IsCanonicalSignature(vchSig) && IsCanonicalPubKey(vchPubKey)));
 
                     if(fSuccess)
-                      fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType);
+                      fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, psighashcache);
 
                     popstack(stack);
                     popstack(stack);
@@ -1123,7 +1123,8 @@ bool EvalScript(vector<vector<uchar> > &stack, const CScript &script, const CTra
                         bool fOk = (!fStrictEncodings ||
                           (IsCanonicalSignature(vchSig) && IsCanonicalPubKey(vchPubKey)));
 
-                        if(fOk) fOk = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType);
+                        if(fOk) fOk = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType,
+                          psighashcache);
 
                         if(fOk) {
                             isig++;
@@ -1165,8 +1166,12 @@ bool EvalScript(vector<vector<uchar> > &stack, const CScript &script, const CTra
 }
 
 
+/* Serialises the signature hash preimage directly into the hasher;
+ * the transaction is never copied, other inputs are written with empty scripts
+ * and the outputs are blanked as the hash type requires */
 uint256 SignatureHash(CScript scriptCode, const CTransaction &txTo, uint nIn,
-  int nHashType) {
+  int nHashType, CSigHashCache *psighashcache) {
+    static const CTxOut txoutNull;
     uint i;
 
     if(nIn >= txTo.vin.size()) {
@@ -1174,57 +1179,107 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction &txTo, uint nIn,
         return(1);
     }
 
-    CTransaction txTmp(txTo);
-
     // In case concatenating two scripts ends up with two codeseparators,
     // or an extra one at the end, this prevents all those possible incompatibilities.
     scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
 
-    // Blank out other inputs' signatures
-    for(i = 0; i < txTmp.vin.size(); i++)
-      txTmp.vin[i].scriptSig = CScript();
+    bool fAnyoneCanPay = (nHashType & SIGHASH_ANYONECANPAY);
+    bool fNone = ((nHashType & 0x1F) == SIGHASH_NONE);
+    bool fSingle = ((nHashType & 0x1F) == SIGHASH_SINGLE);
 
-    txTmp.vin[nIn].scriptSig = scriptCode;
+    // Only lock-in the txout payee at same index as txin
+    if(fSingle && (nIn >= txTo.vout.size())) {
+        printf("ERROR: SignatureHash() : nOut=%d out of range\n", nIn);
+        return(1);
+    }
 
-    // Blank out some of the outputs
-    if((nHashType & 0x1F) == SIGHASH_NONE) {
+    // The common case shares most of the preimage between inputs
+    if(psighashcache && !fAnyoneCanPay && !fNone && !fSingle)
+      return(psighashcache->SignatureHashAll(scriptCode, nIn, nHashType));
 
-        // Wildcard payee
-        txTmp.vout.clear();
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << txTo.nVersion << txTo.nTime;
 
+    // Blank out other inputs completely, not recommended for open transactions
+    WriteCompactSize(ss, fAnyoneCanPay ? 1 : txTo.vin.size());
+    for(i = 0; i < txTo.vin.size(); i++) {
+        if(fAnyoneCanPay && (i != nIn)) continue;
+        const CTxIn &txin = txTo.vin[i];
+        ss << txin.prevout;
+        // Blank out other inputs' signatures
+        if(i == nIn) ss << scriptCode;
+        else WriteCompactSize(ss, 0);
         // Let the others update at will
-        for(i = 0; i < txTmp.vin.size(); i++)
-          if(i != nIn) txTmp.vin[i].nSequence = 0;
+        if((i != nIn) && (fNone || fSingle)) ss << (uint)0;
+        else ss << txin.nSequence;
+    }
 
-    } else if((nHashType & 0x1F) == SIGHASH_SINGLE) {
+    // Blank out some of the outputs
+    if(fNone) {
+        // Wildcard payee
+        WriteCompactSize(ss, 0);
+    } else if(fSingle) {
+        WriteCompactSize(ss, nIn + 1);
+        for(i = 0; i < nIn; i++)
+          ss << txoutNull;
+        ss << txTo.vout[nIn];
+    } else {
+        ss << txTo.vout;
+    }
 
-        // Only lock-in the txout payee at same index as txin
-        uint nOut = nIn;
-        if(nOut >= txTmp.vout.size()) {
-            printf("ERROR: SignatureHash() : nOut=%d out of range\n", nOut);
-            return(1);
-        }
-        txTmp.vout.resize(nOut + 1);
-        for(i = 0; i < nOut; i++)
-          txTmp.vout[i].SetNull();
+    ss << txTo.nLockTime;
+    if(txTo.nVersion > 1) ss << txTo.strTxComment;
+    ss << nHashType;
 
-        // Let the others update at will
-        for(i = 0; i < txTmp.vin.size(); i++)
-          if(i != nIn) txTmp.vin[i].nSequence = 0;
+    return(ss.GetHash());
+}
 
-    }
+uint256 SignatureHash(CScript scriptCode, const CTransaction &txTo, uint nIn,
+  int nHashType) {
+    return(SignatureHash(scriptCode, txTo, nIn, nHashType, NULL));
+}
 
-    // Blank out other inputs completely, not recommended for open transactions
-    if(nHashType & SIGHASH_ANYONECANPAY) {
-        txTmp.vin[0] = txTmp.vin[nIn];
-        txTmp.vin.resize(1);
+void CSigHashCache::Init() {
+    CHashWriter hw(SER_GETHASH, 0);
+    CDataStream ssInputs(SER_GETHASH, 0), ssOutputs(SER_GETHASH, 0);
+    uint i, nInputs = txTo.vin.size();
+
+    hw << txTo.nVersion << txTo.nTime;
+    WriteCompactSize(hw, nInputs);
+
+    // Inputs with their scripts blanked and the midstates between them
+    vMidstate.resize(nInputs);
+    vOffset.resize(nInputs + 1);
+    for(i = 0; i < nInputs; i++) {
+        vMidstate[i] = hw.GetState();
+        vOffset[i] = ssInputs.size();
+        ssInputs << txTo.vin[i].prevout;
+        WriteCompactSize(ssInputs, 0);
+        ssInputs << txTo.vin[i].nSequence;
+        hw.write(&ssInputs[vOffset[i]], ssInputs.size() - vOffset[i]);
     }
+    vOffset[nInputs] = ssInputs.size();
+    vchInputs.assign(ssInputs.begin(), ssInputs.end());
+
+    ssOutputs << txTo.vout << txTo.nLockTime;
+    if(txTo.nVersion > 1) ssOutputs << txTo.strTxComment;
+    vchOutputs.assign(ssOutputs.begin(), ssOutputs.end());
 
-    // Serialize and hash
-    CDataStream ss(SER_GETHASH, 0);
-    ss.reserve(10000);
-    ss << txTmp << nHashType;
-    return(Hash(ss.begin(), ss.end()));
+    fReady = true;
+}
+
+uint256 CSigHashCache::SignatureHashAll(const CScript &scriptCode, uint nIn, int nHashType) {
+
+    if(!fReady) Init();
+
+    CHashWriter hw(SER_GETHASH, 0, vMidstate[nIn]);
+    hw << txTo.vin[nIn].prevout << scriptCode << txTo.vin[nIn].nSequence;
+    if(vOffset[nIn + 1] < vchInputs.size())
+      hw.write(&vchInputs[vOffset[nIn + 1]], vchInputs.size() - vOffset[nIn + 1]);
+    hw.write(&vchOutputs[0], vchOutputs.size());
+    hw << nHashType;
+
+    return(hw.GetHash());
 }
 
 
@@ -1282,7 +1337,7 @@ public:
 };
 
 bool CheckSig(vector<uchar> vchSig, vector<uchar> vchPubKey, CScript scriptCode,
-  const CTransaction &txTo, uint nIn, int nHashType) {
+  const CTransaction &txTo, uint nIn, int nHashType, CSigHashCache *psighashcache) {
     static CSignatureCache signatureCache;
 
     // Hash type is one byte tacked on to the end of the signature
@@ -1294,7 +1349,7 @@ bool CheckSig(vector<uchar> vchSig, vector<uchar> vchPubKey, CScript scriptCode,
     }
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType, psighashcache);
 
     if(signatureCache.Get(sighash, vchSig, vchPubKey))
       return(true);
@@ -1712,17 +1767,90 @@ bool ExtractDestinations(const CScript &scriptPubKey, txnouttype &typeRet,
     return(true);
 }
 
+/* Verifies spends of the exact pay-to-pubkey-hash and pay-to-pubkey templates
+ * by a data push only signature script without running the interpreter;
+ * the checks and their order are those EvalScript() performs for these scripts.
+ * Returns false if the scripts don't match and must be evaluated in full */
+static bool VerifyTemplateScript(const CScript &scriptSig, const CScript &scriptPubKey,
+  const CTransaction &txTo, uint nIn, uint flags, int nHashType,
+  CSigHashCache *psighashcache, bool &fValid) {
+    CScript::const_iterator pc = scriptSig.begin();
+    opcodetype opcode;
+    valtype vchSig, vchPubKey;
+    uint nSize = scriptPubKey.size();
+
+    if((nSize == 25) && (scriptPubKey[0] == OP_DUP) && (scriptPubKey[1] == OP_HASH160) &&
+      (scriptPubKey[2] == 20) && (scriptPubKey[23] == OP_EQUALVERIFY) &&
+      (scriptPubKey[24] == OP_CHECKSIG)) {
+
+        // <sig> <pubkey>
+        if(!scriptSig.GetOp(pc, opcode, vchSig) || (opcode > OP_PUSHDATA4))
+          return(false);
+        if(!scriptSig.GetOp(pc, opcode, vchPubKey) || (opcode > OP_PUSHDATA4))
+          return(false);
+        if((pc != scriptSig.end()) || (vchSig.size() > 520) || (vchPubKey.size() > 520))
+          return(false);
+
+        // OP_DUP OP_HASH160 <hash> OP_EQUALVERIFY
+        uint160 hash = Hash160(vchPubKey);
+        if(memcmp(&scriptPubKey[3], hash.begin(), 20)) {
+            fValid = false;
+            return(true);
+        }
+
+    } else if((((nSize == 35) && (scriptPubKey[0] == 33)) ||
+      ((nSize == 67) && (scriptPubKey[0] == 65))) && (scriptPubKey[nSize - 1] == OP_CHECKSIG)) {
+
+        // <sig>
+        if(!scriptSig.GetOp(pc, opcode, vchSig) || (opcode > OP_PUSHDATA4))
+          return(false);
+        if((pc != scriptSig.end()) || (vchSig.size() > 520))
+          return(false);
+
+        vchPubKey.assign(scriptPubKey.begin() + 1, scriptPubKey.end() - 1);
+
+    } else return(false);
+
+    try {
+        // OP_CHECKSIG with the signature dropped from the script code
+        CScript scriptCode(scriptPubKey);
+        scriptCode.FindAndDelete(CScript(vchSig));
+
+        if(!CheckSignatureEncoding(vchSig, flags)) {
+            fValid = false;
+            return(true);
+        }
+
+        fValid = (!(flags & SCRIPT_VERIFY_STRICTENC) ||
+          (IsCanonicalSignature(vchSig) && IsCanonicalPubKey(vchPubKey)));
+
+        if(fValid)
+          fValid = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, psighashcache);
+    }
+    catch(...) {
+        fValid = false;
+    }
+
+    return(true);
+}
+
 bool VerifyScript(const CScript &scriptSig, const CScript &scriptPubKey,
-  const CTransaction &txTo, uint nIn, uint flags, int nHashType) {
+  const CTransaction &txTo, uint nIn, uint flags, int nHashType, CSigHashCache *psighashcache) {
     vector<vector<uchar> > stack, stackCopy;
+    bool fValid;
+
+    // Standard templates need no interpreter
+    if(VerifyTemplateScript(scriptSig, scriptPubKey, txTo, nIn, flags, nHashType,
+      psighashcache, fValid))
+      return(fValid);
 
-    if(!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType))
+    if(!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType, psighashcache))
       return(false);
 
     if(flags & SCRIPT_VERIFY_P2SH)
       stackCopy = stack;
 
-    if(!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType))
+    if(!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType, psighashcache))
       return(false);
 
     if(stack.empty())
@@ -1742,7 +1870,7 @@ bool VerifyScript(const CScript &scriptSig, const CScript &scriptPubKey,
         CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
         popstack(stackCopy);
 
-        if(!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType))
+        if(!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType, psighashcache))
           return(false);
 
         if(stackCopy.empty())
@@ -1783,7 +1911,7 @@ bool SignSignature(const CKeyStore &keystore, const CScript &fromPubKey,
           txin.scriptSig, subType) && (subType != TX_SCRIPTHASH);
 
         // Append serialized subscript whether or not it is completely signed:
-        txin.scriptSig << static_cast<valtype>(subscript);
+        txin.scriptSig << ToByteVector(subscript);
         if(!fSolved) return(false);
     }
 
@@ -1804,7 +1932,7 @@ bool SignSignature(const CKeyStore &keystore, const CTransaction &txFrom,
 }
 
 bool VerifySignature(const CCoins &txFrom, const CTransaction &txTo, uint nIn,
-  uint flags, int nHashType) {
+  uint flags, int nHashType, CSigHashCache *psighashcache) {
 
     assert(nIn < txTo.vin.size());
     const CTxIn &txin = txTo.vin[nIn];
@@ -1814,7 +1942,8 @@ bool VerifySignature(const CCoins &txFrom, const CTransaction &txTo, uint nIn,
 
     const CTxOut &txout = txFrom.vout[txin.prevout.n];
 
-    return(VerifyScript(txin.scriptSig, txout.scriptPubKey, txTo, nIn, flags, nHashType));
+    return(VerifyScript(txin.scriptSig, txout.scriptPubKey, txTo, nIn, flags, nHashType,
+      psighashcache));
 }
 
 static CScript PushAll(const vector<valtype> &values) {
@@ -1988,8 +2117,8 @@ uint CScript::GetSigOpCount(const CScript &scriptSig) const {
 
 // Extra-fast test for pay-to-script-hash CScripts
 bool CScript::IsPayToScriptHash() const {
-    return((this->size() == 23) && (this->at(0) == OP_HASH160) &&
-      (this->at(1) == 0x14) && (this->at(22) == OP_EQUAL));
+    return((this->size() == 23) && ((*this)[0] == OP_HASH160) &&
+      ((*this)[1] == 0x14) && ((*this)[22] == OP_EQUAL));
 }
 
 class CScriptVisitor : public boost::static_visitor<bool> {
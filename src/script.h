@@ -13,6 +13,7 @@
 
 #include "keystore.h"
 #include "bignum.h"
+#include "prevector.h"
 
 /* Threshold for nLockTime: below this value it is interpreted as block number,
  * otherwise as UNIX timestamp */
@@ -230,7 +231,10 @@ inline std::string StackString(const std::vector<std::vector<uchar> > &vStack) {
 
 
 /** Serialized script, used inside transaction inputs and outputs */
-class CScript : public std::vector<uchar> {
+/* Most scripts fit the inline storage and need no heap allocation */
+typedef prevector<28, uchar> CScriptBase;
+
+class CScript : public CScriptBase {
 protected:
     CScript &push_int64(int64 n) {
         if((n == -1) || ((n >= 1) && (n <= 16))) {
@@ -254,15 +258,12 @@ protected:
 
 public:
     CScript() { }
-    CScript(const CScript &b) : std::vector<uchar> (b.begin(), b.end()) { }
-    CScript(const_iterator pbegin, const_iterator pend) : std::vector<uchar> (pbegin, pend) { }
-#ifndef _MSC_VER
-    CScript(const uchar *pbegin, const uchar *pend) : std::vector<uchar>(pbegin, pend) { }
-#endif
+    CScript(const CScript &b) : CScriptBase(b) { }
+    template<typename InputIterator>
+    CScript(InputIterator pbegin, InputIterator pend) : CScriptBase(pbegin, pend) { }
 
     CScript &operator=(const CScript &b) {
-        clear();
-        insert(begin(), b.begin(), b.end());
+        CScriptBase::operator=(b);
         return(*this);
     }
 
@@ -523,10 +524,34 @@ public:
     }
 
     CScriptID GetID() const {
-        return(CScriptID(Hash160(*this)));
+        return(CScriptID(Hash160(begin(), end())));
     }
 };
 
+inline uint GetSerializeSize(const CScript &v, int nType, int nVersion) {
+    return(GetSizeOfCompactSize(v.size()) + v.size());
+}
+
+template<typename Stream>
+void Serialize(Stream &os, const CScript &v, int nType, int nVersion) {
+    WriteCompactSize(os, v.size());
+    if(!v.empty()) os.write((char *)&v[0], v.size());
+}
+
+template<typename Stream>
+void Unserialize(Stream &is, CScript &v, int nType, int nVersion) {
+    uint i = 0, nSize = ReadCompactSize(is);
+
+    // Limit size per read so bogus size value won't cause out of memory
+    v.clear();
+    while(i < nSize) {
+        uint blk = std::min(nSize - i, (uint)5000000);
+        v.resize(i + blk);
+        is.read((char *)&v[i], blk);
+        i += blk;
+    }
+}
+
 CScript GetScriptForPubKeyHash(const CKeyID &keyID);
 
 /** Compact serializer for scripts.
@@ -602,11 +627,36 @@ public:
     }
 };
 
+/* Signature hash data shared by all inputs of a transaction: the inputs with
+ * their scripts blanked, the outputs and the SHA-256 midstates of the SIGHASH_ALL
+ * preimage ahead of every input; prepared on first use and valid for as long as
+ * the transaction referenced stays unmodified */
+class CSigHashCache {
+private:
+    const CTransaction &txTo;
+    bool fReady;
+    std::vector<SHA256_CTX> vMidstate;
+    std::vector<uint> vOffset;
+    std::vector<char> vchInputs;
+    std::vector<char> vchOutputs;
+
+    void Init();
+
+public:
+    CSigHashCache(const CTransaction &txToIn) : txTo(txToIn), fReady(false) { }
+
+    uint256 SignatureHashAll(const CScript &scriptCode, uint nIn, int nHashType);
+};
+
+uint256 SignatureHash(CScript scriptCode, const CTransaction &txTo, uint nIn,
+  int nHashType, CSigHashCache *psighashcache);
+
 bool IsCanonicalPubKey(const std::vector<uchar> &vchPubKey);
 bool IsCanonicalSignature(const std::vector<uchar> &vchSig);
 
 bool EvalScript(std::vector<std::vector<uchar> > &stack, const CScript &script,
-  const CTransaction &txTo, uint nIn, uint flags, int nHashType);
+  const CTransaction &txTo, uint nIn, uint flags, int nHashType,
+  CSigHashCache *psighashcache = NULL);
 bool Solver(const CScript &scriptPubKey, txnouttype &typeRet,
   std::vector<std::vector<uchar> > &vSolutionsRet);
 int ScriptSigArgsExpected(txnouttype t, const std::vector<std::vector<uchar> > &vSolutions);
@@ -624,9 +674,10 @@ bool SignSignature(const CKeyStore &keystore, const CScript &fromPubKey,
 bool SignSignature(const CKeyStore &keystore, const CTransaction &txFrom,
   CTransaction &txTo, uint nIn, int nHashType = SIGHASH_ALL);
 bool VerifyScript(const CScript &scriptSig, const CScript &scriptPubKey,
-  const CTransaction &txTo, uint nIn, uint flags, int nHashType);
+  const CTransaction &txTo, uint nIn, uint flags, int nHashType,
+  CSigHashCache *psighashcache = NULL);
 bool VerifySignature(const CCoins &txFrom, const CTransaction &txTo,
-  uint nIn, uint flags, int nHashType);
+  uint nIn, uint flags, int nHashType, CSigHashCache *psighashcache = NULL);
 
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
@@ -391,8 +391,8 @@ template<typename Stream, typename T, typename A> void Unserialize_impl(Stream&
 template<typename Stream, typename T, typename A> void Unserialize_impl(Stream& is, std::vector<T, A>& v, int nType, int nVersion, const boost::false_type&);
 template<typename Stream, typename T, typename A> inline void Unserialize(Stream& is, std::vector<T, A>& v, int nType, int nVersion);
 
-// others derived from vector
-extern inline unsigned int GetSerializeSize(const CScript& v, int nType, int nVersion);
+// script, defined in script.h
+inline unsigned int GetSerializeSize(const CScript& v, int nType, int nVersion);
 template<typename Stream> void Serialize(Stream& os, const CScript& v, int nType, int nVersion);
 template<typename Stream> void Unserialize(Stream& is, CScript& v, int nType, int nVersion);
 
@@ -571,28 +571,6 @@ inline void Unserialize(Stream& is, std::vector<T, A>& v, int nType, int nVersio
 
 
 
-//
-// others derived from vector
-//
-inline unsigned int GetSerializeSize(const CScript& v, int nType, int nVersion)
-{
-    return GetSerializeSize((const std::vector<unsigned char>&)v, nType, nVersion);
-}
-
-template<typename Stream>
-void Serialize(Stream& os, const CScript& v, int nType, int nVersion)
-{
-    Serialize(os, (const std::vector<unsigned char>&)v, nType, nVersion);
-}
-
-template<typename Stream>
-void Unserialize(Stream& is, CScript& v, int nType, int nVersion)
-{
-    Unserialize(is, (std::vector<unsigned char>&)v, nType, nVersion);
-}
-
-
-
 //
 // pair
 //
@@ -1218,6 +1196,54 @@ public:
     }
 };
 
+/** Read only stream over a memory range which isn't owned,
+ * such as a part of a memory mapped file.
+ * Deserialises in place with no copying of the source data */
+class CMemoryReader
+{
+private:
+    const char *pbegin;
+    const char *pread;
+    const char *pend;
+
+public:
+    int nType;
+    int nVersion;
+
+    CMemoryReader(const char *pbeginIn, const char *pendIn, int nTypeIn, int nVersionIn) :
+      pbegin(pbeginIn), pread(pbeginIn), pend(pendIn), nType(nTypeIn), nVersion(nVersionIn) { }
+
+    void SetType(int n)          { nType = n; }
+    int GetType()                { return(nType); }
+    void SetVersion(int n)       { nVersion = n; }
+    int GetVersion()             { return(nVersion); }
+
+    size_t size() const          { return(pend - pread); }
+    bool empty() const           { return(pread == pend); }
+    size_t GetPos() const        { return(pread - pbegin); }
+
+    /* Positions the stream at an offset from the beginning */
+    void Seek(size_t nPos) {
+        if(nPos > (size_t)(pend - pbegin))
+          throw(std::ios_base::failure("CMemoryReader::Seek : position out of range"));
+        pread = pbegin + nPos;
+    }
+
+    CMemoryReader& read(char *pch, size_t nSize) {
+        if(nSize > size())
+          throw(std::ios_base::failure("CMemoryReader::read : end of data"));
+        memcpy(pch, pread, nSize);
+        pread += nSize;
+        return(*this);
+    }
+
+    template<typename T>
+    CMemoryReader& operator>>(T& obj) {
+        ::Unserialize(*this, obj, nType, nVersion);
+        return(*this);
+    }
+};
+
 /** Non-refcounted RAII wrapper around a FILE* that implements a ring buffer to
  *  deserialize from. It guarantees the ability to rewind a given number of bytes.
  *
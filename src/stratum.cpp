@@ -0,0 +1,744 @@
+// Copyright (c) 2018 The Orbitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "main.h"
+#include "init.h"
+#include "miner.h"
+#include "wallet.h"
+#include "bignum.h"
+#include "stratum.h"
+
+#include "json/json_spirit_reader_template.h"
+#include "json/json_spirit_writer_template.h"
+#include "json/json_spirit_utils.h"
+
+#undef printf
+#include <boost/asio.hpp>
+#if (BOOST_VERSION >= 107100)
+#include <boost/bind/bind.hpp>
+#else
+#include <boost/bind.hpp>
+#endif
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <algorithm>
+#include <deque>
+
+#define printf OutputDebugStringF
+
+using namespace std;
+using namespace json_spirit;
+using boost::asio::ip::tcp;
+
+/* The Stratum server runs a single network thread which pushes the jobs
+ * and parses the requests and a share validator thread which does the
+ * NeoScrypt hashing and submits blocks, so a busy miner can't stall either
+ * the network or the node. Jobs are built from the block template shared
+ * with getwork and getblocktemplate */
+
+/* Requests longer than this disconnect the client */
+static const uint STRATUM_MAX_REQUEST = 16384;
+/* Replies and notifications queued for a slow client before it's dropped */
+static const uint STRATUM_MAX_SEND_QUEUE = 256;
+/* Shares queued for validation per client and in total; more are rejected */
+static const uint STRATUM_MAX_CLIENT_SHARES = 32;
+static const uint STRATUM_MAX_SHARES = 1024;
+/* Jobs of the current block kept for late shares */
+static const uint STRATUM_MAX_JOBS = 16;
+/* The template is refreshed at this age when the memory pool changes */
+static const int64 STRATUM_TEMPLATE_AGE = 30;
+
+static inline unsigned short GetDefaultStratumPort() {
+    return(fTestNet ? 25300 : 15300);
+}
+
+typedef boost::shared_ptr<CStratumJob> CStratumJobRef;
+
+class CStratumClient;
+typedef boost::shared_ptr<CStratumClient> CStratumClientRef;
+
+class CStratumShare
+{
+public:
+    CStratumClientRef pclient;
+    Value id;
+    CStratumJobRef pjob;
+    /* Extranonce1 followed by extranonce2 */
+    std::vector<uchar> vchExtraNonce;
+    uint nTime;
+    uint nNonce;
+};
+
+/* The jobs by ID; the current job is also kept by the network thread */
+static CCriticalSection cs_stratum;
+static std::map<std::string, CStratumJobRef> mapStratumJobs;
+static std::deque<std::string> vStratumJobIds;
+
+/* The network thread only */
+static std::set<CStratumClientRef> setStratumClients;
+static CStratumJobRef pjobCurrent;
+static uint nStratumTemplateId = 0;
+static uint nStratumJobCounter = 0;
+static uint nExtraNonce1Next = 0;
+
+static double dShareDifficulty = 0.0;
+static uint256 hashShareTarget = 0;
+
+/* The share queue; the network thread is reachable through this service
+ * while it is running */
+static boost::mutex csShareQueue;
+static boost::condition_variable cvShareQueue;
+static std::deque<CStratumShare> vShareQueue;
+static boost::asio::io_service *pStratumService = NULL;
+
+static Array StratumError(int nCode, const std::string &strMessage) {
+    Array error;
+
+    error.push_back(nCode);
+    error.push_back(strMessage);
+    error.push_back(Value::null);
+
+    return(error);
+}
+
+static bool StratumClientAllowed(const boost::asio::ip::address &address) {
+
+    if(address.is_v6() && (address.to_v6().is_v4_compatible() || address.to_v6().is_v4_mapped()))
+      return(StratumClientAllowed(address.to_v6().to_v4()));
+
+    if(address.is_loopback() ||
+      (address.is_v4() && ((address.to_v4().to_ulong() & 0xff000000) == 0x7f000000)))
+        return(true);
+
+    const std::string strAddress = address.to_string();
+    const std::vector<std::string> &vAllow = mapMultiArgs["-stratumallowip"];
+    BOOST_FOREACH(const std::string &strAllow, vAllow) {
+        if(WildcardMatch(strAddress, strAllow))
+          return(true);
+    }
+
+    return(false);
+}
+
+class CStratumClient : public boost::enable_shared_from_this<CStratumClient>
+{
+public:
+    tcp::socket socket;
+    boost::asio::streambuf bufRecv;
+    std::deque<std::string> vSend;
+    std::vector<uchar> vchExtraNonce1;
+    std::string strAddress;
+    std::string strWorker;
+    bool fSubscribed;
+    bool fAuthorised;
+    /* Shares in the validation queue; guarded by csShareQueue */
+    uint nSharesQueued;
+
+    CStratumClient(boost::asio::io_service &io_service) :
+      socket(io_service), bufRecv(STRATUM_MAX_REQUEST), fSubscribed(false), fAuthorised(false),
+      nSharesQueued(0) {}
+
+    void Read() {
+        boost::asio::async_read_until(socket, bufRecv, '\n',
+          boost::bind(&CStratumClient::HandleRead, shared_from_this(),
+          boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+    }
+
+    void HandleRead(const boost::system::error_code &error, size_t nBytes) {
+
+        if(error) {
+            if(error != boost::asio::error::operation_aborted)
+              Close();
+            return;
+        }
+
+        std::istream stream(&bufRecv);
+        std::string strRequest;
+        std::getline(stream, strRequest);
+        if(!strRequest.empty() && (strRequest[strRequest.size() - 1] == '\r'))
+          strRequest.erase(strRequest.size() - 1);
+
+        if(!strRequest.empty()) {
+            Value valRequest;
+            if(!read_string(strRequest, valRequest) || (valRequest.type() != obj_type)) {
+                printf("Stratum: invalid request from %s\n", strAddress.c_str());
+                Close();
+                return;
+            }
+            HandleRequest(valRequest.get_obj());
+        }
+
+        if(socket.is_open())
+          Read();
+    }
+
+    void Send(const std::string &strMessage) {
+
+        if(!socket.is_open())
+          return;
+
+        if(vSend.size() >= STRATUM_MAX_SEND_QUEUE) {
+            printf("Stratum: send queue overflow for %s\n", strAddress.c_str());
+            Close();
+            return;
+        }
+
+        vSend.push_back(strMessage);
+        if(vSend.size() == 1)
+          Write();
+    }
+
+    void Write() {
+        boost::asio::async_write(socket, boost::asio::buffer(vSend.front()),
+          boost::bind(&CStratumClient::HandleWrite, shared_from_this(),
+          boost::asio::placeholders::error));
+    }
+
+    void HandleWrite(const boost::system::error_code &error) {
+
+        if(error) {
+            if(error != boost::asio::error::operation_aborted)
+              Close();
+            return;
+        }
+
+        vSend.pop_front();
+        if(!vSend.empty())
+          Write();
+    }
+
+    void Close() {
+
+        if(socket.is_open()) {
+            boost::system::error_code ec;
+            socket.shutdown(tcp::socket::shutdown_both, ec);
+            socket.close(ec);
+            printf("Stratum: %s disconnected\n", strAddress.c_str());
+        }
+
+        setStratumClients.erase(shared_from_this());
+    }
+
+    void Reply(const Value &id, const Value &result, const Value &error) {
+        Object reply;
+
+        reply.push_back(Pair("id", id));
+        reply.push_back(Pair("result", result));
+        reply.push_back(Pair("error", error));
+
+        Send(write_string(Value(reply), false) + "\n");
+    }
+
+    void Notify(const std::string &strMethod, const Array &params) {
+        Object notification;
+
+        notification.push_back(Pair("id", Value::null));
+        notification.push_back(Pair("method", strMethod));
+        notification.push_back(Pair("params", params));
+
+        Send(write_string(Value(notification), false) + "\n");
+    }
+
+    void SendDifficulty() {
+        Array params;
+
+        params.push_back(dShareDifficulty);
+        Notify("mining.set_difficulty", params);
+    }
+
+    void SendJob(const CStratumJob &job, bool fClean);
+
+    void HandleRequest(const Object &request);
+
+    void HandleSubmit(const Value &id, const Array &params);
+};
+
+void CStratumClient::SendJob(const CStratumJob &job, bool fClean) {
+    Array params, branch;
+    std::string strPrevHash;
+    uint i;
+
+    /* The previous block hash goes out in 32-bit words with their bytes swapped */
+    uint256 hashPrev = job.block.hashPrevBlock;
+    const uint *pprev = (const uint *) hashPrev.begin();
+    for(i = 0; i < 8; i++)
+      strPrevHash += strprintf("%08x", pprev[i]);
+
+    BOOST_FOREACH(const uint256 &hash, job.vMerkleBranch)
+      branch.push_back(HexStr(BEGIN(hash), END(hash)));
+
+    params.push_back(job.strId);
+    params.push_back(strPrevHash);
+    params.push_back(HexStr(job.vchCoinBase1));
+    params.push_back(HexStr(job.vchCoinBase2));
+    params.push_back(branch);
+    params.push_back(strprintf("%08x", job.block.nVersion));
+    params.push_back(strprintf("%08x", job.block.nBits));
+    params.push_back(strprintf("%08x", job.block.nTime));
+    params.push_back(fClean);
+
+    Notify("mining.notify", params);
+}
+
+void CStratumClient::HandleRequest(const Object &request) {
+    const Value &id = find_value(request, "id");
+    const Value &method = find_value(request, "method");
+    const Value &valParams = find_value(request, "params");
+
+    if(method.type() != str_type) {
+        Reply(id, Value::null, StratumError(20, "Invalid request"));
+        return;
+    }
+
+    const std::string &strMethod = method.get_str();
+    Array params;
+    if(valParams.type() == array_type)
+      params = valParams.get_array();
+
+    if(strMethod == "mining.subscribe") {
+        Array subscription, subscriptions, result;
+
+        subscription.push_back("mining.notify");
+        subscription.push_back(HexStr(vchExtraNonce1));
+        subscriptions.push_back(subscription);
+
+        result.push_back(subscriptions);
+        result.push_back(HexStr(vchExtraNonce1));
+        result.push_back((int)STRATUM_EXTRANONCE2_SIZE);
+        Reply(id, result, Value::null);
+
+        fSubscribed = true;
+        SendDifficulty();
+        if(pjobCurrent)
+          SendJob(*pjobCurrent, true);
+
+        return;
+    }
+
+    /* Any credentials are accepted; the node pays to its own wallet */
+    if(strMethod == "mining.authorize") {
+        if(!params.empty() && (params[0].type() == str_type))
+          strWorker = params[0].get_str();
+        fAuthorised = true;
+        Reply(id, true, Value::null);
+        printf("Stratum: %s authorised as %s\n", strAddress.c_str(), strWorker.c_str());
+        return;
+    }
+
+    if(strMethod == "mining.submit") {
+        HandleSubmit(id, params);
+        return;
+    }
+
+    /* The extranonce never changes for a connection */
+    if(strMethod == "mining.extranonce.subscribe") {
+        Reply(id, true, Value::null);
+        return;
+    }
+
+    Reply(id, Value::null, StratumError(20, "Method not found"));
+}
+
+/* Parses a share and queues it for the validator which replies */
+void CStratumClient::HandleSubmit(const Value &id, const Array &params) {
+    uint i;
+
+    if(!fSubscribed) {
+        Reply(id, Value::null, StratumError(25, "Not subscribed"));
+        return;
+    }
+
+    if(!fAuthorised) {
+        Reply(id, Value::null, StratumError(24, "Unauthorized worker"));
+        return;
+    }
+
+    /* worker, job ID, extranonce2, time, nonce */
+    if(params.size() < 5) {
+        Reply(id, Value::null, StratumError(20, "Invalid parameters"));
+        return;
+    }
+    for(i = 0; i < 5; i++) {
+        if(params[i].type() != str_type) {
+            Reply(id, Value::null, StratumError(20, "Invalid parameters"));
+            return;
+        }
+    }
+
+    const std::string &strExtraNonce2 = params[2].get_str();
+    const std::string &strTime = params[3].get_str();
+    const std::string &strNonce = params[4].get_str();
+    if((strExtraNonce2.size() != (2 * STRATUM_EXTRANONCE2_SIZE)) || !IsHex(strExtraNonce2) ||
+      (strTime.size() != 8) || !IsHex(strTime) || (strNonce.size() != 8) || !IsHex(strNonce)) {
+        Reply(id, Value::null, StratumError(20, "Invalid parameters"));
+        return;
+    }
+
+    CStratumShare share;
+    {
+        LOCK(cs_stratum);
+        std::map<std::string, CStratumJobRef>::iterator it = mapStratumJobs.find(params[1].get_str());
+        if(it == mapStratumJobs.end()) {
+            Reply(id, Value::null, StratumError(21, "Job not found"));
+            return;
+        }
+        share.pjob = it->second;
+    }
+
+    share.pclient = shared_from_this();
+    share.id = id;
+    share.vchExtraNonce = vchExtraNonce1;
+    std::vector<uchar> vchExtraNonce2 = ParseHex(strExtraNonce2);
+    share.vchExtraNonce.insert(share.vchExtraNonce.end(), vchExtraNonce2.begin(), vchExtraNonce2.end());
+    share.nTime = (uint)strtoul(strTime.c_str(), NULL, 16);
+    share.nNonce = (uint)strtoul(strNonce.c_str(), NULL, 16);
+
+    {
+        boost::unique_lock<boost::mutex> lock(csShareQueue);
+        if((nSharesQueued >= STRATUM_MAX_CLIENT_SHARES) || (vShareQueue.size() >= STRATUM_MAX_SHARES)) {
+            lock.unlock();
+            Reply(id, Value::null, StratumError(20, "Too many shares pending, try again later"));
+            return;
+        }
+        nSharesQueued++;
+        vShareQueue.push_back(share);
+    }
+    cvShareQueue.notify_one();
+}
+
+/* The coin base is split around the extranonce for the miners to fill in */
+bool CreateStratumJob(const CBlock &block, CBlockIndex *pindexPrev, CStratumJob &job) {
+
+    /* A random marker of the extranonce size locates it in the serialised coin base */
+    uint256 hashMarker = GetRandHash();
+    std::vector<uchar> vchMarker(hashMarker.begin(),
+      hashMarker.begin() + STRATUM_EXTRANONCE1_SIZE + STRATUM_EXTRANONCE2_SIZE);
+
+    job.block = block;
+    job.pindexPrev = pindexPrev;
+    SetExtraNonce(&job.block, pindexPrev, vchMarker);
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << job.block.vtx[0];
+    std::vector<uchar> vchCoinBase(ss.begin(), ss.end());
+
+    std::vector<uchar>::iterator it =
+      std::search(vchCoinBase.begin(), vchCoinBase.end(), vchMarker.begin(), vchMarker.end());
+    if(it == vchCoinBase.end())
+      return(false);
+    if(std::search(it + 1, vchCoinBase.end(), vchMarker.begin(), vchMarker.end()) != vchCoinBase.end())
+      return(false);
+
+    job.vchCoinBase1.assign(vchCoinBase.begin(), it);
+    job.vchCoinBase2.assign(it + vchMarker.size(), vchCoinBase.end());
+    job.vMerkleBranch = job.block.GetMerkleBranch(0);
+    job.strId = strprintf("%x", ++nStratumJobCounter);
+
+    return(true);
+}
+
+/* Makes a new job when the block template changes and pushes it out */
+static void UpdateStratumJob() {
+    CBlock *pblock = NULL;
+    CBlockIndex *pindexPrev = NULL;
+
+    if(IsInitialBlockDownload() || vNodes.empty())
+      return;
+
+    uint nTemplateId = nStratumTemplateId;
+    if(!GetBlockTemplate(pwalletMain, STRATUM_TEMPLATE_AGE, nTemplateId, pblock, pindexPrev))
+      return;
+    nStratumTemplateId = nTemplateId;
+
+    /* Unchanged */
+    if(!pblock)
+      return;
+
+    CStratumJobRef pjob(new CStratumJob());
+    bool fCreated = CreateStratumJob(*pblock, pindexPrev, *pjob);
+    delete pblock;
+    if(!fCreated) {
+        printf("Stratum: failed to locate the extranonce in the coin base\n");
+        return;
+    }
+
+    /* Work on another block invalidates the jobs outstanding */
+    bool fClean = !pjobCurrent || (pjobCurrent->pindexPrev != pindexPrev);
+    {
+        LOCK(cs_stratum);
+        if(fClean) {
+            mapStratumJobs.clear();
+            vStratumJobIds.clear();
+        }
+        mapStratumJobs[pjob->strId] = pjob;
+        vStratumJobIds.push_back(pjob->strId);
+        while(vStratumJobIds.size() > STRATUM_MAX_JOBS) {
+            mapStratumJobs.erase(vStratumJobIds.front());
+            vStratumJobIds.pop_front();
+        }
+    }
+    pjobCurrent = pjob;
+
+    /* Sending may drop a client, so walk a copy */
+    std::set<CStratumClientRef> setClients(setStratumClients);
+    BOOST_FOREACH(const CStratumClientRef &pclient, setClients) {
+        if(pclient->fSubscribed)
+          pclient->SendJob(*pjob, fClean);
+    }
+}
+
+static void StratumAccept(tcp::acceptor *pacceptor);
+
+static void StratumAcceptHandler(tcp::acceptor *pacceptor, CStratumClientRef pclient,
+  const boost::system::error_code &error) {
+
+    /* The acceptor has been closed */
+    if(error == boost::asio::error::operation_aborted)
+      return;
+
+    if(!error) {
+        boost::system::error_code ec;
+        tcp::endpoint peer = pclient->socket.remote_endpoint(ec);
+        if(ec || !StratumClientAllowed(peer.address())) {
+            pclient->socket.close(ec);
+        } else {
+            uint nExtraNonce1 = nExtraNonce1Next++;
+            pclient->vchExtraNonce1.assign((uchar *) &nExtraNonce1,
+              (uchar *) &nExtraNonce1 + STRATUM_EXTRANONCE1_SIZE);
+            pclient->strAddress = peer.address().to_string();
+            setStratumClients.insert(pclient);
+            printf("Stratum: %s connected\n", pclient->strAddress.c_str());
+            pclient->Read();
+        }
+    }
+
+    StratumAccept(pacceptor);
+}
+
+static void StratumAccept(tcp::acceptor *pacceptor) {
+    CStratumClientRef pclient(new CStratumClient(*pStratumService));
+
+    pacceptor->async_accept(pclient->socket,
+      boost::bind(&StratumAcceptHandler, pacceptor, pclient, boost::asio::placeholders::error));
+}
+
+static void StratumTimer(boost::asio::deadline_timer *ptimer, tcp::acceptor *pacceptor,
+  const boost::system::error_code &error) {
+
+    if(error)
+      return;
+
+    if(fShutdown) {
+        boost::system::error_code ec;
+        pacceptor->close(ec);
+        std::set<CStratumClientRef> setClients(setStratumClients);
+        BOOST_FOREACH(const CStratumClientRef &pclient, setClients)
+          pclient->Close();
+        /* No more work for the service to run */
+        return;
+    }
+
+    UpdateStratumJob();
+
+    ptimer->expires_from_now(boost::posix_time::seconds(1));
+    ptimer->async_wait(boost::bind(&StratumTimer, ptimer, pacceptor, boost::asio::placeholders::error));
+}
+
+/* Hashes a share, submits a block if found and replies to the client */
+static void ValidateShare(CStratumShare &share, CReserveKey &reservekey) {
+    CStratumJob &job = *share.pjob;
+    Value result = true, error = Value::null;
+
+    /* Rebuild the coin base from the parts with the extranonce filled in */
+    std::vector<uchar> vchCoinBase(job.vchCoinBase1);
+    vchCoinBase.insert(vchCoinBase.end(), share.vchExtraNonce.begin(), share.vchExtraNonce.end());
+    vchCoinBase.insert(vchCoinBase.end(), job.vchCoinBase2.begin(), job.vchCoinBase2.end());
+
+    CTransaction txCoinBase;
+    try {
+        CDataStream ss(vchCoinBase, SER_NETWORK, PROTOCOL_VERSION);
+        ss >> txCoinBase;
+    } catch(std::exception &e) {
+        error = StratumError(20, "Invalid coin base");
+    }
+
+    /* A fresh header as the hash cache of a block ignores the nonce */
+    CBlock header;
+    header.nVersion = job.block.nVersion;
+    header.hashPrevBlock = job.block.hashPrevBlock;
+    header.hashMerkleRoot = CBlock::CheckMerkleBranch(txCoinBase.GetHash(), job.vMerkleBranch, 0);
+    header.nTime = share.nTime;
+    header.nBits = job.block.nBits;
+    header.nNonce = share.nNonce;
+
+    if(error.type() == null_type) {
+        if((header.nTime < job.block.nTime) || (header.nTime > FutureDrift(GetAdjustedTime())))
+          error = StratumError(20, "Time out of range");
+    }
+
+    uint256 hashPoW = 0;
+    if(error.type() == null_type) {
+        hashPoW = header.GetHashPoW();
+        if(hashPoW > hashShareTarget)
+          error = StratumError(23, "Low difficulty share");
+        else if(!job.setShares.insert(header.GetHash()).second)
+          error = StratumError(22, "Duplicate share");
+    }
+
+    if((error.type() == null_type) && (hashPoW <= CBigNum().SetCompact(job.block.nBits).getuint256())) {
+        CBlock block(job.block);
+        block.vtx[0] = txCoinBase;
+        block.hashMerkleRoot = block.BuildMerkleTree();
+        block.nTime = share.nTime;
+        block.nNonce = share.nNonce;
+
+        printf("Stratum: block found by %s %s\n",
+          share.pclient->strWorker.c_str(), block.GetHash().ToString().c_str());
+
+        if(!fNeoScrypt && !block.SignWorkBlock(*pwalletMain)) {
+            printf("Stratum: failed to sign the block\n");
+        } else if(!CheckWork(&block, *pwalletMain, reservekey)) {
+            /* The share is still valid for a stale block */
+            printf("Stratum: block rejected\n");
+        }
+    }
+
+    if(error.type() != null_type)
+      result = Value::null;
+
+    boost::unique_lock<boost::mutex> lock(csShareQueue);
+    if(pStratumService) {
+        pStratumService->post(boost::bind(&CStratumClient::Reply, share.pclient,
+          share.id, result, error));
+    }
+}
+
+static void ThreadStratumValidator(void *parg) {
+
+    RenameThread("orb-stratumval");
+
+    vnThreadsRunning[THREAD_STRATUM]++;
+
+    try {
+        CReserveKey reservekey(pwalletMain);
+
+        while(!fShutdown) {
+            CStratumShare share;
+            {
+                boost::unique_lock<boost::mutex> lock(csShareQueue);
+                while(vShareQueue.empty() && pStratumService && !fShutdown)
+                  cvShareQueue.timed_wait(lock, boost::posix_time::seconds(1));
+                if(fShutdown || !pStratumService)
+                  break;
+                share = vShareQueue.front();
+                vShareQueue.pop_front();
+                share.pclient->nSharesQueued--;
+            }
+            ValidateShare(share, reservekey);
+        }
+    }
+    catch(std::exception &e) {
+        PrintException(&e, "ThreadStratumValidator()");
+    }
+
+    vnThreadsRunning[THREAD_STRATUM]--;
+    printf("ThreadStratumValidator exited\n");
+}
+
+static void RunStratumServer() {
+
+    dShareDifficulty = atof(GetArg("-stratumdifficulty", "16").c_str());
+    if(dShareDifficulty < 1.0 / 65536)
+      dShareDifficulty = 1.0 / 65536;
+
+    /* Difficulty 1 is 0xFFFF << 224 as for the other scrypt family coins */
+    CBigNum bnShareTarget = (CBigNum(0xFFFF) << 224) * 65536 / (int64)(dShareDifficulty * 65536);
+    hashShareTarget = bnShareTarget.getuint256();
+
+    boost::asio::io_service io_service;
+
+    /* Loopback only unless some other clients are allowed */
+    const bool fLoopback = !mapArgs.count("-stratumallowip");
+    tcp::endpoint endpoint(fLoopback ? boost::asio::ip::address(boost::asio::ip::address_v4::loopback()) :
+      boost::asio::ip::address(boost::asio::ip::address_v4::any()),
+      GetArg("-stratumport", GetDefaultStratumPort()));
+    tcp::acceptor acceptor(io_service);
+
+    try {
+        acceptor.open(endpoint.protocol());
+        acceptor.set_option(tcp::acceptor::reuse_address(true));
+        acceptor.bind(endpoint);
+        acceptor.listen(boost::asio::socket_base::max_connections);
+    } catch(boost::system::system_error &e) {
+        printf("Stratum: unable to bind to port %u: %s\n", endpoint.port(), e.what());
+        return;
+    }
+
+    printf("Stratum server listening on port %u with share difficulty %g\n",
+      endpoint.port(), dShareDifficulty);
+
+    nExtraNonce1Next = GetRandInt(0x7FFFFFFF);
+    {
+        boost::unique_lock<boost::mutex> lock(csShareQueue);
+        pStratumService = &io_service;
+    }
+
+    /* Joined before the service it replies through goes out of scope */
+    boost::thread *pthreadValidator = NULL;
+    try {
+        pthreadValidator = new boost::thread(&ThreadStratumValidator, (void *)NULL);
+    } catch(boost::thread_resource_error &e) {
+        printf("Error: unable to start ThreadStratumValidator: %s\n", e.what());
+    }
+
+    StratumAccept(&acceptor);
+
+    boost::asio::deadline_timer timer(io_service);
+    timer.expires_from_now(boost::posix_time::seconds(1));
+    timer.async_wait(boost::bind(&StratumTimer, &timer, &acceptor, boost::asio::placeholders::error));
+
+    try {
+        io_service.run();
+    } catch(std::exception &e) {
+        PrintExceptionContinue(&e, "RunStratumServer()");
+    }
+
+    {
+        boost::unique_lock<boost::mutex> lock(csShareQueue);
+        pStratumService = NULL;
+        vShareQueue.clear();
+    }
+    cvShareQueue.notify_all();
+    if(pthreadValidator) {
+        pthreadValidator->join();
+        delete pthreadValidator;
+    }
+
+    setStratumClients.clear();
+    pjobCurrent.reset();
+    {
+        LOCK(cs_stratum);
+        mapStratumJobs.clear();
+        vStratumJobIds.clear();
+    }
+}
+
+void ThreadStratumServer(void *parg) {
+
+    // Make this thread recognisable as the Stratum server thread
+    RenameThread("orb-stratum");
+
+    vnThreadsRunning[THREAD_STRATUM]++;
+
+    try {
+        RunStratumServer();
+    }
+    catch(std::exception &e) {
+        PrintException(&e, "ThreadStratumServer()");
+    }
+
+    vnThreadsRunning[THREAD_STRATUM]--;
+    printf("ThreadStratumServer exited\n");
+}
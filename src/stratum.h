@@ -0,0 +1,34 @@
+// Copyright (c) 2018 The Orbitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef STRATUM_H
+#define STRATUM_H
+
+#include "main.h"
+
+static const uint STRATUM_EXTRANONCE1_SIZE = 4;
+static const uint STRATUM_EXTRANONCE2_SIZE = 4;
+
+/** A Stratum job out of a block template */
+class CStratumJob
+{
+public:
+    std::string strId;
+    CBlock block;
+    CBlockIndex *pindexPrev;
+    /* The serialised coin base around the extranonce */
+    std::vector<uchar> vchCoinBase1;
+    std::vector<uchar> vchCoinBase2;
+    std::vector<uint256> vMerkleBranch;
+    /* Header hashes of the shares accepted; the share validator only */
+    std::set<uint256> setShares;
+};
+
+/* Builds a job out of a block template */
+bool CreateStratumJob(const CBlock &block, CBlockIndex *pindexPrev, CStratumJob &job);
+
+/* Runs the Stratum mining server until shutdown */
+void ThreadStratumServer(void *parg);
+
+#endif /* STRATUM_H */
@@ -16,9 +16,9 @@
 #include <stdint.h>
 
 // Tests this internal-to-main.cpp method:
-extern bool AddOrphanTx(const CTransaction& tx);
+extern bool AddOrphanTx(const CTransactionRef& ptx);
 extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
-extern std::map<uint256, CTransaction> mapOrphanTransactions;
+extern std::map<uint256, CTransactionRef> mapOrphanTransactions;
 extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
 
 CService ip(uint32_t i)
@@ -83,11 +83,11 @@ BOOST_AUTO_TEST_CASE(DoS_bantime)
 }
 
 CTransaction RandomOrphan() {
-    std::map<uint256, CTransaction>::iterator it;
+    std::map<uint256, CTransactionRef>::iterator it;
     it = mapOrphanTransactions.lower_bound(GetRandHash());
     if (it == mapOrphanTransactions.end())
         it = mapOrphanTransactions.begin();
-    return(it->second);
+    return(*it->second);
 }
 
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
@@ -109,7 +109,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
 
-        AddOrphanTx(tx);
+        AddOrphanTx(CTransactionRef(new CTransaction(tx)));
     }
 
     // ... and 50 that depend on other orphans:
@@ -126,7 +126,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
         SignSignature(keystore, txPrev, tx, 0);
 
-        AddOrphanTx(tx);
+        AddOrphanTx(CTransactionRef(new CTransaction(tx)));
     }
 
     // This really-big orphan should be ignored:
@@ -150,7 +150,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         for (unsigned int j = 1; j < tx.vin.size(); j++)
             tx.vin[j].scriptSig = tx.vin[0].scriptSig;
 
-        BOOST_CHECK(!AddOrphanTx(tx));
+        BOOST_CHECK(!AddOrphanTx(CTransactionRef(new CTransaction(tx))));
     }
 
     // Test LimitOrphanTxSize() function:
@@ -188,7 +188,7 @@ BOOST_AUTO_TEST_CASE(DoS_checkSig)
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
 
-        AddOrphanTx(tx);
+        AddOrphanTx(CTransactionRef(new CTransaction(tx)));
     }
 
     // Create a transaction that depends on orphans:
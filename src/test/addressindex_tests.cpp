@@ -0,0 +1,74 @@
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "txdb.h"
+#include "base58.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(addressindex_tests)
+
+/* Pay-to-pubkey outputs of coin bases and coin stakes are found by the address */
+BOOST_AUTO_TEST_CASE(address_index_p2pk) {
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    CCoinAddress address(pubkey.GetID());
+
+    CScript scriptPubKey, scriptPubKeyHash;
+    scriptPubKey << pubkey << OP_CHECKSIG;
+    scriptPubKeyHash.SetDestination(pubkey.GetID());
+
+    uint160 hashAddress = GetAddressIndexHash(address.Get());
+    BOOST_CHECK(GetAddressIndexHash(scriptPubKey) == hashAddress);
+    BOOST_CHECK(GetAddressIndexHash(scriptPubKeyHash) == hashAddress);
+
+    /* Pay-to-script-hash by the script ID */
+    CScript scriptRedeem;
+    scriptRedeem << OP_TRUE;
+    CScript scriptPubKeyP2SH;
+    scriptPubKeyP2SH.SetDestination(scriptRedeem.GetID());
+    BOOST_CHECK(GetAddressIndexHash(scriptPubKeyP2SH) ==
+      GetAddressIndexHash(CCoinAddress(scriptRedeem.GetID()).Get()));
+    BOOST_CHECK(GetAddressIndexHash(scriptPubKeyP2SH) != hashAddress);
+
+    /* A coin stake spends a pay-to-pubkey-hash output into a pay-to-pubkey one */
+    uint256 txidFund = GetRandHash(), txidStake = GetRandHash();
+    vector<pair<CAddressIndexKey, int64> > vHistory;
+    vector<pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspent;
+    vHistory.push_back(make_pair(CAddressIndexKey(GetAddressIndexHash(scriptPubKeyHash),
+      10, txidFund, 0, false), 5 * COIN));
+    vHistory.push_back(make_pair(CAddressIndexKey(GetAddressIndexHash(scriptPubKeyHash),
+      20, txidStake, 0, true), -5 * COIN));
+    vHistory.push_back(make_pair(CAddressIndexKey(GetAddressIndexHash(scriptPubKey),
+      20, txidStake, 1, false), 6 * COIN));
+    vUnspent.push_back(make_pair(CAddressUnspentKey(GetAddressIndexHash(scriptPubKey), txidStake, 1),
+      CAddressUnspentValue(6 * COIN, scriptPubKey, 20)));
+    BOOST_REQUIRE(pblocktree->WriteAddressIndex(vHistory, vUnspent));
+
+    vector<pair<CAddressIndexKey, int64> > vHistoryRead;
+    BOOST_REQUIRE(pblocktree->ReadAddressIndex(hashAddress, vHistoryRead));
+    BOOST_CHECK_EQUAL(vHistoryRead.size(), 3U);
+    int64 nBalance = 0;
+    for(uint i = 0; i < vHistoryRead.size(); i++)
+      nBalance += vHistoryRead[i].second;
+    BOOST_CHECK_EQUAL(nBalance, 6 * COIN);
+
+    vector<pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspentRead;
+    BOOST_REQUIRE(pblocktree->ReadAddressUnspentIndex(hashAddress, vUnspentRead));
+    BOOST_REQUIRE_EQUAL(vUnspentRead.size(), 1U);
+    BOOST_CHECK(vUnspentRead[0].first.txid == txidStake);
+    BOOST_CHECK(vUnspentRead[0].second.scriptPubKey == scriptPubKey);
+
+    /* Disconnection leaves nothing behind */
+    vUnspent[0].second.SetNull();
+    BOOST_REQUIRE(pblocktree->EraseAddressIndex(vHistory, vUnspent));
+    vHistoryRead.clear();
+    vUnspentRead.clear();
+    BOOST_CHECK(pblocktree->ReadAddressIndex(hashAddress, vHistoryRead) && vHistoryRead.empty());
+    BOOST_CHECK(pblocktree->ReadAddressUnspentIndex(hashAddress, vUnspentRead) && vUnspentRead.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,212 @@
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "txdb.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(blockfile_tests)
+
+/* A block of a coin base with a long script which compresses well */
+static CBlock MakeCompressibleBlock() {
+    CBlock block;
+    block.hashPrevBlock = pindexGenesisBlock->GetBlockHash();
+    block.nTime = pindexGenesisBlock->nTime + 1;
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.SetNull();
+    tx.vin[0].scriptSig = CScript() << GetRandHash();
+    tx.vout.resize(1);
+    tx.vout[0].nValue = COIN;
+    tx.vout[0].scriptPubKey = CScript() << vector<uchar>(2000, 0x55) << OP_DROP << OP_TRUE;
+    block.vtx.push_back(tx);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return(block);
+}
+
+/* Appends a record to the last block file as a new block would be */
+static CDiskBlockPos AppendBlockRecord(const CBlockRecord &record, uint nHeight, uint nTime) {
+    CDiskBlockPos pos;
+    {
+        LOCK(cs_LastBlockFile);
+        pos = CDiskBlockPos(nLastBlockFile, infoLastBlockFile.nSize);
+        infoLastBlockFile.nSize += record.GetDiskSize();
+        infoLastBlockFile.AddBlock(nHeight, nTime);
+        BOOST_REQUIRE(pblocktree->WriteBlockFileInfo(nLastBlockFile, infoLastBlockFile));
+    }
+    BOOST_REQUIRE(WriteBlockRecord(pos, false, record));
+    return(pos);
+}
+
+BOOST_AUTO_TEST_CASE(block_record_roundtrip) {
+    CBlock block = MakeCompressibleBlock();
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << block;
+    vector<char> vBlock(ss.begin(), ss.end());
+
+    CBlockRecord recordPlain, recordCompressed;
+    recordPlain.Set(&vBlock[0], &vBlock[0] + vBlock.size(), false);
+    recordCompressed.Set(&vBlock[0], &vBlock[0] + vBlock.size(), true);
+    BOOST_CHECK(!recordPlain.fCompressed);
+    BOOST_CHECK(recordCompressed.fCompressed);
+    BOOST_CHECK(recordCompressed.vData.size() < recordPlain.vData.size());
+    BOOST_CHECK(recordCompressed.GetSizeWord() & BLOCK_RECORD_COMPRESSED);
+
+    /* Data which doesn't shrink is stored as is */
+    CBlockRecord recordSmall;
+    recordSmall.Set(&vBlock[0], &vBlock[0] + 8, true);
+    BOOST_CHECK(!recordSmall.fCompressed);
+
+    CDiskBlockPos posPlain = AppendBlockRecord(recordPlain, 1, block.nTime);
+    CDiskBlockPos posCompressed = AppendBlockRecord(recordCompressed, 1, block.nTime);
+    BOOST_CHECK_EQUAL(GetBlockRecordSize(posPlain, false), recordPlain.GetDiskSize());
+    BOOST_CHECK_EQUAL(GetBlockRecordSize(posCompressed, false), recordCompressed.GetDiskSize());
+
+    /* Both read back as the same block */
+    CDiskBlockPos pos[2] = { posPlain, posCompressed };
+    for(uint i = 0; i < 2; i++) {
+        CBlockFileView view;
+        BOOST_REQUIRE(GetBlockFileView(pos[i], false, view));
+        BOOST_CHECK(vector<char>(view.pbegin, view.pend) == vBlock);
+        CBlock blockRead;
+        BOOST_REQUIRE(blockRead.ReadFromDisk(pos[i]));
+        BOOST_CHECK(blockRead.GetHash() == block.GetHash());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(block_record_import) {
+    CBlock blockGenesis, block = MakeCompressibleBlock();
+    BOOST_REQUIRE(blockGenesis.ReadFromDisk(pindexGenesisBlock));
+
+    /* Junk followed by a plain and a compressed record as in a block file */
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << blockGenesis;
+    CBlockRecord recordPlain;
+    recordPlain.Set(&ss[0], &ss[0] + ss.size(), false);
+    ss.clear();
+    ss << block;
+    CBlockRecord recordCompressed;
+    recordCompressed.Set(&ss[0], &ss[0] + ss.size(), true);
+    BOOST_REQUIRE(recordCompressed.fCompressed);
+
+    boost::filesystem::path path = GetDataDir() / "import.dat";
+    FILE *file = fopen(path.string().c_str(), "wb+");
+    BOOST_REQUIRE(file);
+    {
+        CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+        fileout << (uint)0;
+        fileout << FLATDATA(pchMessageStart) << recordPlain.GetSizeWord();
+        fileout.write(&recordPlain.vData[0], recordPlain.vData.size());
+        fileout << FLATDATA(pchMessageStart) << recordCompressed.GetSizeWord();
+        fileout.write(&recordCompressed.vData[0], recordCompressed.vData.size());
+        fflush(fileout);
+        rewind(fileout);
+        fileout.release();
+    }
+
+    CBufferedFile blkdat(file, 2 * MAX_BLOCK_SIZE, MAX_BLOCK_SIZE + 8, SER_DISK, CLIENT_VERSION);
+    uint256 hashExpected[2] = { blockGenesis.GetHash(), block.GetHash() };
+    for(uint i = 0; i < 2; i++) {
+        uchar buf[4];
+        uint nSizeWord, nSize;
+        bool fCompressed;
+        blkdat.FindByte(pchMessageStart[0]);
+        blkdat >> FLATDATA(buf) >> nSizeWord;
+        BOOST_REQUIRE(!memcmp(buf, pchMessageStart, 4));
+        BOOST_REQUIRE(ParseBlockRecordSize(nSizeWord, nSize, fCompressed));
+        BOOST_CHECK_EQUAL(fCompressed, (i == 1));
+        BOOST_CHECK_EQUAL(nSize, (i ? recordCompressed : recordPlain).vData.size());
+        vector<char> vData(nSize);
+        blkdat.read(&vData[0], nSize);
+        CBlock blockRead;
+        DecodeBlockRecord(vData, fCompressed, blockRead);
+        BOOST_CHECK(blockRead.GetHash() == hashExpected[i]);
+    }
+
+    /* Out of range sizes are skipped, compressed or not */
+    uint nSize;
+    bool fCompressed;
+    BOOST_CHECK(!ParseBlockRecordSize(79, nSize, fCompressed));
+    BOOST_CHECK(ParseBlockRecordSize(5 | BLOCK_RECORD_COMPRESSED, nSize, fCompressed) && fCompressed);
+    BOOST_CHECK(!ParseBlockRecordSize((MAX_BLOCK_SIZE + 1) | BLOCK_RECORD_COMPRESSED, nSize, fCompressed));
+
+    /* A corrupt compressed payload isn't taken for a block */
+    vector<char> vCorrupt(recordCompressed.vData);
+    vCorrupt[vCorrupt.size() / 2] ^= 0x55;
+    CBlock blockCorrupt;
+    BOOST_CHECK_THROW(DecodeBlockRecord(vCorrupt, true, blockCorrupt), std::exception);
+}
+
+BOOST_AUTO_TEST_CASE(block_file_compress) {
+    CBlock block = MakeCompressibleBlock();
+    CBlockRecord record;
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << block;
+    record.Set(&ss[0], &ss[0] + ss.size(), false);
+    CDiskBlockPos pos = AppendBlockRecord(record, 1, block.nTime);
+    int nFile = pos.nFile;
+
+    /* A side chain block stored in the file and its indexed transaction */
+    uint256 hashBlock = block.GetHash();
+    CBlockIndex *pindex = new CBlockIndex(block);
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hashBlock, pindex)).first;
+    pindex->phashBlock = &((*mi).first);
+    pindex->pprev = pindexGenesisBlock;
+    pindex->nHeight = 1;
+    pindex->nFile = nFile;
+    pindex->nDataPos = pos.nPos;
+    pindex->nStatus = BLOCK_VALID_TRANSACTIONS | BLOCK_HAVE_DATA;
+
+    bool fTxIndexSaved = fTxIndex;
+    fTxIndex = true;
+    uint256 hashTx = block.vtx[0].GetHash();
+    vector<pair<uint256, CDiskTxPos> > vPos;
+    vPos.push_back(make_pair(hashTx, CDiskTxPos(pos, 80 + GetSizeOfCompactSize(block.vtx.size()))));
+    BOOST_REQUIRE(pblocktree->WriteTxIndex(vPos));
+
+    /* The file is done with once another one is started */
+    {
+        LOCK(cs_LastBlockFile);
+        nLastBlockFile = nFile + 1;
+    }
+    bool fCompressed = CompressBlockFile(nFile);
+    {
+        LOCK(cs_LastBlockFile);
+        nLastBlockFile = nFile;
+        infoLastBlockFile.SetNull();
+        pblocktree->ReadBlockFileInfo(nFile, infoLastBlockFile);
+    }
+    BOOST_REQUIRE(fCompressed);
+    BOOST_CHECK(pblocktree->IsBlockFileCompressed(nFile));
+
+    /* The block moved into a smaller record and the indices followed it */
+    BOOST_CHECK(pindex->nDataPos != pos.nPos);
+    BOOST_CHECK(GetBlockRecordSize(pindex->GetBlockPos(), false) < record.GetDiskSize());
+    CBlock blockRead;
+    BOOST_REQUIRE(blockRead.ReadFromDisk(pindex));
+    BOOST_CHECK(blockRead.GetHash() == hashBlock);
+
+    CDiskTxPos postx;
+    BOOST_REQUIRE(pblocktree->ReadTxIndex(hashTx, postx));
+    BOOST_CHECK_EQUAL(postx.nFile, nFile);
+    BOOST_CHECK_EQUAL(postx.nPos, pindex->nDataPos);
+    CTransaction tx;
+    CBlock header;
+    uint nTxOffset;
+    BOOST_CHECK(ReadIndexedTransaction(hashTx, tx, header, nTxOffset));
+    BOOST_CHECK(header.GetHash() == hashBlock);
+
+    /* The blocks the file held before are still there */
+    CBlock blockGenesis;
+    BOOST_CHECK(blockGenesis.ReadFromDisk(pindexGenesisBlock));
+    BOOST_CHECK(blockGenesis.GetHash() == pindexGenesisBlock->GetBlockHash());
+
+    fTxIndex = fTxIndexSaved;
+    mapBlockIndex.erase(mi);
+    delete pindex;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
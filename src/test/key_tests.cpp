@@ -4,6 +4,7 @@
 #include <vector>
 
 #include "key.h"
+#include "keystore.h"
 #include "base58.h"
 #include "uint256.h"
 #include "util.h"
@@ -143,4 +144,30 @@ BOOST_AUTO_TEST_CASE(key_test1) {
     }
 }
 
+BOOST_AUTO_TEST_CASE(keystore_pubkey_cache) {
+    CCoinSecret bsecret1, bsecret1C;
+    BOOST_CHECK(bsecret1.SetString (strSecret1));
+    BOOST_CHECK(bsecret1C.SetString(strSecret1C));
+
+    bool fCompressed;
+    CKey key1, key1C;
+    key1.SetSecret (bsecret1.GetSecret(fCompressed),  fCompressed);
+    key1C.SetSecret(bsecret1C.GetSecret(fCompressed), fCompressed);
+
+    CBasicKeyStore keystore;
+    CPubKey vchPubKey;
+    BOOST_CHECK(!keystore.GetPubKey(key1.GetPubKey().GetID(), vchPubKey));
+
+    BOOST_CHECK(keystore.AddKey(key1));
+    BOOST_CHECK(keystore.AddKey(key1C));
+
+    BOOST_CHECK(keystore.GetPubKey(key1.GetPubKey().GetID(), vchPubKey));
+    BOOST_CHECK(vchPubKey == key1.GetPubKey());
+    BOOST_CHECK(CCoinAddress(vchPubKey.GetID()) == addr1);
+
+    BOOST_CHECK(keystore.GetPubKey(key1C.GetPubKey().GetID(), vchPubKey));
+    BOOST_CHECK(vchPubKey == key1C.GetPubKey());
+    BOOST_CHECK(CCoinAddress(vchPubKey.GetID()) == addr1C);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
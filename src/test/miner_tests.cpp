@@ -20,4 +20,177 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_basic) {
     delete(pblock);
 }
 
+BOOST_AUTO_TEST_CASE(mempool_packages) {
+    CTransaction tx[3];
+    uint256 hash[3];
+    uint i;
+
+    /* A chain of three with the last one spending both predecessors */
+    for(i = 0; i < 3; i++) {
+        tx[i].vin.resize(i ? i : 1);
+        tx[i].vout.resize(2);
+        tx[i].vout[0].nValue = tx[i].vout[1].nValue = COIN;
+        tx[i].vout[0].scriptPubKey = tx[i].vout[1].scriptPubKey = CScript() << OP_TRUE;
+    }
+    tx[0].vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx[1].vin[0].prevout = COutPoint(tx[0].GetHash(), 0);
+    tx[2].vin[0].prevout = COutPoint(tx[1].GetHash(), 0);
+    tx[2].vin[1].prevout = COutPoint(tx[0].GetHash(), 1);
+    for(i = 0; i < 3; i++)
+      hash[i] = tx[i].GetHash();
+
+    /* The child arrives ahead of its parents as if resurrected */
+    LOCK(mempool.cs);
+    mempool.clear();
+    mempool.addUnchecked(hash[2], CTransactionRef(new CTransaction(tx[2])));
+    mempool.addUnchecked(hash[0], CTransactionRef(new CTransaction(tx[0])));
+    mempool.addUnchecked(hash[1], CTransactionRef(new CTransaction(tx[1])));
+    BOOST_CHECK_EQUAL(mempool.setAncestorFeeRate.size(), 3U);
+
+    const CTxMemPoolEntry &entry = mempool.mapTx[hash[2]];
+    BOOST_CHECK_EQUAL(entry.setParents.size(), 2U);
+    BOOST_CHECK_EQUAL(entry.nCountWithAncestors, 3U);
+    BOOST_CHECK_EQUAL(entry.nSizeWithAncestors,
+      (uint64)(tx[0].GetSize() + tx[1].GetSize() + tx[2].GetSize()));
+    BOOST_CHECK_EQUAL(mempool.mapTx[hash[0]].setChildren.size(), 2U);
+    BOOST_CHECK_EQUAL(mempool.mapTx[hash[0]].nCountWithDescendants, 3U);
+    BOOST_CHECK_EQUAL(mempool.mapTx[hash[1]].nCountWithDescendants, 2U);
+    BOOST_CHECK_EQUAL(mempool.mapTx[hash[0]].nSizeWithDescendants, entry.nSizeWithAncestors);
+
+    /* Confirmation of the oldest leaves the rest with smaller packages */
+    mempool.remove(tx[0]);
+    BOOST_CHECK_EQUAL(mempool.setAncestorFeeRate.size(), 2U);
+    BOOST_CHECK_EQUAL(entry.setParents.size(), 1U);
+    BOOST_CHECK_EQUAL(entry.nCountWithAncestors, 2U);
+    BOOST_CHECK_EQUAL(entry.nSizeWithAncestors, (uint64)(tx[1].GetSize() + tx[2].GetSize()));
+    BOOST_CHECK_EQUAL(mempool.mapTx[hash[1]].nCountWithAncestors, 1U);
+    BOOST_CHECK(mempool.mapTx[hash[1]].setParents.empty());
+
+    mempool.remove(tx[2]);
+    BOOST_CHECK(mempool.mapTx[hash[1]].setChildren.empty());
+    BOOST_CHECK_EQUAL(mempool.mapTx[hash[1]].nCountWithDescendants, 1U);
+    mempool.clear();
+    BOOST_CHECK(mempool.setAncestorFeeRate.empty());
+}
+
+BOOST_AUTO_TEST_CASE(mempool_chain_limits) {
+    CTransaction tx[4];
+    uint i;
+
+    LOCK(mempool.cs);
+    mempool.clear();
+    uint nLimitAncestors = mempool.nLimitAncestors;
+    uint nLimitDescendants = mempool.nLimitDescendants;
+    mempool.nLimitAncestors = 3;
+    mempool.nLimitDescendants = 4;
+
+    for(i = 0; i < 4; i++) {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].prevout = COutPoint(i ? tx[i - 1].GetHash() : GetRandHash(), 0);
+        tx[i].vout.resize(2);
+        tx[i].vout[0].nValue = tx[i].vout[1].nValue = COIN;
+        tx[i].vout[0].scriptPubKey = tx[i].vout[1].scriptPubKey = CScript() << OP_TRUE;
+    }
+
+    /* The fourth of a chain exceeds the ancestor limit */
+    for(i = 0; i < 3; i++) {
+        BOOST_CHECK(mempool.CheckChainLimits(tx[i], tx[i].GetSize()));
+        mempool.addUnchecked(tx[i].GetHash(), CTransactionRef(new CTransaction(tx[i])));
+    }
+    BOOST_CHECK(!mempool.CheckChainLimits(tx[3], tx[3].GetSize()));
+
+    /* Siblings exceed the descendant limit of the root */
+    CTransaction txSibling(tx[1]);
+    txSibling.vin[0].prevout = COutPoint(tx[0].GetHash(), 1);
+    BOOST_CHECK(mempool.CheckChainLimits(txSibling, txSibling.GetSize()));
+    mempool.addUnchecked(txSibling.GetHash(), CTransactionRef(new CTransaction(txSibling)));
+    BOOST_CHECK_EQUAL(mempool.mapTx[tx[0].GetHash()].nCountWithDescendants, 4U);
+    txSibling.vin[0].prevout = COutPoint(tx[1].GetHash(), 1);
+    BOOST_CHECK(!mempool.CheckChainLimits(txSibling, txSibling.GetSize()));
+
+    mempool.nLimitAncestors = nLimitAncestors;
+    mempool.nLimitDescendants = nLimitDescendants;
+    mempool.clear();
+}
+
+BOOST_AUTO_TEST_CASE(mempool_trim) {
+    CTransaction tx[6];
+    uint i;
+
+    /* A chain of a free root and three paying descendants followed by
+     * two unrelated transactions paying more */
+    for(i = 0; i < 6; i++) {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].prevout = COutPoint(((i > 0) && (i < 4)) ? tx[i - 1].GetHash() : GetRandHash(), 0);
+        tx[i].vout.resize(1);
+        tx[i].vout[0].nValue = COIN;
+        tx[i].vout[0].scriptPubKey = CScript() << OP_TRUE;
+    }
+    int64 nFee[6] = { 0, 1 * CENT, 1 * CENT, 1 * CENT, 5 * CENT, 5 * CENT };
+
+    LOCK(mempool.cs);
+    mempool.clear();
+    for(i = 0; i < 6; i++)
+      mempool.addUnchecked(tx[i].GetHash(), CTransactionRef(new CTransaction(tx[i])), nFee[i]);
+    BOOST_CHECK(mempool.DynamicMemoryUsage() > mempool.GetTotalTxSize());
+    BOOST_CHECK_EQUAL(mempool.setDescendantScore.size(), 6U);
+    BOOST_CHECK(mempool.setDescendantScore.begin()->second == tx[0].GetHash());
+
+    /* Memory accounting is symmetric */
+    size_t nUsage = mempool.DynamicMemoryUsage();
+    mempool.remove(tx[3]);
+    BOOST_CHECK(mempool.DynamicMemoryUsage() < nUsage);
+    mempool.addUnchecked(tx[3].GetHash(), CTransactionRef(new CTransaction(tx[3])), nFee[3]);
+    BOOST_CHECK_EQUAL(mempool.DynamicMemoryUsage(), nUsage);
+
+    size_t nUsageUnrelated = mempool.mapTx[tx[4].GetHash()].nUsage + mempool.mapTx[tx[5].GetHash()].nUsage;
+    uint64 nSizeUnrelated = mempool.mapTx[tx[4].GetHash()].nSize + mempool.mapTx[tx[5].GetHash()].nSize;
+
+    /* Eviction of the chain root takes its descendants too and nothing else */
+    BOOST_CHECK_EQUAL(mempool.GetMinFeeRate(), 0);
+    mempool.TrimToSize(nUsage - 1);
+    BOOST_CHECK_EQUAL(mempool.size(), 2U);
+    for(i = 0; i < 4; i++)
+      BOOST_CHECK(!mempool.exists(tx[i].GetHash()));
+    BOOST_CHECK(mempool.exists(tx[4].GetHash()));
+    BOOST_CHECK(mempool.exists(tx[5].GetHash()));
+    BOOST_CHECK_EQUAL(mempool.DynamicMemoryUsage(), nUsageUnrelated);
+    BOOST_CHECK_EQUAL(mempool.GetTotalTxSize(), nSizeUnrelated);
+    BOOST_CHECK_EQUAL(mempool.setDescendantScore.size(), 2U);
+    BOOST_CHECK(mempool.GetMinFeeRate() >= MIN_RELAY_TX_FEE);
+    mempool.clear();
+}
+
+BOOST_AUTO_TEST_CASE(mempool_trim_cpfp) {
+    CTransaction tx[3];
+    uint i;
+
+    /* A free parent with a child paying for both and an unrelated transaction
+     * paying more than the parent but less than the package */
+    for(i = 0; i < 3; i++) {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].prevout = COutPoint(GetRandHash(), 0);
+        tx[i].vout.resize(1);
+        tx[i].vout[0].nValue = COIN;
+        tx[i].vout[0].scriptPubKey = CScript() << OP_TRUE;
+    }
+    tx[1].vin[0].prevout = COutPoint(tx[0].GetHash(), 0);
+
+    LOCK(mempool.cs);
+    mempool.clear();
+    mempool.addUnchecked(tx[0].GetHash(), CTransactionRef(new CTransaction(tx[0])), 0);
+    mempool.addUnchecked(tx[1].GetHash(), CTransactionRef(new CTransaction(tx[1])), 10 * CENT);
+    mempool.addUnchecked(tx[2].GetHash(), CTransactionRef(new CTransaction(tx[2])), 1 * CENT);
+    BOOST_CHECK_EQUAL(mempool.setDescendantScore.size(), 3U);
+    BOOST_CHECK_EQUAL(mempool.mapTx[tx[0].GetHash()].nFeesWithDescendants, 10 * CENT);
+
+    /* The unrelated transaction goes first */
+    mempool.TrimToSize(mempool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK_EQUAL(mempool.size(), 2U);
+    BOOST_CHECK(!mempool.exists(tx[2].GetHash()));
+    BOOST_CHECK(mempool.exists(tx[0].GetHash()));
+    BOOST_CHECK(mempool.exists(tx[1].GetHash()));
+    mempool.clear();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
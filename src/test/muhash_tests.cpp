@@ -0,0 +1,246 @@
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "muhash.h"
+#include "serialize.h"
+#include "version.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(muhash_tests)
+
+static vector<unsigned char> Element(unsigned int n) {
+    vector<unsigned char> vch(1 + n % 50, (unsigned char)n);
+    vch[0] = (unsigned char)(n >> 8);
+    return(vch);
+}
+
+BOOST_AUTO_TEST_CASE(muhash_order_independence) {
+    CMuHash3072 a, b;
+    uint i;
+
+    for(i = 0; i < 32; i++) {
+        a.Insert(Element(i));
+        b.Insert(Element(31 - i));
+    }
+    BOOST_CHECK(a.Finalize() == b.Finalize());
+    BOOST_CHECK(a.Finalize() != CMuHash3072().Finalize());
+
+    // A multiset, not a set
+    b.Insert(Element(0));
+    BOOST_CHECK(a.Finalize() != b.Finalize());
+}
+
+BOOST_AUTO_TEST_CASE(muhash_insert_remove) {
+    CMuHash3072 a, b;
+    uint i;
+
+    for(i = 0; i < 16; i++)
+      a.Insert(Element(i));
+    for(i = 0; i < 16; i += 2)
+      a.Remove(Element(i));
+    for(i = 1; i < 16; i += 2)
+      b.Insert(Element(i));
+    BOOST_CHECK(a.Finalize() == b.Finalize());
+
+    // Removals may come before insertions
+    CMuHash3072 c;
+    c.Remove(Element(100));
+    c.Insert(Element(100));
+    BOOST_CHECK(c.Finalize() == CMuHash3072().Finalize());
+}
+
+BOOST_AUTO_TEST_CASE(muhash_combine) {
+    CMuHash3072 a, b, c, delta;
+    uint i;
+
+    for(i = 0; i < 8; i++) {
+        a.Insert(Element(i));
+        c.Insert(Element(i));
+    }
+    for(i = 8; i < 12; i++) {
+        b.Insert(Element(i));
+        c.Insert(Element(i));
+    }
+    a *= b;
+    BOOST_CHECK(a.Finalize() == c.Finalize());
+
+    // Deltas with removals combine the same way
+    delta.Remove(Element(3));
+    delta.Insert(Element(20));
+    c *= delta;
+    b = CMuHash3072();
+    for(i = 0; i < 12; i++) {
+        if(i != 3)
+          b.Insert(Element(i));
+    }
+    b.Insert(Element(20));
+    BOOST_CHECK(b.Finalize() == c.Finalize());
+}
+
+BOOST_AUTO_TEST_CASE(muhash_serialization) {
+    CMuHash3072 a, b;
+
+    a.Insert(Element(1));
+    a.Insert(Element(2));
+    a.Remove(Element(3));
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << a;
+    BOOST_CHECK_EQUAL(ss.size(), ::GetSerializeSize(a, SER_DISK, CLIENT_VERSION));
+    ss >> b;
+    BOOST_CHECK(a.Finalize() == b.Finalize());
+    BOOST_CHECK(ss.empty());
+}
+
+/* Statistics of the coins of the transactions specified as a full scan would count them */
+static CCoinsStats ScanCoins(CCoinsViewCache &view, const vector<uint256> &vTxid) {
+    CCoinsStats stats;
+    uint i;
+
+    BOOST_FOREACH(const uint256 &txid, vTxid) {
+        CCoins coins;
+        if(!view.GetCoins(txid, coins) || !CCoinsStats::IsCounted(coins))
+          continue;
+        stats.nTransactions++;
+        for(i = 0; i < coins.vout.size(); i++) {
+            if(CCoinsStats::IsCounted(coins.vout[i]))
+              stats.AddOutput(txid, i, coins, coins.vout[i]);
+        }
+    }
+
+    return(stats);
+}
+
+static bool StatsEqual(const CCoinsStats &a, const CCoinsStats &b) {
+    return((a.nTransactions == b.nTransactions) &&
+      (a.nTransactionOutputs == b.nTransactionOutputs) &&
+      (a.nTotalAmount == b.nTotalAmount) &&
+      (a.muhash.Finalize() == b.muhash.Finalize()));
+}
+
+/* Reverts a transaction the way DisconnectBlock() does */
+static bool DisconnectTx(CCoinsViewCache &view, const CTransaction &tx, const CTxUndo &txundo) {
+    uint256 hash = tx.GetHash();
+    uint i;
+
+    if(!view.HaveCoins(hash))
+      return(false);
+    CCoins &outs = view.GetCoins(hash);
+    view.GetStatsDelta().RemoveCoins(hash, outs);
+    outs = CCoins();
+
+    if(tx.IsCoinBase())
+      return(true);
+    for(i = tx.vin.size(); i-- > 0;) {
+        if(!ApplyTxInUndo(txundo.vprevout[i], view, tx.vin[i].prevout))
+          return(false);
+    }
+
+    return(true);
+}
+
+BOOST_AUTO_TEST_CASE(coinsstats_delta) {
+    CCoinsView viewDummy;
+    CCoinsViewCache viewBase(viewDummy);
+    CCoinsViewCache view(viewBase);
+    vector<uint256> vTxid;
+    CTxUndo undo[4];
+
+    /* Funds with an empty output in between */
+    CTransaction txFund;
+    txFund.nTime = 1000;
+    txFund.vin.resize(1);
+    txFund.vin[0].prevout.SetNull();
+    txFund.vout.resize(3);
+    txFund.vout[0].nValue = 10 * COIN;
+    txFund.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    txFund.vout[1].SetEmpty();
+    txFund.vout[2].nValue = 5 * COIN;
+    txFund.vout[2].scriptPubKey = CScript() << OP_TRUE;
+
+    /* Spends a part of the funds */
+    CTransaction txSpend;
+    txSpend.nTime = 1001;
+    txSpend.vin.resize(1);
+    txSpend.vin[0].prevout = COutPoint(txFund.GetHash(), 0);
+    txSpend.vout.resize(1);
+    txSpend.vout[0].nValue = 9 * COIN;
+    txSpend.vout[0].scriptPubKey = CScript() << OP_TRUE;
+
+    /* Spends the last output of the funds, which prunes them */
+    CTransaction txStake;
+    txStake.nTime = 1002;
+    txStake.vin.resize(1);
+    txStake.vin[0].prevout = COutPoint(txFund.GetHash(), 2);
+    txStake.vout.resize(2);
+    txStake.vout[0].SetEmpty();
+    txStake.vout[1].nValue = 6 * COIN;
+    txStake.vout[1].scriptPubKey = CScript() << OP_TRUE;
+    BOOST_CHECK(txStake.IsCoinStake());
+
+    /* Spends the rest */
+    CTransaction txSweep;
+    txSweep.nTime = 1003;
+    txSweep.vin.resize(2);
+    txSweep.vin[0].prevout = COutPoint(txSpend.GetHash(), 0);
+    txSweep.vin[1].prevout = COutPoint(txStake.GetHash(), 1);
+    txSweep.vout.resize(1);
+    txSweep.vout[0].nValue = 14 * COIN;
+    txSweep.vout[0].scriptPubKey = CScript() << OP_TRUE;
+
+    vTxid.push_back(txFund.GetHash());
+    vTxid.push_back(txSpend.GetHash());
+    vTxid.push_back(txStake.GetHash());
+    vTxid.push_back(txSweep.GetHash());
+
+    BOOST_CHECK(txFund.UpdateCoins(view, undo[0], 1, 2000, txFund.GetHash()));
+    BOOST_CHECK(StatsEqual(view.GetStatsDelta(), ScanCoins(view, vTxid)));
+    BOOST_CHECK_EQUAL(view.GetStatsDelta().nTransactionOutputs, 2U);
+
+    BOOST_CHECK(txSpend.UpdateCoins(view, undo[1], 2, 2001, txSpend.GetHash()));
+    BOOST_CHECK(StatsEqual(view.GetStatsDelta(), ScanCoins(view, vTxid)));
+
+    /* The funds are pruned while their metadata is kept for the undo record */
+    BOOST_CHECK(txStake.UpdateCoins(view, undo[2], 3, 2002, txStake.GetHash()));
+    BOOST_CHECK(view.GetCoins(txFund.GetHash()).IsPruned());
+    BOOST_CHECK_EQUAL(undo[2].vprevout[0].nHeight, 1U);
+    BOOST_CHECK(StatsEqual(view.GetStatsDelta(), ScanCoins(view, vTxid)));
+    BOOST_CHECK_EQUAL(view.GetStatsDelta().nTransactions, 2U);
+
+    /* Changes of a nested cache are merged on flush */
+    {
+        CCoinsViewCache viewNested(view);
+        BOOST_CHECK(txSweep.UpdateCoins(viewNested, undo[3], 4, 2003, txSweep.GetHash()));
+        BOOST_CHECK(viewNested.Flush());
+    }
+    BOOST_CHECK(StatsEqual(view.GetStatsDelta(), ScanCoins(view, vTxid)));
+    BOOST_CHECK_EQUAL(view.GetStatsDelta().nTransactions, 1U);
+    BOOST_CHECK_EQUAL(view.GetStatsDelta().nTotalAmount, 14 * COIN);
+
+    {
+        CCoinsViewCache viewNested(view);
+        BOOST_CHECK(DisconnectTx(viewNested, txSweep, undo[3]));
+        BOOST_CHECK(viewNested.Flush());
+    }
+    BOOST_CHECK(StatsEqual(view.GetStatsDelta(), ScanCoins(view, vTxid)));
+
+    /* The pruned funds are restored from the undo record */
+    BOOST_CHECK(DisconnectTx(view, txStake, undo[2]));
+    BOOST_CHECK(view.GetCoins(txFund.GetHash()).IsAvailable(2));
+    BOOST_CHECK(StatsEqual(view.GetStatsDelta(), ScanCoins(view, vTxid)));
+
+    BOOST_CHECK(DisconnectTx(view, txSpend, undo[1]));
+    BOOST_CHECK(StatsEqual(view.GetStatsDelta(), ScanCoins(view, vTxid)));
+    BOOST_CHECK_EQUAL(view.GetStatsDelta().nTotalAmount, 15 * COIN);
+
+    /* Nothing is left after reverting everything, down to the base */
+    BOOST_CHECK(DisconnectTx(view, txFund, undo[0]));
+    BOOST_CHECK(view.Flush());
+    BOOST_CHECK(StatsEqual(viewBase.GetStatsDelta(), ScanCoins(viewBase, vTxid)));
+    BOOST_CHECK(StatsEqual(viewBase.GetStatsDelta(), CCoinsStats()));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,156 @@
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+#include "prevector.h"
+#include "serialize.h"
+#include "script.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(prevector_tests)
+
+typedef prevector<8, int> pretype;
+
+// Every operation is mirrored on a std::vector and the contents compared
+class CPrevectorTester {
+public:
+    vector<int> real;
+    pretype pre;
+
+    void Check() {
+        BOOST_CHECK_EQUAL(real.size(), pre.size());
+        BOOST_CHECK_EQUAL(real.empty(), pre.empty());
+        BOOST_CHECK(pre.capacity() >= pre.size());
+        BOOST_CHECK_EQUAL(pre.allocated_memory() != 0, pre.capacity() > 8);
+        for(uint i = 0; i < real.size(); i++)
+          BOOST_CHECK_EQUAL(real[i], pre[i]);
+        BOOST_CHECK(vector<int>(pre.begin(), pre.end()) == real);
+        pretype copy(pre);
+        BOOST_CHECK(copy == pre);
+        BOOST_CHECK(!(copy < pre) && !(pre < copy));
+    }
+
+    void resize(uint s) {
+        real.resize(s);
+        pre.resize(s);
+        Check();
+    }
+
+    void insert(uint pos, int value) {
+        real.insert(real.begin() + pos, value);
+        pre.insert(pre.begin() + pos, value);
+        Check();
+    }
+
+    void insert(uint pos, uint count, int value) {
+        real.insert(real.begin() + pos, count, value);
+        pre.insert(pre.begin() + pos, count, value);
+        Check();
+    }
+
+    void insert_range(uint pos, const vector<int> &range) {
+        real.insert(real.begin() + pos, range.begin(), range.end());
+        pre.insert(pre.begin() + pos, range.begin(), range.end());
+        Check();
+    }
+
+    void erase(uint first, uint last) {
+        real.erase(real.begin() + first, real.begin() + last);
+        pre.erase(pre.begin() + first, pre.begin() + last);
+        Check();
+    }
+
+    void push_back(int value) {
+        real.push_back(value);
+        pre.push_back(value);
+        Check();
+    }
+
+    void pop_back() {
+        real.pop_back();
+        pre.pop_back();
+        Check();
+    }
+
+    void shrink_to_fit() {
+        pre.shrink_to_fit();
+        Check();
+    }
+
+    void swap() {
+        pretype other;
+        other.swap(pre);
+        pre = other;
+        Check();
+    }
+};
+
+BOOST_AUTO_TEST_CASE(prevector_random) {
+    uint i, j;
+
+    for(j = 0; j < 64; j++) {
+        CPrevectorTester test;
+        for(i = 0; i < 2048; i++) {
+            uint r = GetRandInt(1 << 30), s = test.real.size();
+            switch(r % 10) {
+                case(0):
+                    test.insert(r % (s + 1), r);
+                    break;
+                case(1):
+                    test.insert(r % (s + 1), 1 + (r >> 4) % 12, r);
+                    break;
+                case(2):
+                    test.insert_range(r % (s + 1), vector<int>((r >> 4) % 20, r));
+                    break;
+                case(3):
+                    if(s) {
+                        uint first = (r >> 4) % s;
+                        test.erase(first, first + 1 + (r >> 8) % (s - first));
+                    }
+                    break;
+                case(4):
+                    if(s) test.pop_back();
+                    break;
+                case(5):
+                    test.resize(std::max(0, (int)s + (int)((r >> 4) % 17) - 8));
+                    break;
+                case(6):
+                    test.shrink_to_fit();
+                    break;
+                case(7):
+                    test.swap();
+                    break;
+                default:
+                    test.push_back(r);
+                    break;
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(prevector_script_serialization) {
+    uint i;
+
+    // The inline and heap sizes of scripts serialise as byte vectors always did
+    for(i = 0; i < 600; i += 7) {
+        vector<unsigned char> vch(i);
+        for(uint j = 0; j < i; j++)
+          vch[j] = (unsigned char)(i + j);
+        CScript script(vch.begin(), vch.end());
+
+        CDataStream ssScript(SER_NETWORK, PROTOCOL_VERSION), ssVector(SER_NETWORK, PROTOCOL_VERSION);
+        ssScript << script;
+        ssVector << vch;
+        BOOST_CHECK(ssScript.str() == ssVector.str());
+        BOOST_CHECK_EQUAL(ssScript.size(), ::GetSerializeSize(script, SER_NETWORK, PROTOCOL_VERSION));
+
+        CScript script2;
+        ssScript >> script2;
+        BOOST_CHECK(script2 == script);
+        BOOST_CHECK(ToByteVector(script2) == vch);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -344,7 +344,7 @@ BOOST_AUTO_TEST_CASE(script_combineSigs)
     combined = CombineSignatures(scriptPubKey, txTo, 0, scriptSigCopy, scriptSig);
     BOOST_CHECK(combined == scriptSigCopy || combined == scriptSig);
     // dummy scriptSigCopy with placeholder, should always choose non-placeholder:
-    scriptSigCopy = CScript() << OP_0 << static_cast<vector<unsigned char> >(pkSingle);
+    scriptSigCopy = CScript() << OP_0 << ToByteVector(pkSingle);
     combined = CombineSignatures(scriptPubKey, txTo, 0, scriptSigCopy, scriptSig);
     BOOST_CHECK(combined == scriptSig);
     combined = CombineSignatures(scriptPubKey, txTo, 0, scriptSig, scriptSigCopy);
@@ -432,4 +432,170 @@ BOOST_AUTO_TEST_CASE(script_GetScriptAsm) {
     BOOST_CHECK_EQUAL(derSig + "83 " + pubKey, ScriptToAsmStr(CScript() << ToByteVector(ParseHex(derSig + "83")) << vchPubKey));
 }
 
+// The signature hash as computed on a blanked out copy of the transaction
+static uint256 SignatureHashCopy(CScript scriptCode, const CTransaction &txTo, uint nIn, int nHashType) {
+    uint i;
+
+    if(nIn >= txTo.vin.size()) return(1);
+    CTransaction txTmp(txTo);
+    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
+    for(i = 0; i < txTmp.vin.size(); i++)
+      txTmp.vin[i].scriptSig = CScript();
+    txTmp.vin[nIn].scriptSig = scriptCode;
+    if((nHashType & 0x1F) == SIGHASH_NONE) {
+        txTmp.vout.clear();
+        for(i = 0; i < txTmp.vin.size(); i++)
+          if(i != nIn) txTmp.vin[i].nSequence = 0;
+    } else if((nHashType & 0x1F) == SIGHASH_SINGLE) {
+        if(nIn >= txTmp.vout.size()) return(1);
+        txTmp.vout.resize(nIn + 1);
+        for(i = 0; i < nIn; i++)
+          txTmp.vout[i].SetNull();
+        for(i = 0; i < txTmp.vin.size(); i++)
+          if(i != nIn) txTmp.vin[i].nSequence = 0;
+    }
+    if(nHashType & SIGHASH_ANYONECANPAY) {
+        txTmp.vin[0] = txTmp.vin[nIn];
+        txTmp.vin.resize(1);
+    }
+    CDataStream ss(SER_GETHASH, 0);
+    ss << txTmp << nHashType;
+    return(Hash(ss.begin(), ss.end()));
+}
+
+BOOST_AUTO_TEST_CASE(script_SignatureHash) {
+    const int vHashTypes[] = { 0, SIGHASH_ALL, SIGHASH_NONE, SIGHASH_SINGLE, 4,
+      SIGHASH_ALL | SIGHASH_ANYONECANPAY, SIGHASH_NONE | SIGHASH_ANYONECANPAY,
+      SIGHASH_SINGLE | SIGHASH_ANYONECANPAY, 0x21 };
+    CScript scriptCode = CScript() << OP_DUP << OP_HASH160 << ParseHex("0102030405")
+      << OP_CODESEPARATOR << OP_EQUALVERIFY << OP_CHECKSIG;
+    uint i, j, k;
+
+    for(k = 1; k <= 2; k++) {
+        CTransaction tx;
+        tx.nVersion = k;
+        tx.nTime = 1400000000 + k;
+        tx.nLockTime = 12345;
+        if(k > 1) tx.strTxComment = "text";
+        tx.vin.resize(5);
+        for(i = 0; i < tx.vin.size(); i++) {
+            tx.vin[i].prevout = COutPoint(GetRandHash(), i);
+            tx.vin[i].scriptSig = CScript() << ParseHex("deadbeef") << OP_1;
+            tx.vin[i].nSequence = i;
+        }
+        tx.vout.resize(3);
+        for(i = 0; i < tx.vout.size(); i++) {
+            tx.vout[i].nValue = (i + 1) * COIN;
+            tx.vout[i].scriptPubKey = CScript() << OP_RETURN << i;
+        }
+
+        CSigHashCache sighashcache(tx);
+        for(i = 0; i < tx.vin.size(); i++) {
+            for(j = 0; j < sizeof(vHashTypes) / sizeof(vHashTypes[0]); j++) {
+                uint256 hash = SignatureHashCopy(scriptCode, tx, i, vHashTypes[j]);
+                BOOST_CHECK(SignatureHash(scriptCode, tx, i, vHashTypes[j]) == hash);
+                BOOST_CHECK(SignatureHash(scriptCode, tx, i, vHashTypes[j], &sighashcache) == hash);
+            }
+        }
+
+        // Out of range inputs hash to one
+        BOOST_CHECK(SignatureHash(scriptCode, tx, tx.vin.size(), SIGHASH_ALL, &sighashcache) == 1);
+    }
+}
+
+// Runs both scripts through the interpreter as VerifyScript() did for all scripts
+static bool VerifyScriptInterpreted(const CScript &scriptSig, const CScript &scriptPubKey,
+  const CTransaction &txTo) {
+    vector<vector<unsigned char> > stack;
+
+    if(!EvalScript(stack, scriptSig, txTo, 0, flags, 0)) return(false);
+    if(!EvalScript(stack, scriptPubKey, txTo, 0, flags, 0)) return(false);
+    if(stack.empty()) return(false);
+
+    const vector<unsigned char> &vch = stack.back();
+    for(uint i = 0; i < vch.size(); i++) {
+        if(vch[i]) return(!((i == (vch.size() - 1)) && (vch[i] == 0x80)));
+    }
+    return(false);
+}
+
+static vector<unsigned char> SignTemplate(CKey &key, const CScript &scriptPubKey,
+  const CTransaction &txTo, int nHashType) {
+    vector<unsigned char> vchSig;
+
+    BOOST_CHECK(key.Sign(SignatureHash(scriptPubKey, txTo, 0, nHashType), vchSig));
+    vchSig.push_back((unsigned char)nHashType);
+    return(vchSig);
+}
+
+BOOST_AUTO_TEST_CASE(script_template_fastpath) {
+    CKey key1, key2, key3;
+    key1.MakeNewKey(true);
+    key2.MakeNewKey(false);
+    key3.MakeNewKey(true);
+    uint i, j;
+
+    vector<CScript> vScriptPubKey;
+    vScriptPubKey.push_back(CScript() << OP_DUP << OP_HASH160 << key1.GetPubKey().GetID()
+      << OP_EQUALVERIFY << OP_CHECKSIG);
+    vScriptPubKey.push_back(CScript() << key1.GetPubKey() << OP_CHECKSIG);
+    vScriptPubKey.push_back(CScript() << OP_DUP << OP_HASH160 << key2.GetPubKey().GetID()
+      << OP_EQUALVERIFY << OP_CHECKSIG);
+    vScriptPubKey.push_back(CScript() << key2.GetPubKey() << OP_CHECKSIG);
+    vector<CKey> vKey;
+    vKey.push_back(key1);
+    vKey.push_back(key1);
+    vKey.push_back(key2);
+    vKey.push_back(key2);
+
+    CTransaction txTo;
+    txTo.vin.resize(1);
+    txTo.vout.resize(1);
+    txTo.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txTo.vout[0].nValue = 1;
+
+    for(i = 0; i < vScriptPubKey.size(); i++) {
+        const CScript &scriptPubKey = vScriptPubKey[i];
+        bool fHash = (scriptPubKey[0] == OP_DUP);
+        vector<unsigned char> vchPubKey = vKey[i].GetPubKey().Raw();
+
+        vector<unsigned char> vchSigAll = SignTemplate(vKey[i], scriptPubKey, txTo, SIGHASH_ALL);
+        vector<unsigned char> vchSigNone = SignTemplate(vKey[i], scriptPubKey, txTo, SIGHASH_NONE);
+        vector<unsigned char> vchSigOther = SignTemplate(key3, scriptPubKey, txTo, SIGHASH_ALL);
+        vector<unsigned char> vchSigBad(vchSigAll);
+        vchSigBad[4] ^= 0x01;
+        vector<unsigned char> vchSigNonDER(vchSigAll);
+        vchSigNonDER[1]++;
+
+        vector<CScript> vScriptSig;
+        vScriptSig.push_back(fHash ? (CScript() << vchSigAll << vchPubKey) : (CScript() << vchSigAll));
+        vScriptSig.push_back(fHash ? (CScript() << vchSigNone << vchPubKey) : (CScript() << vchSigNone));
+        vScriptSig.push_back(fHash ? (CScript() << vchSigOther << vchPubKey) : (CScript() << vchSigOther));
+        vScriptSig.push_back(fHash ? (CScript() << vchSigBad << vchPubKey) : (CScript() << vchSigBad));
+        vScriptSig.push_back(fHash ? (CScript() << vchSigNonDER << vchPubKey) : (CScript() << vchSigNonDER));
+        vScriptSig.push_back(fHash ? (CScript() << OP_0 << vchPubKey) : (CScript() << OP_0));
+        vScriptSig.push_back(CScript() << vchSigAll << key3.GetPubKey());
+        vScriptSig.push_back(CScript() << OP_1 << vchSigAll << vchPubKey);
+        vScriptSig.push_back(CScript() << vchSigAll << vchPubKey << OP_NOP);
+        vScriptSig.push_back(CScript() << OP_1);
+        vScriptSig.push_back(CScript());
+
+        for(j = 0; j < vScriptSig.size(); j++) {
+            bool fValid = VerifyScriptInterpreted(vScriptSig[j], scriptPubKey, txTo);
+            BOOST_CHECK_EQUAL(VerifyScript(vScriptSig[j], scriptPubKey, txTo, 0, flags, 0), fValid);
+        }
+
+        BOOST_CHECK(VerifyScript(vScriptSig[0], scriptPubKey, txTo, 0, flags, 0));
+        BOOST_CHECK(VerifyScript(vScriptSig[1], scriptPubKey, txTo, 0, flags, 0));
+        BOOST_CHECK(!VerifyScript(vScriptSig[2], scriptPubKey, txTo, 0, flags, 0));
+        BOOST_CHECK(!VerifyScript(vScriptSig[3], scriptPubKey, txTo, 0, flags, 0));
+
+        // Only the SIGHASH_NONE signature survives a change of the outputs
+        CTransaction txChanged(txTo);
+        txChanged.vout[0].nValue = 2;
+        BOOST_CHECK(!VerifyScript(vScriptSig[0], scriptPubKey, txChanged, 0, flags, 0));
+        BOOST_CHECK(VerifyScript(vScriptSig[1], scriptPubKey, txChanged, 0, flags, 0));
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -3,6 +3,7 @@
 
 #include "serialize.h"
 #include "util.h"
+#include "main.h"
 
 using namespace std;
 
@@ -147,4 +148,57 @@ BOOST_AUTO_TEST_CASE(insert_delete) {
     BOOST_CHECK_EQUAL(ss[3], (char)0xff);
 }
 
+/* The address index is walked by height, so the keys must sort by it bytewise */
+BOOST_AUTO_TEST_CASE(address_index_key_order) {
+    const int nHeights[] = { 0, 1, 255, 256, 65535, 65536, 16777216, 0x7FFFFFFF };
+    uint160 hashScript = Hash160(vector<unsigned char>(1, 0x51));
+    string strPrev;
+    uint i;
+
+    for(i = 0; i < sizeof(nHeights) / sizeof(nHeights[0]); i++) {
+        CAddressIndexKey key(hashScript, nHeights[i], i, i, i & 1);
+        CDataStream ss(SER_DISK, 0);
+        ss << make_pair('a', key);
+        BOOST_CHECK_EQUAL(ss.size(), 1 + ::GetSerializeSize(key, SER_DISK, 0));
+        if(i) BOOST_CHECK(ss.str() > strPrev);
+        strPrev = ss.str();
+
+        char chType;
+        CAddressIndexKey key2;
+        ss >> chType >> key2;
+        BOOST_CHECK(key2.hashScript == hashScript);
+        BOOST_CHECK_EQUAL(key2.nHeight, nHeights[i]);
+        BOOST_CHECK(key2.txid == uint256(i));
+        BOOST_CHECK_EQUAL(key2.nIndex, i);
+        BOOST_CHECK_EQUAL(key2.fSpending, (bool)(i & 1));
+    }
+}
+
+/* Reading in place from memory must match the stream it was written to */
+BOOST_AUTO_TEST_CASE(memory_reader) {
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    vector<int> vInts(100, 7);
+    string str("memory reader");
+    uint64 n = 0x0102030405060708ULL;
+    ss << vInts << str << VARINT(n);
+    vector<char> vData(ss.begin(), ss.end());
+
+    CMemoryReader reader(&vData[0], &vData[0] + vData.size(), SER_DISK, CLIENT_VERSION);
+    vector<int> vInts2;
+    string str2;
+    uint64 n2;
+    reader >> vInts2 >> str2 >> VARINT(n2);
+    BOOST_CHECK(vInts2 == vInts);
+    BOOST_CHECK_EQUAL(str2, str);
+    BOOST_CHECK_EQUAL(n2, n);
+    BOOST_CHECK(reader.empty());
+    BOOST_CHECK_THROW(reader >> n2, std::ios_base::failure);
+
+    /* Seek past the vector */
+    reader.Seek(::GetSerializeSize(vInts, SER_DISK, CLIENT_VERSION));
+    reader >> str2;
+    BOOST_CHECK_EQUAL(str2, str);
+    BOOST_CHECK_THROW(reader.Seek(vData.size() + 1), std::ios_base::failure);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
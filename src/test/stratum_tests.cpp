@@ -0,0 +1,62 @@
+#include <boost/test/unit_test.hpp>
+
+#include "init.h"
+#include "wallet.h"
+#include "miner.h"
+#include "stratum.h"
+
+BOOST_AUTO_TEST_SUITE(stratum_tests)
+
+BOOST_AUTO_TEST_CASE(stratum_job) {
+    CBlock *pblock;
+    uint i;
+
+    BOOST_REQUIRE(pblock = CreateNewBlock(pwalletMain, false));
+
+    /* Another transaction for the coin base to have a merkle branch */
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = COIN;
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    pblock->vtx.push_back(tx);
+
+    CStratumJob job;
+    BOOST_CHECK(CreateStratumJob(*pblock, pindexBest, job));
+    BOOST_CHECK_EQUAL(job.vMerkleBranch.size(), 1U);
+    BOOST_CHECK(job.pindexPrev == pindexBest);
+
+    /* A miner fills in the extranonce between the parts of the coin base */
+    std::vector<uchar> vchExtraNonce(STRATUM_EXTRANONCE1_SIZE + STRATUM_EXTRANONCE2_SIZE);
+    for(i = 0; i < vchExtraNonce.size(); i++)
+      vchExtraNonce[i] = (uchar)(i + 1);
+    std::vector<uchar> vchCoinBase(job.vchCoinBase1);
+    vchCoinBase.insert(vchCoinBase.end(), vchExtraNonce.begin(), vchExtraNonce.end());
+    vchCoinBase.insert(vchCoinBase.end(), job.vchCoinBase2.begin(), job.vchCoinBase2.end());
+
+    CTransaction txCoinBase;
+    CDataStream ss(vchCoinBase, SER_NETWORK, PROTOCOL_VERSION);
+    ss >> txCoinBase;
+    BOOST_CHECK(txCoinBase.IsCoinBase());
+
+    /* The same coin base and merkle root as the node makes with this extranonce */
+    CBlock block(*pblock);
+    SetExtraNonce(&block, pindexBest, vchExtraNonce);
+    BOOST_CHECK(txCoinBase.GetHash() == block.vtx[0].GetHash());
+    BOOST_CHECK(CBlock::CheckMerkleBranch(txCoinBase.GetHash(), job.vMerkleBranch, 0) == block.hashMerkleRoot);
+
+    /* The extranonce has a fixed place regardless of its value */
+    std::vector<uchar> vchExtraNonceZero(vchExtraNonce.size(), 0);
+    SetExtraNonce(&block, pindexBest, vchExtraNonceZero);
+    BOOST_CHECK_EQUAL(block.vtx[0].vin[0].scriptSig.size(), txCoinBase.vin[0].scriptSig.size());
+
+    /* Every job has an ID of its own */
+    CStratumJob jobNext;
+    BOOST_CHECK(CreateStratumJob(*pblock, pindexBest, jobNext));
+    BOOST_CHECK(job.strId != jobNext.strId);
+
+    delete(pblock);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
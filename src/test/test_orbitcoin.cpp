@@ -23,7 +23,6 @@ extern bool fPrintToConsole;
 extern void noui_connect();
 
 struct TestingSetup {
-    CCoinsViewDB *pcoinsdbview;
     boost::filesystem::path pathTemp;
     boost::thread_group threadGroup;
 
@@ -51,6 +50,7 @@ struct TestingSetup {
         pwalletMain = NULL;
         delete pcoinsTip;
         delete pcoinsdbview;
+        pcoinsdbview = NULL;
         delete pblocktree;
         bitdb.Flush(true);
         boost::filesystem::remove_all(pathTemp);
@@ -214,6 +214,7 @@ BOOST_AUTO_TEST_CASE(basic_transaction_tests) {
     BOOST_CHECK_MESSAGE(tx.CheckTransaction(), "Simple deserialized transaction should be valid.");
 
     // Check that duplicate txins fail
+    tx.Thaw();
     tx.vin.push_back(tx.vin[0]);
     BOOST_CHECK_MESSAGE(!tx.CheckTransaction(), "Transaction with duplicate txins should be invalid.");
 }
@@ -288,4 +289,41 @@ BOOST_AUTO_TEST_CASE(test_Get)
     BOOST_CHECK(!t1.AreInputsStandard(coins));
 }
 
+BOOST_AUTO_TEST_CASE(test_FrozenHash)
+{
+    CBasicKeyStore keystore;
+    CCoinsView coinsDummy;
+    std::vector<CTransaction> dummyTransactions = SetupDummyInputs(keystore, coinsDummy);
+
+    CTransaction t1 = dummyTransactions[0];
+    BOOST_CHECK(!t1.IsFrozen());
+    uint256 hash = t1.GetHash();
+    uint nSize = t1.GetSize();
+    BOOST_CHECK_EQUAL(nSize, ::GetSerializeSize(t1, SER_NETWORK, PROTOCOL_VERSION));
+
+    // Transactions read from a stream come frozen with the same hash and size
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << t1;
+    CTransaction t2;
+    ss >> t2;
+    BOOST_CHECK(t2.IsFrozen());
+    BOOST_CHECK(t2.GetHash() == hash);
+    BOOST_CHECK_EQUAL(t2.GetSize(), nSize);
+
+    // Copies keep the cached values
+    CTransaction t3(t2);
+    BOOST_CHECK(t3.IsFrozen());
+    BOOST_CHECK(t3.GetHash() == hash);
+
+    // Thawed transactions are hashed as they change
+    t3.Thaw();
+    t3.vout[0].nValue++;
+    t3.vout[0].scriptPubKey << OP_NOP;
+    BOOST_CHECK(t3.GetHash() != hash);
+    BOOST_CHECK_EQUAL(t3.GetSize(), nSize + 1);
+    t3.Freeze();
+    BOOST_CHECK(t3.GetHash() == SerializeHash(t3));
+    BOOST_CHECK_EQUAL(t3.GetSize(), nSize + 1);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
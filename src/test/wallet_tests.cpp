@@ -1,5 +1,6 @@
 #include <boost/test/unit_test.hpp>
 
+#include "init.h"
 #include "main.h"
 #include "wallet.h"
 
@@ -292,4 +293,156 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     }
 }
 
+BOOST_AUTO_TEST_CASE(address_grouping_tests)
+{
+    CAddressGrouping grouping;
+    vector<CTxDestination> vAddr;
+    for (int i = 0; i < 6; i++)
+        vAddr.push_back(CKeyID(uint160(i + 1)));
+
+    // interning is stable
+    BOOST_CHECK_EQUAL(grouping.Intern(vAddr[0]), 0U);
+    BOOST_CHECK_EQUAL(grouping.Intern(vAddr[1]), 1U);
+    BOOST_CHECK_EQUAL(grouping.Intern(vAddr[0]), 0U);
+    BOOST_CHECK_EQUAL(grouping.size(), 2U);
+
+    for (int i = 2; i < 6; i++)
+        grouping.Intern(vAddr[i]);
+    BOOST_CHECK_EQUAL(grouping.GetGroups().size(), 6U);
+
+    // {0,1} {2,3} then bridge them through 1-3; 4 and 5 stay alone
+    grouping.Union(0, 1);
+    grouping.Union(2, 3);
+    BOOST_CHECK_EQUAL(grouping.GetGroups().size(), 4U);
+    BOOST_CHECK(grouping.Find(0) != grouping.Find(2));
+    grouping.Union(1, 3);
+    grouping.Union(3, 1);
+    BOOST_CHECK(grouping.Find(0) == grouping.Find(2));
+
+    set< set<CTxDestination> > groups = grouping.GetGroups();
+    BOOST_CHECK_EQUAL(groups.size(), 3U);
+    set<CTxDestination> merged;
+    for (int i = 0; i < 4; i++)
+        merged.insert(vAddr[i]);
+    BOOST_CHECK(groups.count(merged));
+    BOOST_CHECK(groups.count(set<CTxDestination>(vAddr.begin() + 4, vAddr.begin() + 5)));
+
+    grouping.Clear();
+    BOOST_CHECK_EQUAL(grouping.size(), 0U);
+    BOOST_CHECK(grouping.GetGroups().empty());
+}
+
+static bool contains_tx(const vector<const CWalletTx*>& vwtx, const uint256& hash)
+{
+    BOOST_FOREACH(const CWalletTx* pwtx, vwtx)
+        if (pwtx->GetHash() == hash)
+            return true;
+    return false;
+}
+
+BOOST_AUTO_TEST_CASE(tx_height_index_tests)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = COIN;
+    tx.vout[0].scriptPubKey.SetDestination(pwalletMain->GenerateNewKey().GetID());
+    uint256 hash = tx.GetHash();
+
+    // a block next to the best one, indexed but not in the main chain yet
+    // as in ConnectBlock()
+    CBlock block;
+    block.hashPrevBlock = pindexBest->GetBlockHash();
+    block.nTime = pindexBest->nTime + 1;
+    block.vtx.push_back(tx);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    CBlockIndex* pindex = new CBlockIndex(block);
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(block.GetHash(), pindex)).first;
+    pindex->phashBlock = &((*mi).first);
+    pindex->pprev = pindexBest;
+    pindex->nHeight = pindexBest->nHeight + 1;
+    BOOST_CHECK(!pindex->IsInMainChain());
+
+    SyncWithWallets(hash, tx, &block, true);
+    vector<const CWalletTx*> vwtx;
+    pwalletMain->GetTransactionsSince(pindex->nHeight - 1, vwtx);
+    BOOST_CHECK(contains_tx(vwtx, hash));
+    pwalletMain->GetTransactionsSince(pindex->nHeight, vwtx);
+    BOOST_CHECK(!contains_tx(vwtx, hash));
+
+    // disconnected it's unconfirmed and listed since any block
+    SyncWithWallets(hash, tx, &block, false, false);
+    pwalletMain->GetTransactionsSince(pindex->nHeight, vwtx);
+    BOOST_CHECK(contains_tx(vwtx, hash));
+
+    pwalletMain->EraseFromWallet(hash);
+    mapBlockIndex.erase(mi);
+    delete pindex;
+}
+
+static set<CTxDestination> find_group(const set< set<CTxDestination> >& groups, const CTxDestination& address)
+{
+    BOOST_FOREACH(const set<CTxDestination>& group, groups)
+        if (group.count(address))
+            return group;
+    return set<CTxDestination>();
+}
+
+static CTransaction make_tx(const COutPoint& prevout, const CTxDestination& address)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = prevout;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = COIN;
+    tx.vout[0].scriptPubKey.SetDestination(address);
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(wallet_address_grouping_tests)
+{
+    CTxDestination addrA = pwalletMain->GenerateNewKey().GetID();
+    CTxDestination addrChange = pwalletMain->GenerateNewKey().GetID();
+    CTxDestination addrD = pwalletMain->GenerateNewKey().GetID();
+    CTxDestination addrNew = pwalletMain->GenerateNewKey().GetID();
+    CKey keyOther;
+    keyOther.MakeNewKey(true);
+    pwalletMain->GetAddressGroupings();
+
+    // funded from outside, a group of its own
+    CTransaction txA = make_tx(COutPoint(GetRandHash(), 0), addrA);
+    pwalletMain->AddToWallet(CWalletTx(pwalletMain, txA));
+    set< set<CTxDestination> > groups = pwalletMain->GetAddressGroupings();
+    BOOST_CHECK(find_group(groups, addrA) == set<CTxDestination>(&addrA, &addrA + 1));
+
+    // a new address with no transactions isn't listed
+    pwalletMain->SetAddressBookName(addrNew, "new");
+    groups = pwalletMain->GetAddressGroupings();
+    BOOST_CHECK(find_group(groups, addrNew).empty());
+
+    // a spend of A and of D not in the wallet yet with change
+    CTransaction txD = make_tx(COutPoint(GetRandHash(), 0), addrD);
+    CTransaction txSpend = make_tx(COutPoint(txA.GetHash(), 0), keyOther.GetPubKey().GetID());
+    txSpend.vin.push_back(CTxIn(COutPoint(txD.GetHash(), 0)));
+    txSpend.vout.push_back(CTxOut(COIN / 2, CScript()));
+    txSpend.vout[1].scriptPubKey.SetDestination(addrChange);
+    pwalletMain->AddToWallet(CWalletTx(pwalletMain, txSpend));
+    groups = pwalletMain->GetAddressGroupings();
+    BOOST_CHECK(find_group(groups, addrA).count(addrChange));
+    BOOST_CHECK(!find_group(groups, addrA).count(addrD));
+
+    // the spend stays pending until D arrives
+    pwalletMain->AddToWallet(CWalletTx(pwalletMain, txD));
+    groups = pwalletMain->GetAddressGroupings();
+    BOOST_CHECK_EQUAL(find_group(groups, addrA).size(), 3U);
+    BOOST_CHECK(find_group(groups, addrA).count(addrD));
+    BOOST_CHECK(find_group(groups, keyOther.GetPubKey().GetID()).empty());
+
+    pwalletMain->EraseFromWallet(txSpend.GetHash());
+    pwalletMain->EraseFromWallet(txD.GetHash());
+    pwalletMain->EraseFromWallet(txA.GetHash());
+    pwalletMain->DelAddressBookName(addrNew);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
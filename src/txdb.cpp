@@ -16,7 +16,21 @@ void static BatchWriteHashBestChain(CLevelDBBatch &batch, const uint256 &hash) {
     batch.Write('B', hash);
 }
 
-CCoinsViewDB::CCoinsViewDB(bool fMemory) : db(GetDataDir() / "coins", fMemory) {
+void static BatchWriteStats(CLevelDBBatch &batch, const CCoinsStats &stats) {
+    batch.Write('S', stats);
+}
+
+CCoinsViewDB *pcoinsdbview = NULL;
+
+CCoinsViewDB::CCoinsViewDB(bool fMemory) : db(GetDataDir() / "coins", fMemory), nScans(0) {
+    uint256 hashBestChain;
+
+    /* The statistics stored are valid for the best block they've been written with;
+     * a new database has none to be accounted for */
+    if(db.Read('B', hashBestChain))
+      fStatsValid = db.Read('S', stats) && (stats.hashBlock == hashBestChain);
+    else
+      fStatsValid = true;
 }
 
 bool CCoinsViewDB::GetCoins(uint256 txid, CCoins &coins) {
@@ -37,7 +51,7 @@ CBlockIndex *CCoinsViewDB::GetBestBlock() {
     uint256 hashBestChain;
     if (!db.Read('B', hashBestChain))
         return NULL;
-    std::map<uint256, CBlockIndex*>::iterator it = mapBlockIndex.find(hashBestChain);
+    BlockMap::iterator it = mapBlockIndex.find(hashBestChain);
     if (it == mapBlockIndex.end())
         return NULL;
     return it->second;
@@ -49,7 +63,8 @@ bool CCoinsViewDB::SetBestBlock(CBlockIndex *pindex) {
     return db.WriteBatch(batch);
 }
 
-bool CCoinsViewDB::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) {
+bool CCoinsViewDB::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex,
+  const CCoinsStats &statsDelta) {
     printf("Committing %u changed transactions to coin database...\n", (unsigned int)mapCoins.size());
 
     CLevelDBBatch batch;
@@ -57,7 +72,22 @@ bool CCoinsViewDB::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockI
         BatchWriteCoins(batch, it->first, it->second);
     BatchWriteHashBestChain(batch, pindex->GetBlockHash());
 
-    return db.WriteBatch(batch);
+    /* The statistics are updated atomically with the coins they describe */
+    CCoinsStats statsNew = stats;
+    if(fStatsValid) {
+        statsNew.Add(statsDelta);
+        statsNew.nHeight = pindex->nHeight;
+        statsNew.hashBlock = pindex->GetBlockHash();
+        BatchWriteStats(batch, statsNew);
+    }
+
+    /* The last step of a chain state commit */
+    if(!db.WriteBatch(batch, true))
+      return(false);
+
+    stats = statsNew;
+
+    return(true);
 }
 
 CBlockTreeDB::CBlockTreeDB(bool fMemory) : CLevelDB(GetDataDir() / "blktree", fMemory) {
@@ -68,6 +98,19 @@ bool CBlockTreeDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
     return Write(make_pair('b', blockindex.GetBlockHash()), blockindex);
 }
 
+bool CBlockTreeDB::ReadBlockIndex(const uint256 &hash, CDiskBlockIndex &blockindex) {
+    return(Read(make_pair('b', hash), blockindex));
+}
+
+bool CBlockTreeDB::WriteBlockIndex(const std::vector<CBlockIndex *> &vIndex) {
+    CLevelDBBatch batch;
+    BOOST_FOREACH(CBlockIndex *pindex, vIndex) {
+        CDiskBlockIndex blockindex(pindex);
+        batch.Write(make_pair('b', blockindex.GetBlockHash()), blockindex);
+    }
+    return(WriteBatch(batch));
+}
+
 bool CBlockTreeDB::ReadBestInvalidTrust(CBigNum& bnBestInvalidTrust)
 {
     return Read('I', bnBestInvalidTrust);
@@ -98,6 +141,169 @@ bool CBlockTreeDB::WriteCheckpointPubKey(const string& strPubKey)
     return Write('K', strPubKey);
 }
 
+bool CBlockTreeDB::ReadTxIndex(const uint256 &txid, CDiskTxPos &pos) {
+    return(Read(make_pair('t', txid), pos));
+}
+
+bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &vPos) {
+    CLevelDBBatch batch;
+    for(std::vector<std::pair<uint256, CDiskTxPos> >::const_iterator it = vPos.begin(); it != vPos.end(); it++)
+      batch.Write(make_pair('t', it->first), it->second);
+    return(WriteBatch(batch));
+}
+
+void static BatchWriteAddressUnspent(CLevelDBBatch &batch,
+  const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vUnspent) {
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it;
+
+    /* In order as an output may be created and spent within a block */
+    for(it = vUnspent.begin(); it != vUnspent.end(); it++) {
+        if(it->second.IsNull())
+          batch.Erase(make_pair('u', it->first));
+        else
+          batch.Write(make_pair('u', it->first), it->second);
+    }
+}
+
+bool CBlockTreeDB::WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, int64> > &vHistory,
+  const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vUnspent) {
+    CLevelDBBatch batch;
+    for(std::vector<std::pair<CAddressIndexKey, int64> >::const_iterator it = vHistory.begin(); it != vHistory.end(); it++)
+      batch.Write(make_pair('a', it->first), it->second);
+    BatchWriteAddressUnspent(batch, vUnspent);
+    return(WriteBatch(batch));
+}
+
+bool CBlockTreeDB::EraseAddressIndex(const std::vector<std::pair<CAddressIndexKey, int64> > &vHistory,
+  const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vUnspent) {
+    CLevelDBBatch batch;
+    for(std::vector<std::pair<CAddressIndexKey, int64> >::const_iterator it = vHistory.begin(); it != vHistory.end(); it++)
+      batch.Erase(make_pair('a', it->first));
+    BatchWriteAddressUnspent(batch, vUnspent);
+    return(WriteBatch(batch));
+}
+
+/* The history of a script by height, oldest first, nCount of 0 for all of it */
+bool CBlockTreeDB::ReadAddressIndex(const uint160 &hashScript, std::vector<std::pair<CAddressIndexKey, int64> > &vHistory,
+  uint nSkip, uint nCount) {
+    leveldb::Iterator *pcursor = NewIterator();
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('a', CAddressIndexKey(hashScript, 0, 0, 0, false));
+    pcursor->Seek(leveldb::Slice(&ssKeySet[0], ssKeySet.size()));
+
+    for(; pcursor->Valid() && (!nCount || (vHistory.size() < nCount)); pcursor->Next()) {
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            CAddressIndexKey key;
+            ssKey >> chType;
+            if(chType != 'a')
+              break;
+            ssKey >> key;
+            if(key.hashScript != hashScript)
+              break;
+            if(nSkip) {
+                nSkip--;
+                continue;
+            }
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            int64 nValue;
+            ssValue >> nValue;
+            vHistory.push_back(make_pair(key, nValue));
+        } catch(std::exception &e) {
+            delete(pcursor);
+            return(error("ReadAddressIndex() : deserialise error"));
+        }
+    }
+    delete(pcursor);
+
+    return(true);
+}
+
+bool CBlockTreeDB::ReadAddressUnspentIndex(const uint160 &hashScript,
+  std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vUnspent) {
+    leveldb::Iterator *pcursor = NewIterator();
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('u', CAddressUnspentKey(hashScript, 0, 0));
+    pcursor->Seek(leveldb::Slice(&ssKeySet[0], ssKeySet.size()));
+
+    for(; pcursor->Valid(); pcursor->Next()) {
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            CAddressUnspentKey key;
+            ssKey >> chType;
+            if(chType != 'u')
+              break;
+            ssKey >> key;
+            if(key.hashScript != hashScript)
+              break;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            CAddressUnspentValue value;
+            ssValue >> value;
+            vUnspent.push_back(make_pair(key, value));
+        } catch(std::exception &e) {
+            delete(pcursor);
+            return(error("ReadAddressUnspentIndex() : deserialise error"));
+        }
+    }
+    delete(pcursor);
+
+    return(true);
+}
+
+/* Block files converted to compressed records are marked so */
+bool CBlockTreeDB::IsBlockFileCompressed(int nFile) {
+    return(Exists(make_pair('z', nFile)));
+}
+
+bool CBlockTreeDB::WriteBlockFileCompressed(int nFile) {
+    return(Write(make_pair('z', nFile), '1'));
+}
+
+/* The new positions of the blocks in a converted file along with the file
+ * marked as pending until the new file is renamed over the old one */
+bool CBlockTreeDB::WriteCompressedBlockFile(int nFile, const CBlockFileInfo &info,
+  const std::vector<CBlockIndex *> &vIndex, const std::vector<std::pair<uint256, CDiskTxPos> > &vPos) {
+    CLevelDBBatch batch;
+    BOOST_FOREACH(CBlockIndex *pindex, vIndex) {
+        CDiskBlockIndex blockindex(pindex);
+        batch.Write(make_pair('b', blockindex.GetBlockHash()), blockindex);
+    }
+    for(std::vector<std::pair<uint256, CDiskTxPos> >::const_iterator it = vPos.begin(); it != vPos.end(); it++)
+      batch.Write(make_pair('t', it->first), it->second);
+    batch.Write(make_pair('f', nFile), info);
+    batch.Write(make_pair('z', nFile), '1');
+    batch.Write('Z', nFile);
+    return(WriteBatch(batch, true));
+}
+
+bool CBlockTreeDB::ReadBlockFileCompressPending(int &nFile) {
+    return(Read('Z', nFile));
+}
+
+bool CBlockTreeDB::EraseBlockFileCompressPending() {
+    return(Erase('Z', true));
+}
+
+bool CBlockTreeDB::ReadFlag(const std::string &strName, bool &fValue) {
+    char ch;
+    if(!Read(make_pair('F', strName), ch))
+      return(false);
+    fValue = (ch == '1');
+    return(true);
+}
+
+bool CBlockTreeDB::WriteFlag(const std::string &strName, bool fValue) {
+    return(Write(make_pair('F', strName), fValue ? '1' : '0'));
+}
+
 bool CBlockTreeDB::WriteBlockFileInfo(int nFile, const CBlockFileInfo &info) {
     return Write(make_pair('f', nFile), info);
 }
@@ -114,104 +320,277 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
     return Read('l', nFile);
 }
 
-bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
-    leveldb::Iterator *pcursor = db.NewIterator();
-    pcursor->SeekToFirst();
+bool CCoinsViewDB::GetStats(CCoinsStats &statsOut) {
+    if(!fStatsValid)
+      return(false);
+
+    statsOut = stats;
+
+    BlockMap::iterator it = mapBlockIndex.find(stats.hashBlock);
+    if(it != mapBlockIndex.end())
+      statsOut.nHeight = it->second->nHeight;
+
+    return(true);
+}
 
-    while (pcursor->Valid()) {
+/* Accumulates the statistics of the coins whose transaction hashes
+ * begin with a byte within the range specified */
+void static ScanStatsThread(CLevelDB *pdb, const leveldb::Snapshot *psnapshot, uint nStart, uint nEnd,
+  CCoinsStats *pstats, char *pfError) {
+    leveldb::Iterator *pcursor = pdb->NewIterator(psnapshot);
+    uint i;
+
+    char chKey[2] = { 'c', (char)nStart };
+    pcursor->Seek(leveldb::Slice(chKey, sizeof(chKey)));
+
+    while(pcursor->Valid()) {
+        if(fShutdown || fRequestShutdown) {
+            *pfError = 1;
+            break;
+        }
         try {
             leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            if((slKey.size() != 33) || (slKey[0] != 'c') || ((uchar)slKey[1] >= nEnd))
+              break;
+
+            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
             char chType;
-            ssKey >> chType;
-            if (chType == 'c' && !fRequestShutdown) {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
-                CCoins coins;
-                ssValue >> coins;
-                uint256 txhash;
-                ssKey >> txhash;
-
-                if(!coins.IsPruned()) {
-                    stats.nTransactions++;
-                    BOOST_FOREACH(const CTxOut &out, coins.vout) {
-                        if(!out.IsNull())
-                          stats.nTransactionOutputs++;
-                    }
-                } else {
-                    stats.nPrunedTransactions++;
+            uint256 txhash;
+            ssKey >> chType >> txhash;
+
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            CCoins coins;
+            ssValue >> coins;
+
+            if(CCoinsStats::IsCounted(coins)) {
+                pstats->nTransactions++;
+                for(i = 0; i < coins.vout.size(); i++) {
+                    if(CCoinsStats::IsCounted(coins.vout[i]))
+                      pstats->AddOutput(txhash, i, coins, coins.vout[i]);
                 }
-                stats.nSerializedSize += 32 + slValue.size();
+            } else {
+                pstats->nPrunedTransactions++;
             }
+            pstats->nSerializedSize += 32 + slValue.size();
+
             pcursor->Next();
-        } catch (std::exception &e) {
-            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+        } catch(std::exception &e) {
+            *pfError = 1;
+            break;
         }
     }
+
     delete pcursor;
-    stats.nHeight = GetBestBlock()->nHeight;
-    return true;
+}
+
+/* Doesn't need cs_main, so the height of the block scanned isn't looked up */
+bool CCoinsViewDB::ScanStats(CCoinsStats &statsOut) {
+    uint nThreads = GetNumCores(), i;
+
+    /* The ranges are scanned in parallel, all of them at the same point in time */
+    const leveldb::Snapshot *psnapshot = db.GetSnapshot();
+
+    statsOut = CCoinsStats();
+    {
+        leveldb::Iterator *pcursor = db.NewIterator(psnapshot);
+        pcursor->Seek(leveldb::Slice("B", 1));
+        if(pcursor->Valid() && (pcursor->key() == leveldb::Slice("B", 1))) {
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> statsOut.hashBlock;
+        }
+        delete pcursor;
+    }
+
+    std::vector<CCoinsStats> vStats(nThreads);
+    std::vector<char> vError(nThreads, 0);
+    {
+        boost::thread_group scanThreads;
+        for(i = 1; i < nThreads; i++) {
+            try {
+                scanThreads.create_thread(boost::bind(&ScanStatsThread, &db, psnapshot,
+                  256 * i / nThreads, 256 * (i + 1) / nThreads, &vStats[i], &vError[i]));
+            } catch(boost::thread_resource_error &e) {
+                ScanStatsThread(&db, psnapshot, 256 * i / nThreads, 256 * (i + 1) / nThreads,
+                  &vStats[i], &vError[i]);
+            }
+        }
+        ScanStatsThread(&db, psnapshot, 0, 256 / nThreads, &vStats[0], &vError[0]);
+        scanThreads.join_all();
+    }
+
+    db.ReleaseSnapshot(psnapshot);
+
+    for(i = 0; i < nThreads; i++) {
+        if(vError[i])
+          return(error("%s() : deserialize error or shutdown", __PRETTY_FUNCTION__));
+        statsOut.Add(vStats[i]);
+    }
+
+    return(true);
+}
+
+bool CCoinsViewDB::InitStats() {
+    if(fStatsValid)
+      return(true);
+
+    CCoinsStats statsNew;
+    BeginScan();
+    bool fScanned = ScanStats(statsNew);
+    EndScan();
+    if(!fScanned)
+      return(false);
+
+    /* The best block cannot change while the chain state isn't loaded yet */
+    uint256 hashBestChain;
+    if(!db.Read('B', hashBestChain) || (hashBestChain != statsNew.hashBlock))
+      return(error("CCoinsViewDB::InitStats() : best block mismatch"));
+
+    CLevelDBBatch batch;
+    BatchWriteStats(batch, statsNew);
+    if(!db.WriteBatch(batch, true))
+      return(false);
+
+    stats = statsNew;
+    fStatsValid = true;
+
+    return(true);
+}
+
+void CCoinsViewDB::BeginScan() {
+    LOCK(cs_scan);
+    nScans++;
+}
+
+void CCoinsViewDB::EndScan() {
+    LOCK(cs_scan);
+    nScans--;
+}
+
+void CCoinsViewDB::WaitForScans() {
+    while(true) {
+        {
+            LOCK(cs_scan);
+            if(!nScans)
+              break;
+        }
+        MilliSleep(10);
+    }
+}
+
+/* Block index entries are deserialised in batches of this size */
+static const uint BLOCK_INDEX_BATCH = 65536;
+
+/* Deserialises a contiguous part of a batch of block index entries */
+void static LoadBlockIndexThread(const std::vector<std::string> *pvData, std::vector<CDiskBlockIndex> *pvIndex,
+  std::vector<char> *pvError, uint nThread, uint nThreads) {
+    uint i, nStart, nEnd;
+
+    nStart = pvData->size() * nThread / nThreads;
+    nEnd = pvData->size() * (nThread + 1) / nThreads;
+
+    for(i = nStart; i < nEnd; i++) {
+        try {
+            const std::string &strData = (*pvData)[i];
+            CDataStream ssValue(strData.data(), strData.data() + strData.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> (*pvIndex)[i];
+            /* Hashes the recent blocks */
+            (*pvIndex)[i].GetBlockHash();
+        } catch(std::exception &e) {
+            (*pvError)[nThread] = 1;
+        }
+    }
 }
 
 bool CBlockTreeDB::LoadBlockIndexGuts()
 {
     leveldb::Iterator *pcursor = NewIterator();
+    std::vector<std::string> vData;
+    std::vector<CDiskBlockIndex> vIndex;
+    uint nThreads = GetNumCores(), i;
 
     CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
     ssKeySet << make_pair('b', uint256(0));
     pcursor->Seek(ssKeySet.str());
 
     // Load mapBlockIndex
-    while (pcursor->Valid()) {
-        try {
+    while(!fRequestShutdown) {
+
+        /* Collect the raw entries, a one byte key type followed by a block hash */
+        vData.clear();
+        while(pcursor->Valid() && (vData.size() < BLOCK_INDEX_BATCH)) {
             leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'b' && !fRequestShutdown) {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
-                CDiskBlockIndex diskindex;
-                ssValue >> diskindex;
-
-                uint256 blockHash = diskindex.GetBlockHash();
-
-                // Construct block index object
-                CBlockIndex* pindexNew = InsertBlockIndex(blockHash);
-                pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-                pindexNew->nHeight        = diskindex.nHeight;
-                pindexNew->nFile          = diskindex.nFile;
-                pindexNew->nDataPos       = diskindex.nDataPos;
-                pindexNew->nUndoPos       = diskindex.nUndoPos;
-                pindexNew->nMint          = diskindex.nMint;
-                pindexNew->nMoneySupply   = diskindex.nMoneySupply;
-                pindexNew->nFlags         = diskindex.nFlags;
-                pindexNew->nStakeModifier = diskindex.nStakeModifier;
-                pindexNew->prevoutStake   = diskindex.prevoutStake;
-                pindexNew->nStakeTime     = diskindex.nStakeTime;
-                pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
-                pindexNew->nVersion       = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->nTime          = diskindex.nTime;
-                pindexNew->nBits          = diskindex.nBits;
-                pindexNew->nNonce         = diskindex.nNonce;
-                pindexNew->nStatus        = diskindex.nStatus;
-                pindexNew->nTx            = diskindex.nTx;
-
-                // Watch for genesis block
-                if (pindexGenesisBlock == NULL && blockHash == (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet))
-                    pindexGenesisBlock = pindexNew;
-
-                // Build setStakeSeen
-                if (pindexNew->IsProofOfStake())
-                    setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
-
-                pcursor->Next();
-            } else {
-                break; // if shutdown requested or finished loading block index
+            if((slKey.size() != 33) || (slKey[0] != 'b'))
+              break;
+            vData.push_back(pcursor->value().ToString());
+            pcursor->Next();
+        }
+        if(vData.empty())
+          break;
+
+        /* Deserialise them in parallel */
+        vIndex.clear();
+        vIndex.resize(vData.size());
+        std::vector<char> vError(nThreads, 0);
+        {
+            boost::thread_group loadThreads;
+            for(i = 1; i < nThreads; i++) {
+                try {
+                    loadThreads.create_thread(boost::bind(&LoadBlockIndexThread,
+                      &vData, &vIndex, &vError, i, nThreads));
+                } catch(boost::thread_resource_error &e) {
+                    LoadBlockIndexThread(&vData, &vIndex, &vError, i, nThreads);
+                }
+            }
+            LoadBlockIndexThread(&vData, &vIndex, &vError, 0, nThreads);
+            loadThreads.join_all();
+        }
+        for(i = 0; i < nThreads; i++) {
+            if(vError[i]) {
+                delete pcursor;
+                return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+            }
+        }
+
+        mapBlockIndex.reserve(mapBlockIndex.size() + vIndex.size());
+
+        BOOST_FOREACH(const CDiskBlockIndex &diskindex, vIndex) {
+            uint256 blockHash = diskindex.GetBlockHash();
+
+            // Construct block index object
+            CBlockIndex* pindexNew = InsertBlockIndex(blockHash);
+            pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+            pindexNew->nHeight        = diskindex.nHeight;
+            pindexNew->nFile          = diskindex.nFile;
+            pindexNew->nDataPos       = diskindex.nDataPos;
+            pindexNew->nUndoPos       = diskindex.nUndoPos;
+            pindexNew->nChainTrust    = diskindex.nChainTrust;
+            pindexNew->nMint          = diskindex.nMint;
+            pindexNew->nMoneySupply   = diskindex.nMoneySupply;
+            pindexNew->nFlags         = diskindex.nFlags;
+            pindexNew->nStakeModifier = diskindex.nStakeModifier;
+            pindexNew->nStakeModifierChecksum = diskindex.nStakeModifierChecksum;
+            pindexNew->nVersion       = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime          = diskindex.nTime;
+            pindexNew->nBits          = diskindex.nBits;
+            pindexNew->nNonce         = diskindex.nNonce;
+            pindexNew->nStatus        = diskindex.nStatus;
+            pindexNew->nTx            = diskindex.nTx;
+
+            // Watch for genesis block
+            if (pindexGenesisBlock == NULL && blockHash == (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet))
+                pindexGenesisBlock = pindexNew;
+
+            // Build setStakeSeen
+            if (pindexNew->IsProofOfStake()) {
+                setStakeSeen.insert(make_pair(diskindex.prevoutStake, diskindex.nStakeTime));
+                /* Keep the stake details of the entries whose
+                 * stake modifier checksum is to be calculated */
+                if (!(diskindex.nStatus & BLOCK_HAVE_TRUST))
+                    pindexNew->SetStake(diskindex.prevoutStake, diskindex.nStakeTime, diskindex.hashProofOfStake);
             }
-        } catch (std::exception &e) {
-            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
         }
     }
     delete pcursor;
@@ -14,6 +14,11 @@ class CCoinsViewDB : public CCoinsView
 {
 protected:
     CLevelDB db;
+    CCoinsStats stats;
+    bool fStatsValid;
+    /* Full scans in progress without cs_main */
+    CCriticalSection cs_scan;
+    uint nScans;
 public:
     CCoinsViewDB(bool fMemory = false);
 
@@ -22,10 +27,30 @@ public:
     bool HaveCoins(uint256 txid);
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
-    bool GetStats(CCoinsStats &stats);
+    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex,
+      const CCoinsStats &statsDelta);
+    bool GetStats(CCoinsStats &statsOut);
+    bool ScanStats(CCoinsStats &statsOut);
+
+    bool HaveStats() const {
+        return(fStatsValid);
+    }
+
+    /* Calculates and stores the statistics if unknown for the current best block */
+    bool InitStats();
+
+    /* A full scan is registered under cs_main before it runs without the lock,
+     * so the database isn't destroyed underneath it */
+    void BeginScan();
+    void EndScan();
+
+    /* Waits for the scans registered to finish, which stop early on shutdown */
+    void WaitForScans();
 };
 
+/** Global variable that points to the coin database (protected by cs_main) */
+extern CCoinsViewDB *pcoinsdbview;
+
 /** Access to the block database (blktree/) */
 class CBlockTreeDB : public CLevelDB
 {
@@ -35,7 +60,9 @@ private:
     CBlockTreeDB(const CBlockTreeDB&);
     void operator=(const CBlockTreeDB&);
 public:
+    bool ReadBlockIndex(const uint256 &hash, CDiskBlockIndex &blockindex);
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
+    bool WriteBlockIndex(const std::vector<CBlockIndex *> &vIndex);
     bool ReadBestInvalidTrust(CBigNum& bnBestInvalidTrust);
     bool WriteBestInvalidTrust(CBigNum bnBestInvalidTrust);
     bool ReadBlockFileInfo(int nFile, CBlockFileInfo &fileinfo);
@@ -46,6 +73,24 @@ public:
     bool WriteSyncCheckpoint(uint256 hashCheckpoint);
     bool ReadCheckpointPubKey(std::string& strPubKey);
     bool WriteCheckpointPubKey(const std::string& strPubKey);
+    bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
+    bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &vPos);
+    bool WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, int64> > &vHistory,
+      const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vUnspent);
+    bool EraseAddressIndex(const std::vector<std::pair<CAddressIndexKey, int64> > &vHistory,
+      const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vUnspent);
+    bool ReadAddressIndex(const uint160 &hashScript, std::vector<std::pair<CAddressIndexKey, int64> > &vHistory,
+      uint nSkip = 0, uint nCount = 0);
+    bool ReadAddressUnspentIndex(const uint160 &hashScript,
+      std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vUnspent);
+    bool IsBlockFileCompressed(int nFile);
+    bool WriteBlockFileCompressed(int nFile);
+    bool WriteCompressedBlockFile(int nFile, const CBlockFileInfo &info, const std::vector<CBlockIndex *> &vIndex,
+      const std::vector<std::pair<uint256, CDiskTxPos> > &vPos);
+    bool ReadBlockFileCompressPending(int &nFile);
+    bool EraseBlockFileCompressPending();
+    bool ReadFlag(const std::string &strName, bool &fValue);
+    bool WriteFlag(const std::string &strName, bool fValue);
     bool LoadBlockIndexGuts();
 };
 
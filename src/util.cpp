@@ -1188,6 +1188,23 @@ int FileCommit(FILE *fileout) {
     return(ret);
 }
 
+/* Syncronises directory entries such as those of renamed files with a medium;
+ * returns zero on success and -1 on failure */
+int DirectoryCommit(const boost::filesystem::path &dirname) {
+#if defined(WIN32)
+    /* NTFS journals directory updates with no way to flush them separately */
+    return(0);
+#else
+    int ret, fd;
+
+    fd = open(dirname.string().c_str(), O_RDONLY);
+    if(fd < 0) return(-1);
+    ret = fsync(fd);
+    close(fd);
+    return(ret);
+#endif /* WIN32 */
+}
+
 int GetFilesize(FILE* file)
 {
     int nSavePos = ftell(file);
@@ -1474,3 +1491,9 @@ bool NewThread(void(*pfn)(void*), void* parg)
     }
     return true;
 }
+
+int GetNumCores()
+{
+    int nCores = (int)boost::thread::hardware_concurrency();
+    return((nCores > 0) ? nCores : 1);
+}
@@ -226,6 +226,7 @@ bool WildcardMatch(const char* psz, const char* mask);
 bool WildcardMatch(const std::string& str, const std::string& mask);
 int FileTruncate(FILE *fileout, uint length);
 int FileCommit(FILE *fileout);
+int DirectoryCommit(const boost::filesystem::path &dirname);
 int GetFilesize(FILE* file);
 void AllocateFileRange(FILE *file, unsigned int offset, unsigned int length);
 bool RenameOver(boost::filesystem::path src, boost::filesystem::path dest);
@@ -338,7 +339,8 @@ std::string HexStr(const T itbegin, const T itend, bool fSpaces=false)
     return rv;
 }
 
-inline std::string HexStr(const std::vector<unsigned char>& vch, bool fSpaces=false)
+template<typename T>
+inline std::string HexStr(const T& vch, bool fSpaces=false)
 {
     return HexStr(vch.begin(), vch.end(), fSpaces);
 }
@@ -494,6 +496,14 @@ public:
         Init();
     }
 
+    // resumes hashing from a saved midstate
+    CHashWriter(int nTypeIn, int nVersionIn, const SHA256_CTX &ctxIn) : ctx(ctxIn), nType(nTypeIn), nVersion(nVersionIn) { }
+
+    // the midstate of the data written so far
+    const SHA256_CTX &GetState() const {
+        return ctx;
+    }
+
     CHashWriter& write(const char *pch, size_t size) {
         SHA256_Update(&ctx, pch, size);
         return (*this);
@@ -559,15 +569,22 @@ uint256 SerializeHash(const T& obj, int nType=SER_GETHASH, int nVersion=PROTOCOL
     return ss.GetHash();
 }
 
-inline uint160 Hash160(const std::vector<unsigned char>& vch)
+template<typename T1>
+inline uint160 Hash160(const T1 pbegin, const T1 pend)
 {
+    static unsigned char pblank[1];
     uint256 hash1;
-    SHA256(&vch[0], vch.size(), (unsigned char*)&hash1);
+    SHA256((pbegin == pend ? pblank : (unsigned char*)&pbegin[0]), (pend - pbegin) * sizeof(pbegin[0]), (unsigned char*)&hash1);
     uint160 hash2;
     RIPEMD160((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
     return hash2;
 }
 
+inline uint160 Hash160(const std::vector<unsigned char>& vch)
+{
+    return Hash160(vch.begin(), vch.end());
+}
+
 /**
  * Timing-attack-resistant comparison.
  * Takes time proportional to length
@@ -641,6 +658,9 @@ public:
 
 bool NewThread(void(*pfn)(void*), void* parg);
 
+/* Number of hardware threads available for parallel work, at least 1 */
+int GetNumCores();
+
 #ifdef WIN32
 inline void SetThreadPriority(int nPriority)
 {
@@ -22,6 +22,10 @@ extern const std::string CLIENT_NAME;
 extern const std::string CLIENT_BUILD;
 extern const std::string CLIENT_DATE;
 
+/* Block index records written since this version store the chain trust
+ * and the stake modifier checksum */
+static const int BLOCK_INDEX_TRUST_VERSION = 1060101;
+
 static const int PROTOCOL_VERSION = 60016;
 static const int MIN_PROTOCOL_VERSION = 60016;
 
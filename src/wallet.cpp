@@ -11,6 +11,8 @@
 #include "base58.h"
 #include "kernel.h"
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 
 using namespace std;
 
@@ -58,6 +60,7 @@ bool CWallet::AddKey(const CKey& key)
 
     if (!CCryptoKeyStore::AddKey(key))
         return false;
+    MarkAddressGroupingsDirty();
     if (!fFileBacked)
         return true;
     if (!IsCrypted())
@@ -93,9 +96,10 @@ bool CWallet::AddCScript(const CScript& redeemScript)
 {
     if (!CCryptoKeyStore::AddCScript(redeemScript))
         return false;
+    MarkAddressGroupingsDirty();
     if (!fFileBacked)
         return true;
-    return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
+    return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript.begin(), redeemScript.end()), redeemScript);
 }
 
 bool CWallet::AddWatchOnly(const CScript &dest) {
@@ -103,6 +107,8 @@ bool CWallet::AddWatchOnly(const CScript &dest) {
     if(!CCryptoKeyStore::AddWatchOnly(dest))
       return(false);
 
+    MarkAddressGroupingsDirty();
+
     /* No birthday information for watch only keys */
     UpdateTimeFirstKey();
 
@@ -119,6 +125,8 @@ bool CWallet::RemoveWatchOnly(const CScript &dest) {
     if(!CCryptoKeyStore::RemoveWatchOnly(dest))
       return(false);
 
+    MarkAddressGroupingsDirty();
+
     if(fFileBacked) {
         if(!CWalletDB(strWalletFile).EraseWatchOnly(dest))
           return(false);
@@ -354,28 +362,111 @@ int64 CWallet::IncOrderPosNext(CWalletDB *pwalletdb)
     return nRet;
 }
 
-CWallet::TxItems CWallet::OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount)
+void CWallet::AddAccountingEntry(const CAccountingEntry& acentry)
 {
-    CWalletDB walletdb(strWalletFile);
+    LOCK(cs_wallet);
+    laccentries.push_back(acentry);
+    CAccountingEntry& entry = laccentries.back();
+    wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+}
+
+// Height of the main chain block a wallet transaction is in, -1 if none;
+// transactions in orphaned blocks are indexed as unconfirmed, so
+// listsinceblock never skips them after a reorganisation
+static int GetTxBlockHeight(const CWalletTx& wtx)
+{
+    if (wtx.hashBlock == 0)
+        return -1;
+    BlockMap::const_iterator mi = mapBlockIndex.find(wtx.hashBlock);
+    if (mi == mapBlockIndex.end())
+        return -1;
+    if (!(*mi).second->IsInMainChain())
+        return -1;
+    return (*mi).second->nHeight;
+}
+
+void CWallet::IndexTxHeight(const uint256& hash, int nHeight)
+{
+    map<uint256, int>::iterator mi = mapTxHeight.find(hash);
+    if (mi != mapTxHeight.end())
+    {
+        if ((*mi).second == nHeight)
+            return;
+        setTxByHeight.erase(make_pair((*mi).second, hash));
+        (*mi).second = nHeight;
+    }
+    else
+        mapTxHeight.insert(make_pair(hash, nHeight));
+    setTxByHeight.insert(make_pair(nHeight, hash));
+}
 
-    // First: get all CWalletTx and CAccountingEntry into a sorted-by-order multimap.
-    TxItems txOrdered;
+void CWallet::UnindexTx(const CWalletTx& wtx)
+{
+    pair<TxItems::iterator, TxItems::iterator> range = wtxOrdered.equal_range(wtx.nOrderPos);
+    for (TxItems::iterator it = range.first; it != range.second; ++it)
+        if ((*it).second.first == &wtx)
+        {
+            wtxOrdered.erase(it);
+            break;
+        }
+
+    uint256 hash = wtx.GetHash();
+    map<uint256, int>::iterator mi = mapTxHeight.find(hash);
+    if (mi != mapTxHeight.end())
+    {
+        setTxByHeight.erase(make_pair((*mi).second, hash));
+        mapTxHeight.erase(mi);
+    }
+}
+
+void CWallet::BuildTxIndexes()
+{
+    LOCK(cs_wallet);
+
+    wtxOrdered.clear();
+    setTxByHeight.clear();
+    mapTxHeight.clear();
 
-    // Note: maintaining indices in the database of (account,time) --> txid and (account, time) --> acentry
-    // would make this much faster for applications that do this a lot.
     for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
     {
         CWalletTx* wtx = &((*it).second);
-        txOrdered.insert(make_pair(wtx->nOrderPos, TxPair(wtx, (CAccountingEntry*)0)));
+        wtxOrdered.insert(make_pair(wtx->nOrderPos, TxPair(wtx, (CAccountingEntry*)0)));
+        IndexTxHeight((*it).first, GetTxBlockHeight(*wtx));
     }
-    acentries.clear();
-    walletdb.ListAccountCreditDebit(strAccount, acentries);
-    BOOST_FOREACH(CAccountingEntry& entry, acentries)
+    BOOST_FOREACH(CAccountingEntry& entry, laccentries)
+        wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+}
+
+void CWallet::GetTransactionsSince(int nHeight, std::vector<const CWalletTx*>& vwtx) const
+{
+    LOCK(cs_wallet);
+
+    vwtx.clear();
+    set< pair<int, uint256> >::const_iterator it = setTxByHeight.begin();
+    if (nHeight >= 0)
     {
-        txOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+        // not in a block first, then everything above nHeight
+        for (; (it != setTxByHeight.end()) && ((*it).first < 0); ++it)
+        {
+            map<uint256, CWalletTx>::const_iterator mi = mapWallet.find((*it).second);
+            if (mi != mapWallet.end())
+                vwtx.push_back(&(*mi).second);
+        }
+        it = setTxByHeight.lower_bound(make_pair(nHeight + 1, uint256(0)));
     }
+    for (; it != setTxByHeight.end(); ++it)
+    {
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find((*it).second);
+        if (mi != mapWallet.end())
+            vwtx.push_back(&(*mi).second);
+    }
+}
 
-    return txOrdered;
+void CWallet::DisconnectTransaction(const uint256& hash)
+{
+    LOCK(cs_wallet);
+    if (mapTxHeight.count(hash))
+        IndexTxHeight(hash, -1);
 }
 
 void CWallet::WalletUpdateSpent(const CTransaction &tx, bool fBlock)
@@ -431,7 +522,9 @@ void CWallet::MarkDirty()
     }
 }
 
-bool CWallet::AddToWallet(const CWalletTx& wtxIn)
+// pindex is the block the transaction is being connected in, if any;
+// the main chain doesn't include it yet at the time
+bool CWallet::AddToWallet(const CWalletTx& wtxIn, const CBlockIndex* pindex)
 {
     uint256 hash = wtxIn.GetHash();
     {
@@ -441,10 +534,14 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         CWalletTx& wtx = (*ret.first).second;
         wtx.BindWallet(this);
         bool fInsertedNew = ret.second;
+        setGroupingPending.insert(hash);
         if (fInsertedNew)
         {
+            if(!wtx.IsFrozen())
+              wtx.Freeze();
             wtx.nTimeReceived = GetAdjustedTime();
             wtx.nOrderPos = IncOrderPosNext();
+            wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
 
             wtx.nTimeSmart = wtx.nTimeReceived;
             if (wtxIn.hashBlock != 0)
@@ -456,9 +553,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
                     {
                         // Tolerate times up to the last timestamp in the wallet not more than 5 minutes into the future
                         int64 latestTolerated = latestNow + 300;
-                        std::list<CAccountingEntry> acentries;
-                        TxItems txOrdered = OrderedTxItems(acentries);
-                        for (TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+                        for (TxItems::reverse_iterator it = wtxOrdered.rbegin(); it != wtxOrdered.rend(); ++it)
                         {
                             CWalletTx *const pwtx = (*it).second.first;
                             if (pwtx == &wtx)
@@ -516,6 +611,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
             fUpdated |= wtx.UpdateSpent(wtxIn.vfSpent);
         }
 
+        IndexTxHeight(hash, pindex ? pindex->nHeight : GetTxBlockHeight(wtx));
+
         //// debug print
         printf("AddToWallet %s  %s%s\n", hash.ToString().substr(0,10).c_str(), (fInsertedNew ? "new" : ""), (fUpdated ? "update" : ""));
 
@@ -571,10 +668,18 @@ bool CWallet::AddToWalletIfInvolvingMe(const uint256 &hash, const CTransaction&
         if (fExisted || IsMine(tx) || IsFromMe(tx))
         {
             CWalletTx wtx(this,tx);
-            // Get merkle branch if transaction was found in a block
+            // Get merkle branch if transaction was found in a block;
+            // blocks come here as they are connected or rescanned
+            // along the main chain
+            const CBlockIndex* pindex = NULL;
             if (pblock)
+            {
                 wtx.SetMerkleBranch(pblock);
-            return AddToWallet(wtx);
+                BlockMap::const_iterator mi = mapBlockIndex.find(wtx.hashBlock);
+                if (mi != mapBlockIndex.end())
+                    pindex = (*mi).second;
+            }
+            return AddToWallet(wtx, pindex);
         }
         else
             WalletUpdateSpent(tx);
@@ -588,8 +693,14 @@ bool CWallet::EraseFromWallet(uint256 hash)
         return false;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
+        map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+        {
+            UnindexTx((*mi).second);
+            mapWallet.erase(mi);
             CWalletDB(strWalletFile).EraseTx(hash);
+        }
+        fGroupingDirty = true;
     }
     return true;
 }
@@ -841,6 +952,12 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
     int ret = 0;
 
+    if (!HaveBlockData(pindexStart))
+    {
+        printf("ScanForWalletTransactions() : blocks pruned, unable to rescan\n");
+        return ret;
+    }
+
     CBlockIndex* pindex = pindexStart;
     {
         LOCK(cs_wallet);
@@ -1486,7 +1603,7 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64> > &vecSend,
                   if(!SignSignature(*this, *coin.first, wtxNew, nIn++)) return(false);
 
                 /* Limit size */
-                uint nBytes = ::GetSerializeSize(*(CTransaction *) &wtxNew, SER_NETWORK, PROTOCOL_VERSION);
+                uint nBytes = wtxNew.GetSize();
                 if(nBytes >= (MAX_BLOCK_SIZE_GEN / 5)) return(false);
                 dPriority /= nBytes;
 
@@ -1645,19 +1762,10 @@ bool CWallet::CreateCoinStake(const CKeyStore &keystore, uint nBits, int64 nSear
             if((coins.nBlockTime + GetStakeMinAge(coins.nBlockTime)) > (txNew.nTime - nMaxStakeSearchInterval))
               continue;
 
-            CBlockIndex *pindex = FindBlockByHeight(coins.nHeight);
-
             /* Discard if the block cannot be located */
-            if(!block.ReadFromDisk(pindex))
+            CTransaction txPrev;
+            if(!ReadKernelInput(hashTx, coins, txPrev, block, nTxPos))
               continue;
-
-            BOOST_FOREACH(const CTransaction &tx, block.vtx) {
-                if(tx.GetHash() == hashTx)
-                  break;
-                nTxPos += tx.GetSerializeSize(SER_DISK, CLIENT_VERSION);
-            }
-            nTxPos += GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION)
-              - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(block.vtx.size());
         }
 
         uint n;
@@ -1804,7 +1912,7 @@ bool CWallet::CreateCoinStake(const CKeyStore &keystore, uint nBits, int64 nSear
         }
 
         // Limit size
-        unsigned int nBytes = ::GetSerializeSize(txNew, SER_NETWORK, PROTOCOL_VERSION);
+        unsigned int nBytes = txNew.GetSize();
         if (nBytes >= MAX_BLOCK_SIZE_GEN/5)
             return error("CreateCoinStake : exceeded coinstake size limit");
 
@@ -1964,6 +2072,7 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
         return DB_LOAD_OK;
     fFirstRunRet = false;
     DBErrors nLoadWalletRet = CWalletDB(strWalletFile,"cr+").LoadWallet(this);
+    BuildTxIndexes();
     if (nLoadWalletRet == DB_NEED_REWRITE)
     {
         if (CDB::Rewrite(strWalletFile, "\x04pool"))
@@ -1987,6 +2096,15 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
 bool CWallet::SetAddressBookName(const CTxDestination& address, const string& strName)
 {
     std::map<CTxDestination, std::string>::iterator mi = mapAddressBook.find(address);
+    if (mi == mapAddressBook.end())
+    {
+        // IsChange() depends on the address book; an address already grouped
+        // may have to be split off by a rebuild, while a fresh one such as
+        // from getnewaddress has no transactions to group yet
+        LOCK(cs_wallet);
+        if (addressGrouping.Contains(address))
+            fGroupingDirty = true;
+    }
     mapAddressBook[address] = strName;
     NotifyAddressBookChanged(this, address, strName, ::IsMine(*this, address), (mi == mapAddressBook.end()) ? CT_NEW : CT_UPDATED);
     if (!fFileBacked)
@@ -1997,6 +2115,7 @@ bool CWallet::SetAddressBookName(const CTxDestination& address, const string& st
 bool CWallet::DelAddressBookName(const CTxDestination& address)
 {
     mapAddressBook.erase(address);
+    MarkAddressGroupingsDirty();
     NotifyAddressBookChanged(this, address, "", ::IsMine(*this, address), CT_DELETED);
     if (!fFileBacked)
         return false;
@@ -2058,6 +2177,9 @@ bool GetWalletFile(CWallet* pwallet, string &strWalletFileOut)
     return true;
 }
 
+/* Number of key pool keys generated and written per database transaction */
+const uint nKeyPoolBatch = 1000;
+
 /* Generates a whole new set of reserved keys
  * while labelling the old reserved keys as used */
 bool CWallet::NewKeyPool(uint nSize) {
@@ -2079,55 +2201,213 @@ bool CWallet::NewKeyPool(uint nSize) {
           (uint)setKeyPool.size());
 
         if(IsLocked()) return(false);
+    }
 
-        if(nSize > 0) nKeys = nSize;
-        else nKeys = (uint)GetArg("-keypool", 100);
+    if(nSize > 0) nKeys = nSize;
+    else nKeys = (uint)GetArg("-keypool", 100);
 
-        /* Should be sufficient for any particular purpose */
-        if(nKeys >> 16) nKeys = 0xFFFF;
+    /* Should be sufficient for any particular purpose */
+    if(nKeys >> 16) nKeys = 0xFFFF;
 
-        for(i = 0; i < nKeys; i++) {
-            walletdb.WritePool(i + 1, CKeyPool(GenerateNewKey()));
-            setKeyPool.insert(i + 1);
-            printf("CWallet::NewKeyPool() : key pool size %u got a new key index %u\n",
-              (uint)setKeyPool.size(), i + 1);
+    while(true) {
+        uint nPoolSize;
+        {
+            LOCK(cs_wallet);
+            nPoolSize = (uint)setKeyPool.size();
         }
 
-        printf("CWallet::NewKeyPool() : %u new keys written\n", nKeys);
+        if(nPoolSize >= nKeys) break;
+
+        if(!GenerateKeyPoolKeys(std::min(nKeys - nPoolSize, nKeyPoolBatch)))
+          return(false);
+
+        printf("CWallet::NewKeyPool() : key pool size %u of %u\n",
+          (uint)GetKeyPoolSize(), nKeys);
     }
 
+    printf("CWallet::NewKeyPool() : %u new keys written\n", nKeys);
+
     return(true);
 }
 
 /* Generates a number of reserved keys to match the key pool size */
 bool CWallet::TopUpKeyPool(uint nSize) {
-    uint nIndex, nKeys;
+    uint nKeys, nPoolSize;
+
+    if(nSize > 0) nKeys = nSize;
+    else nKeys = (uint)GetArg("-keypool", 100);
+
+    /* Should be sufficient for any particular purpose */
+    if(nKeys >> 16) nKeys = 0xFFFF;
+
+    while(true) {
+        {
+            LOCK(cs_wallet);
+            if(IsLocked()) return(false);
+            nPoolSize = (uint)setKeyPool.size();
+        }
+
+        if(nPoolSize >= (nKeys + 1)) break;
+
+        /* The wallet may be locked or encrypted meanwhile; try again then */
+        bool fFailed = false;
+        if(!GenerateKeyPoolKeys(std::min(nKeys + 1 - nPoolSize, nKeyPoolBatch), &fFailed)) {
+            if(fFailed)
+              throw(runtime_error("CWallet::TopUpKeyPool() : failed to generate or write keys"));
+            continue;
+        }
+
+        printf("CWallet::TopUpKeyPool() : key pool size %u of %u\n",
+          (uint)GetKeyPoolSize(), nKeys + 1);
+    }
+
+    return(true);
+}
+
+/* A key pool key made by a worker thread along with
+ * its serialised or encrypted private key */
+class CKeyPoolGen {
+public:
+    CKey key;
+    CPubKey vchPubKey;
+    CPrivKey vchPrivKey;
+    std::vector<uchar> vchCryptedSecret;
+    bool fValid;
+
+    CKeyPoolGen() : fValid(false) { }
+};
+
+/* Generates every nThreads-th key starting from nThread */
+static void GenerateKeyPoolThread(std::vector<CKeyPoolGen> *pvGen, CKeyingMaterial *pvMasterKey,
+  bool fCompressed, uint nThread, uint nThreads) {
+
+    for(uint i = nThread; i < pvGen->size(); i += nThreads) {
+        CKeyPoolGen &gen = (*pvGen)[i];
+        try {
+            gen.key.MakeNewKey(fCompressed);
+            gen.vchPubKey = gen.key.GetPubKey();
+            if(pvMasterKey) {
+                bool fKeyCompressed;
+                gen.fValid = EncryptSecret(*pvMasterKey, gen.key.GetSecret(fKeyCompressed),
+                  gen.vchPubKey.GetHash(), gen.vchCryptedSecret);
+            } else {
+                gen.vchPrivKey = gen.key.GetPrivKey();
+                gen.fValid = true;
+            }
+        } catch(const std::exception &) {
+            gen.fValid = false;
+        }
+    }
+}
+
+/* Generates a batch of new keys and encrypts them if necessary on worker threads
+ * without holding the wallet lock, then writes the keys along with their key pool
+ * records in a single database transaction; returns false with *pfFailed set
+ * if key generation or the database failed rather than the wallet got locked */
+bool CWallet::GenerateKeyPoolKeys(uint nKeys, bool *pfFailed) {
+    CKeyingMaterial vMasterKeyCopy;
+    bool fCrypted, fCompressed;
+    uint nThreads, i;
+
+    if(pfFailed) *pfFailed = false;
+
+    if(!nKeys) return(true);
 
     {
         LOCK(cs_wallet);
-
         if(IsLocked()) return(false);
+        fCrypted = IsCrypted();
+        if(fCrypted && !GetMasterKey(vMasterKeyCopy))
+          return(false);
+        /* Default to compressed public keys if we want 0.6.0 wallets */
+        fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY);
+    }
 
-        CWalletDB walletdb(strWalletFile);
+    RandAddSeedPerfmon();
+
+    std::vector<CKeyPoolGen> vGen(nKeys);
+    int64 nStart = GetTimeMillis();
+    nThreads = std::min((uint)GetNumCores(), nKeys);
+    {
+        boost::thread_group genThreads;
+        for(i = 1; i < nThreads; i++) {
+            try {
+                genThreads.create_thread(boost::bind(&GenerateKeyPoolThread, &vGen,
+                  fCrypted ? &vMasterKeyCopy : NULL, fCompressed, i, nThreads));
+            } catch(const boost::thread_resource_error &) {
+                GenerateKeyPoolThread(&vGen, fCrypted ? &vMasterKeyCopy : NULL, fCompressed, i, nThreads);
+            }
+        }
+        GenerateKeyPoolThread(&vGen, fCrypted ? &vMasterKeyCopy : NULL, fCompressed, 0, nThreads);
+        genThreads.join_all();
+    }
+
+    for(i = 0; i < nKeys; i++) {
+        if(!vGen[i].fValid) {
+            if(pfFailed) *pfFailed = true;
+            return(error("CWallet::GenerateKeyPoolKeys() : key generation failed"));
+        }
+    }
+
+    {
+        LOCK(cs_wallet);
+
+        /* Encryption status changed while generating, the keys are of no use */
+        if(IsCrypted() != fCrypted) return(false);
 
-        if(nSize > 0) nKeys = nSize;
-        else nKeys = (uint)GetArg("-keypool", 100);
+        /* Any failure past this point is of the database or key store */
+        if(pfFailed) *pfFailed = true;
 
-        /* Should be sufficient for any particular purpose */
-        if(nKeys >> 16) nKeys = 0xFFFF;
+        /* Compressed public keys were introduced in version 0.6.0 */
+        if(fCompressed)
+          SetMinVersion(FEATURE_COMPRPUBKEY);
 
-        while(setKeyPool.size() < (nKeys + 1)) {
-            nIndex = 1;
-            if(!setKeyPool.empty())
-              nIndex = *(--setKeyPool.end()) + 1;
-            if(!walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey())))
-              throw(runtime_error("CWallet::TopUpKeyPool() : failed to write a generated key"));
-            setKeyPool.insert(nIndex);
-            printf("CWallet::TopUpKeyPool() : key pool size %u got a new key index %u\n",
-              (uint)setKeyPool.size(), nIndex);
+        int64 nIndex = 1;
+        if(!setKeyPool.empty())
+          nIndex = *(--setKeyPool.end()) + 1;
+
+        int64 nCreationTime = GetTime();
+        CKeyMetadata keyMeta(nCreationTime);
+
+        if(fFileBacked) {
+            CWalletDB walletdb(strWalletFile);
+            if(!walletdb.TxnBegin())
+              return(false);
+            for(i = 0; i < nKeys; i++) {
+                const CKeyPoolGen &gen = vGen[i];
+                bool fWritten;
+                if(fCrypted)
+                  fWritten = walletdb.WriteCryptedKey(gen.vchPubKey, gen.vchCryptedSecret, keyMeta);
+                else
+                  fWritten = walletdb.WriteKey(gen.vchPubKey, gen.vchPrivKey, keyMeta);
+                if(!fWritten || !walletdb.WritePool(nIndex + i, CKeyPool(gen.vchPubKey))) {
+                    walletdb.TxnAbort();
+                    return(false);
+                }
+            }
+            if(!walletdb.TxnCommit())
+              return(false);
         }
+
+        for(i = 0; i < nKeys; i++) {
+            const CKeyPoolGen &gen = vGen[i];
+            mapKeyMetadata[gen.vchPubKey.GetID()] = keyMeta;
+            if(fCrypted) {
+                if(!CCryptoKeyStore::AddCryptedKey(gen.vchPubKey, gen.vchCryptedSecret))
+                  return(false);
+            } else {
+                if(!CCryptoKeyStore::AddKey(gen.key))
+                  return(false);
+            }
+            setKeyPool.insert(nIndex + i);
+        }
+        UpdateTimeFirstKey(nCreationTime);
+        if(pfFailed) *pfFailed = false;
     }
 
+    printf("CWallet::GenerateKeyPoolKeys() : %u keys generated by %u threads in %" PRI64d "ms\n",
+      nKeys, nThreads, GetTimeMillis() - nStart);
+
     return(true);
 }
 
@@ -2272,87 +2552,147 @@ std::map<CTxDestination, int64> CWallet::GetAddressBalances()
     return balances;
 }
 
-set< set<CTxDestination> > CWallet::GetAddressGroupings()
+unsigned int CAddressGrouping::Intern(const CTxDestination& address)
 {
-    set< set<CTxDestination> > groupings;
-    set<CTxDestination> grouping;
+    map<CTxDestination, unsigned int>::iterator mi = mapIndex.find(address);
+    if (mi != mapIndex.end())
+        return (*mi).second;
+
+    unsigned int n = vDestination.size();
+    mapIndex.insert(make_pair(address, n));
+    vDestination.push_back(address);
+    vParent.push_back(n);
+    vRank.push_back(0);
+    return n;
+}
 
-    BOOST_FOREACH(PAIRTYPE(uint256, CWalletTx) walletEntry, mapWallet)
+unsigned int CAddressGrouping::Find(unsigned int n)
+{
+    // path halving
+    while (vParent[n] != n)
     {
-        CWalletTx *pcoin = &walletEntry.second;
+        vParent[n] = vParent[vParent[n]];
+        n = vParent[n];
+    }
+    return n;
+}
 
-        if (pcoin->vin.size() > 0 && IsMine(pcoin->vin[0]))
+void CAddressGrouping::Union(unsigned int a, unsigned int b)
+{
+    a = Find(a);
+    b = Find(b);
+    if (a == b)
+        return;
+
+    // union by rank
+    if (vRank[a] < vRank[b])
+        std::swap(a, b);
+    vParent[b] = a;
+    if (vRank[a] == vRank[b])
+        vRank[a]++;
+}
+
+set< set<CTxDestination> > CAddressGrouping::GetGroups()
+{
+    map< unsigned int, set<CTxDestination> > mapGroups;
+    for (unsigned int n = 0; n < vDestination.size(); n++)
+        mapGroups[Find(n)].insert(vDestination[n]);
+
+    set< set<CTxDestination> > ret;
+    for (map< unsigned int, set<CTxDestination> >::iterator it = mapGroups.begin(); it != mapGroups.end(); ++it)
+        ret.insert((*it).second);
+
+    return ret;
+}
+
+// Merges the addresses of a wallet transaction into the groupings;
+// returns false if some of its inputs are not in the wallet yet
+bool CWallet::UpdateAddressGrouping(const CWalletTx& wtx)
+{
+    bool fComplete = true;
+
+    // a first input spending no wallet transaction isn't ours, so a transaction
+    // funded from outside is complete with its outputs grouped
+    if (wtx.vin.size() > 0 && IsMine(wtx.vin[0]))
+    {
+        // group all input addresses with each other
+        vector<unsigned int> vGroup;
+        BOOST_FOREACH(const CTxIn& txin, wtx.vin)
         {
-            // group all input addresses with each other
-            BOOST_FOREACH(CTxIn txin, pcoin->vin)
+            map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(txin.prevout.hash);
+            if (mi == mapWallet.end())
             {
-                CTxDestination address;
-                if(!ExtractDestination(mapWallet[txin.prevout.hash].vout[txin.prevout.n].scriptPubKey, address))
-                    continue;
-                grouping.insert(address);
+                fComplete = false;
+                continue;
             }
-
-            // group change with input addresses
-            BOOST_FOREACH(CTxOut txout, pcoin->vout)
-                if (IsChange(txout))
-                {
-                    CWalletTx tx = mapWallet[pcoin->vin[0].prevout.hash];
-                    CTxDestination txoutAddr;
-                    if(!ExtractDestination(txout.scriptPubKey, txoutAddr))
-                        continue;
-                    grouping.insert(txoutAddr);
-                }
-            groupings.insert(grouping);
-            grouping.clear();
+            const CWalletTx& prev = (*mi).second;
+            if (txin.prevout.n >= prev.vout.size())
+                continue;
+            CTxDestination address;
+            if (!ExtractDestination(prev.vout[txin.prevout.n].scriptPubKey, address))
+                continue;
+            vGroup.push_back(addressGrouping.Intern(address));
         }
 
-        // group lone addrs by themselves
-        for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-            if (IsMine(pcoin->vout[i]))
+        // group change with input addresses
+        BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+            if (IsChange(txout))
             {
-                CTxDestination address;
-                if(!ExtractDestination(pcoin->vout[i].scriptPubKey, address))
+                CTxDestination txoutAddr;
+                if (!ExtractDestination(txout.scriptPubKey, txoutAddr))
                     continue;
-                grouping.insert(address);
-                groupings.insert(grouping);
-                grouping.clear();
+                vGroup.push_back(addressGrouping.Intern(txoutAddr));
             }
-    }
 
-    set< set<CTxDestination>* > uniqueGroupings; // a set of pointers to groups of addresses
-    map< CTxDestination, set<CTxDestination>* > setmap;  // map addresses to the unique group containing it
-    BOOST_FOREACH(set<CTxDestination> grouping, groupings)
-    {
-        // make a set of all the groups hit by this new group
-        set< set<CTxDestination>* > hits;
-        map< CTxDestination, set<CTxDestination>* >::iterator it;
-        BOOST_FOREACH(CTxDestination address, grouping)
-            if ((it = setmap.find(address)) != setmap.end())
-                hits.insert((*it).second);
+        for (unsigned int i = 1; i < vGroup.size(); i++)
+            addressGrouping.Union(vGroup[0], vGroup[i]);
+    }
 
-        // merge all hit groups into a new single group and delete old groups
-        set<CTxDestination>* merged = new set<CTxDestination>(grouping);
-        BOOST_FOREACH(set<CTxDestination>* hit, hits)
+    // group lone addrs by themselves
+    BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+        if (IsMine(txout))
         {
-            merged->insert(hit->begin(), hit->end());
-            uniqueGroupings.erase(hit);
-            delete hit;
+            CTxDestination address;
+            if (!ExtractDestination(txout.scriptPubKey, address))
+                continue;
+            addressGrouping.Intern(address);
         }
-        uniqueGroupings.insert(merged);
 
-        // update setmap
-        BOOST_FOREACH(CTxDestination element, *merged)
-            setmap[element] = merged;
+    return fComplete;
+}
+
+void CWallet::MarkAddressGroupingsDirty()
+{
+    LOCK(cs_wallet);
+    fGroupingDirty = true;
+}
+
+set< set<CTxDestination> > CWallet::GetAddressGroupings()
+{
+    LOCK(cs_wallet);
+
+    if (fGroupingDirty)
+    {
+        addressGrouping.Clear();
+        setGroupingPending.clear();
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            setGroupingPending.insert((*it).first);
+        fGroupingDirty = false;
     }
 
-    set< set<CTxDestination> > ret;
-    BOOST_FOREACH(set<CTxDestination>* uniqueGrouping, uniqueGroupings)
+    // Merging is idempotent, so transactions with inputs missing
+    // from the wallet stay pending and are merged again later
+    set<uint256>::iterator it = setGroupingPending.begin();
+    while (it != setGroupingPending.end())
     {
-        ret.insert(*uniqueGrouping);
-        delete uniqueGrouping;
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(*it);
+        if ((mi == mapWallet.end()) || UpdateAddressGrouping((*mi).second))
+            setGroupingPending.erase(it++);
+        else
+            ++it;
     }
 
-    return ret;
+    return addressGrouping.GetGroups();
 }
 
 // 1. check 'spent' consistency between wallet and coins database
@@ -2565,7 +2905,7 @@ void CWallet::GetKeyBirthTimes(std::map<CKeyID, int64> &mapKeyBirth) const {
     for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); it++) {
         // iterate over all wallet transactions...
         const CWalletTx &wtx = (*it).second;
-        std::map<uint256, CBlockIndex*>::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
+        BlockMap::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
         if (blit != mapBlockIndex.end() && blit->second->IsInMainChain()) {
             // ... which are already in a block
             int nHeight = blit->second->nHeight;
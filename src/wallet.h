@@ -63,6 +63,37 @@ public:
     )
 };
 
+/** Disjoint set forest over interned destinations, used to group
+ * addresses which have been spent together or received change together */
+class CAddressGrouping
+{
+private:
+    std::map<CTxDestination, unsigned int> mapIndex;
+    std::vector<CTxDestination> vDestination;
+    std::vector<unsigned int> vParent;
+    std::vector<unsigned char> vRank;
+
+public:
+    void Clear()
+    {
+        mapIndex.clear();
+        vDestination.clear();
+        vParent.clear();
+        vRank.clear();
+    }
+
+    unsigned int size() const { return vDestination.size(); }
+    bool Contains(const CTxDestination& address) const { return mapIndex.count(address) > 0; }
+
+    // Returns the index of the destination, adding it as a group of its own if new
+    unsigned int Intern(const CTxDestination& address);
+    // Returns the index of the root of the group containing n
+    unsigned int Find(unsigned int n);
+    // Merges the groups containing a and b
+    void Union(unsigned int a, unsigned int b);
+    std::set< std::set<CTxDestination> > GetGroups();
+};
+
 /** A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
  */
@@ -85,6 +116,22 @@ private:
     // the maximum wallet format version: memory-only variable that specifies to what version this wallet may be upgraded
     int nWalletMaxVersion;
 
+    // address groupings maintained incrementally from the transactions added,
+    // rebuilt from scratch if anything affecting IsMine() or IsChange() changes
+    CAddressGrouping addressGrouping;
+    std::set<uint256> setGroupingPending;
+    bool fGroupingDirty;
+
+    bool UpdateAddressGrouping(const CWalletTx& wtx);
+
+    // wallet transactions by the height of their block, -1 if not in a block
+    // or disconnected; entries above a height are the ones shallower than it
+    std::set< std::pair<int, uint256> > setTxByHeight;
+    std::map<uint256, int> mapTxHeight;
+
+    void IndexTxHeight(const uint256& hash, int nHeight);
+    void UnindexTx(const CWalletTx& wtx);
+
 public:
     mutable CCriticalSection cs_wallet;
 
@@ -107,6 +154,7 @@ public:
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
         nOrderPosNext = 0;
+        fGroupingDirty = true;
     }
     CWallet(std::string strWalletFileIn)
     {
@@ -117,6 +165,7 @@ public:
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
         nOrderPosNext = 0;
+        fGroupingDirty = true;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -186,14 +235,23 @@ public:
     typedef std::pair<CWalletTx*, CAccountingEntry*> TxPair;
     typedef std::multimap<int64, TxPair > TxItems;
 
-    /** Get the wallet's activity log
-        @return multimap of ordered transactions and accounting entries
-        @warning Returned pointers are *only* valid within the scope of passed acentries
-     */
-    TxItems OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount = "");
+    /* The wallet's activity log: transactions and accounting entries
+     * by order position, maintained as they are added or erased */
+    TxItems wtxOrdered;
+    std::list<CAccountingEntry> laccentries;
+
+    // Adds an accounting entry to the activity log, the caller saves it to disk
+    void AddAccountingEntry(const CAccountingEntry& acentry);
+    // Builds the activity log and the height index from scratch (used by LoadWallet)
+    void BuildTxIndexes();
+    // Transactions not in the main chain at or below nHeight, i.e. either
+    // unconfirmed or in later blocks; all of them if nHeight is negative
+    void GetTransactionsSince(int nHeight, std::vector<const CWalletTx*>& vwtx) const;
+    // The transaction's block has been disconnected from the main chain
+    void DisconnectTransaction(const uint256& hash);
 
     void MarkDirty();
-    bool AddToWallet(const CWalletTx& wtxIn);
+    bool AddToWallet(const CWalletTx& wtxIn, const CBlockIndex* pindex = NULL);
     bool AddToWalletIfInvolvingMe(const uint256 &hash, const CTransaction& tx, const CBlock* pblock, bool fUpdate = false, bool fFindBlock = false);
     bool EraseFromWallet(uint256 hash);
     void WalletUpdateSpent(const CTransaction& prevout, bool fBlock = false);
@@ -221,6 +279,7 @@ public:
 
     bool NewKeyPool(uint nSize = 0);
     bool TopUpKeyPool(uint nSize = 0);
+    bool GenerateKeyPoolKeys(uint nKeys, bool *pfFailed = NULL);
     int64 AddReserveKey(const CKeyPool& keypool);
     void ReserveKeyFromKeyPool(int64& nIndex, CKeyPool& keypool);
     void KeepKey(int64 nIndex);
@@ -230,6 +289,7 @@ public:
     void GetAllReserveKeys(std::set<CKeyID>& setAddress) const;
 
     std::set< std::set<CTxDestination> > GetAddressGroupings();
+    void MarkAddressGroupingsDirty();
     std::map<CTxDestination, int64> GetAddressBalances();
 
     isminetype IsMine(const CTxIn &txin) const;
@@ -13,6 +13,8 @@
 #include <boost/lexical_cast.hpp>
 #include <boost/variant/get.hpp>
 #include <boost/algorithm/string.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 
 using namespace std;
 using namespace boost;
@@ -132,9 +134,7 @@ CWalletDB::ReorderTransactions(CWallet* pwallet)
         CWalletTx* wtx = &((*it).second);
         txByTime.insert(make_pair(wtx->nTimeReceived, TxPair(wtx, (CAccountingEntry*)0)));
     }
-    list<CAccountingEntry> acentries;
-    ListAccountCreditDebit("", acentries);
-    BOOST_FOREACH(CAccountingEntry& entry, acentries)
+    BOOST_FOREACH(CAccountingEntry& entry, pwallet->laccentries)
     {
         txByTime.insert(make_pair(entry.nTime, TxPair((CWalletTx*)0, &entry)));
     }
@@ -205,6 +205,128 @@ public:
     }
 };
 
+/* The expensive parts of wallet record decoding (transaction deserialisation
+ * and private key validation) don't touch the wallet and may run on worker
+ * threads; the Load*() counterparts merge their results under cs_wallet */
+static bool DecodeWalletTx(CDataStream& ssKey, CDataStream& ssValue, uint256& hash,
+                           CWalletTx& wtx, bool& fUpgraded, string& strErr)
+{
+    ssKey >> hash;
+    ssValue >> wtx;
+    if (!wtx.CheckTransaction() || (wtx.GetHash() != hash))
+        return false;
+
+    // Undo serialize changes in 31600
+    fUpgraded = false;
+    if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
+    {
+        if (!ssValue.empty())
+        {
+            char fTmp;
+            char fUnused;
+            ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
+            strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
+                               wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount.c_str(), hash.ToString().c_str());
+            wtx.fTimeReceivedIsTxTime = fTmp;
+        }
+        else
+        {
+            strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString().c_str());
+            wtx.fTimeReceivedIsTxTime = 0;
+        }
+        fUpgraded = true;
+    }
+
+    return true;
+}
+
+static bool LoadDecodedTx(CWallet* pwallet, const uint256& hash, const CWalletTx& wtxIn,
+                          bool fUpgraded, CWalletScanState &wss)
+{
+    CWalletTx& wtx = pwallet->mapWallet[hash];
+    wtx = wtxIn;
+    wtx.BindWallet(pwallet);
+
+    if (fUpgraded)
+        wss.vWalletUpgrade.push_back(hash);
+
+    if (wtx.nOrderPos == -1)
+        wss.fAnyUnordered = true;
+
+    //// debug print
+    //printf("LoadWallet  %s\n", wtx.GetHash().ToString().c_str());
+    //printf(" %12" PRI64d "  %s  %s  %s\n",
+    //    wtx.vout[0].nValue,
+    //    DateTimeStrFormat("%x %H:%M:%S", wtx.GetBlockTime()).c_str(),
+    //    wtx.hashBlock.ToString().substr(0,20).c_str(),
+    //    wtx.mapValue["message"].c_str());
+
+    return true;
+}
+
+static bool DecodeWalletKey(const string& strType, CDataStream& ssKey, CDataStream& ssValue,
+                            CKey& key, string& strErr)
+{
+    vector<unsigned char> vchPubKey;
+    ssKey >> vchPubKey;
+    if (strType == "key")
+    {
+        CPrivKey pkey;
+        ssValue >> pkey;
+        key.SetPubKey(vchPubKey);
+        if (!key.SetPrivKey(pkey))
+        {
+            strErr = "Error reading wallet database: CPrivKey corrupt";
+            return false;
+        }
+        if (key.GetPubKey() != vchPubKey)
+        {
+            strErr = "Error reading wallet database: CPrivKey pubkey inconsistency";
+            return false;
+        }
+        if (!key.IsValid())
+        {
+            strErr = "Error reading wallet database: invalid CPrivKey";
+            return false;
+        }
+    }
+    else
+    {
+        CWalletKey wkey;
+        ssValue >> wkey;
+        key.SetPubKey(vchPubKey);
+        if (!key.SetPrivKey(wkey.vchPrivKey))
+        {
+            strErr = "Error reading wallet database: CPrivKey corrupt";
+            return false;
+        }
+        if (key.GetPubKey() != vchPubKey)
+        {
+            strErr = "Error reading wallet database: CWalletKey pubkey inconsistency";
+            return false;
+        }
+        if (!key.IsValid())
+        {
+            strErr = "Error reading wallet database: invalid CWalletKey";
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool LoadDecodedKey(CWallet* pwallet, const string& strType, const CKey& key,
+                           CWalletScanState &wss, string& strErr)
+{
+    if (strType == "key")
+        wss.nKeys++;
+    if (!pwallet->LoadKey(key))
+    {
+        strErr = "Error reading wallet database: LoadKey failed";
+        return false;
+    }
+    return true;
+}
+
 bool
 ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
              CWalletScanState &wss, string& strType, string& strErr)
@@ -223,47 +345,12 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         else if (strType == "tx")
         {
             uint256 hash;
-            ssKey >> hash;
-            CWalletTx& wtx = pwallet->mapWallet[hash];
-            ssValue >> wtx;
-            if (wtx.CheckTransaction() && (wtx.GetHash() == hash))
-                wtx.BindWallet(pwallet);
-            else
-            {
-                pwallet->mapWallet.erase(hash);
+            CWalletTx wtxDecoded;
+            bool fUpgraded = false;
+            if (!DecodeWalletTx(ssKey, ssValue, hash, wtxDecoded, fUpgraded, strErr))
+                return false;
+            if (!LoadDecodedTx(pwallet, hash, wtxDecoded, fUpgraded, wss))
                 return false;
-            }
-
-            // Undo serialize changes in 31600
-            if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
-            {
-                if (!ssValue.empty())
-                {
-                    char fTmp;
-                    char fUnused;
-                    ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
-                    strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
-                                       wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount.c_str(), hash.ToString().c_str());
-                    wtx.fTimeReceivedIsTxTime = fTmp;
-                }
-                else
-                {
-                    strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString().c_str());
-                    wtx.fTimeReceivedIsTxTime = 0;
-                }
-                wss.vWalletUpgrade.push_back(hash);
-            }
-
-            if (wtx.nOrderPos == -1)
-                wss.fAnyUnordered = true;
-
-            //// debug print
-            //printf("LoadWallet  %s\n", wtx.GetHash().ToString().c_str());
-            //printf(" %12" PRI64d "  %s  %s  %s\n",
-            //    wtx.vout[0].nValue,
-            //    DateTimeStrFormat("%x %H:%M:%S", wtx.GetBlockTime()).c_str(),
-            //    wtx.hashBlock.ToString().substr(0,20).c_str(),
-            //    wtx.mapValue["message"].c_str());
         }
         else if (strType == "acentry")
         {
@@ -274,13 +361,13 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
             if (nNumber > nAccountingEntryNumber)
                 nAccountingEntryNumber = nNumber;
 
-            if (!wss.fAnyUnordered)
-            {
-                CAccountingEntry acentry;
-                ssValue >> acentry;
-                if (acentry.nOrderPos == -1)
-                    wss.fAnyUnordered = true;
-            }
+            CAccountingEntry acentry;
+            ssValue >> acentry;
+            acentry.strAccount = strAccount;
+            acentry.nEntryNo = nNumber;
+            if (acentry.nOrderPos == -1)
+                wss.fAnyUnordered = true;
+            pwallet->laccentries.push_back(acentry);
         }
         else if(strType == "watch") {
             CScript script;
@@ -294,57 +381,11 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         }
         else if (strType == "key" || strType == "wkey")
         {
-            vector<unsigned char> vchPubKey;
-            ssKey >> vchPubKey;
             CKey key;
-            if (strType == "key")
-            {
-                wss.nKeys++;
-                CPrivKey pkey;
-                ssValue >> pkey;
-                key.SetPubKey(vchPubKey);
-                if (!key.SetPrivKey(pkey))
-                {
-                    strErr = "Error reading wallet database: CPrivKey corrupt";
-                    return false;
-                }
-                if (key.GetPubKey() != vchPubKey)
-                {
-                    strErr = "Error reading wallet database: CPrivKey pubkey inconsistency";
-                    return false;
-                }
-                if (!key.IsValid())
-                {
-                    strErr = "Error reading wallet database: invalid CPrivKey";
-                    return false;
-                }
-            }
-            else
-            {
-                CWalletKey wkey;
-                ssValue >> wkey;
-                key.SetPubKey(vchPubKey);
-                if (!key.SetPrivKey(wkey.vchPrivKey))
-                {
-                    strErr = "Error reading wallet database: CPrivKey corrupt";
-                    return false;
-                }
-                if (key.GetPubKey() != vchPubKey)
-                {
-                    strErr = "Error reading wallet database: CWalletKey pubkey inconsistency";
-                    return false;
-                }
-                if (!key.IsValid())
-                {
-                    strErr = "Error reading wallet database: invalid CWalletKey";
-                    return false;
-                }
-            }
-            if (!pwallet->LoadKey(key))
-            {
-                strErr = "Error reading wallet database: LoadKey failed";
+            if (!DecodeWalletKey(strType, ssKey, ssValue, key, strErr))
+                return false;
+            if (!LoadDecodedKey(pwallet, strType, key, wss, strErr))
                 return false;
-            }
         }
         else if (strType == "mkey")
         {
@@ -441,6 +482,51 @@ static bool IsKeyType(string strType)
             strType == "mkey" || strType == "ckey");
 }
 
+/* A raw wallet database record along with the outcome of decoding it
+ * on a worker thread (keys and transactions only, nObject >= 0) */
+class CWalletRecord {
+public:
+    CDataStream ssKey;
+    CDataStream ssValue;
+    string strType;
+    int nObject;
+    bool fDecoded;
+    bool fUpgraded;
+    uint256 hash;
+    string strErr;
+
+    CWalletRecord() : ssKey(SER_DISK, CLIENT_VERSION), ssValue(SER_DISK, CLIENT_VERSION) {
+        nObject = -1;
+        fDecoded = false;
+        fUpgraded = false;
+    }
+};
+
+/* Minimal number of records per decoding thread */
+static const unsigned int nWalletDecodeMin = 500;
+
+/* Decodes every nThreads-th record starting from nThread */
+static void DecodeWalletRecords(vector<CWalletRecord*>* pvDecode, vector<CKey>* pvKeys,
+                                vector<CWalletTx>* pvTx, unsigned int nThread, unsigned int nThreads)
+{
+    for (unsigned int i = nThread; i < pvDecode->size(); i += nThreads)
+    {
+        CWalletRecord& rec = *(*pvDecode)[i];
+        try {
+            string strType;
+            rec.ssKey >> strType;
+            if (strType == "tx")
+                rec.fDecoded = DecodeWalletTx(rec.ssKey, rec.ssValue, rec.hash,
+                                              (*pvTx)[rec.nObject], rec.fUpgraded, rec.strErr);
+            else
+                rec.fDecoded = DecodeWalletKey(strType, rec.ssKey, rec.ssValue,
+                                               (*pvKeys)[rec.nObject], rec.strErr);
+        } catch (...) {
+            rec.fDecoded = false;
+        }
+    }
+}
+
 DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
 {
     pwallet->vchDefaultKey = CPubKey();
@@ -466,23 +552,86 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
             return DB_CORRUPT;
         }
 
+        // Read all records sequentially, the cursor cannot be shared
+        deque<CWalletRecord> vRecords;
+        vector<CWalletRecord*> vDecode;
+        unsigned int nDecodeKeys = 0, nDecodeTx = 0;
         while (true)
         {
-            // Read next record
-            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-            int ret = ReadAtCursor(pcursor, ssKey, ssValue);
+            vRecords.push_back(CWalletRecord());
+            CWalletRecord& rec = vRecords.back();
+            int ret = ReadAtCursor(pcursor, rec.ssKey, rec.ssValue);
             if (ret == DB_NOTFOUND)
+            {
+                vRecords.pop_back();
                 break;
+            }
             else if (ret != 0)
             {
                 printf("Error reading next record from wallet database\n");
                 return DB_CORRUPT;
             }
 
-            // Try to be tolerant of single corrupt records:
+            // Peek at the record type; keys and transactions are decoded in parallel
+            try {
+                CDataStream ssType(rec.ssKey.begin(), rec.ssKey.end(), SER_DISK, CLIENT_VERSION);
+                ssType >> rec.strType;
+            } catch (...) {
+                continue;
+            }
+            if (rec.strType == "key" || rec.strType == "wkey")
+                rec.nObject = nDecodeKeys++;
+            else if (rec.strType == "tx")
+                rec.nObject = nDecodeTx++;
+            else
+                continue;
+            vDecode.push_back(&rec);
+        }
+        pcursor->close();
+
+        // Decode and verify the expensive records on worker threads
+        vector<CKey> vKeys(nDecodeKeys);
+        vector<CWalletTx> vTx(nDecodeTx);
+        unsigned int nThreads = 1;
+        if (vDecode.size() >= nWalletDecodeMin)
+            nThreads = std::min((unsigned int)GetNumCores(), (unsigned int)vDecode.size() / nWalletDecodeMin);
+        int64 nStart = GetTimeMillis();
+        {
+            boost::thread_group decodeThreads;
+            for (unsigned int nThread = 1; nThread < nThreads; nThread++)
+            {
+                try {
+                    decodeThreads.create_thread(boost::bind(&DecodeWalletRecords,
+                      &vDecode, &vKeys, &vTx, nThread, nThreads));
+                } catch(boost::thread_resource_error &e) {
+                    DecodeWalletRecords(&vDecode, &vKeys, &vTx, nThread, nThreads);
+                }
+            }
+            DecodeWalletRecords(&vDecode, &vKeys, &vTx, 0, nThreads);
+            decodeThreads.join_all();
+        }
+        printf("Wallet records: %" PRIszu " total, %" PRIszu " decoded by %u threads in %" PRI64d "ms\n",
+          vRecords.size(), vDecode.size(), nThreads, GetTimeMillis() - nStart);
+
+        // Merge into the wallet in the original database order
+        BOOST_FOREACH(CWalletRecord& rec, vRecords)
+        {
             string strType, strErr;
-            if (!ReadKeyValue(pwallet, ssKey, ssValue, wss, strType, strErr))
+            bool fReadOK;
+            if (rec.nObject < 0)
+                fReadOK = ReadKeyValue(pwallet, rec.ssKey, rec.ssValue, wss, strType, strErr);
+            else
+            {
+                strType = rec.strType;
+                strErr = rec.strErr;
+                if (strType == "tx")
+                    fReadOK = rec.fDecoded && LoadDecodedTx(pwallet, rec.hash, vTx[rec.nObject], rec.fUpgraded, wss);
+                else
+                    fReadOK = rec.fDecoded && LoadDecodedKey(pwallet, strType, vKeys[rec.nObject], wss, strErr);
+            }
+
+            // Try to be tolerant of single corrupt records:
+            if (!fReadOK)
             {
                 // losing keys is considered a catastrophic error, anything else
                 // we assume the user can live with:
@@ -500,7 +649,6 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
             if (!strErr.empty())
                 printf("%s\n", strErr.c_str());
         }
-        pcursor->close();
     }
     catch (...)
     {
@@ -934,6 +1082,9 @@ bool ImportWallet(CWallet *pwallet, const string& strLocation) {
     while(pindex && pindex->pprev && pindex->nTime > nTimeBegin - 7200)
       pindex = pindex->pprev;
 
+    if(!HaveBlockData(pindex))
+      return(error("ImportWallet() : unable to rescan pruned blocks"));
+
     printf("Rescanning last %i blocks\n", pindexBest->nHeight - pindex->nHeight + 1);
     pwallet->ScanForWalletTransactions(pindex);
     pwallet->ReacceptWalletTransactions();